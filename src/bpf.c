@@ -0,0 +1,459 @@
+#include "system.h"
+
+#include "bpf.h"
+#include "xalloc.h"
+
+// Instruction classes
+#define BPF_CLASS(code) ((code) & 0x07)
+#define BPF_LD          0x00
+#define BPF_LDX         0x01
+#define BPF_ST          0x02
+#define BPF_STX         0x03
+#define BPF_ALU         0x04
+#define BPF_JMP         0x05
+#define BPF_RET         0x06
+#define BPF_MISC        0x07
+
+// Load sizes and addressing modes
+#define BPF_SIZE(code)  ((code) & 0x18)
+#define BPF_W           0x00
+#define BPF_H           0x08
+#define BPF_B           0x10
+#define BPF_MODE(code)  ((code) & 0xe0)
+#define BPF_IMM         0x00
+#define BPF_ABS         0x20
+#define BPF_IND         0x40
+#define BPF_MEM         0x60
+#define BPF_LEN         0x80
+#define BPF_MSH         0xa0
+
+// ALU and jump operations
+#define BPF_OP(code)    ((code) & 0xf0)
+#define BPF_ADD         0x00
+#define BPF_SUB         0x10
+#define BPF_MUL         0x20
+#define BPF_DIV         0x30
+#define BPF_OR          0x40
+#define BPF_AND         0x50
+#define BPF_LSH         0x60
+#define BPF_RSH         0x70
+#define BPF_NEG         0x80
+#define BPF_MOD         0x90
+#define BPF_XOR         0xa0
+
+#define BPF_JA          0x00
+#define BPF_JEQ         0x10
+#define BPF_JGT         0x20
+#define BPF_JGE         0x30
+#define BPF_JSET        0x40
+
+// Operand sources
+#define BPF_SRC(code)   ((code) & 0x08)
+#define BPF_K           0x00
+#define BPF_X           0x08
+#define BPF_RVAL(code)  ((code) & 0x18)
+#define BPF_A           0x10
+
+#define BPF_MISCOP(code) ((code) & 0xf8)
+#define BPF_TAX         0x00
+#define BPF_TXA         0x80
+
+#define BPF_MEMWORDS    16
+
+bool bpf_validate(const bpf_program_t *prog) {
+	if(!prog->len || prog->len > BPF_MAX_INSNS) {
+		return false;
+	}
+
+	for(size_t pc = 0; pc < prog->len; pc++) {
+		const bpf_insn_t *insn = &prog->insns[pc];
+		uint16_t code = insn->code;
+		size_t next = pc + 1;
+
+		if(code & 0xff00) {
+			return false;
+		}
+
+		switch(BPF_CLASS(code)) {
+		case BPF_LD:
+			switch(BPF_MODE(code)) {
+			case BPF_ABS:
+			case BPF_IND:
+				if(BPF_SIZE(code) == 0x18) {
+					return false;
+				}
+
+				break;
+
+			case BPF_MEM:
+				if(insn->k >= BPF_MEMWORDS) {
+					return false;
+				}
+
+			// fallthrough
+			case BPF_IMM:
+			case BPF_LEN:
+				if(BPF_SIZE(code) != BPF_W) {
+					return false;
+				}
+
+				break;
+
+			default:
+				return false;
+			}
+
+			break;
+
+		case BPF_LDX:
+			if(code != (BPF_LDX | BPF_W | BPF_IMM) && code != (BPF_LDX | BPF_W | BPF_MEM) &&
+			                code != (BPF_LDX | BPF_W | BPF_LEN) && code != (BPF_LDX | BPF_B | BPF_MSH)) {
+				return false;
+			}
+
+			if(BPF_MODE(code) == BPF_MEM && insn->k >= BPF_MEMWORDS) {
+				return false;
+			}
+
+			break;
+
+		case BPF_ST:
+		case BPF_STX:
+			if(code & 0xf8 || insn->k >= BPF_MEMWORDS) {
+				return false;
+			}
+
+			break;
+
+		case BPF_ALU:
+			if(BPF_OP(code) > BPF_XOR || (BPF_OP(code) == BPF_NEG && BPF_SRC(code) == BPF_X)) {
+				return false;
+			}
+
+			if((BPF_OP(code) == BPF_DIV || BPF_OP(code) == BPF_MOD) && BPF_SRC(code) == BPF_K && !insn->k) {
+				return false;
+			}
+
+			break;
+
+		case BPF_JMP:
+
+			// All jumps go forward, so every program terminates
+			if(BPF_OP(code) == BPF_JA) {
+				if(BPF_SRC(code) != BPF_K || insn->k >= prog->len - next) {
+					return false;
+				}
+			} else if(BPF_OP(code) > BPF_JSET || next + insn->jt >= prog->len || next + insn->jf >= prog->len) {
+				return false;
+			}
+
+			break;
+
+		case BPF_RET:
+			if(code & 0xe0 || BPF_RVAL(code) == 0x18) {
+				return false;
+			}
+
+			break;
+
+		case BPF_MISC:
+			if(code != (BPF_MISC | BPF_TAX) && code != (BPF_MISC | BPF_TXA)) {
+				return false;
+			}
+
+			break;
+		}
+	}
+
+	return BPF_CLASS(prog->insns[prog->len - 1].code) == BPF_RET;
+}
+
+// Load a big endian value of the given size, or fail if it is out of bounds
+static bool load(const uint8_t *packet, uint32_t len, uint32_t offset, uint16_t size, uint32_t *value) {
+	uint32_t bytes = size == BPF_W ? 4 : size == BPF_H ? 2 : 1;
+
+	if(offset >= len || bytes > len - offset) {
+		return false;
+	}
+
+	const uint8_t *p = packet + offset;
+
+	switch(bytes) {
+	case 4:
+		*value = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+		break;
+
+	case 2:
+		*value = (uint32_t)p[0] << 8 | p[1];
+		break;
+
+	default:
+		*value = p[0];
+		break;
+	}
+
+	return true;
+}
+
+uint32_t bpf_run(const bpf_program_t *prog, const uint8_t *packet, uint32_t len) {
+	uint32_t a = 0;
+	uint32_t x = 0;
+	uint32_t mem[BPF_MEMWORDS] = {0};
+
+	for(size_t pc = 0; pc < prog->len; pc++) {
+		const bpf_insn_t *insn = &prog->insns[pc];
+		uint16_t code = insn->code;
+		uint32_t k = insn->k;
+
+		switch(BPF_CLASS(code)) {
+		case BPF_LD:
+			switch(BPF_MODE(code)) {
+			case BPF_IMM:
+				a = k;
+				break;
+
+			case BPF_ABS:
+				if(!load(packet, len, k, BPF_SIZE(code), &a)) {
+					return 0;
+				}
+
+				break;
+
+			case BPF_IND:
+				if(x + k < x || !load(packet, len, x + k, BPF_SIZE(code), &a)) {
+					return 0;
+				}
+
+				break;
+
+			case BPF_MEM:
+				a = mem[k];
+				break;
+
+			case BPF_LEN:
+				a = len;
+				break;
+			}
+
+			break;
+
+		case BPF_LDX:
+			switch(BPF_MODE(code)) {
+			case BPF_IMM:
+				x = k;
+				break;
+
+			case BPF_MEM:
+				x = mem[k];
+				break;
+
+			case BPF_LEN:
+				x = len;
+				break;
+
+			case BPF_MSH: {
+				uint32_t byte;
+
+				if(!load(packet, len, k, BPF_B, &byte)) {
+					return 0;
+				}
+
+				x = (byte & 0xf) << 2;
+				break;
+			}
+			}
+
+			break;
+
+		case BPF_ST:
+			mem[k] = a;
+			break;
+
+		case BPF_STX:
+			mem[k] = x;
+			break;
+
+		case BPF_ALU: {
+			uint32_t operand = BPF_SRC(code) == BPF_X ? x : k;
+
+			switch(BPF_OP(code)) {
+			case BPF_ADD:
+				a += operand;
+				break;
+
+			case BPF_SUB:
+				a -= operand;
+				break;
+
+			case BPF_MUL:
+				a *= operand;
+				break;
+
+			case BPF_DIV:
+				if(!operand) {
+					return 0;
+				}
+
+				a /= operand;
+				break;
+
+			case BPF_MOD:
+				if(!operand) {
+					return 0;
+				}
+
+				a %= operand;
+				break;
+
+			case BPF_OR:
+				a |= operand;
+				break;
+
+			case BPF_AND:
+				a &= operand;
+				break;
+
+			case BPF_XOR:
+				a ^= operand;
+				break;
+
+			case BPF_LSH:
+				a = operand < 32 ? a << operand : 0;
+				break;
+
+			case BPF_RSH:
+				a = operand < 32 ? a >> operand : 0;
+				break;
+
+			case BPF_NEG:
+				a = -a;
+				break;
+			}
+
+			break;
+		}
+
+		case BPF_JMP: {
+			uint32_t operand = BPF_SRC(code) == BPF_X ? x : k;
+			bool taken;
+
+			switch(BPF_OP(code)) {
+			case BPF_JA:
+				pc += k;
+				continue;
+
+			case BPF_JEQ:
+				taken = a == operand;
+				break;
+
+			case BPF_JGT:
+				taken = a > operand;
+				break;
+
+			case BPF_JGE:
+				taken = a >= operand;
+				break;
+
+			default:
+				taken = a & operand;
+				break;
+			}
+
+			pc += taken ? insn->jt : insn->jf;
+			break;
+		}
+
+		case BPF_RET:
+			switch(BPF_RVAL(code)) {
+			case BPF_X:
+				return x;
+
+			case BPF_A:
+				return a;
+
+			default:
+				return k;
+			}
+
+		case BPF_MISC:
+			if(BPF_MISCOP(code) == BPF_TAX) {
+				x = a;
+			} else {
+				a = x;
+			}
+
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static bool parse_number(const char **p, unsigned long max, unsigned long *value) {
+	while(**p == ' ' || **p == '\t' || **p == ',' || **p == '\n' || **p == '\r') {
+		(*p)++;
+	}
+
+	if(!isdigit((unsigned char)**p)) {
+		return false;
+	}
+
+	char *end;
+	errno = 0;
+	*value = strtoul(*p, &end, 10);
+
+	if(errno || *value > max) {
+		return false;
+	}
+
+	*p = end;
+	return true;
+}
+
+bool bpf_parse(bpf_program_t *prog, const char *text) {
+	const char *p = text;
+	unsigned long count;
+
+	memset(prog, 0, sizeof(*prog));
+
+	if(!parse_number(&p, BPF_MAX_INSNS, &count) || !count) {
+		return false;
+	}
+
+	prog->len = count;
+	prog->insns = xzalloc(count * sizeof(*prog->insns));
+
+	for(size_t i = 0; i < count; i++) {
+		unsigned long code, jt, jf, k;
+
+		if(!parse_number(&p, UINT16_MAX, &code) || !parse_number(&p, UINT8_MAX, &jt) ||
+		                !parse_number(&p, UINT8_MAX, &jf) || !parse_number(&p, UINT32_MAX, &k)) {
+			bpf_free(prog);
+			return false;
+		}
+
+		prog->insns[i] = (bpf_insn_t) {
+			.code = (uint16_t)code,
+			.jt = (uint8_t)jt,
+			.jf = (uint8_t)jf,
+			.k = (uint32_t)k,
+		};
+	}
+
+	while(*p == ' ' || *p == '\t' || *p == ',' || *p == '\n' || *p == '\r') {
+		p++;
+	}
+
+	if(*p || !bpf_validate(prog)) {
+		bpf_free(prog);
+		return false;
+	}
+
+	return true;
+}
+
+void bpf_free(bpf_program_t *prog) {
+	free(prog->insns);
+	prog->insns = NULL;
+	prog->len = 0;
+}
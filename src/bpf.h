@@ -0,0 +1,36 @@
+#ifndef TINC_BPF_H
+#define TINC_BPF_H
+
+#include "system.h"
+
+// Classic BPF packet filters, as generated by tcpdump -ddd.
+
+#define BPF_MAX_INSNS 4096
+
+typedef struct bpf_insn_t {
+	uint16_t code;
+	uint8_t jt;
+	uint8_t jf;
+	uint32_t k;
+} bpf_insn_t;
+
+typedef struct bpf_program_t {
+	size_t len;
+	bpf_insn_t *insns;
+} bpf_program_t;
+
+// Parse a program in the format printed by tcpdump -ddd: the number of
+// instructions followed by one "code jt jf k" line per instruction.
+// Lines may also be separated by commas. The program is validated.
+extern bool bpf_parse(bpf_program_t *prog, const char *text);
+
+// Check that a program only uses known instructions, only jumps forward
+// within the program and always ends with a return.
+extern bool bpf_validate(const bpf_program_t *prog);
+
+// Run a validated program on a packet. Returns the number of bytes to keep, 0 to drop the packet.
+extern uint32_t bpf_run(const bpf_program_t *prog, const uint8_t *packet, uint32_t len);
+
+extern void bpf_free(bpf_program_t *prog);
+
+#endif
@@ -0,0 +1,274 @@
+#include "system.h"
+
+#include "bpf.h"
+#include "capture.h"
+#include "connection.h"
+#include "control_common.h"
+#include "device_workers.h"
+#include "logger.h"
+#include "meta.h"
+#include "net.h"
+#include "protocol.h"
+#include "route.h"
+#include "xalloc.h"
+
+struct capture_t {
+	bpf_program_t filter;           // Empty if every packet matches
+	uint32_t snaplen;               // 0 if packets are not truncated
+	uint32_t sample;                // Capture one out of every sample matching packets
+	uint32_t matched;
+
+	capture_ring_t *ring;           // NULL if packets are sent over the control connection
+	size_t map_size;
+	uint32_t size;                  // Our own copies, tinc pcap can write to the ring
+	uint64_t head;
+	uint64_t dropped;
+};
+
+static void capture_free(capture_t *cap) {
+	if(!cap) {
+		return;
+	}
+
+#ifdef HAVE_CAPTURE_RING
+
+	if(cap->ring) {
+		munmap(cap->ring, cap->map_size);
+	}
+
+#endif
+
+	bpf_free(&cap->filter);
+	free(cap);
+}
+
+#ifdef HAVE_CAPTURE_RING
+static bool send_fd(connection_t *c, const char *line, int fd) {
+	struct iovec iov = {
+		.iov_base = (void *)line,
+		.iov_len = strlen(line),
+	};
+
+	char cmsgbuf[CMSG_SPACE(sizeof(fd))];
+	memset(cmsgbuf, 0, sizeof(cmsgbuf));
+
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cmsgbuf,
+		.msg_controllen = sizeof(cmsgbuf),
+	};
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+
+	return sendmsg(c->socket, &msg, MSG_NOSIGNAL) == (ssize_t)iov.iov_len;
+}
+
+// Create the ring buffer and pass it to tinc pcap together with the reply line
+static bool open_ring(connection_t *c, capture_t *cap) {
+	// The file descriptor must not overtake pending output
+	if(c->outbuf.len) {
+		return false;
+	}
+
+	int fd = memfd_create("tinc-pcap", MFD_CLOEXEC);
+
+	if(fd < 0) {
+		logger(DEBUG_ALWAYS, LOG_ERR, "Could not create capture buffer: %s", strerror(errno));
+		return false;
+	}
+
+	size_t map_size = sizeof(capture_ring_t) + CAPTURE_RING_SIZE;
+
+	if(ftruncate(fd, map_size)) {
+		logger(DEBUG_ALWAYS, LOG_ERR, "Could not create capture buffer: %s", strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	capture_ring_t *ring = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if(ring == MAP_FAILED) {
+		logger(DEBUG_ALWAYS, LOG_ERR, "Could not map capture buffer: %s", strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	ring->magic = CAPTURE_RING_MAGIC;
+	ring->size = CAPTURE_RING_SIZE;
+
+	char line[64];
+	snprintf(line, sizeof(line), "%d %d %d %d\n", CONTROL, REQ_PCAP_RING, 0, CAPTURE_RING_SIZE);
+	bool sent = send_fd(c, line, fd);
+	close(fd);
+
+	if(!sent) {
+		logger(DEBUG_ALWAYS, LOG_ERR, "Could not send capture buffer to %s: %s", c->name, strerror(errno));
+		munmap(ring, map_size);
+		return false;
+	}
+
+	cap->ring = ring;
+	cap->map_size = map_size;
+	cap->size = CAPTURE_RING_SIZE;
+	return true;
+}
+
+static void write_ring(connection_t *c, capture_t *cap, const uint8_t *data, uint32_t caplen, uint32_t origlen, const struct timeval *tv) {
+	capture_ring_t *ring = cap->ring;
+	uint32_t size = (sizeof(capture_record_t) + caplen + CAPTURE_RECORD_ALIGN - 1) & ~(CAPTURE_RECORD_ALIGN - 1);
+	uint32_t offset = cap->head % cap->size;
+	uint32_t contiguous = cap->size - offset;
+	uint64_t needed = size > contiguous ? size + contiguous : size;
+	uint64_t used = cap->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	if(used > cap->size || cap->size - used < needed) {
+		__atomic_store_n(&ring->dropped, ++cap->dropped, __ATOMIC_RELAXED);
+		return;
+	}
+
+	if(size > contiguous) {
+		memset(ring->data + offset, 0, sizeof(uint32_t));
+		cap->head += contiguous;
+		offset = 0;
+	}
+
+	capture_record_t record = {
+		.size = size,
+		.tv_sec = (uint32_t)tv->tv_sec,
+		.tv_usec = (uint32_t)tv->tv_usec,
+		.caplen = caplen,
+		.origlen = origlen,
+	};
+
+	memcpy(ring->data + offset, &record, sizeof(record));
+	memcpy(ring->data + offset + sizeof(record), data, caplen);
+	cap->head += size;
+	__atomic_store_n(&ring->head, cap->head, __ATOMIC_SEQ_CST);
+
+	// Only wake up tinc pcap if it ran out of packets
+	if(__atomic_load_n(&ring->waiting, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&ring->waiting, 0, __ATOMIC_SEQ_CST)) {
+		send_request(c, "%d %d", CONTROL, REQ_PCAP_RING);
+	}
+}
+#else
+static bool open_ring(connection_t *c, capture_t *cap) {
+	(void)c;
+	(void)cap;
+	return false;
+}
+#endif
+
+bool capture_start(connection_t *c, const char *request, bool ring) {
+	int snaplen = 0;
+	int sample = 0;
+	int offset = 0;
+
+	// Older versions of tinc pcap only send the snaplen
+	if(sscanf(request, "%*d %*d %d %d %n", &snaplen, &sample, &offset) < 2) {
+		offset = 0;
+	}
+
+	capture_t *cap = xzalloc(sizeof(*cap));
+	cap->snaplen = snaplen > 0 ? snaplen : 0;
+	cap->sample = sample > 1 ? sample : 1;
+
+	if(offset && request[offset] && !bpf_parse(&cap->filter, request + offset)) {
+		logger(DEBUG_ALWAYS, LOG_ERR, "Invalid packet filter from %s", c->name);
+		capture_free(cap);
+		return false;
+	}
+
+	if(ring && !open_ring(c, cap)) {
+		capture_free(cap);
+		return send_request(c, "%d %d %d", CONTROL, REQ_PCAP_RING, -1);
+	}
+
+	capture_free(c->capture);
+	c->capture = cap;
+	c->status.pcap = true;
+	pcap = true;
+	device_workers_update();
+	return true;
+}
+
+void capture_stop(connection_t *c) {
+	if(c->capture) {
+		device_workers_update();
+	}
+
+	capture_free(c->capture);
+	c->capture = NULL;
+	c->status.pcap = false;
+}
+
+void capture_walk(void (*cb)(void *arg, const bpf_program_t *filter), void *arg) {
+	for list_each(connection_t, c, &connection_list) {
+		if(c->status.pcap && c->capture) {
+			cb(arg, &c->capture->filter);
+		}
+	}
+}
+
+void capture_packet(const vpn_packet_t *packet) {
+	const uint8_t *data = DATA(packet);
+#ifdef HAVE_CAPTURE_RING
+	struct timeval tv;
+	bool have_time = false;
+#endif
+
+	pcap = false;
+
+	for list_each(connection_t, c, &connection_list) {
+		capture_t *cap = c->capture;
+
+		if(!c->status.pcap || !cap) {
+			continue;
+		}
+
+		pcap = true;
+		uint32_t len = packet->len;
+
+		if(cap->filter.len) {
+			uint32_t keep = bpf_run(&cap->filter, data, len);
+
+			if(!keep) {
+				continue;
+			}
+
+			if(keep < len) {
+				len = keep;
+			}
+		}
+
+		if(cap->sample > 1 && cap->matched++ % cap->sample) {
+			continue;
+		}
+
+		if(cap->snaplen && cap->snaplen < len) {
+			len = cap->snaplen;
+		}
+
+#ifdef HAVE_CAPTURE_RING
+
+		if(cap->ring) {
+			if(!have_time) {
+				gettimeofday(&tv, NULL);
+				have_time = true;
+			}
+
+			write_ring(c, cap, data, len, packet->len, &tv);
+			continue;
+		}
+
+#endif
+
+		if(send_request(c, "%d %d %u %u", CONTROL, REQ_PCAP, len, (uint32_t)packet->len)) {
+			send_meta(c, data, len);
+		}
+	}
+}
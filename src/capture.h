@@ -0,0 +1,62 @@
+#ifndef TINC_CAPTURE_H
+#define TINC_CAPTURE_H
+
+#include "system.h"
+
+// Packet capture for tinc pcap. Packets are filtered in tincd with a classic
+// BPF program, then either sent over the control connection, or written to a
+// ring buffer in shared memory that tinc pcap reads directly.
+
+#define CAPTURE_RING_MAGIC 0x74637270
+#define CAPTURE_RING_SIZE (4 * 1024 * 1024)
+#define CAPTURE_RECORD_ALIGN 8
+
+// The header of the shared ring buffer. Each side only writes its own cache line.
+typedef struct capture_ring_t {
+	uint32_t magic;
+	uint32_t size;                  // Size of the data area
+	uint8_t reserved1[56];
+
+	// Written by tincd
+	uint64_t head;                  // Total number of bytes written
+	uint64_t dropped;               // Number of packets that did not fit
+	uint8_t reserved2[48];
+
+	// Written by tinc pcap
+	uint64_t tail;                  // Total number of bytes read
+	uint32_t waiting;               // Set when tinc pcap waits for a wakeup line
+	uint8_t reserved3[52];
+
+	uint8_t data[];
+} capture_ring_t;
+
+STATIC_ASSERT(sizeof(capture_ring_t) == 192, "capture_ring_t has incorrect size");
+
+// Records are padded to a multiple of 8 bytes and never wrap around the end of
+// the data area. A record size of zero means the rest of the data area is unused.
+typedef struct capture_record_t {
+	uint32_t size;                  // Including this header and padding
+	uint32_t tv_sec;
+	uint32_t tv_usec;
+	uint32_t caplen;
+	uint32_t origlen;
+	uint32_t reserved;
+} capture_record_t;
+
+STATIC_ASSERT(sizeof(capture_record_t) % CAPTURE_RECORD_ALIGN == 0, "capture_record_t has incorrect size");
+
+struct bpf_program_t;
+struct connection_t;
+struct vpn_packet_t;
+
+typedef struct capture_t capture_t;
+
+// Start capturing on a control connection, as requested by a REQ_PCAP or REQ_PCAP_RING line.
+extern bool capture_start(struct connection_t *c, const char *request, bool ring);
+extern void capture_stop(struct connection_t *c);
+extern void capture_packet(const struct vpn_packet_t *packet);
+
+// Call cb with the filter of every capture in progress. An empty filter matches every packet.
+extern void capture_walk(void (*cb)(void *arg, const struct bpf_program_t *filter), void *arg);
+
+#endif
@@ -3,14 +3,124 @@
 
 #include "chacha.h"
 #include "chacha-poly1305.h"
+#include "kernel.h"
 #include "poly1305.h"
 
 struct chacha_poly1305_ctx {
 	struct chacha_ctx main_ctx, header_ctx;
+	const chacha_poly1305_kernel_t *kernel;
 };
 
+static bool always_supported(void) {
+	return true;
+}
+
+static const chacha_poly1305_kernel_t reference_kernel = {
+	.name = "reference",
+	.supported = always_supported,
+	.chacha = chacha_encrypt_bytes,
+	.poly1305 = poly1305_auth,
+	.poly1305_blocks = poly1305_blocks,
+};
+
+#ifdef HAVE_X86_KERNELS
+static bool sse2_supported(void) {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+}
+
+static bool avx2_supported(void) {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+static bool avx512_supported(void) {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2");
+}
+
+static const chacha_poly1305_kernel_t sse2_kernel = {
+	.name = "sse2",
+	.supported = sse2_supported,
+	.chacha = chacha_encrypt_bytes_sse2,
+	.poly1305 = poly1305_auth,
+	.poly1305_blocks = poly1305_blocks,
+};
+
+static const chacha_poly1305_kernel_t avx2_kernel = {
+	.name = "avx2",
+	.supported = avx2_supported,
+	.chacha = chacha_encrypt_bytes_avx2,
+	.poly1305 = poly1305_auth_avx2,
+	.poly1305_blocks = poly1305_blocks_avx2,
+};
+
+static const chacha_poly1305_kernel_t avx512_kernel = {
+	.name = "avx512",
+	.supported = avx512_supported,
+	.chacha = chacha_encrypt_bytes_avx512,
+	.poly1305 = poly1305_auth_avx2,
+	.poly1305_blocks = poly1305_blocks_avx2,
+};
+#endif
+
+const chacha_poly1305_kernel_t *const chacha_poly1305_kernels[] = {
+	&reference_kernel,
+#ifdef HAVE_X86_KERNELS
+	&sse2_kernel,
+	&avx2_kernel,
+	&avx512_kernel,
+#endif
+	NULL,
+};
+
+static const chacha_poly1305_kernel_t *selected_kernel;
+
+static const chacha_poly1305_kernel_t *best_kernel(void) {
+	const chacha_poly1305_kernel_t *best = &reference_kernel;
+
+	for(const chacha_poly1305_kernel_t *const *k = chacha_poly1305_kernels; *k; k++) {
+		if((*k)->supported()) {
+			best = *k;
+		}
+	}
+
+	return best;
+}
+
+bool chacha_poly1305_set_kernel(const char *name) {
+	if(!name) {
+		selected_kernel = best_kernel();
+		return true;
+	}
+
+	for(const chacha_poly1305_kernel_t *const *k = chacha_poly1305_kernels; *k; k++) {
+		if(!strcmp((*k)->name, name) && (*k)->supported()) {
+			selected_kernel = *k;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+const char *chacha_poly1305_get_kernel(void) {
+	if(!selected_kernel) {
+		selected_kernel = best_kernel();
+	}
+
+	return selected_kernel->name;
+}
+
 chacha_poly1305_ctx_t *chacha_poly1305_init(void) {
-	return xzalloc(sizeof(chacha_poly1305_ctx_t));
+	chacha_poly1305_ctx_t *ctx = xzalloc(sizeof(chacha_poly1305_ctx_t));
+
+	if(!selected_kernel) {
+		selected_kernel = best_kernel();
+	}
+
+	ctx->kernel = selected_kernel;
+	return ctx;
 }
 
 void chacha_poly1305_exit(chacha_poly1305_ctx_t *ctx) {
@@ -23,6 +133,10 @@ bool chacha_poly1305_set_key(chacha_poly1305_ctx_t *ctx, const uint8_t *key) {
 	return true;
 }
 
+void chacha_poly1305_copy(chacha_poly1305_ctx_t *dst, const chacha_poly1305_ctx_t *src) {
+	*dst = *src;
+}
+
 static void put_u64(void *vp, uint64_t v) {
 	uint8_t *p = (uint8_t *) vp;
 
@@ -36,7 +150,7 @@ static void put_u64(void *vp, uint64_t v) {
 	p[7] = (uint8_t) v & 0xff;
 }
 
-bool chacha_poly1305_encrypt(chacha_poly1305_ctx_t *ctx, uint64_t seqnr, const void *indata, size_t inlen, void *voutdata, size_t *outlen) {
+bool chacha_poly1305_encrypt_twopass(chacha_poly1305_ctx_t *ctx, uint64_t seqnr, const void *indata, size_t inlen, void *voutdata, size_t *outlen) {
 	uint8_t seqbuf[8];
 	const uint8_t one[8] = { 1, 0, 0, 0, 0, 0, 0, 0 };      /* NB little-endian */
 	uint8_t poly_key[POLY1305_KEYLEN];
@@ -49,13 +163,13 @@ bool chacha_poly1305_encrypt(chacha_poly1305_ctx_t *ctx, uint64_t seqnr, const v
 	memset(poly_key, 0, sizeof(poly_key));
 	put_u64(seqbuf, seqnr);
 	chacha_ivsetup(&ctx->main_ctx, seqbuf, NULL);
-	chacha_encrypt_bytes(&ctx->main_ctx, poly_key, poly_key, sizeof(poly_key));
+	ctx->kernel->chacha(&ctx->main_ctx, poly_key, poly_key, sizeof(poly_key));
 
 	/* Set Chacha's block counter to 1 */
 	chacha_ivsetup(&ctx->main_ctx, seqbuf, one);
 
-	chacha_encrypt_bytes(&ctx->main_ctx, indata, outdata, inlen);
-	poly1305_auth(outdata + inlen, outdata, inlen, poly_key);
+	ctx->kernel->chacha(&ctx->main_ctx, indata, outdata, inlen);
+	ctx->kernel->poly1305(outdata + inlen, outdata, inlen, poly_key);
 
 	if(outlen) {
 		*outlen = inlen + POLY1305_TAGLEN;
@@ -64,7 +178,7 @@ bool chacha_poly1305_encrypt(chacha_poly1305_ctx_t *ctx, uint64_t seqnr, const v
 	return true;
 }
 
-bool chacha_poly1305_decrypt(chacha_poly1305_ctx_t *ctx, uint64_t seqnr, const void *vindata, size_t inlen, void *outdata, size_t *outlen) {
+bool chacha_poly1305_decrypt_twopass(chacha_poly1305_ctx_t *ctx, uint64_t seqnr, const void *vindata, size_t inlen, void *outdata, size_t *outlen) {
 	uint8_t seqbuf[8];
 	const uint8_t one[8] = { 1, 0, 0, 0, 0, 0, 0, 0 };      /* NB little-endian */
 	uint8_t expected_tag[POLY1305_TAGLEN], poly_key[POLY1305_KEYLEN];
@@ -77,7 +191,7 @@ bool chacha_poly1305_decrypt(chacha_poly1305_ctx_t *ctx, uint64_t seqnr, const v
 	memset(poly_key, 0, sizeof(poly_key));
 	put_u64(seqbuf, seqnr);
 	chacha_ivsetup(&ctx->main_ctx, seqbuf, NULL);
-	chacha_encrypt_bytes(&ctx->main_ctx, poly_key, poly_key, sizeof(poly_key));
+	ctx->kernel->chacha(&ctx->main_ctx, poly_key, poly_key, sizeof(poly_key));
 
 	/* Set Chacha's block counter to 1 */
 	chacha_ivsetup(&ctx->main_ctx, seqbuf, one);
@@ -86,13 +200,138 @@ bool chacha_poly1305_decrypt(chacha_poly1305_ctx_t *ctx, uint64_t seqnr, const v
 	inlen -= POLY1305_TAGLEN;
 	const uint8_t *tag = indata + inlen;
 
-	poly1305_auth(expected_tag, indata, inlen, poly_key);
+	ctx->kernel->poly1305(expected_tag, indata, inlen, poly_key);
 
 	if(memcmp(expected_tag, tag, POLY1305_TAGLEN)) {
 		return false;
 	}
 
-	chacha_encrypt_bytes(&ctx->main_ctx, indata, outdata, inlen);
+	ctx->kernel->chacha(&ctx->main_ctx, indata, outdata, inlen);
+
+	if(outlen) {
+		*outlen = inlen;
+	}
+
+	return true;
+}
+
+/*
+ * The single pass versions work in chunks that fit comfortably in the L1 cache,
+ * so Poly1305 reads the data ChaCha20 just wrote (or vice versa) from the cache.
+ * The chunk size is a multiple of the ChaCha20 block size, so the keystream
+ * continues seamlessly from one chunk to the next.
+ */
+#define CHUNKLEN 2048
+#define FIRSTLEN (512 - CHACHA_BLOCKLEN)
+
+/*
+ * Block 0 of the keystream provides the Poly1305 key. Rather than running
+ * ChaCha20 separately for it, generate it together with the keystream for the
+ * first FIRSTLEN bytes of data, which are copied to buf for that. FIRSTLEN is
+ * kept small to limit the copying, but large enough for a full SIMD batch.
+ * The IV is the packet sequence number. Returns the number of bytes of data
+ * processed, which are left in buf + CHACHA_BLOCKLEN.
+ */
+static size_t first_chunk(chacha_poly1305_ctx_t *ctx, uint64_t seqnr, const uint8_t *indata, size_t inlen, uint8_t buf[CHACHA_BLOCKLEN + FIRSTLEN], poly1305_state_t *poly) {
+	uint8_t seqbuf[8];
+	size_t len = inlen < FIRSTLEN ? inlen : FIRSTLEN;
+
+	memset(buf, 0, CHACHA_BLOCKLEN);
+	memcpy(buf + CHACHA_BLOCKLEN, indata, len);
+
+	put_u64(seqbuf, seqnr);
+	chacha_ivsetup(&ctx->main_ctx, seqbuf, NULL);
+	ctx->kernel->chacha(&ctx->main_ctx, buf, buf, (uint32_t)(CHACHA_BLOCKLEN + len));
+
+	poly1305_setup(poly, buf);
+	return len;
+}
+
+/* Authenticate the last piece of data, which may end with a partial block */
+static void poly1305_last(const chacha_poly1305_kernel_t *kernel, poly1305_state_t *poly, const uint8_t *data, size_t len) {
+	size_t full = len & ~(size_t)15;
+	kernel->poly1305_blocks(poly, data, full);
+	poly1305_update(poly, data + full, len - full);
+}
+
+bool chacha_poly1305_encrypt(chacha_poly1305_ctx_t *ctx, uint64_t seqnr, const void *vindata, size_t inlen, void *voutdata, size_t *outlen) {
+	const chacha_poly1305_kernel_t *kernel = ctx->kernel;
+	const uint8_t *indata = vindata;
+	uint8_t *outdata = voutdata;
+	uint8_t buf[CHACHA_BLOCKLEN + FIRSTLEN];
+	poly1305_state_t poly;
+
+	size_t len = first_chunk(ctx, seqnr, indata, inlen, buf, &poly);
+	size_t left = inlen - len;
+	memcpy(outdata, buf + CHACHA_BLOCKLEN, len);
+
+	if(!left) {
+		poly1305_last(kernel, &poly, outdata, len);
+	} else {
+		kernel->poly1305_blocks(&poly, outdata, len);
+		indata += len;
+		outdata += len;
+
+		for(; left > CHUNKLEN; indata += CHUNKLEN, outdata += CHUNKLEN, left -= CHUNKLEN) {
+			kernel->chacha(&ctx->main_ctx, indata, outdata, CHUNKLEN);
+			kernel->poly1305_blocks(&poly, outdata, CHUNKLEN);
+		}
+
+		kernel->chacha(&ctx->main_ctx, indata, outdata, (uint32_t)left);
+		poly1305_last(kernel, &poly, outdata, left);
+	}
+
+	poly1305_finish(&poly, (uint8_t *)voutdata + inlen, buf);
+	memzero(buf, POLY1305_KEYLEN);
+
+	if(outlen) {
+		*outlen = inlen + POLY1305_TAGLEN;
+	}
+
+	return true;
+}
+
+bool chacha_poly1305_decrypt(chacha_poly1305_ctx_t *ctx, uint64_t seqnr, const void *vindata, size_t inlen, void *voutdata, size_t *outlen) {
+	const chacha_poly1305_kernel_t *kernel = ctx->kernel;
+	const uint8_t *indata = vindata;
+	uint8_t *outdata = voutdata;
+	uint8_t buf[CHACHA_BLOCKLEN + FIRSTLEN];
+	uint8_t expected_tag[POLY1305_TAGLEN];
+	poly1305_state_t poly;
+
+	inlen -= POLY1305_TAGLEN;
+	const uint8_t *tag = indata + inlen;
+
+	// Authenticate each chunk before decrypting it, so this also works in place.
+	size_t len = first_chunk(ctx, seqnr, indata, inlen, buf, &poly);
+	size_t left = inlen - len;
+
+	if(!left) {
+		poly1305_last(kernel, &poly, indata, len);
+		memcpy(outdata, buf + CHACHA_BLOCKLEN, len);
+	} else {
+		kernel->poly1305_blocks(&poly, indata, len);
+		memcpy(outdata, buf + CHACHA_BLOCKLEN, len);
+		indata += len;
+		outdata += len;
+
+		for(; left > CHUNKLEN; indata += CHUNKLEN, outdata += CHUNKLEN, left -= CHUNKLEN) {
+			kernel->poly1305_blocks(&poly, indata, CHUNKLEN);
+			kernel->chacha(&ctx->main_ctx, indata, outdata, CHUNKLEN);
+		}
+
+		poly1305_last(kernel, &poly, indata, left);
+		kernel->chacha(&ctx->main_ctx, indata, outdata, (uint32_t)left);
+	}
+
+	poly1305_finish(&poly, expected_tag, buf);
+	memzero(buf, POLY1305_KEYLEN);
+
+	// The plaintext has already been written, so it has to be wiped if the tag does not match.
+	if(memcmp(expected_tag, tag, POLY1305_TAGLEN)) {
+		memzero(voutdata, inlen);
+		return false;
+	}
 
 	if(outlen) {
 		*outlen = inlen;
@@ -100,3 +339,30 @@ bool chacha_poly1305_decrypt(chacha_poly1305_ctx_t *ctx, uint64_t seqnr, const v
 
 	return true;
 }
+
+bool chacha_poly1305_verify(chacha_poly1305_ctx_t *ctx, uint64_t seqnr, const void *vindata, size_t inlen) {
+	const uint8_t *indata = vindata;
+	uint8_t seqbuf[8];
+	uint8_t key[CHACHA_BLOCKLEN];
+	uint8_t expected_tag[POLY1305_TAGLEN];
+	poly1305_state_t poly;
+
+	if(inlen < POLY1305_TAGLEN) {
+		return false;
+	}
+
+	inlen -= POLY1305_TAGLEN;
+
+	// Only block 0 of the keystream is needed, for the Poly1305 key
+	memset(key, 0, sizeof(key));
+	put_u64(seqbuf, seqnr);
+	chacha_ivsetup(&ctx->main_ctx, seqbuf, NULL);
+	ctx->kernel->chacha(&ctx->main_ctx, key, key, sizeof(key));
+
+	poly1305_setup(&poly, key);
+	poly1305_last(ctx->kernel, &poly, indata, inlen);
+	poly1305_finish(&poly, expected_tag, key);
+	memzero(key, sizeof(key));
+
+	return !memcmp(expected_tag, indata + inlen, POLY1305_TAGLEN);
+}
@@ -8,8 +8,18 @@ typedef struct chacha_poly1305_ctx chacha_poly1305_ctx_t;
 extern void chacha_poly1305_exit(chacha_poly1305_ctx_t *);
 extern chacha_poly1305_ctx_t *chacha_poly1305_init(void) ATTR_DEALLOCATOR(chacha_poly1305_exit);
 extern bool chacha_poly1305_set_key(chacha_poly1305_ctx_t *ctx, const uint8_t *key);
+extern void chacha_poly1305_copy(chacha_poly1305_ctx_t *dst, const chacha_poly1305_ctx_t *src);
+
+// Select the ChaCha20-Poly1305 implementation used by contexts initialized afterwards.
+// NULL selects the fastest one supported by this CPU, which is also the default.
+// Returns false if the named implementation does not exist or is not supported.
+extern bool chacha_poly1305_set_kernel(const char *name);
+extern const char *chacha_poly1305_get_kernel(void);
 
 extern bool chacha_poly1305_encrypt(chacha_poly1305_ctx_t *ctx, uint64_t seqnr, const void *indata, size_t inlen, void *outdata, size_t *outlen);
 extern bool chacha_poly1305_decrypt(chacha_poly1305_ctx_t *ctx, uint64_t seqnr, const void *indata, size_t inlen, void *outdata, size_t *outlen);
 
+// Only check the tag of a sealed message, without decrypting it.
+extern bool chacha_poly1305_verify(chacha_poly1305_ctx_t *ctx, uint64_t seqnr, const void *indata, size_t inlen);
+
 #endif //CHACHA_POLY1305_H
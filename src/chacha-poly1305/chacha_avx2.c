@@ -0,0 +1,106 @@
+/*
+ * ChaCha20 using AVX2, processing four blocks in parallel.
+ *
+ * Each vector holds one row of the state of two blocks, one per 128-bit lane.
+ * Two sets of rows are interleaved to hide instruction latency.
+ */
+
+#include "../system.h"
+
+#include <immintrin.h>
+
+#include "kernel.h"
+
+#define TARGET __attribute__((target("avx2")))
+
+#define ROTATE(v, n) _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n)))
+#define ROTATE16(v) _mm256_shuffle_epi8(v, rot16)
+#define ROTATE8(v) _mm256_shuffle_epi8(v, rot8)
+
+#define QUARTERROUND(a, b, c, d) \
+	a = _mm256_add_epi32(a, b); d = ROTATE16(_mm256_xor_si256(d, a)); \
+	c = _mm256_add_epi32(c, d); b = ROTATE(_mm256_xor_si256(b, c), 12); \
+	a = _mm256_add_epi32(a, b); d = ROTATE8(_mm256_xor_si256(d, a)); \
+	c = _mm256_add_epi32(c, d); b = ROTATE(_mm256_xor_si256(b, c), 7);
+
+/* Rotate the rows so the next quarter rounds operate on the diagonals, and back */
+#define DIAGONALIZE(b, c, d) \
+	b = _mm256_shuffle_epi32(b, 0x39); \
+	c = _mm256_shuffle_epi32(c, 0x4e); \
+	d = _mm256_shuffle_epi32(d, 0x93);
+
+#define UNDIAGONALIZE(b, c, d) \
+	b = _mm256_shuffle_epi32(b, 0x93); \
+	c = _mm256_shuffle_epi32(c, 0x4e); \
+	d = _mm256_shuffle_epi32(d, 0x39);
+
+#define BLOCKS 4
+
+TARGET static inline __m256i counter_row(const uint32_t input[16], uint64_t counter) {
+	uint64_t c1 = counter + 1;
+	return _mm256_setr_epi32((int)counter, (int)(counter >> 32), (int)input[14], (int)input[15],
+	                         (int)c1, (int)(c1 >> 32), (int)input[14], (int)input[15]);
+}
+
+TARGET static inline void store_blocks(__m256i a, __m256i b, __m256i c, __m256i d, const uint8_t *m, uint8_t *out) {
+	__m256i r[4] = {
+		_mm256_permute2x128_si256(a, b, 0x20),
+		_mm256_permute2x128_si256(c, d, 0x20),
+		_mm256_permute2x128_si256(a, b, 0x31),
+		_mm256_permute2x128_si256(c, d, 0x31),
+	};
+
+	for(int i = 0; i < 4; i++) {
+		__m256i in = _mm256_loadu_si256((const __m256i *)(m + 32 * i));
+		_mm256_storeu_si256((__m256i *)(out + 32 * i), _mm256_xor_si256(in, r[i]));
+	}
+}
+
+TARGET static void chacha_blocks_avx2(const uint32_t input[16], uint64_t counter, const uint8_t *m, uint8_t *c) {
+	const __m256i rot16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+	                                       2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+	const __m256i rot8 = _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+	                                      3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+
+	const __m256i ja = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(input + 0)));
+	const __m256i jb = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(input + 4)));
+	const __m256i jc = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(input + 8)));
+	const __m256i jd0 = counter_row(input, counter);
+	const __m256i jd1 = counter_row(input, counter + 2);
+
+	__m256i a0 = ja, b0 = jb, c0 = jc, d0 = jd0;
+	__m256i a1 = ja, b1 = jb, c1 = jc, d1 = jd1;
+
+	for(int i = 20; i > 0; i -= 2) {
+		QUARTERROUND(a0, b0, c0, d0)
+		QUARTERROUND(a1, b1, c1, d1)
+		DIAGONALIZE(b0, c0, d0)
+		DIAGONALIZE(b1, c1, d1)
+		QUARTERROUND(a0, b0, c0, d0)
+		QUARTERROUND(a1, b1, c1, d1)
+		UNDIAGONALIZE(b0, c0, d0)
+		UNDIAGONALIZE(b1, c1, d1)
+	}
+
+	store_blocks(_mm256_add_epi32(a0, ja), _mm256_add_epi32(b0, jb), _mm256_add_epi32(c0, jc), _mm256_add_epi32(d0, jd0), m, c);
+	store_blocks(_mm256_add_epi32(a1, ja), _mm256_add_epi32(b1, jb), _mm256_add_epi32(c1, jc), _mm256_add_epi32(d1, jd1), m + 128, c + 128);
+}
+
+void chacha_encrypt_bytes_avx2(struct chacha_ctx *x, const uint8_t *m, uint8_t *c, uint32_t bytes) {
+	uint64_t counter = x->input[12] | (uint64_t)x->input[13] << 32;
+
+	for(; bytes >= BLOCKS * 64; bytes -= BLOCKS * 64, m += BLOCKS * 64, c += BLOCKS * 64, counter += BLOCKS) {
+		chacha_blocks_avx2(x->input, counter, m, c);
+	}
+
+	if(bytes) {
+		uint8_t tmp[BLOCKS * 64] = {0};
+		memcpy(tmp, m, bytes);
+		chacha_blocks_avx2(x->input, counter, tmp, tmp);
+		memcpy(c, tmp, bytes);
+		counter += (bytes + 63) / 64;
+	}
+
+	x->input[12] = (uint32_t)counter;
+	x->input[13] = (uint32_t)(counter >> 32);
+}
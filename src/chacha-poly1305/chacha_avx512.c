@@ -0,0 +1,104 @@
+/*
+ * ChaCha20 using AVX-512, processing eight blocks in parallel.
+ *
+ * Each vector holds one row of the state of four blocks, one per 128-bit lane.
+ * Two sets of rows are interleaved to hide instruction latency.
+ */
+
+#include "../system.h"
+
+#include <immintrin.h>
+
+#include "kernel.h"
+
+#define TARGET __attribute__((target("avx512f")))
+
+#define QUARTERROUND(a, b, c, d) \
+	a = _mm512_add_epi32(a, b); d = _mm512_rol_epi32(_mm512_xor_si512(d, a), 16); \
+	c = _mm512_add_epi32(c, d); b = _mm512_rol_epi32(_mm512_xor_si512(b, c), 12); \
+	a = _mm512_add_epi32(a, b); d = _mm512_rol_epi32(_mm512_xor_si512(d, a), 8); \
+	c = _mm512_add_epi32(c, d); b = _mm512_rol_epi32(_mm512_xor_si512(b, c), 7);
+
+/* Rotate the rows so the next quarter rounds operate on the diagonals, and back */
+#define DIAGONALIZE(b, c, d) \
+	b = _mm512_shuffle_epi32(b, (_MM_PERM_ENUM)0x39); \
+	c = _mm512_shuffle_epi32(c, (_MM_PERM_ENUM)0x4e); \
+	d = _mm512_shuffle_epi32(d, (_MM_PERM_ENUM)0x93);
+
+#define UNDIAGONALIZE(b, c, d) \
+	b = _mm512_shuffle_epi32(b, (_MM_PERM_ENUM)0x93); \
+	c = _mm512_shuffle_epi32(c, (_MM_PERM_ENUM)0x4e); \
+	d = _mm512_shuffle_epi32(d, (_MM_PERM_ENUM)0x39);
+
+#define BLOCKS 8
+
+TARGET static inline __m512i counter_row(const uint32_t input[16], uint64_t counter) {
+	uint64_t c1 = counter + 1, c2 = counter + 2, c3 = counter + 3;
+	return _mm512_setr_epi32((int)counter, (int)(counter >> 32), (int)input[14], (int)input[15],
+	                         (int)c1, (int)(c1 >> 32), (int)input[14], (int)input[15],
+	                         (int)c2, (int)(c2 >> 32), (int)input[14], (int)input[15],
+	                         (int)c3, (int)(c3 >> 32), (int)input[14], (int)input[15]);
+}
+
+TARGET static inline void store_blocks(__m512i a, __m512i b, __m512i c, __m512i d, const uint8_t *m, uint8_t *out) {
+	/* Transpose the 128-bit lanes, so each vector holds one whole block */
+	__m512i t0 = _mm512_shuffle_i32x4(a, b, 0x44);
+	__m512i t1 = _mm512_shuffle_i32x4(c, d, 0x44);
+	__m512i t2 = _mm512_shuffle_i32x4(a, b, 0xee);
+	__m512i t3 = _mm512_shuffle_i32x4(c, d, 0xee);
+	__m512i r[4] = {
+		_mm512_shuffle_i32x4(t0, t1, 0x88),
+		_mm512_shuffle_i32x4(t0, t1, 0xdd),
+		_mm512_shuffle_i32x4(t2, t3, 0x88),
+		_mm512_shuffle_i32x4(t2, t3, 0xdd),
+	};
+
+	for(int i = 0; i < 4; i++) {
+		__m512i in = _mm512_loadu_si512((const void *)(m + 64 * i));
+		_mm512_storeu_si512((void *)(out + 64 * i), _mm512_xor_si512(in, r[i]));
+	}
+}
+
+TARGET static void chacha_blocks_avx512(const uint32_t input[16], uint64_t counter, const uint8_t *m, uint8_t *c) {
+	const __m512i ja = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)(input + 0)));
+	const __m512i jb = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)(input + 4)));
+	const __m512i jc = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)(input + 8)));
+	const __m512i jd0 = counter_row(input, counter);
+	const __m512i jd1 = counter_row(input, counter + 4);
+
+	__m512i a0 = ja, b0 = jb, c0 = jc, d0 = jd0;
+	__m512i a1 = ja, b1 = jb, c1 = jc, d1 = jd1;
+
+	for(int i = 20; i > 0; i -= 2) {
+		QUARTERROUND(a0, b0, c0, d0)
+		QUARTERROUND(a1, b1, c1, d1)
+		DIAGONALIZE(b0, c0, d0)
+		DIAGONALIZE(b1, c1, d1)
+		QUARTERROUND(a0, b0, c0, d0)
+		QUARTERROUND(a1, b1, c1, d1)
+		UNDIAGONALIZE(b0, c0, d0)
+		UNDIAGONALIZE(b1, c1, d1)
+	}
+
+	store_blocks(_mm512_add_epi32(a0, ja), _mm512_add_epi32(b0, jb), _mm512_add_epi32(c0, jc), _mm512_add_epi32(d0, jd0), m, c);
+	store_blocks(_mm512_add_epi32(a1, ja), _mm512_add_epi32(b1, jb), _mm512_add_epi32(c1, jc), _mm512_add_epi32(d1, jd1), m + 256, c + 256);
+}
+
+void chacha_encrypt_bytes_avx512(struct chacha_ctx *x, const uint8_t *m, uint8_t *c, uint32_t bytes) {
+	uint64_t counter = x->input[12] | (uint64_t)x->input[13] << 32;
+
+	for(; bytes >= BLOCKS * 64; bytes -= BLOCKS * 64, m += BLOCKS * 64, c += BLOCKS * 64, counter += BLOCKS) {
+		chacha_blocks_avx512(x->input, counter, m, c);
+	}
+
+	if(bytes) {
+		uint8_t tmp[BLOCKS * 64] = {0};
+		memcpy(tmp, m, bytes);
+		chacha_blocks_avx512(x->input, counter, tmp, tmp);
+		memcpy(c, tmp, bytes);
+		counter += (bytes + 63) / 64;
+	}
+
+	x->input[12] = (uint32_t)counter;
+	x->input[13] = (uint32_t)(counter >> 32);
+}
@@ -0,0 +1,94 @@
+/*
+ * ChaCha20 using SSE2, processing four blocks in parallel.
+ *
+ * Each vector holds the same state word of four consecutive blocks,
+ * so the rounds need no shuffling, and the output is transposed at the end.
+ */
+
+#include "../system.h"
+
+#include <immintrin.h>
+
+#include "kernel.h"
+
+#define TARGET __attribute__((target("sse2")))
+
+#define ROTATE(v, n) _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+
+#define QUARTERROUND(a, b, c, d) \
+	a = _mm_add_epi32(a, b); d = ROTATE(_mm_xor_si128(d, a), 16); \
+	c = _mm_add_epi32(c, d); b = ROTATE(_mm_xor_si128(b, c), 12); \
+	a = _mm_add_epi32(a, b); d = ROTATE(_mm_xor_si128(d, a), 8); \
+	c = _mm_add_epi32(c, d); b = ROTATE(_mm_xor_si128(b, c), 7);
+
+#define BLOCKS 4
+
+TARGET static void chacha_blocks_sse2(const uint32_t input[16], uint64_t counter, const uint8_t *m, uint8_t *c) {
+	__m128i j[16], x[16];
+
+	for(int i = 0; i < 16; i++) {
+		j[i] = _mm_set1_epi32((int)input[i]);
+	}
+
+	uint64_t c0 = counter, c1 = counter + 1, c2 = counter + 2, c3 = counter + 3;
+	j[12] = _mm_setr_epi32((int)c0, (int)c1, (int)c2, (int)c3);
+	j[13] = _mm_setr_epi32((int)(c0 >> 32), (int)(c1 >> 32), (int)(c2 >> 32), (int)(c3 >> 32));
+
+	for(int i = 0; i < 16; i++) {
+		x[i] = j[i];
+	}
+
+	for(int i = 20; i > 0; i -= 2) {
+		QUARTERROUND(x[0], x[4], x[8], x[12])
+		QUARTERROUND(x[1], x[5], x[9], x[13])
+		QUARTERROUND(x[2], x[6], x[10], x[14])
+		QUARTERROUND(x[3], x[7], x[11], x[15])
+		QUARTERROUND(x[0], x[5], x[10], x[15])
+		QUARTERROUND(x[1], x[6], x[11], x[12])
+		QUARTERROUND(x[2], x[7], x[8], x[13])
+		QUARTERROUND(x[3], x[4], x[9], x[14])
+	}
+
+	for(int i = 0; i < 16; i++) {
+		x[i] = _mm_add_epi32(x[i], j[i]);
+	}
+
+	/* Transpose each group of four words, so each vector holds 16 bytes of one block */
+	for(int g = 0; g < 4; g++) {
+		__m128i t0 = _mm_unpacklo_epi32(x[4 * g + 0], x[4 * g + 1]);
+		__m128i t1 = _mm_unpacklo_epi32(x[4 * g + 2], x[4 * g + 3]);
+		__m128i t2 = _mm_unpackhi_epi32(x[4 * g + 0], x[4 * g + 1]);
+		__m128i t3 = _mm_unpackhi_epi32(x[4 * g + 2], x[4 * g + 3]);
+		__m128i r[4] = {
+			_mm_unpacklo_epi64(t0, t1),
+			_mm_unpackhi_epi64(t0, t1),
+			_mm_unpacklo_epi64(t2, t3),
+			_mm_unpackhi_epi64(t2, t3),
+		};
+
+		for(int b = 0; b < 4; b++) {
+			size_t off = 64 * b + 16 * g;
+			__m128i in = _mm_loadu_si128((const __m128i *)(m + off));
+			_mm_storeu_si128((__m128i *)(c + off), _mm_xor_si128(in, r[b]));
+		}
+	}
+}
+
+void chacha_encrypt_bytes_sse2(struct chacha_ctx *x, const uint8_t *m, uint8_t *c, uint32_t bytes) {
+	uint64_t counter = x->input[12] | (uint64_t)x->input[13] << 32;
+
+	for(; bytes >= BLOCKS * 64; bytes -= BLOCKS * 64, m += BLOCKS * 64, c += BLOCKS * 64, counter += BLOCKS) {
+		chacha_blocks_sse2(x->input, counter, m, c);
+	}
+
+	if(bytes) {
+		uint8_t tmp[BLOCKS * 64] = {0};
+		memcpy(tmp, m, bytes);
+		chacha_blocks_sse2(x->input, counter, tmp, tmp);
+		memcpy(c, tmp, bytes);
+		counter += (bytes + 63) / 64;
+	}
+
+	x->input[12] = (uint32_t)counter;
+	x->input[13] = (uint32_t)(counter >> 32);
+}
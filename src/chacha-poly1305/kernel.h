@@ -0,0 +1,34 @@
+#ifndef CHACHA_POLY1305_KERNEL_H
+#define CHACHA_POLY1305_KERNEL_H
+
+#include "chacha.h"
+#include "chacha-poly1305.h"
+#include "poly1305.h"
+
+// A set of ChaCha20 and Poly1305 implementations optimized for a particular CPU.
+typedef struct chacha_poly1305_kernel_t {
+	const char *name;
+	bool (*supported)(void);
+	void (*chacha)(struct chacha_ctx *x, const uint8_t *m, uint8_t *c, uint32_t bytes);
+	void (*poly1305)(uint8_t out[POLY1305_TAGLEN], const uint8_t *m, size_t inlen, const uint8_t key[POLY1305_KEYLEN]);
+	void (*poly1305_blocks)(poly1305_state_t *st, const uint8_t *m, size_t len);
+} chacha_poly1305_kernel_t;
+
+// All kernels built into this binary, ordered from slowest to fastest, terminated by NULL.
+// The first one is the portable reference implementation.
+extern const chacha_poly1305_kernel_t *const chacha_poly1305_kernels[];
+
+// The straightforward construction that runs ChaCha20 and Poly1305 in two separate passes over the data.
+// chacha_poly1305_encrypt() and chacha_poly1305_decrypt() produce the same results in a single pass.
+extern bool chacha_poly1305_encrypt_twopass(chacha_poly1305_ctx_t *ctx, uint64_t seqnr, const void *indata, size_t inlen, void *outdata, size_t *outlen);
+extern bool chacha_poly1305_decrypt_twopass(chacha_poly1305_ctx_t *ctx, uint64_t seqnr, const void *indata, size_t inlen, void *outdata, size_t *outlen);
+
+#ifdef HAVE_X86_KERNELS
+extern void chacha_encrypt_bytes_sse2(struct chacha_ctx *x, const uint8_t *m, uint8_t *c, uint32_t bytes);
+extern void chacha_encrypt_bytes_avx2(struct chacha_ctx *x, const uint8_t *m, uint8_t *c, uint32_t bytes);
+extern void chacha_encrypt_bytes_avx512(struct chacha_ctx *x, const uint8_t *m, uint8_t *c, uint32_t bytes);
+extern void poly1305_blocks_avx2(poly1305_state_t *st, const uint8_t *m, size_t len);
+extern void poly1305_auth_avx2(uint8_t out[POLY1305_TAGLEN], const uint8_t *m, size_t inlen, const uint8_t key[POLY1305_KEYLEN]);
+#endif
+
+#endif // CHACHA_POLY1305_KERNEL_H
@@ -24,18 +24,8 @@
 	} while (0)
 
 void
-poly1305_auth(unsigned char out[POLY1305_TAGLEN], const unsigned char *m, size_t inlen, const unsigned char key[POLY1305_KEYLEN]) {
+poly1305_setup(poly1305_state_t *st, const unsigned char key[POLY1305_KEYLEN]) {
 	uint32_t t0, t1, t2, t3;
-	uint32_t h0, h1, h2, h3, h4;
-	uint32_t r0, r1, r2, r3, r4;
-	uint32_t s1, s2, s3, s4;
-	uint32_t b, nb;
-	size_t j;
-	uint64_t t[5];
-	uint64_t f0, f1, f2, f3;
-	uint32_t g0, g1, g2, g3, g4;
-	uint64_t c;
-	unsigned char mp[16];
 
 	/* clamp key */
 	t0 = U8TO32_LE(key + 0);
@@ -44,83 +34,162 @@ poly1305_auth(unsigned char out[POLY1305_TAGLEN], const unsigned char *m, size_t
 	t3 = U8TO32_LE(key + 12);
 
 	/* precompute multipliers */
-	r0 = t0 & 0x3ffffff;
+	st->r[0] = t0 & 0x3ffffff;
 	t0 >>= 26;
 	t0 |= t1 << 6;
-	r1 = t0 & 0x3ffff03;
+	st->r[1] = t0 & 0x3ffff03;
 	t1 >>= 20;
 	t1 |= t2 << 12;
-	r2 = t1 & 0x3ffc0ff;
+	st->r[2] = t1 & 0x3ffc0ff;
 	t2 >>= 14;
 	t2 |= t3 << 18;
-	r3 = t2 & 0x3f03fff;
+	st->r[3] = t2 & 0x3f03fff;
 	t3 >>= 8;
-	r4 = t3 & 0x00fffff;
-
-	s1 = r1 * 5;
-	s2 = r2 * 5;
-	s3 = r3 * 5;
-	s4 = r4 * 5;
+	st->r[4] = t3 & 0x00fffff;
 
 	/* init state */
-	h0 = 0;
-	h1 = 0;
-	h2 = 0;
-	h3 = 0;
-	h4 = 0;
-
-	/* full blocks */
-	if(inlen < 16) {
-		goto poly1305_donna_atmost15bytes;
-	}
+	st->h[0] = 0;
+	st->h[1] = 0;
+	st->h[2] = 0;
+	st->h[3] = 0;
+	st->h[4] = 0;
 
-poly1305_donna_16bytes:
-	m += 16;
-	inlen -= 16;
-
-	t0 = U8TO32_LE(m - 16);
-	t1 = U8TO32_LE(m - 12);
-	t2 = U8TO32_LE(m - 8);
-	t3 = U8TO32_LE(m - 4);
+	st->powers = false;
+	st->lanes = false;
+}
 
-	h0 += t0 & 0x3ffffff;
-	h1 += ((((uint64_t) t1 << 32) | t0) >> 26) & 0x3ffffff;
-	h2 += ((((uint64_t) t2 << 32) | t1) >> 20) & 0x3ffffff;
-	h3 += ((((uint64_t) t3 << 32) | t2) >> 14) & 0x3ffffff;
-	h4 += (t3 >> 8) | (1 << 24);
+/* h = h * r, partially reduced */
+void
+poly1305_mul(uint32_t h[5], const uint32_t r[5]) {
+	uint32_t h0 = h[0], h1 = h[1], h2 = h[2], h3 = h[3], h4 = h[4];
+	uint32_t r0 = r[0], r1 = r[1], r2 = r[2], r3 = r[3], r4 = r[4];
+	uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+	uint64_t t[5];
+	uint64_t c;
 
-poly1305_donna_mul:
 	t[0] = mul32x32_64(h0, r0) + mul32x32_64(h1, s4) + mul32x32_64(h2, s3) + mul32x32_64(h3, s2) + mul32x32_64(h4, s1);
 	t[1] = mul32x32_64(h0, r1) + mul32x32_64(h1, r0) + mul32x32_64(h2, s4) + mul32x32_64(h3, s3) + mul32x32_64(h4, s2);
 	t[2] = mul32x32_64(h0, r2) + mul32x32_64(h1, r1) + mul32x32_64(h2, r0) + mul32x32_64(h3, s4) + mul32x32_64(h4, s3);
 	t[3] = mul32x32_64(h0, r3) + mul32x32_64(h1, r2) + mul32x32_64(h2, r1) + mul32x32_64(h3, r0) + mul32x32_64(h4, s4);
 	t[4] = mul32x32_64(h0, r4) + mul32x32_64(h1, r3) + mul32x32_64(h2, r2) + mul32x32_64(h3, r1) + mul32x32_64(h4, r0);
 
+	/* carry in 64 bits, since powers of r have larger limbs than a clamped r */
 	h0 = (uint32_t) t[0] & 0x3ffffff;
 	c = (t[0] >> 26);
 	t[1] += c;
 	h1 = (uint32_t) t[1] & 0x3ffffff;
-	b = (uint32_t)(t[1] >> 26);
-	t[2] += b;
+	c = (t[1] >> 26);
+	t[2] += c;
 	h2 = (uint32_t) t[2] & 0x3ffffff;
-	b = (uint32_t)(t[2] >> 26);
-	t[3] += b;
+	c = (t[2] >> 26);
+	t[3] += c;
 	h3 = (uint32_t) t[3] & 0x3ffffff;
-	b = (uint32_t)(t[3] >> 26);
-	t[4] += b;
+	c = (t[3] >> 26);
+	t[4] += c;
 	h4 = (uint32_t) t[4] & 0x3ffffff;
-	b = (uint32_t)(t[4] >> 26);
-	h0 += b * 5;
+	c = (t[4] >> 26) * 5 + h0;
+	h0 = (uint32_t) c & 0x3ffffff;
+	h1 += (uint32_t)(c >> 26);
 
-	if(inlen >= 16) {
-		goto poly1305_donna_16bytes;
+	h[0] = h0;
+	h[1] = h1;
+	h[2] = h2;
+	h[3] = h3;
+	h[4] = h4;
+}
+
+static void
+poly1305_block(poly1305_state_t *st, const unsigned char m[16], uint32_t hibit) {
+	uint32_t t0, t1, t2, t3;
+
+	t0 = U8TO32_LE(m + 0);
+	t1 = U8TO32_LE(m + 4);
+	t2 = U8TO32_LE(m + 8);
+	t3 = U8TO32_LE(m + 12);
+
+	st->h[0] += t0 & 0x3ffffff;
+	st->h[1] += ((((uint64_t) t1 << 32) | t0) >> 26) & 0x3ffffff;
+	st->h[2] += ((((uint64_t) t2 << 32) | t1) >> 20) & 0x3ffffff;
+	st->h[3] += ((((uint64_t) t3 << 32) | t2) >> 14) & 0x3ffffff;
+	st->h[4] += (t3 >> 8) | hibit;
+
+	poly1305_mul(st->h, st->r);
+}
+
+/*
+ * The vectorized implementations process four interleaved blocks at a time,
+ * and keep four accumulators where the last multiplication is still pending.
+ * Fold them back into h, with lane i multiplied by r^(4-i).
+ */
+void
+poly1305_combine(poly1305_state_t *st) {
+	uint64_t t[5] = {0};
+	uint64_t c;
+
+	if(!st->lanes) {
+		return;
 	}
 
-	/* final bytes */
-poly1305_donna_atmost15bytes:
+	for(int i = 0; i < 4; i++) {
+		uint32_t lane[5];
+		memcpy(lane, st->hn[i], sizeof(lane));
+		poly1305_mul(lane, st->rn[3 - i]);
+
+		for(int j = 0; j < 5; j++) {
+			t[j] += lane[j];
+		}
+	}
+
+	c = t[0] >> 26;
+	t[0] &= 0x3ffffff;
+	t[1] += c;
+	c = t[1] >> 26;
+	t[1] &= 0x3ffffff;
+	t[2] += c;
+	c = t[2] >> 26;
+	t[2] &= 0x3ffffff;
+	t[3] += c;
+	c = t[3] >> 26;
+	t[3] &= 0x3ffffff;
+	t[4] += c;
+	c = t[4] >> 26;
+	t[4] &= 0x3ffffff;
+	t[0] += c * 5;
+	c = t[0] >> 26;
+	t[0] &= 0x3ffffff;
+	t[1] += c;
+
+	for(int j = 0; j < 5; j++) {
+		st->h[j] = (uint32_t)t[j];
+	}
+
+	st->lanes = false;
+}
 
+/* Process full blocks only, len must be a multiple of 16 */
+void
+poly1305_blocks(poly1305_state_t *st, const unsigned char *m, size_t len) {
+	poly1305_combine(st);
+
+	for(; len >= 16; m += 16, len -= 16) {
+		poly1305_block(st, m, 1 << 24);
+	}
+}
+
+/* Process the message. A trailing partial block is padded, so this must be the last call before poly1305_finish(), even if inlen is 0. */
+void
+poly1305_update(poly1305_state_t *st, const unsigned char *m, size_t inlen) {
+	size_t j;
+	unsigned char mp[16];
+	size_t full = inlen & ~(size_t)15;
+
+	poly1305_blocks(st, m, full);
+	m += full;
+	inlen -= full;
+
+	/* final bytes */
 	if(!inlen) {
-		goto poly1305_donna_finish;
+		return;
 	}
 
 	for(j = 0; j < inlen; j++) {
@@ -133,22 +202,16 @@ poly1305_donna_atmost15bytes:
 		mp[j] = 0;
 	}
 
-	inlen = 0;
-
-	t0 = U8TO32_LE(mp + 0);
-	t1 = U8TO32_LE(mp + 4);
-	t2 = U8TO32_LE(mp + 8);
-	t3 = U8TO32_LE(mp + 12);
-
-	h0 += t0 & 0x3ffffff;
-	h1 += ((((uint64_t) t1 << 32) | t0) >> 26) & 0x3ffffff;
-	h2 += ((((uint64_t) t2 << 32) | t1) >> 20) & 0x3ffffff;
-	h3 += ((((uint64_t) t3 << 32) | t2) >> 14) & 0x3ffffff;
-	h4 += (t3 >> 8);
+	poly1305_block(st, mp, 0);
+}
 
-	goto poly1305_donna_mul;
+void
+poly1305_finish(const poly1305_state_t *st, unsigned char out[POLY1305_TAGLEN], const unsigned char key[POLY1305_KEYLEN]) {
+	uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3], h4 = st->h[4];
+	uint32_t g0, g1, g2, g3, g4;
+	uint32_t b, nb;
+	uint64_t f0, f1, f2, f3;
 
-poly1305_donna_finish:
 	b = h0 >> 26;
 	h0 = h0 & 0x3ffffff;
 	h1 += b;
@@ -203,3 +266,12 @@ poly1305_donna_finish:
 	f3 += (f2 >> 32);
 	U32TO8_LE(&out[12], f3);
 }
+
+void
+poly1305_auth(unsigned char out[POLY1305_TAGLEN], const unsigned char *m, size_t inlen, const unsigned char key[POLY1305_KEYLEN]) {
+	poly1305_state_t st;
+
+	poly1305_setup(&st, key);
+	poly1305_update(&st, m, inlen);
+	poly1305_finish(&st, out, key);
+}
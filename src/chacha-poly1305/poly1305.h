@@ -11,6 +11,24 @@
 #define POLY1305_KEYLEN         32
 #define POLY1305_TAGLEN         16
 
+typedef struct poly1305_state_t {
+	uint32_t r[5];
+	uint32_t h[5];
+	/* Used by the vectorized implementations */
+	bool powers;            /* rn[i] holds r^(i+1) */
+	bool lanes;             /* the accumulator is split over hn, see poly1305_combine() */
+	uint32_t rn[4][5];
+	uint32_t hn[4][5];
+} poly1305_state_t;
+
 void poly1305_auth(uint8_t out[POLY1305_TAGLEN], const uint8_t *m, size_t inlen, const uint8_t key[POLY1305_KEYLEN]);
 
+/* Incremental interface, used by the vectorized implementations to process the tail */
+void poly1305_setup(poly1305_state_t *st, const uint8_t key[POLY1305_KEYLEN]);
+void poly1305_mul(uint32_t h[5], const uint32_t r[5]);
+void poly1305_combine(poly1305_state_t *st);
+void poly1305_blocks(poly1305_state_t *st, const uint8_t *m, size_t len);
+void poly1305_update(poly1305_state_t *st, const uint8_t *m, size_t inlen);
+void poly1305_finish(const poly1305_state_t *st, uint8_t out[POLY1305_TAGLEN], const uint8_t key[POLY1305_KEYLEN]);
+
 #endif                          /* POLY1305_H */
@@ -0,0 +1,165 @@
+/*
+ * Poly1305 using AVX2, processing four blocks in parallel.
+ *
+ * Each 64-bit lane holds one accumulator in radix 2^26, and lane i processes
+ * blocks 4k + i. All lanes are multiplied by r^4 before adding the next four
+ * blocks. The last multiplication, of lane i by r^(4-i), is left to
+ * poly1305_combine(), so the lanes can be kept across calls.
+ */
+
+#include "../system.h"
+
+#include <immintrin.h>
+
+#include "kernel.h"
+
+#define TARGET __attribute__((target("avx2")))
+
+typedef struct poly1305_vec {
+	__m256i v[5];
+} poly1305_vec_t;
+
+TARGET static inline poly1305_vec_t poly1305_load_avx2(const uint8_t *m) {
+	const __m256i mask = _mm256_set1_epi64x(0x3ffffff);
+	__m256i a = _mm256_loadu_si256((const __m256i *)m);
+	__m256i b = _mm256_loadu_si256((const __m256i *)(m + 32));
+
+	/* lo holds bytes 0-7 of each block, hi bytes 8-15 */
+	__m256i lo = _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(a, b), 0xd8);
+	__m256i hi = _mm256_permute4x64_epi64(_mm256_unpackhi_epi64(a, b), 0xd8);
+
+	poly1305_vec_t r;
+	r.v[0] = _mm256_and_si256(lo, mask);
+	r.v[1] = _mm256_and_si256(_mm256_srli_epi64(lo, 26), mask);
+	r.v[2] = _mm256_and_si256(_mm256_or_si256(_mm256_srli_epi64(lo, 52), _mm256_slli_epi64(hi, 12)), mask);
+	r.v[3] = _mm256_and_si256(_mm256_srli_epi64(hi, 14), mask);
+	r.v[4] = _mm256_or_si256(_mm256_srli_epi64(hi, 40), _mm256_set1_epi64x(1 << 24));
+	return r;
+}
+
+/* h = h * r, partially reduced */
+TARGET static inline void poly1305_mul_avx2(poly1305_vec_t *h, const poly1305_vec_t *r, const poly1305_vec_t *s) {
+	const __m256i mask = _mm256_set1_epi64x(0x3ffffff);
+	__m256i h0 = h->v[0];
+	__m256i h1 = h->v[1];
+	__m256i h2 = h->v[2];
+	__m256i h3 = h->v[3];
+	__m256i h4 = h->v[4];
+
+#define MUL(a, b) _mm256_mul_epu32(a, b)
+#define ADD5(a, b, c, d, e) _mm256_add_epi64(_mm256_add_epi64(_mm256_add_epi64(a, b), _mm256_add_epi64(c, d)), e)
+	__m256i t0 = ADD5(MUL(h0, r->v[0]), MUL(h1, s->v[4]), MUL(h2, s->v[3]), MUL(h3, s->v[2]), MUL(h4, s->v[1]));
+	__m256i t1 = ADD5(MUL(h0, r->v[1]), MUL(h1, r->v[0]), MUL(h2, s->v[4]), MUL(h3, s->v[3]), MUL(h4, s->v[2]));
+	__m256i t2 = ADD5(MUL(h0, r->v[2]), MUL(h1, r->v[1]), MUL(h2, r->v[0]), MUL(h3, s->v[4]), MUL(h4, s->v[3]));
+	__m256i t3 = ADD5(MUL(h0, r->v[3]), MUL(h1, r->v[2]), MUL(h2, r->v[1]), MUL(h3, r->v[0]), MUL(h4, s->v[4]));
+	__m256i t4 = ADD5(MUL(h0, r->v[4]), MUL(h1, r->v[3]), MUL(h2, r->v[2]), MUL(h3, r->v[1]), MUL(h4, r->v[0]));
+#undef MUL
+#undef ADD5
+
+	__m256i c;
+	t1 = _mm256_add_epi64(t1, _mm256_srli_epi64(t0, 26));
+	t0 = _mm256_and_si256(t0, mask);
+	t2 = _mm256_add_epi64(t2, _mm256_srli_epi64(t1, 26));
+	t1 = _mm256_and_si256(t1, mask);
+	t3 = _mm256_add_epi64(t3, _mm256_srli_epi64(t2, 26));
+	t2 = _mm256_and_si256(t2, mask);
+	t4 = _mm256_add_epi64(t4, _mm256_srli_epi64(t3, 26));
+	t3 = _mm256_and_si256(t3, mask);
+	c = _mm256_srli_epi64(t4, 26);
+	t4 = _mm256_and_si256(t4, mask);
+	t0 = _mm256_add_epi64(t0, _mm256_add_epi64(c, _mm256_slli_epi64(c, 2)));
+	t1 = _mm256_add_epi64(t1, _mm256_srli_epi64(t0, 26));
+	t0 = _mm256_and_si256(t0, mask);
+
+	h->v[0] = t0;
+	h->v[1] = t1;
+	h->v[2] = t2;
+	h->v[3] = t3;
+	h->v[4] = t4;
+}
+
+TARGET static inline void poly1305_add_avx2(poly1305_vec_t *h, const poly1305_vec_t *m) {
+	for(int j = 0; j < 5; j++) {
+		h->v[j] = _mm256_add_epi64(h->v[j], m->v[j]);
+	}
+}
+
+/* Process a multiple of 64 bytes */
+TARGET static void poly1305_vec_blocks_avx2(poly1305_state_t *st, const uint8_t *m, size_t len) {
+	uint32_t (*r)[5] = st->rn;
+
+	/* r[i] = r^(i+1) */
+	if(!st->powers) {
+		memcpy(r[0], st->r, sizeof(r[0]));
+		memcpy(r[1], st->r, sizeof(r[1]));
+		poly1305_mul(r[1], st->r);
+		memcpy(r[2], r[1], sizeof(r[2]));
+		poly1305_mul(r[2], st->r);
+		memcpy(r[3], r[1], sizeof(r[3]));
+		poly1305_mul(r[3], r[1]);
+		st->powers = true;
+	}
+
+	poly1305_vec_t r4, s4, h;
+
+	for(int j = 0; j < 5; j++) {
+		r4.v[j] = _mm256_set1_epi64x(r[3][j]);
+		s4.v[j] = _mm256_set1_epi64x(r[3][j] * 5ULL);
+	}
+
+	if(st->lanes) {
+		for(int j = 0; j < 5; j++) {
+			h.v[j] = _mm256_set_epi64x(st->hn[3][j], st->hn[2][j], st->hn[1][j], st->hn[0][j]);
+		}
+	} else {
+		/* The current state goes into the first lane */
+		h = poly1305_load_avx2(m);
+		m += 64;
+		len -= 64;
+
+		for(int j = 0; j < 5; j++) {
+			h.v[j] = _mm256_add_epi64(h.v[j], _mm256_set_epi64x(0, 0, 0, st->h[j]));
+		}
+	}
+
+	for(; len; m += 64, len -= 64) {
+		poly1305_vec_t mv = poly1305_load_avx2(m);
+		poly1305_mul_avx2(&h, &r4, &s4);
+		poly1305_add_avx2(&h, &mv);
+	}
+
+	for(int j = 0; j < 5; j++) {
+		uint64_t lanes[4];
+		_mm256_storeu_si256((__m256i *)lanes, h.v[j]);
+
+		for(int i = 0; i < 4; i++) {
+			st->hn[i][j] = (uint32_t)lanes[i];
+		}
+	}
+
+	st->lanes = true;
+}
+
+void poly1305_blocks_avx2(poly1305_state_t *st, const uint8_t *m, size_t len) {
+	/* Short messages are not worth the setup cost */
+	if(len >= 128 || (st->lanes && len >= 64)) {
+		size_t vlen = len & ~(size_t)63;
+		poly1305_vec_blocks_avx2(st, m, vlen);
+		m += vlen;
+		len -= vlen;
+	}
+
+	if(len) {
+		poly1305_blocks(st, m, len);
+	}
+}
+
+void poly1305_auth_avx2(uint8_t out[POLY1305_TAGLEN], const uint8_t *m, size_t inlen, const uint8_t key[POLY1305_KEYLEN]) {
+	poly1305_state_t st;
+	size_t full = inlen & ~(size_t)15;
+
+	poly1305_setup(&st, key);
+	poly1305_blocks_avx2(&st, m, full);
+	poly1305_update(&st, m + full, inlen - full);
+	poly1305_finish(&st, out, key);
+}
@@ -0,0 +1,75 @@
+#include "system.h"
+
+#include "checksum.h"
+
+// Fold a 64 bit ones' complement sum to 16 bits
+static uint16_t fold(uint64_t sum) {
+	sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+	sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	return (uint16_t)sum;
+}
+
+// The ones' complement sum does not depend on the size of the words that are
+// added, as long as carries wrap around, so add 64 bits at a time.
+uint16_t inet_checksum(const void *vdata, size_t len, uint16_t prevsum) {
+	const uint8_t *data = vdata;
+	uint64_t sum = (uint16_t)~prevsum;
+	uint64_t word;
+
+	// Two independent accumulators let the additions overlap
+	uint64_t sum2 = 0;
+
+	while(len >= 16) {
+		uint64_t word2;
+		memcpy(&word, data, sizeof(word));
+		memcpy(&word2, data + 8, sizeof(word2));
+		sum += word;
+		sum += sum < word;
+		sum2 += word2;
+		sum2 += sum2 < word2;
+		data += 16;
+		len -= 16;
+	}
+
+	sum += sum2;
+	sum += sum < sum2;
+
+	if(len >= 8) {
+		memcpy(&word, data, sizeof(word));
+		sum += word;
+		sum += sum < word;
+		data += 8;
+		len -= 8;
+	}
+
+	// Sums of 32 bit and smaller values cannot overflow after folding
+	sum = fold(sum);
+
+	if(len >= 4) {
+		uint32_t word32;
+		memcpy(&word32, data, sizeof(word32));
+		sum += word32;
+		data += 4;
+		len -= 4;
+	}
+
+	uint16_t word16;
+
+	if(len >= 2) {
+		memcpy(&word16, data, sizeof(word16));
+		sum += word16;
+		data += 2;
+		len -= 2;
+	}
+
+	// A trailing byte is padded with a zero byte
+	if(len) {
+		uint8_t tail[2] = {*data, 0};
+		memcpy(&word16, tail, sizeof(word16));
+		sum += word16;
+	}
+
+	return (uint16_t)~fold(sum);
+}
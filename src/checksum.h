@@ -0,0 +1,24 @@
+#ifndef TINC_CHECKSUM_H
+#define TINC_CHECKSUM_H
+
+#include "system.h"
+
+// The Internet checksum (RFC 1071), as used by IPv4, ICMP, ICMPv6, TCP and UDP.
+
+// Checksum len bytes of data, continuing from a previous result. Start with 0xFFFF.
+// The result is in the same byte order as the data, so it can be stored as is.
+// Only the last block of a series may have an odd length.
+extern uint16_t inet_checksum(const void *data, size_t len, uint16_t prevsum);
+
+// Update a checksum after a 16 bit word it covers changed from old to new (RFC 1624).
+// All three values must be in the same byte order.
+static inline uint16_t inet_checksum_update(uint16_t checksum, uint16_t old, uint16_t new) {
+	uint32_t sum = (uint16_t)~checksum;
+	sum += (uint16_t)~old;
+	sum += new;
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum += sum >> 16;
+	return (uint16_t)~sum;
+}
+
+#endif
@@ -22,6 +22,7 @@
 #include "system.h"
 
 #include "list.h"
+#include "capture.h"
 #include "cipher.h"
 #include "conf.h"
 #include "control_common.h"
@@ -131,6 +132,8 @@ void free_connection(connection_t *c) {
 	free(c->hischallenge);
 	free(c->mychallenge);
 
+	capture_stop(c);
+
 	buffer_clear(&c->inbuf);
 	buffer_clear(&c->outbuf);
 
@@ -53,6 +53,7 @@ typedef union connection_status_t {
 		bool invitation: 1;             /* 1 if this is an invitation */
 		bool invitation_used: 1;        /* 1 if the invitation has been consumed */
 		bool tarpit: 1;                 /* 1 if the connection should be added to the tarpit */
+		bool snapshot: 1;               /* 1 if we are receiving a snapshot, and graph() is held back */
 	};
 	uint32_t value;
 } connection_status_t;
@@ -110,6 +111,7 @@ typedef struct connection_t {
 
 	int outmaclength;
 	debug_t log_level;              /* used for REQ_LOG */
+	struct capture_t *capture;      /* used for REQ_PCAP */
 
 	uint8_t *hischallenge;          /* The challenge we sent to him */
 	uint8_t *mychallenge;           /* The challenge we received */
@@ -120,6 +122,8 @@ typedef struct connection_t {
 	uint32_t tcplen;                /* length of incoming TCPpacket */
 	uint32_t sptpslen;              /* length of incoming SPTPS packet */
 	int allow_request;              /* defined if there's only one request possible */
+	uint64_t snapshot_graph_runs;   /* graph_runs when the snapshot being received started */
+	timeout_t snapshot_timeout;     /* drops the connection if the snapshot does not end in time */
 
 	time_t last_ping_time;          /* last time we saw some activity from the other end or pinged them */
 
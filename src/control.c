@@ -18,15 +18,21 @@
 */
 
 #include "system.h"
+#include "capture.h"
 #include "conf.h"
 #include "control.h"
 #include "control_common.h"
+#include "crypto_pool.h"
+#include "device_workers.h"
+#include "graph.h"
 #include "logger.h"
+#include "log_queue.h"
 #include "names.h"
 #include "net.h"
 #include "netutl.h"
 #include "protocol.h"
 #include "route.h"
+#include "subnet.h"
 #include "utils.h"
 #include "xalloc.h"
 #include "random.h"
@@ -42,6 +48,90 @@ static bool control_ok(connection_t *c, int type) {
 	return control_return(c, type, 0);
 }
 
+static bool dump_stat(connection_t *c, const char *name, uint64_t value) {
+	return send_request(c, "%d %d %s %"PRIu64, CONTROL, REQ_DUMP_STATS, name, value);
+}
+
+static bool dump_stats(connection_t *c) {
+#ifdef HAVE_DEVICE_WORKERS
+	device_workers_harvest();
+#endif
+
+	dump_stat(c, "device_read_batches", device_read_batches);
+	dump_stat(c, "device_read_packets", device_read_packets);
+	dump_stat(c, "udp_send_batches", udp_send_batches);
+	dump_stat(c, "udp_send_packets", udp_send_packets);
+	dump_stat(c, "udp_gso_packets", udp_gso_packets);
+	dump_stat(c, "udp_gro_packets", udp_gro_packets);
+
+	hash_stats_t cache;
+	subnet_cache_stats(&cache);
+	dump_stat(c, "subnet_cache_hits", cache.hits);
+	dump_stat(c, "subnet_cache_misses", cache.misses);
+	dump_stat(c, "subnet_cache_evictions", cache.evictions);
+	dump_stat(c, "subnet_cache_flushes", cache.flushes);
+	dump_stat(c, "subnet_cache_resizes", cache.resizes);
+	dump_stat(c, "subnet_cache_entries", cache.entries);
+	dump_stat(c, "subnet_cache_size", cache.size);
+
+	route_cache_stats(&cache);
+	dump_stat(c, "route_cache_hits", cache.hits);
+	dump_stat(c, "route_cache_misses", cache.misses);
+	dump_stat(c, "route_cache_flushes", cache.flushes);
+	dump_stat(c, "route_cache_entries", cache.entries);
+	dump_stat(c, "route_batch_packets", route_batch_packets);
+	dump_stat(c, "route_batch_groups", route_batch_groups);
+
+	dump_stat(c, "past_request_entries", dedup_entries(&past_requests));
+	dump_stat(c, "past_request_slots", dedup_size(&past_requests));
+	dump_stat(c, "past_request_duplicates", past_requests.duplicates);
+	dump_stat(c, "past_request_rotations", past_requests.rotations);
+	dump_stat(c, "past_request_overflows", past_requests.overflows);
+
+	dump_stat(c, "graph_runs", graph_runs);
+	dump_stat(c, "graph_coalesced", graph_coalesced);
+
+	dump_stat(c, "snapshot_records_sent", snapshot_records_sent);
+	dump_stat(c, "snapshot_records_received", snapshot_records_received);
+	dump_stat(c, "snapshot_requests_received", snapshot_requests_received);
+	dump_stat(c, "snapshots_received", snapshots_received);
+	dump_stat(c, "snapshot_graph_runs", snapshot_graph_runs);
+
+#ifdef HAVE_LINUX
+	dump_stat(c, "epoll_ctl_calls", epoll_ctl_calls);
+	dump_stat(c, "epoll_wait_calls", epoll_wait_calls);
+	dump_stat(c, "epoll_direct_writes", epoll_direct_writes);
+#endif
+
+#ifdef HAVE_IO_URING
+	dump_stat(c, "io_uring_enter_calls", io_uring_enter_calls);
+	dump_stat(c, "io_uring_submissions", io_uring_submissions);
+	dump_stat(c, "io_uring_recv_packets", io_uring_recv_packets);
+	dump_stat(c, "io_uring_read_packets", io_uring_read_packets);
+	dump_stat(c, "io_uring_write_packets", io_uring_write_packets);
+#endif
+
+#ifdef HAVE_CRYPTO_POOL
+	dump_stat(c, "crypto_jobs", crypto_jobs);
+	dump_stat(c, "crypto_stalls", crypto_stalls);
+#endif
+
+#ifdef HAVE_DEVICE_WORKERS
+	dump_stat(c, "device_worker_packets", device_worker_packets);
+	dump_stat(c, "device_worker_handoffs", device_worker_handoffs);
+	dump_stat(c, "device_worker_drops", device_worker_drops);
+	dump_stat(c, "device_worker_snapshots", device_worker_snapshots);
+#endif
+
+#ifdef HAVE_LOG_QUEUE
+	dump_stat(c, "log_queue_records", log_queue_records);
+	dump_stat(c, "log_queue_deferred", log_queue_deferred);
+	dump_stat(c, "log_queue_dropped", log_queue_dropped);
+#endif
+
+	return send_request(c, "%d %d", CONTROL, REQ_DUMP_STATS);
+}
+
 bool control_h(connection_t *c, const char *request) {
 	int type;
 
@@ -124,11 +214,14 @@ bool control_h(connection_t *c, const char *request) {
 	case REQ_DUMP_TRAFFIC:
 		return dump_traffic(c);
 
+	case REQ_DUMP_STATS:
+		return dump_stats(c);
+
 	case REQ_PCAP:
-		sscanf(request, "%*d %*d %d", &c->outmaclength);
-		c->status.pcap = true;
-		pcap = true;
-		return true;
+		return capture_start(c, request, false);
+
+	case REQ_PCAP_RING:
+		return capture_start(c, request, true);
 
 	case REQ_LOG: {
 		int level = 0, colorize = 0;
@@ -41,6 +41,8 @@ enum request_type {
 	REQ_DUMP_TRAFFIC,
 	REQ_PCAP,
 	REQ_LOG,
+	REQ_DUMP_STATS,
+	REQ_PCAP_RING,
 };
 
 #define TINC_CTL_VERSION_CURRENT 0
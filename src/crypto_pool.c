@@ -0,0 +1,357 @@
+#include "system.h"
+
+#include <pthread.h>
+
+#include "crypto_pool.h"
+#include "event.h"
+#include "logger.h"
+#include "sptps.h"
+#include "xalloc.h"
+
+// Maximum number of datagrams in flight in each direction
+#define CRYPTO_RING_SIZE 256
+
+// Jobs are handed to the workers in order, and delivered in the same order.
+// [head, next) are being processed or finished, [next, tail) are waiting for a worker.
+// Only the main thread advances head and tail.
+typedef struct crypto_ring_t {
+	crypto_job_t *jobs;
+	bool finished[CRYPTO_RING_SIZE];
+	size_t head;
+	size_t next;
+	size_t tail;
+} crypto_ring_t;
+
+uint64_t crypto_jobs;
+uint64_t crypto_stalls;
+
+static crypto_ring_t send_ring;
+static crypto_ring_t receive_ring;
+
+static pthread_t *workers;
+static int nworkers;
+static bool running;
+static bool notified;
+static unsigned int turn;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t finished_cond = PTHREAD_COND_INITIALIZER;
+
+static int pipefd[2] = {-1, -1};
+static io_t pool_io;
+static bool delivering;
+
+static crypto_job_t *next_job(crypto_ring_t **ring, size_t *seq) {
+	crypto_ring_t *rings[2] = {&send_ring, &receive_ring};
+
+	for(int i = 0; i < 2; i++) {
+		crypto_ring_t *r = rings[(turn + i) % 2];
+
+		if(r->next != r->tail) {
+			turn++;
+			*ring = r;
+			*seq = r->next++;
+			return &r->jobs[*seq % CRYPTO_RING_SIZE];
+		}
+	}
+
+	return NULL;
+}
+
+static void *crypto_worker(void *arg) {
+	(void)arg;
+
+	pthread_mutex_lock(&lock);
+
+	while(running) {
+		crypto_ring_t *ring;
+		size_t seq;
+		crypto_job_t *job = next_job(&ring, &seq);
+
+		if(!job) {
+			pthread_cond_wait(&queued_cond, &lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&lock);
+
+		if(job->encrypt) {
+			sptps_seal_datagram(job->cipher, job->data, (uint16_t)job->len);
+		} else {
+			job->verified = sptps_open_datagram(job->cipher, job->data, job->len, &job->outlen);
+		}
+
+		pthread_mutex_lock(&lock);
+		ring->finished[seq % CRYPTO_RING_SIZE] = true;
+
+		// Only the oldest job can be delivered, so only wake up the main thread for that one.
+		if(seq == ring->head) {
+			if(!notified) {
+				notified = true;
+				char c = 0;
+
+				if(write(pipefd[1], &c, 1) != 1) {
+					// The pipe is never full, and the main thread drains it anyway.
+				}
+			}
+
+			pthread_cond_broadcast(&finished_cond);
+		}
+	}
+
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+static void deliver(crypto_job_t *job) {
+	if(!job->node) {
+		return;
+	}
+
+	if(job->encrypt) {
+		sptps_t *s = &job->node->sptps;
+		delivering = true;
+		s->send_data(s->handle, job->type, job->data, job->len + 21UL);
+		delivering = false;
+	} else {
+		job->done(job);
+	}
+}
+
+// Deliver finished jobs in order. If wait is set, wait for at least one job to finish.
+static void deliver_ring(crypto_ring_t *ring, bool wait) {
+	while(ring->head != ring->tail) {
+		size_t i = ring->head % CRYPTO_RING_SIZE;
+
+		pthread_mutex_lock(&lock);
+
+		while(wait && !ring->finished[i]) {
+			pthread_cond_wait(&finished_cond, &lock);
+		}
+
+		bool ready = ring->finished[i];
+		ring->finished[i] = false;
+		pthread_mutex_unlock(&lock);
+
+		if(!ready) {
+			break;
+		}
+
+		wait = false;
+		deliver(&ring->jobs[i]);
+
+		pthread_mutex_lock(&lock);
+		ring->head++;
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+static void crypto_pool_handler(void *data, int flags) {
+	(void)data;
+	(void)flags;
+
+	char buf[16];
+
+	if(read(pipefd[0], buf, sizeof(buf)) <= 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	notified = false;
+	pthread_mutex_unlock(&lock);
+
+	deliver_ring(&send_ring, false);
+	deliver_ring(&receive_ring, false);
+}
+
+// Get the next free job in a ring. If the ring is full, wait for the oldest job and deliver it.
+// Delivering received datagrams can queue new datagrams to send, but never the other way around,
+// so the rings are kept separate to make this safe to call from within a delivery.
+static crypto_job_t *reserve_job(crypto_ring_t *ring) {
+	if(ring->tail - ring->head >= CRYPTO_RING_SIZE) {
+		crypto_stalls++;
+		deliver_ring(ring, true);
+	}
+
+	return &ring->jobs[ring->tail % CRYPTO_RING_SIZE];
+}
+
+static void queue_job(crypto_ring_t *ring) {
+	pthread_mutex_lock(&lock);
+	ring->tail++;
+	pthread_cond_signal(&queued_cond);
+	pthread_mutex_unlock(&lock);
+
+	crypto_jobs++;
+}
+
+bool crypto_pool_send(node_t *n, uint8_t type, const void *data, uint16_t len) {
+	sptps_t *s = &n->sptps;
+
+	if(!nworkers || !s->datagram || !s->outstate || len + 21UL > MAXSIZE) {
+		return false;
+	}
+
+	crypto_job_t *job = reserve_job(&send_ring);
+
+	if(sptps_prepare_datagram(s, type, data, len, job->data)) {
+		chacha_poly1305_copy(job->cipher, s->outcipher);
+		job->node = n;
+		job->encrypt = true;
+		job->type = type;
+		job->len = len;
+		queue_job(&send_ring);
+	}
+
+	return true;
+}
+
+bool crypto_pool_receive(node_t *n, node_t *via, size_t sock, const sockaddr_t *addr, bool direct, const void *data, size_t len, crypto_done_t done) {
+	sptps_t *s = &n->sptps;
+
+	if(!nworkers || !s->datagram || !s->instate || len < 21 || len > MAXSIZE) {
+		return false;
+	}
+
+	crypto_job_t *job = reserve_job(&receive_ring);
+
+	memcpy(job->data, data, len);
+	chacha_poly1305_copy(job->cipher, s->incipher);
+	job->node = n;
+	job->via = via;
+	job->done = done;
+	job->addr = *addr;
+	job->sock = sock;
+	job->direct = direct;
+	job->encrypt = false;
+	job->len = len;
+	queue_job(&receive_ring);
+
+	return true;
+}
+
+void crypto_pool_flush(const node_t *n) {
+	if(!nworkers || delivering) {
+		return;
+	}
+
+	size_t last = send_ring.tail;
+
+	for(size_t seq = send_ring.head; seq != send_ring.tail; seq++) {
+		if(send_ring.jobs[seq % CRYPTO_RING_SIZE].node == n) {
+			last = seq;
+		}
+	}
+
+	if(last == send_ring.tail) {
+		return;
+	}
+
+	while(send_ring.head <= last) {
+		deliver_ring(&send_ring, true);
+	}
+}
+
+static void cancel_ring(crypto_ring_t *ring, const node_t *n) {
+	for(size_t seq = ring->head; seq != ring->tail; seq++) {
+		crypto_job_t *job = &ring->jobs[seq % CRYPTO_RING_SIZE];
+
+		if(job->node == n || job->via == n) {
+			job->node = NULL;
+		}
+	}
+}
+
+void crypto_pool_cancel(const node_t *n) {
+	cancel_ring(&send_ring, n);
+	cancel_ring(&receive_ring, n);
+}
+
+static void init_ring(crypto_ring_t *ring) {
+	memset(ring, 0, sizeof(*ring));
+	ring->jobs = xzalloc(CRYPTO_RING_SIZE * sizeof(*ring->jobs));
+
+	for(size_t i = 0; i < CRYPTO_RING_SIZE; i++) {
+		ring->jobs[i].cipher = chacha_poly1305_init();
+	}
+}
+
+static void exit_ring(crypto_ring_t *ring) {
+	if(ring->jobs) {
+		for(size_t i = 0; i < CRYPTO_RING_SIZE; i++) {
+			chacha_poly1305_exit(ring->jobs[i].cipher);
+		}
+
+		xzfree(ring->jobs, CRYPTO_RING_SIZE * sizeof(*ring->jobs));
+	}
+
+	memset(ring, 0, sizeof(*ring));
+}
+
+bool crypto_pool_start(int threads) {
+	if(nworkers || threads <= 0) {
+		return true;
+	}
+
+	if(pipe(pipefd)) {
+		logger(DEBUG_ALWAYS, LOG_ERR, "Could not create pipe for crypto threads: %s", strerror(errno));
+		return false;
+	}
+
+#ifdef FD_CLOEXEC
+	fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(pipefd[1], F_SETFD, FD_CLOEXEC);
+#endif
+
+	init_ring(&send_ring);
+	init_ring(&receive_ring);
+	workers = xzalloc(threads * sizeof(*workers));
+	running = true;
+
+	for(; nworkers < threads; nworkers++) {
+		int err = pthread_create(&workers[nworkers], NULL, crypto_worker, NULL);
+
+		if(err) {
+			logger(DEBUG_ALWAYS, LOG_ERR, "Unable to start crypto thread: [%d] %s", err, strerror(err));
+			crypto_pool_stop();
+			return false;
+		}
+	}
+
+	io_add(&pool_io, crypto_pool_handler, NULL, pipefd[0], IO_READ);
+
+	logger(DEBUG_ALWAYS, LOG_INFO, "Started %d crypto threads", nworkers);
+	return true;
+}
+
+void crypto_pool_stop(void) {
+	if(!workers) {
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	running = false;
+	pthread_cond_broadcast(&queued_cond);
+	pthread_mutex_unlock(&lock);
+
+	for(int i = 0; i < nworkers; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	free(workers);
+	workers = NULL;
+	nworkers = 0;
+	notified = false;
+
+	if(pool_io.cb) {
+		io_del(&pool_io);
+	}
+
+	close(pipefd[0]);
+	close(pipefd[1]);
+	pipefd[0] = pipefd[1] = -1;
+
+	exit_ring(&send_ring);
+	exit_ring(&receive_ring);
+}
@@ -0,0 +1,85 @@
+#ifndef TINC_CRYPTO_POOL_H
+#define TINC_CRYPTO_POOL_H
+
+#include "system.h"
+
+#include "net.h"
+#include "node.h"
+
+typedef struct crypto_job_t crypto_job_t;
+typedef void (*crypto_done_t)(crypto_job_t *job);
+
+// A datagram encrypted or decrypted by a worker thread.
+// Workers only touch the cipher copy and the buffer, everything else belongs to the main thread.
+struct crypto_job_t {
+	node_t *node;                   // Owner of the SPTPS session, NULL if the job was cancelled
+	node_t *via;                    // Node a received datagram arrived from
+	crypto_done_t done;             // Called for received datagrams, in the order they arrived
+	chacha_poly1305_ctx_t *cipher;  // Private copy of the session's cipher
+	sockaddr_t addr;
+	size_t sock;
+	bool direct;
+	bool encrypt;
+	bool verified;
+	uint8_t type;
+	size_t len;
+	size_t outlen;
+	uint8_t data[MAXSIZE];
+};
+
+#ifdef HAVE_CRYPTO_POOL
+extern uint64_t crypto_jobs;
+extern uint64_t crypto_stalls;
+
+// Start the worker threads. Until then, all datagrams are processed synchronously.
+extern bool crypto_pool_start(int threads);
+
+// Stop the worker threads, dropping all datagrams that have not been delivered yet.
+extern void crypto_pool_stop(void);
+
+// Queue an application record for encryption and sending via the session's send_data callback.
+// Returns false if the record has to be sent synchronously instead.
+extern bool crypto_pool_send(node_t *n, uint8_t type, const void *data, uint16_t len);
+
+// Queue a datagram received from n for decryption, and call done once it has been verified or rejected.
+// Returns false if the datagram has to be received synchronously instead.
+extern bool crypto_pool_receive(node_t *n, node_t *via, size_t sock, const sockaddr_t *addr, bool direct, const void *data, size_t len, crypto_done_t done);
+
+// Wait for and send all records queued for n. Records that are sent synchronously get
+// higher sequence numbers than the queued ones, so they must not overtake them.
+extern void crypto_pool_flush(const node_t *n);
+
+// Drop all queued datagrams that belong to or arrived from n.
+// Must be called before n's SPTPS session is stopped or n is freed.
+extern void crypto_pool_cancel(const node_t *n);
+#else
+static inline bool crypto_pool_send(node_t *n, uint8_t type, const void *data, uint16_t len) {
+	(void)n;
+	(void)type;
+	(void)data;
+	(void)len;
+	return false;
+}
+
+static inline bool crypto_pool_receive(node_t *n, node_t *via, size_t sock, const sockaddr_t *addr, bool direct, const void *data, size_t len, crypto_done_t done) {
+	(void)n;
+	(void)via;
+	(void)sock;
+	(void)addr;
+	(void)direct;
+	(void)data;
+	(void)len;
+	(void)done;
+	return false;
+}
+
+static inline void crypto_pool_flush(const node_t *n) {
+	(void)n;
+}
+
+static inline void crypto_pool_cancel(const node_t *n) {
+	(void)n;
+}
+#endif
+
+#endif // TINC_CRYPTO_POOL_H
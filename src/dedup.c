@@ -0,0 +1,191 @@
+#include "system.h"
+
+#include "dedup.h"
+#include "random.h"
+#include "xalloc.h"
+
+static inline uint64_t rotl(uint64_t x, int b) {
+	return (x << b) | (x >> (64 - b));
+}
+
+static inline void sipround(uint64_t v[4]) {
+	v[0] += v[1];
+	v[1] = rotl(v[1], 13);
+	v[1] ^= v[0];
+	v[0] = rotl(v[0], 32);
+	v[2] += v[3];
+	v[3] = rotl(v[3], 16);
+	v[3] ^= v[2];
+	v[0] += v[3];
+	v[3] = rotl(v[3], 21);
+	v[3] ^= v[0];
+	v[2] += v[1];
+	v[1] = rotl(v[1], 17);
+	v[1] ^= v[2];
+	v[2] = rotl(v[2], 32);
+}
+
+static inline uint64_t load64(const uint8_t *p, size_t len) {
+	uint64_t x = 0;
+
+	for(size_t i = 0; i < len; i++) {
+		x |= (uint64_t)p[i] << (8 * i);
+	}
+
+	return x;
+}
+
+// SipHash-2-4, so that other nodes cannot craft requests that collide
+uint64_t siphash24(const uint64_t key[2], const void *vdata, size_t len) {
+	const uint8_t *data = vdata;
+	uint64_t v[4] = {
+		key[0] ^ 0x736f6d6570736575ULL,
+		key[1] ^ 0x646f72616e646f6dULL,
+		key[0] ^ 0x6c7967656e657261ULL,
+		key[1] ^ 0x7465646279746573ULL,
+	};
+	uint64_t last = (uint64_t)len << 56;
+
+	for(; len >= 8; data += 8, len -= 8) {
+		uint64_t m = load64(data, 8);
+		v[3] ^= m;
+		sipround(v);
+		sipround(v);
+		v[0] ^= m;
+	}
+
+	last |= load64(data, len);
+	v[3] ^= last;
+	sipround(v);
+	sipround(v);
+	v[0] ^= last;
+
+	v[2] ^= 0xff;
+
+	for(int i = 0; i < 4; i++) {
+		sipround(v);
+	}
+
+	return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+static bool bucket_contains(const dedup_bucket_t *bucket, uint64_t hash) {
+	if(!bucket->used) {
+		return false;
+	}
+
+	uint32_t mask = bucket->size - 1;
+
+	for(uint32_t i = (uint32_t)hash & mask; bucket->slots[i]; i = (i + 1) & mask) {
+		if(bucket->slots[i] == hash) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void bucket_put(dedup_bucket_t *bucket, uint64_t hash) {
+	uint32_t mask = bucket->size - 1;
+	uint32_t i = (uint32_t)hash & mask;
+
+	while(bucket->slots[i]) {
+		i = (i + 1) & mask;
+	}
+
+	bucket->slots[i] = hash;
+	bucket->used++;
+}
+
+static void bucket_resize(dedup_bucket_t *bucket, uint32_t size) {
+	uint64_t *old = bucket->slots;
+	uint32_t oldsize = bucket->size;
+
+	bucket->slots = xzalloc(size * sizeof(*bucket->slots));
+	bucket->size = size;
+	bucket->used = 0;
+
+	for(uint32_t i = 0; i < oldsize; i++) {
+		if(old[i]) {
+			bucket_put(bucket, old[i]);
+		}
+	}
+
+	free(old);
+}
+
+bool dedup_check(dedup_t *dedup, const void *data, size_t len) {
+	if(!dedup->keyed) {
+		randomize(dedup->key, sizeof(dedup->key));
+		dedup->keyed = true;
+	}
+
+	uint64_t hash = siphash24(dedup->key, data, len);
+
+	if(!hash) {
+		hash = 1;
+	}
+
+	for(int i = 0; i < DEDUP_BUCKETS; i++) {
+		if(bucket_contains(&dedup->buckets[i], hash)) {
+			dedup->duplicates++;
+			return true;
+		}
+	}
+
+	dedup_bucket_t *bucket = &dedup->buckets[dedup->current];
+
+	// Keep each bucket at most half full, so probe sequences stay short
+	if((bucket->used + 1) * 2 > bucket->size) {
+		if(bucket->size < dedup->max_size) {
+			bucket_resize(bucket, bucket->size ? bucket->size * 2 : MIN(DEDUP_MIN_SIZE, dedup->max_size));
+		} else {
+			dedup->overflows++;
+			dedup_rotate(dedup);
+			bucket = &dedup->buckets[dedup->current];
+			bucket_resize(bucket, MIN(DEDUP_MIN_SIZE, dedup->max_size));
+		}
+	}
+
+	bucket_put(bucket, hash);
+	return false;
+}
+
+void dedup_rotate(dedup_t *dedup) {
+	dedup->current = (dedup->current + 1) % DEDUP_BUCKETS;
+
+	dedup_bucket_t *bucket = &dedup->buckets[dedup->current];
+	free(bucket->slots);
+	memset(bucket, 0, sizeof(*bucket));
+
+	dedup->rotations++;
+}
+
+size_t dedup_entries(const dedup_t *dedup) {
+	size_t entries = 0;
+
+	for(int i = 0; i < DEDUP_BUCKETS; i++) {
+		entries += dedup->buckets[i].used;
+	}
+
+	return entries;
+}
+
+size_t dedup_size(const dedup_t *dedup) {
+	size_t size = 0;
+
+	for(int i = 0; i < DEDUP_BUCKETS; i++) {
+		size += dedup->buckets[i].size;
+	}
+
+	return size;
+}
+
+void dedup_free(dedup_t *dedup) {
+	for(int i = 0; i < DEDUP_BUCKETS; i++) {
+		free(dedup->buckets[i].slots);
+		memset(&dedup->buckets[i], 0, sizeof(dedup->buckets[i]));
+	}
+
+	dedup->current = 0;
+}
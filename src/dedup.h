@@ -0,0 +1,49 @@
+#ifndef TINC_DEDUP_H
+#define TINC_DEDUP_H
+
+#include "system.h"
+
+// Set of recently seen messages, used to drop duplicates of flooded requests.
+// Only a keyed 64-bit hash of each message is stored. The set is split into buckets
+// by age; new hashes go into the current bucket, and dedup_rotate() replaces the
+// oldest bucket with an empty one. Each bucket grows up to a fixed maximum size,
+// if the current bucket fills up before its time, it is rotated early.
+
+#define DEDUP_BUCKETS 4
+#define DEDUP_MIN_SIZE 256
+
+typedef struct dedup_bucket_t {
+	uint64_t *slots;        // 0 marks an empty slot
+	uint32_t size;          // A power of two, or 0 if nothing was added yet
+	uint32_t used;
+} dedup_bucket_t;
+
+typedef struct dedup_t {
+	dedup_bucket_t buckets[DEDUP_BUCKETS];
+	uint32_t max_size;      // Maximum number of slots per bucket, a power of two
+	unsigned int current;
+	bool keyed;
+	uint64_t key[2];
+
+	// Statistics
+	uint64_t duplicates;
+	uint64_t rotations;
+	uint64_t overflows;     // Rotations because the current bucket was full
+} dedup_t;
+
+extern uint64_t siphash24(const uint64_t key[2], const void *data, size_t len);
+
+// Returns true if the message was seen since the oldest bucket was started,
+// otherwise remembers it and returns false.
+extern bool dedup_check(dedup_t *dedup, const void *data, size_t len);
+
+// Forget the oldest bucket of messages.
+extern void dedup_rotate(dedup_t *dedup);
+
+// Number of messages remembered, and the number of slots allocated for them.
+extern size_t dedup_entries(const dedup_t *dedup);
+extern size_t dedup_size(const dedup_t *dedup);
+
+extern void dedup_free(dedup_t *dedup);
+
+#endif
@@ -27,13 +27,25 @@ extern int device_fd;
 extern char *device;
 extern char *iface;
 
+#define MAX_DEVICE_QUEUES 16
+
+/* Devices that have more than one queue put all their file descriptors here,
+   the first one being device_fd. Queues are read using read_queue, which is
+   called from the device worker threads, so it must not log or change any
+   shared state. Without thread support, the main thread reads the queues. */
+extern int device_queue_fd[MAX_DEVICE_QUEUES];
+extern size_t device_queues;
+
 #define DEVICE_DUMMY "dummy"
 
 typedef struct devops_t {
 	bool (*setup)(void);
 	void (*close)(void);
 	bool (*read)(struct vpn_packet_t *);
+	size_t (*read_batch)(struct vpn_packet_t *, size_t); /* optional */
+	size_t (*read_queue)(size_t, struct vpn_packet_t *, size_t); /* optional */
 	bool (*write)(struct vpn_packet_t *);
+	bool (*read_async)(io_t *, void (*)(struct vpn_packet_t *, size_t)); /* optional, io_uring only */
 	void (*enable)(void);   /* optional */
 	void (*disable)(void);  /* optional */
 } devops_t;
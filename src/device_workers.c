@@ -0,0 +1,989 @@
+#include "system.h"
+
+#include <poll.h>
+#include <pthread.h>
+
+#include "bpf.h"
+#include "capture.h"
+#include "connection.h"
+#include "device.h"
+#include "device_workers.h"
+#include "ethernet.h"
+#include "event.h"
+#include "ipv4.h"
+#include "ipv6.h"
+#include "logger.h"
+#include "net.h"
+#include "netutl.h"
+#include "route.h"
+#include "sptps.h"
+#include "utils.h"
+#include "xalloc.h"
+
+/* Device workers
+
+   Every queue of a multi-queue device is read by its own thread. A worker sends the
+   packets it can forward on its own straight to the peer over UDP: unicast IPv4 and IPv6
+   packets in router mode, to nodes with a confirmed direct UDP address and a valid SPTPS
+   key, that fit in the path MTU. Everything else is handed to the main thread, which
+   routes it like the packets it reads itself.
+
+   Workers never look at nodes, subnets or SPTPS sessions. They use a forwarding snapshot,
+   which the main thread builds from the routing decisions route() cached for packets from
+   myself, and from the nodes those point to. A snapshot is never changed once published.
+   The next one replaces it with an atomic pointer swap, and the old one is freed once no
+   worker can still be using it: while a worker processes a batch, it announces the oldest
+   generation of snapshots it may be using.
+
+   While tinc pcap is running, the snapshot also has copies of the capture filters. Workers
+   run them on every packet, and only hand the packets that match to the main thread, which
+   captures them in route().
+
+   Each snapshot has a copy of the outgoing cipher of every node in it, which the workers
+   copy into a private context before use. Sequence numbers are reserved by atomically
+   incrementing the session's outseqno, just like the main thread does, so none is ever
+   used twice with the same key.
+*/
+
+// Maximum number of packets waiting for the main thread, per worker
+#define HANDOFF_RING_SIZE 256
+
+// How long to wait for more new routing decisions before rebuilding the snapshot, in milliseconds
+#define LEARN_DELAY 10
+
+static const size_t ether_size = sizeof(struct ether_header);
+static const size_t ip_size = sizeof(struct ip);
+static const size_t ip6_size = sizeof(struct ip6_hdr);
+
+typedef struct worker_peer_t {
+	node_t *node;                   // Only used by the main thread
+	uint32_t *seqno;                // outseqno of the node's SPTPS session
+	chacha_poly1305_ctx_t *cipher;  // Copy of the session's outgoing cipher
+	int fd;
+	sockaddr_t address;
+	length_t maxlen;                // Longest packet that is known to fit through the path
+	bool clamp_mss;
+	size_t idlen;
+	uint8_t ids[2 * sizeof(node_id_t)];
+	uint64_t packets;               // Counted by the workers, collected by the main thread
+	uint64_t bytes;
+} worker_peer_t;
+
+typedef struct worker_route_t {
+	uint32_t address[4];            // IPv4 addresses only use the first word
+	uint32_t family;
+	uint32_t peer;                  // Index + 1 into the peers, 0 for an empty slot
+} worker_route_t;
+
+typedef struct worker_snapshot_t {
+	uint64_t generation;
+	struct worker_snapshot_t *next; // Next retired snapshot
+	worker_peer_t *peers;           // Sorted by node
+	size_t npeers;
+	worker_route_t *routes;         // Hash table with open addressing
+	uint32_t mask;
+	size_t skipped;                 // Cached routes to nodes that could not be included
+	bpf_program_t *filters;         // Copies of the filters of the captures in progress
+	size_t nfilters;
+	bool capture_all;               // A capture without a filter is in progress
+	bool disabled;                  // Workers hand all packets to the main thread
+} worker_snapshot_t;
+
+typedef struct device_worker_t {
+	pthread_t thread;
+	size_t queue;
+
+	// Shared with the main thread
+	uint64_t active;                // Oldest generation of snapshots that may be in use, 0 if none
+	int error;                      // errno of a failed read the main thread has not reported yet
+	bool failed;                    // Too many errors in a row, the worker gave up
+	uint64_t read_batches;
+	uint64_t read_packets;
+	uint64_t read_bytes;
+	uint64_t sent;
+	uint64_t handoffs;
+	uint64_t drops;
+
+	// Packets for the main thread. Only the worker advances head, only the main thread advances tail.
+	vpn_packet_t *handoff;
+	size_t head;
+	size_t tail;
+
+	// Only used by the worker
+	chacha_poly1305_ctx_t *cipher;
+	vpn_packet_t packets[MAX_DEVICE_BATCH];
+	const worker_peer_t *peer[MAX_DEVICE_BATCH];
+	size_t packet[MAX_DEVICE_BATCH];
+	struct iovec iov[MAX_DEVICE_BATCH];
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr msg[MAX_DEVICE_BATCH];
+#endif
+	uint8_t out[MAX_DEVICE_BATCH][MAXSIZE];
+} device_worker_t;
+
+uint64_t device_worker_packets;
+uint64_t device_worker_handoffs;
+uint64_t device_worker_drops;
+uint64_t device_worker_snapshots;
+
+static device_worker_t *workers[MAX_DEVICE_QUEUES];
+static size_t nworkers;
+static bool running;
+
+static worker_snapshot_t *current;
+static uint64_t generation;
+static worker_snapshot_t *retired;
+
+static bool waiting;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+static int notify_pipe[2] = {-1, -1};
+static int stop_pipe[2] = {-1, -1};
+static bool notified;
+static io_t notify_io;
+
+static timeout_t update_timeout;
+static timeout_t harvest_timeout;
+static bool update_pending;
+
+/* Snapshots, only built and freed by the main thread */
+
+static bool eligible(const node_t *n) {
+	return n != myself
+	       && n->status.reachable
+	       && n->status.sptps
+	       && n->status.validkey
+	       && n->status.udp_confirmed
+	       && !n->status.send_locally
+	       && n->via == n
+	       && n->sptps.datagram
+	       && n->sptps.outstate
+	       && n->sptps.state == SPTPS_SECONDARY_KEX
+	       && n->minmtu
+	       && n->outcompression == COMPRESS_NONE
+	       && !((myself->options | n->options) & OPTION_TCPONLY);
+}
+
+static length_t peer_maxlen(const node_t *n) {
+	return MIN(n->minmtu, n->mtu);
+}
+
+static void fill_peer(worker_peer_t *p, node_t *n) {
+	p->node = n;
+	p->seqno = &n->sptps.outseqno;
+	p->cipher = chacha_poly1305_init();
+	chacha_poly1305_copy(p->cipher, n->sptps.outcipher);
+	p->fd = listen_socket[n->sock].udp.fd;
+	p->address = n->address;
+	p->maxlen = peer_maxlen(n);
+	p->clamp_mss = n->options & OPTION_CLAMP_MSS;
+
+	// See put_sptps_ids(), the packets are always sent directly
+	if((n->options >> 24) >= 4) {
+		memset(p->ids, 0, sizeof(node_id_t));
+		memcpy(p->ids + sizeof(node_id_t), &myself->id, sizeof(node_id_t));
+		p->idlen = sizeof(p->ids);
+	}
+}
+
+// Check whether the snapshot would still contain the same peer if it was built now
+static bool peer_changed(const worker_peer_t *p) {
+	const node_t *n = p->node;
+
+	return !eligible(n)
+	       || p->fd != listen_socket[n->sock].udp.fd
+	       || sockaddrcmp(&p->address, &n->address)
+	       || p->maxlen != peer_maxlen(n)
+	       || p->clamp_mss != !!(n->options & OPTION_CLAMP_MSS);
+}
+
+static int peer_compare(const void *va, const void *vb) {
+	uintptr_t a = (uintptr_t)((const worker_peer_t *)va)->node;
+	uintptr_t b = (uintptr_t)((const worker_peer_t *)vb)->node;
+	return a < b ? -1 : a > b;
+}
+
+static worker_peer_t *find_peer(const worker_snapshot_t *snap, const node_t *n) {
+	worker_peer_t key = {.node = (node_t *)n};
+	return snap ? bsearch(&key, snap->peers, snap->npeers, sizeof(key), peer_compare) : NULL;
+}
+
+static uint32_t route_hash(const worker_route_t *route) {
+	uint32_t hash = route->family;
+
+	for(int i = 0; i < 4; i++) {
+		hash = (hash ^ route->address[i]) * 0x9e3779b1U;
+	}
+
+	return hash ^ hash >> 16;
+}
+
+typedef struct route_list_t {
+	worker_snapshot_t *snap;
+	worker_route_t *routes;
+	size_t count;
+	size_t size;
+} route_list_t;
+
+static void add_route(void *arg, int family, const void *address, node_t *owner) {
+	route_list_t *list = arg;
+	const worker_peer_t *p = find_peer(list->snap, owner);
+
+	if(!p) {
+		// Packets for myself are always handed to the main thread
+		if(owner != myself) {
+			list->snap->skipped++;
+		}
+
+		return;
+	}
+
+	if(list->count == list->size) {
+		list->size = list->size ? list->size * 2 : 64;
+		list->routes = xrealloc(list->routes, list->size * sizeof(*list->routes));
+	}
+
+	worker_route_t *route = &list->routes[list->count++];
+	memcpy(route->address, address, sizeof(route->address));
+	route->family = (uint32_t)family;
+	route->peer = (uint32_t)(p - list->snap->peers) + 1;
+}
+
+// Packets are only forwarded by the workers if route() would do nothing but send them
+static bool fast_path_allowed(void) {
+	return routing_mode == RMODE_ROUTER && !priorityinheritance;
+}
+
+static void add_filter(void *arg, const bpf_program_t *filter) {
+	worker_snapshot_t *snap = arg;
+
+	if(!filter->len) {
+		snap->capture_all = true;
+		return;
+	}
+
+	snap->filters = xrealloc(snap->filters, (snap->nfilters + 1) * sizeof(*snap->filters));
+	bpf_program_t *copy = &snap->filters[snap->nfilters++];
+	copy->len = filter->len;
+	copy->insns = xmalloc(filter->len * sizeof(*filter->insns));
+	memcpy(copy->insns, filter->insns, filter->len * sizeof(*filter->insns));
+}
+
+// Build a snapshot of the current state, leaving out exclude
+static worker_snapshot_t *build_snapshot(const node_t *exclude) {
+	worker_snapshot_t *snap = xzalloc(sizeof(*snap));
+
+	if(!fast_path_allowed()) {
+		snap->disabled = true;
+		return snap;
+	}
+
+	// Without routes, the workers hand all packets to the main thread
+	capture_walk(add_filter, snap);
+
+	if(snap->capture_all) {
+		return snap;
+	}
+
+	for splay_each(node_t, n, &node_tree) {
+		if(n != exclude && eligible(n)) {
+			snap->npeers++;
+		}
+	}
+
+	if(!snap->npeers) {
+		return snap;
+	}
+
+	snap->peers = xzalloc(snap->npeers * sizeof(*snap->peers));
+	size_t i = 0;
+
+	for splay_each(node_t, n, &node_tree) {
+		if(n != exclude && eligible(n)) {
+			fill_peer(&snap->peers[i++], n);
+		}
+	}
+
+	qsort(snap->peers, snap->npeers, sizeof(*snap->peers), peer_compare);
+
+	route_list_t list = {.snap = snap};
+	route_cache_walk(myself, add_route, &list);
+
+	if(list.count) {
+		size_t size = 16;
+
+		while(size < list.count * 2) {
+			size *= 2;
+		}
+
+		snap->routes = xzalloc(size * sizeof(*snap->routes));
+		snap->mask = (uint32_t)size - 1;
+
+		for(i = 0; i < list.count; i++) {
+			uint32_t slot = route_hash(&list.routes[i]) & snap->mask;
+
+			while(snap->routes[slot].peer) {
+				slot = (slot + 1) & snap->mask;
+			}
+
+			snap->routes[slot] = list.routes[i];
+		}
+	}
+
+	free(list.routes);
+	return snap;
+}
+
+// Add the packets the workers sent to the nodes' counters. Returns how many nodes sent any.
+static size_t harvest_snapshot(worker_snapshot_t *snap, node_t **active) {
+	size_t count = 0;
+
+	for(size_t i = 0; i < snap->npeers; i++) {
+		worker_peer_t *p = &snap->peers[i];
+		uint64_t packets = __atomic_exchange_n(&p->packets, 0, __ATOMIC_RELAXED);
+		uint64_t bytes = __atomic_exchange_n(&p->bytes, 0, __ATOMIC_RELAXED);
+
+		if(packets) {
+			p->node->out_packets += packets;
+			p->node->out_bytes += bytes;
+
+			if(active) {
+				active[count] = p->node;
+			}
+
+			count++;
+		}
+	}
+
+	return count;
+}
+
+static void free_snapshot(worker_snapshot_t *snap) {
+	harvest_snapshot(snap, NULL);
+
+	for(size_t i = 0; i < snap->npeers; i++) {
+		chacha_poly1305_exit(snap->peers[i].cipher);
+	}
+
+	for(size_t i = 0; i < snap->nfilters; i++) {
+		bpf_free(&snap->filters[i]);
+	}
+
+	free(snap->filters);
+	free(snap->peers);
+	free(snap->routes);
+	free(snap);
+}
+
+// Free the retired snapshots no worker can be using anymore
+static void reclaim(void) {
+	uint64_t oldest = UINT64_MAX;
+
+	for(size_t i = 0; i < nworkers; i++) {
+		uint64_t active = __atomic_load_n(&workers[i]->active, __ATOMIC_SEQ_CST);
+
+		if(active && active < oldest) {
+			oldest = active;
+		}
+	}
+
+	for(worker_snapshot_t **p = &retired; *p;) {
+		worker_snapshot_t *snap = *p;
+
+		if(snap->generation < oldest) {
+			*p = snap->next;
+			free_snapshot(snap);
+		} else {
+			p = &snap->next;
+		}
+	}
+}
+
+// The new snapshot must be visible before its generation, so a worker never announces a newer generation than it uses
+static void publish(worker_snapshot_t *snap) {
+	snap->generation = generation + 1;
+	worker_snapshot_t *old = __atomic_exchange_n(&current, snap, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&generation, snap->generation, __ATOMIC_SEQ_CST);
+	device_worker_snapshots++;
+
+	if(old) {
+		old->next = retired;
+		retired = old;
+	}
+
+	reclaim();
+}
+
+// Wait until all retired snapshots are freed
+static void synchronize(void) {
+	__atomic_store_n(&waiting, true, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&lock);
+
+	for(reclaim(); retired; reclaim()) {
+		pthread_cond_wait(&idle_cond, &lock);
+	}
+
+	pthread_mutex_unlock(&lock);
+	__atomic_store_n(&waiting, false, __ATOMIC_SEQ_CST);
+}
+
+static void update_handler(void *data) {
+	(void)data;
+	update_pending = false;
+	publish(build_snapshot(NULL));
+}
+
+void device_workers_update(void) {
+	if(!nworkers) {
+		return;
+	}
+
+	update_pending = true;
+	timeout_add(&update_timeout, update_handler, NULL, &(struct timeval) {
+		0, 0
+	});
+}
+
+void device_workers_learn(void) {
+	if(!nworkers || update_pending) {
+		return;
+	}
+
+	update_pending = true;
+	timeout_add(&update_timeout, update_handler, NULL, &(struct timeval) {
+		0, LEARN_DELAY * 1000
+	});
+}
+
+void device_workers_cancel(const node_t *n) {
+	if(!nworkers) {
+		return;
+	}
+
+	bool used = find_peer(current, n);
+
+	for(worker_snapshot_t *snap = retired; snap && !used; snap = snap->next) {
+		used = find_peer(snap, n);
+	}
+
+	if(!used) {
+		return;
+	}
+
+	if(find_peer(current, n)) {
+		publish(build_snapshot(n));
+	}
+
+	synchronize();
+}
+
+void device_workers_harvest(void) {
+	for(size_t i = 0; i < nworkers; i++) {
+		device_worker_t *w = workers[i];
+		uint64_t packets = __atomic_exchange_n(&w->read_packets, 0, __ATOMIC_RELAXED);
+
+		device_read_batches += __atomic_exchange_n(&w->read_batches, 0, __ATOMIC_RELAXED);
+		device_read_packets += packets;
+		myself->in_packets += packets;
+		myself->in_bytes += __atomic_exchange_n(&w->read_bytes, 0, __ATOMIC_RELAXED);
+		device_worker_packets += __atomic_exchange_n(&w->sent, 0, __ATOMIC_RELAXED);
+		device_worker_handoffs += __atomic_exchange_n(&w->handoffs, 0, __ATOMIC_RELAXED);
+		device_worker_drops += __atomic_exchange_n(&w->drops, 0, __ATOMIC_RELAXED);
+	}
+
+	if(current) {
+		harvest_snapshot(current, NULL);
+	}
+}
+
+// Collect the counters once a second, and keep UDP and PMTU probing going for the nodes the workers send to,
+// which send_packet() would otherwise do. Probing changes the path MTU and can confirm new UDP addresses,
+// so the snapshot is also rebuilt if it no longer matches the nodes, or could include more of them.
+static void harvest_handler(void *data) {
+	(void)data;
+
+	device_workers_harvest();
+
+	node_t **active = NULL;
+	size_t count = 0;
+	bool changed = current->skipped || current->disabled != !fast_path_allowed();
+
+	if(current->npeers) {
+		active = xzalloc(current->npeers * sizeof(*active));
+		count = harvest_snapshot(current, active);
+
+		for(size_t i = 0; i < current->npeers && !changed; i++) {
+			changed = peer_changed(&current->peers[i]);
+		}
+	}
+
+	if(changed) {
+		device_workers_update();
+	}
+
+	// Probing can lead to sessions being restarted and snapshots being freed, so only do it afterwards
+	for(size_t i = 0; i < count; i++) {
+		try_tx(active[i], true);
+	}
+
+	free(active);
+	reclaim();
+
+	timeout_set(&harvest_timeout, &(struct timeval) {
+		1, 0
+	});
+}
+
+/* Worker threads */
+
+static void notify_main(void) {
+	if(!__atomic_exchange_n(&notified, true, __ATOMIC_SEQ_CST)) {
+		char c = 0;
+
+		if(write(notify_pipe[1], &c, 1) != 1) {
+			// The pipe is never full, and the main thread drains it anyway.
+		}
+	}
+}
+
+static bool handoff(device_worker_t *w, const vpn_packet_t *packet) {
+	if(w->head - __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE) >= HANDOFF_RING_SIZE) {
+		__atomic_fetch_add(&w->drops, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	vpn_packet_t *slot = &w->handoff[w->head % HANDOFF_RING_SIZE];
+	slot->offset = DEFAULT_PACKET_OFFSET;
+	slot->priority = 0;
+	slot->len = packet->len;
+	memcpy(DATA(slot), DATA(packet), packet->len);
+
+	__atomic_store_n(&w->head, w->head + 1, __ATOMIC_RELEASE);
+	__atomic_fetch_add(&w->handoffs, 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+// Check whether clamp_mss() could change a TCP segment starting at start
+static bool has_mss_option(const vpn_packet_t *packet, size_t start) {
+	const uint8_t *data = DATA(packet);
+
+	if(packet->len <= start + 20) {
+		return false;
+	}
+
+	int len = ((data[start + 12] >> 4) - 5) * 4;
+
+	if(len < 2 || packet->len < start + 20 + len) {
+		return false;
+	}
+
+	for(int i = 0; i < len - 1;) {
+		uint8_t kind = data[start + 20 + i];
+
+		if(kind == 0) {
+			break;
+		}
+
+		if(kind == 2) {
+			return true;
+		}
+
+		if(kind == 1) {
+			i++;
+			continue;
+		}
+
+		if(data[start + 21 + i] < 2) {
+			break;
+		}
+
+		i += data[start + 21 + i];
+	}
+
+	return false;
+}
+
+static bool captured(const worker_snapshot_t *snap, const vpn_packet_t *packet) {
+	for(size_t i = 0; i < snap->nfilters; i++) {
+		if(bpf_run(&snap->filters[i], DATA(packet), packet->len)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Find the peer a packet can be sent to directly, or return NULL if route() has to look at it.
+// This makes the same decisions as route_ipv4() and route_ipv6() for packets from myself.
+static const worker_peer_t *classify(const worker_snapshot_t *snap, const vpn_packet_t *packet) {
+	if(!snap->routes || packet->len < ether_size || captured(snap, packet)) {
+		return NULL;
+	}
+
+	const uint8_t *data = DATA(packet);
+	uint16_t type = data[12] << 8 | data[13];
+	worker_route_t key = {0};
+	size_t start;
+	uint8_t protocol;
+
+	if(type == ETH_P_IP && packet->len >= ether_size + ip_size) {
+		key.family = AF_INET;
+		memcpy(key.address, data + 30, sizeof(ipv4_t));
+		protocol = data[23];
+		start = ether_size + (data[14] & 0xf) * 4;
+	} else if(type == ETH_P_IPV6 && packet->len >= ether_size + ip6_size) {
+		protocol = data[20];
+
+		// Neighbor solicitations are answered by route_neighborsol()
+		if(protocol == IPPROTO_ICMPV6 && (packet->len <= ether_size + ip6_size || data[54] == ND_NEIGHBOR_SOLICIT)) {
+			return NULL;
+		}
+
+		key.family = AF_INET6;
+		memcpy(key.address, data + 38, sizeof(ipv6_t));
+		start = ether_size + ip6_size;
+	} else {
+		return NULL;
+	}
+
+	const worker_peer_t *p = NULL;
+
+	for(uint32_t i = route_hash(&key) & snap->mask; snap->routes[i].peer; i = (i + 1) & snap->mask) {
+		const worker_route_t *route = &snap->routes[i];
+
+		if(route->family == key.family && !memcmp(route->address, key.address, sizeof(key.address))) {
+			p = &snap->peers[route->peer - 1];
+			break;
+		}
+	}
+
+	if(!p || packet->len > p->maxlen) {
+		return NULL;
+	}
+
+	if(p->clamp_mss && (protocol == IPPROTO_IPIP || (protocol == IPPROTO_TCP && has_mss_option(packet, start)))) {
+		return NULL;
+	}
+
+	return p;
+}
+
+static void send_datagrams(device_worker_t *w, size_t count) {
+	for(size_t first = 0, last; first < count; first = last) {
+		int fd = w->peer[first]->fd;
+
+		for(last = first + 1; last < count && w->peer[last]->fd == fd; last++);
+
+		size_t sent = first;
+
+		while(sent < last) {
+#ifdef HAVE_SENDMMSG
+			int result = sendmmsg(fd, &w->msg[sent], last - sent, 0);
+#else
+			const worker_peer_t *p = w->peer[sent];
+			int result = sendto(fd, w->iov[sent].iov_base, w->iov[sent].iov_len, 0, &p->address.sa, SALEN(p->address.sa)) < 0 ? -1 : 1;
+#endif
+
+			if(result > 0) {
+				for(size_t i = sent; i < sent + result; i++) {
+					worker_peer_t *p = (worker_peer_t *)w->peer[i];
+					__atomic_fetch_add(&p->packets, 1, __ATOMIC_RELAXED);
+					__atomic_fetch_add(&p->bytes, w->packets[w->packet[i]].len, __ATOMIC_RELAXED);
+				}
+
+				__atomic_fetch_add(&w->sent, result, __ATOMIC_RELAXED);
+				sent += result;
+				continue;
+			}
+
+			if(sockerrno == EINTR) {
+				continue;
+			}
+
+			if(sockwouldblock(sockerrno)) {
+				break;
+			}
+
+			// Let the main thread send it the regular way, which also handles a path MTU that shrank
+			handoff(w, &w->packets[w->packet[sent]]);
+			sent++;
+		}
+	}
+}
+
+static void process_batch(device_worker_t *w, const worker_snapshot_t *snap, size_t count) {
+	const worker_peer_t *cipher_peer = NULL;
+	size_t datagrams = 0;
+	size_t handoffs = 0;
+	size_t bytes = 0;
+
+	for(size_t i = 0; i < count; i++) {
+		vpn_packet_t *packet = &w->packets[i];
+		bytes += packet->len;
+
+		const worker_peer_t *p = classify(snap, packet);
+
+		if(!p) {
+			handoffs += handoff(w, packet);
+			continue;
+		}
+
+		if(cipher_peer != p) {
+			chacha_poly1305_copy(w->cipher, p->cipher);
+			cipher_peer = p;
+		}
+
+		// Router mode leaves out the Ethernet header, see send_sptps_packet()
+		uint8_t *buf = w->out[datagrams];
+		uint16_t len = packet->len - ether_size;
+		uint32_t seqno = __atomic_fetch_add(p->seqno, 1, __ATOMIC_RELAXED);
+
+		memcpy(buf, p->ids, p->idlen);
+		sptps_seal_record_with(w->cipher, seqno, 0, DATA(packet) + ether_size, len, buf + p->idlen);
+
+		w->peer[datagrams] = p;
+		w->packet[datagrams] = i;
+		w->iov[datagrams] = (struct iovec) {
+			.iov_base = buf,
+			.iov_len = p->idlen + len + SPTPS_DATAGRAM_OVERHEAD,
+		};
+#ifdef HAVE_SENDMMSG
+		w->msg[datagrams].msg_hdr = (struct msghdr) {
+			.msg_name = (void *) &p->address.sa,
+			.msg_namelen = SALEN(p->address.sa),
+			.msg_iov = &w->iov[datagrams],
+			.msg_iovlen = 1,
+		};
+#endif
+		datagrams++;
+	}
+
+	send_datagrams(w, datagrams);
+
+	__atomic_fetch_add(&w->read_batches, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&w->read_packets, count, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&w->read_bytes, bytes, __ATOMIC_RELAXED);
+
+	if(handoffs || w->head != __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE)) {
+		notify_main();
+	}
+}
+
+static void *device_worker(void *arg) {
+	device_worker_t *w = arg;
+	struct pollfd pfd[2] = {
+		{.fd = device_queue_fd[w->queue], .events = POLLIN},
+		{.fd = stop_pipe[0], .events = POLLIN},
+	};
+	unsigned int errors = 0;
+
+	while(__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+		if(poll(pfd, 2, -1) < 0 || !pfd[0].revents) {
+			continue;
+		}
+
+		size_t count = devops.read_queue(w->queue, w->packets, MAX_DEVICE_BATCH);
+		int err = errno;
+
+		if(count) {
+			errors = 0;
+
+			// Announce the generation before loading the snapshot, see publish()
+			__atomic_store_n(&w->active, __atomic_load_n(&generation, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+			process_batch(w, __atomic_load_n(&current, __ATOMIC_SEQ_CST), count);
+			__atomic_store_n(&w->active, 0, __ATOMIC_SEQ_CST);
+
+			if(__atomic_load_n(&waiting, __ATOMIC_SEQ_CST)) {
+				pthread_mutex_lock(&lock);
+				pthread_cond_broadcast(&idle_cond);
+				pthread_mutex_unlock(&lock);
+			}
+
+			continue;
+		}
+
+		if(err == EAGAIN || err == EINTR) {
+			continue;
+		}
+
+		// Let the main thread report it, and back off just like handle_device_data() does
+		__atomic_store_n(&w->error, err, __ATOMIC_RELAXED);
+
+		if(++errors > 10) {
+			__atomic_store_n(&w->failed, true, __ATOMIC_RELAXED);
+			notify_main();
+			break;
+		}
+
+		notify_main();
+		sleep_millis(errors * 50);
+	}
+
+	return NULL;
+}
+
+/* Main thread */
+
+static void route_handoffs(device_worker_t *w) {
+	size_t head = __atomic_load_n(&w->head, __ATOMIC_ACQUIRE);
+
+	while(w->tail != head) {
+		size_t first = w->tail % HANDOFF_RING_SIZE;
+		size_t count = MIN(head - w->tail, MIN(HANDOFF_RING_SIZE - first, MAX_DEVICE_BATCH));
+
+		route_batch(myself, &w->handoff[first], count);
+		__atomic_store_n(&w->tail, w->tail + count, __ATOMIC_RELEASE);
+	}
+}
+
+static void notify_handler(void *data, int flags) {
+	(void)data;
+	(void)flags;
+
+	char buf[16];
+
+	if(read(notify_pipe[0], buf, sizeof(buf)) <= 0) {
+		return;
+	}
+
+	__atomic_store_n(&notified, false, __ATOMIC_SEQ_CST);
+
+	for(size_t i = 0; i < nworkers; i++) {
+		device_worker_t *w = workers[i];
+		int err = __atomic_exchange_n(&w->error, 0, __ATOMIC_RELAXED);
+
+		if(err) {
+			logger(DEBUG_ALWAYS, LOG_ERR, "Error while reading from queue %lu of %s: %s", (unsigned long)w->queue, device, strerror(err));
+		}
+
+		if(__atomic_load_n(&w->failed, __ATOMIC_RELAXED)) {
+			logger(DEBUG_ALWAYS, LOG_ERR, "Too many errors from %s, exiting!", device);
+			event_exit();
+		}
+
+		route_handoffs(w);
+	}
+}
+
+static void free_worker(device_worker_t *w) {
+	chacha_poly1305_exit(w->cipher);
+	free(w->handoff);
+	free(w);
+}
+
+static bool open_pipe(int fds[2]) {
+	if(pipe(fds)) {
+		return false;
+	}
+
+#ifdef FD_CLOEXEC
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+#endif
+
+	return true;
+}
+
+bool device_workers_start(void) {
+	if(nworkers || device_queues < 2 || !devops.read_queue) {
+		return false;
+	}
+
+	if(!open_pipe(notify_pipe) || !open_pipe(stop_pipe)) {
+		logger(DEBUG_ALWAYS, LOG_ERR, "Could not create pipe for device workers: %s", strerror(errno));
+		device_workers_stop();
+		return false;
+	}
+
+	// Workers must always find a snapshot, even if it is empty
+	publish(build_snapshot(NULL));
+	running = true;
+
+	for(; nworkers < device_queues; nworkers++) {
+		device_worker_t *w = xzalloc(sizeof(*w));
+		w->queue = nworkers;
+		w->handoff = xzalloc(HANDOFF_RING_SIZE * sizeof(*w->handoff));
+		w->cipher = chacha_poly1305_init();
+
+		for(size_t i = 0; i < MAX_DEVICE_BATCH; i++) {
+			w->packets[i].offset = DEFAULT_PACKET_OFFSET;
+		}
+
+		int err = pthread_create(&w->thread, NULL, device_worker, w);
+
+		if(err) {
+			logger(DEBUG_ALWAYS, LOG_ERR, "Unable to start device worker thread: [%d] %s", err, strerror(err));
+			free_worker(w);
+			device_workers_stop();
+			return false;
+		}
+
+		workers[nworkers] = w;
+	}
+
+	io_add(&notify_io, notify_handler, NULL, notify_pipe[0], IO_READ);
+	timeout_add(&harvest_timeout, harvest_handler, NULL, &(struct timeval) {
+		1, 0
+	});
+
+	logger(DEBUG_ALWAYS, LOG_INFO, "Started %lu device worker threads", (unsigned long)nworkers);
+	return true;
+}
+
+void device_workers_stop(void) {
+	if(running) {
+		__atomic_store_n(&running, false, __ATOMIC_RELEASE);
+
+		char c = 0;
+
+		if(write(stop_pipe[1], &c, 1) != 1) {
+			// The workers also check running after every batch.
+		}
+	}
+
+	for(size_t i = 0; i < nworkers; i++) {
+		pthread_join(workers[i]->thread, NULL);
+	}
+
+	device_workers_harvest();
+
+	for(size_t i = 0; i < nworkers; i++) {
+		free_worker(workers[i]);
+		workers[i] = NULL;
+	}
+
+	nworkers = 0;
+	notified = false;
+	update_pending = false;
+
+	if(notify_io.cb) {
+		io_del(&notify_io);
+	}
+
+	timeout_del(&update_timeout);
+	timeout_del(&harvest_timeout);
+
+	for(int i = 0; i < 2; i++) {
+		if(notify_pipe[i] >= 0) {
+			close(notify_pipe[i]);
+			notify_pipe[i] = -1;
+		}
+
+		if(stop_pipe[i] >= 0) {
+			close(stop_pipe[i]);
+			stop_pipe[i] = -1;
+		}
+	}
+
+	if(current) {
+		free_snapshot(current);
+		current = NULL;
+	}
+
+	while(retired) {
+		worker_snapshot_t *snap = retired;
+		retired = snap->next;
+		free_snapshot(snap);
+	}
+}
@@ -0,0 +1,45 @@
+#ifndef TINC_DEVICE_WORKERS_H
+#define TINC_DEVICE_WORKERS_H
+
+#include "system.h"
+
+#include "node.h"
+
+#ifdef HAVE_DEVICE_WORKERS
+extern uint64_t device_worker_packets;
+extern uint64_t device_worker_handoffs;
+extern uint64_t device_worker_drops;
+extern uint64_t device_worker_snapshots;
+
+// Start one thread for every device queue, which reads, routes, encrypts and sends the packets from that queue.
+// Returns false if the main thread has to read the queues instead.
+extern bool device_workers_start(void);
+
+// Stop the worker threads. Packets that were handed to the main thread but not routed yet are dropped.
+extern void device_workers_stop(void);
+
+// Rebuild the forwarding snapshot the workers use as soon as possible.
+// Must be called when anything changes that it is built from: routes, keys, addresses or path MTUs.
+extern void device_workers_update(void);
+
+// Like device_workers_update(), but for newly cached routing decisions, which can wait a little.
+extern void device_workers_learn(void);
+
+// Make sure no worker uses n's SPTPS session anymore. Must be called before it is stopped or n is freed.
+extern void device_workers_cancel(const node_t *n);
+
+// Add the packet counters of the workers to those of the nodes and to the global statistics.
+extern void device_workers_harvest(void);
+#else
+static inline void device_workers_update(void) {
+}
+
+static inline void device_workers_learn(void) {
+}
+
+static inline void device_workers_cancel(const node_t *n) {
+	(void)n;
+}
+#endif
+
+#endif // TINC_DEVICE_WORKERS_H
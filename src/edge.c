@@ -23,6 +23,7 @@
 #include "splay_tree.h"
 #include "control_common.h"
 #include "edge.h"
+#include "graph.h"
 #include "logger.h"
 #include "netutl.h"
 #include "node.h"
@@ -100,9 +101,13 @@ void edge_add(edge_t *e) {
 		logger(DEBUG_ALWAYS, LOG_ERR, "Edge from %s to %s already exists in edge_weight_tree\n", e->from->name, e->to->name);
 		return;
 	}
+
+	graph_add_edge(e);
 }
 
 void edge_del(edge_t *e) {
+	graph_del_edge(e);
+
 	if(e->reverse) {
 		e->reverse->reverse = NULL;
 	}
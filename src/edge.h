@@ -37,6 +37,7 @@ typedef struct edge_t {
 
 	struct connection_t *connection;        /* connection associated with this edge, if available */
 	struct edge_t *reverse;                 /* edge in the opposite direction, if available */
+	bool mst;                               /* 1 if this edge is part of the minimum spanning tree */
 } edge_t;
 
 extern splay_tree_t edge_weight_tree;          /* Tree with all known edges sorted on weight */
@@ -40,65 +40,44 @@ static int io_compare(const io_t *a, const io_t *b) {
 #endif
 }
 
-static int timeout_compare(const timeout_t *a, const timeout_t *b) {
-	struct timeval diff;
-	timersub(&a->tv, &b->tv, &diff);
-
-	if(diff.tv_sec < 0) {
-		return -1;
-	}
-
-	if(diff.tv_sec > 0) {
-		return 1;
-	}
-
-	if(diff.tv_usec < 0) {
-		return -1;
-	}
-
-	if(diff.tv_usec > 0) {
-		return 1;
-	}
-
-	uintptr_t ap = (uintptr_t)a;
-	uintptr_t bp = (uintptr_t)b;
+splay_tree_t io_tree = {.compare = (splay_compare_t)io_compare};
 
-	if(ap < bp) {
-		return -1;
-	}
+/* Timeouts are kept in a timing wheel with a resolution of one millisecond */
 
-	if(ap > bp) {
-		return 1;
-	}
+timer_wheel_t timeout_wheel;
 
-	return 0;
+static uint64_t timeval_to_tick(const struct timeval *tv, bool round_up) {
+	return (uint64_t)tv->tv_sec * 1000 + ((uint64_t)tv->tv_usec + (round_up ? 999 : 0)) / 1000;
 }
 
-splay_tree_t io_tree = {.compare = (splay_compare_t)io_compare};
-splay_tree_t timeout_tree = {.compare = (splay_compare_t)timeout_compare};
+static timeout_t *timeout_of(wheel_node_t *node) {
+	return (timeout_t *)((char *)node - offsetof(timeout_t, node));
+}
 
 void timeout_add(timeout_t *timeout, timeout_cb_t cb, void *data, const struct timeval *tv) {
 	timeout->cb = cb;
 	timeout->data = data;
-	timeout->node.data = timeout;
 
 	timeout_set(timeout, tv);
 }
 
 void timeout_set(timeout_t *timeout, const struct timeval *tv) {
-	if(timerisset(&timeout->tv)) {
-		splay_unlink_node(&timeout_tree, &timeout->node);
+	if(wheel_contains(&timeout->node)) {
+		wheel_del(&timeout_wheel, &timeout->node);
 	}
 
 	if(!now.tv_sec) {
 		gettimeofday(&now, NULL);
 	}
 
+	if(!timeout_wheel.count) {
+		wheel_advance(&timeout_wheel, timeval_to_tick(&now, false));
+	}
+
 	timeradd(&now, tv, &timeout->tv);
 
-	if(!splay_insert_node(&timeout_tree, &timeout->node)) {
-		abort();
-	}
+	/* Round up, so timeouts never fire early */
+	wheel_add(&timeout_wheel, &timeout->node, timeval_to_tick(&timeout->tv, true));
 }
 
 void timeout_del(timeout_t *timeout) {
@@ -106,7 +85,10 @@ void timeout_del(timeout_t *timeout) {
 		return;
 	}
 
-	splay_unlink_node(&timeout_tree, &timeout->node);
+	if(wheel_contains(&timeout->node)) {
+		wheel_del(&timeout_wheel, &timeout->node);
+	}
+
 	timeout->cb = 0;
 	timeout->tv = (struct timeval) {
 		0, 0
@@ -115,23 +97,56 @@ void timeout_del(timeout_t *timeout) {
 
 struct timeval *timeout_execute(struct timeval *diff) {
 	gettimeofday(&now, NULL);
-	struct timeval *tv = NULL;
+	wheel_advance(&timeout_wheel, timeval_to_tick(&now, false));
 
-	while(timeout_tree.head) {
-		timeout_t *timeout = timeout_tree.head->data;
-		timersub(&timeout->tv, &now, diff);
+	while(true) {
+		/* Expiry times are rounded up to whole ticks, so the expired list can contain timeouts
+		   that are less than a tick away, for example if they were set while running callbacks.
+		   Leave those for the next iteration, but run any due ones behind them. */
+		wheel_node_t *node = timeout_wheel.expired;
 
-		if(diff->tv_sec < 0) {
-			timeout->cb(timeout->data);
+		while(node && !timercmp(&timeout_of(node)->tv, &now, <)) {
+			node = node->next;
+		}
 
-			if(timercmp(&timeout->tv, &now, <)) {
-				timeout_del(timeout);
-			}
-		} else {
-			tv = diff;
+		if(!node) {
 			break;
 		}
+
+		timeout_t *timeout = timeout_of(node);
+		wheel_del(&timeout_wheel, node);
+		timeout->cb(timeout->data);
+
+		if(!wheel_contains(&timeout->node)) {
+			timeout_del(timeout);
+		}
+	}
+
+	uint64_t expires;
+
+	if(!wheel_next_expiry(&timeout_wheel, &expires)) {
+		return NULL;
+	}
+
+	struct timeval next;
+
+	if(timeout_wheel.expired) {
+		next = timeout_of(timeout_wheel.expired)->tv;
+
+		for(wheel_node_t *node = timeout_wheel.expired->next; node; node = node->next) {
+			if(timercmp(&timeout_of(node)->tv, &next, <)) {
+				next = timeout_of(node)->tv;
+			}
+		}
+	} else {
+		next.tv_sec = (time_t)(expires / 1000);
+		next.tv_usec = (suseconds_t)(expires % 1000 * 1000);
+	}
+
+	if(timercmp(&next, &now, <)) {
+		next = now;
 	}
 
-	return tv;
+	timersub(&next, &now, diff);
+	return diff;
 }
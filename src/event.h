@@ -22,11 +22,19 @@
 
 #include "system.h"
 #include "splay_tree.h"
+#include "timer_wheel.h"
 
 #define IO_READ 1
 #define IO_WRITE 2
 
 typedef void (*io_cb_t)(void *data, int flags);
+#ifdef HAVE_IO_URING
+struct vpn_packet_t;
+union sockaddr_t;
+
+typedef void (*io_recv_cb_t)(void *data, struct vpn_packet_t *packet, union sockaddr_t *addr);
+typedef void (*io_read_cb_t)(void *data, struct vpn_packet_t *packets, size_t count);
+#endif
 typedef void (*timeout_cb_t)(void *data);
 typedef void (*signal_cb_t)(void *data);
 
@@ -35,6 +43,14 @@ typedef struct io_t {
 	int flags;
 #ifdef HAVE_WINDOWS
 	WSAEVENT event;
+#endif
+#ifdef HAVE_LINUX
+	uint32_t events;                // Events currently registered with epoll
+	struct io_t *pending_next;      // Write interest that has not been registered yet
+	struct io_t **pending_pprev;
+#endif
+#ifdef HAVE_IO_URING
+	uint32_t slot;                  // Index + 1 of the request slot used by the io_uring loop
 #endif
 	io_cb_t cb;
 	void *data;
@@ -45,7 +61,7 @@ typedef struct timeout_t {
 	struct timeval tv;
 	timeout_cb_t cb;
 	void *data;
-	splay_node_t node;
+	wheel_node_t node;
 } timeout_t;
 
 typedef struct signal_t {
@@ -57,7 +73,37 @@ typedef struct signal_t {
 extern struct timeval now;
 
 extern splay_tree_t io_tree;
-extern splay_tree_t timeout_tree;
+extern timer_wheel_t timeout_wheel;
+
+#ifdef HAVE_LINUX
+extern uint64_t epoll_ctl_calls;
+extern uint64_t epoll_wait_calls;
+extern uint64_t epoll_direct_writes;
+#endif
+
+#ifdef HAVE_IO_URING
+extern uint64_t io_uring_enter_calls;
+extern uint64_t io_uring_submissions;
+extern uint64_t io_uring_recv_packets;
+extern uint64_t io_uring_read_packets;
+extern uint64_t io_uring_write_packets;
+
+// Switch the event loop from epoll to io_uring. This must be called before any io_t is added.
+extern bool event_use_io_uring(void);
+
+// Receive datagrams from fd with a multishot request, and call cb for each of them.
+// Returns false if the io_uring loop is not used; io_add() has to be used instead.
+extern bool io_add_recv(io_t *io, io_recv_cb_t cb, void *data, int fd);
+
+// Keep reads from fd into packet buffers queued, and call cb for each batch of packets read.
+// Data is read to DATA(packet) + headroom, and packet->len includes the headroom.
+// If a read fails, cb is called with no packets and errno set.
+// Returns false if the io_uring loop is not used, or another io_t already does this.
+extern bool io_add_read(io_t *io, io_read_cb_t cb, void *data, int fd, size_t headroom);
+
+// Queue a copy of buf to be written to fd. Returns false if it has to be written directly.
+extern bool io_write(int fd, const void *buf, size_t len);
+#endif
 
 extern void io_add(io_t *io, io_cb_t cb, void *data, int fd, int flags);
 #ifdef HAVE_WINDOWS
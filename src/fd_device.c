@@ -22,6 +22,7 @@
 
 #include "system.h"
 
+#include <poll.h>
 #include <sys/un.h>
 
 #include "conf.h"
@@ -222,6 +223,31 @@ static bool read_packet(vpn_packet_t *packet) {
 	return true;
 }
 
+/* The fd is shared with the process that handed it to us, so it stays in
+   blocking mode. Only read more packets while poll() says they are there. */
+static bool packet_pending(void) {
+	struct pollfd pfd = {
+		.fd = device_fd,
+		.events = POLLIN,
+	};
+
+	return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN);
+}
+
+static size_t read_packets(vpn_packet_t *packets, size_t count) {
+	if(!count || !read_packet(&packets[0])) {
+		return 0;
+	}
+
+	size_t i = 1;
+
+	while(i < count && packet_pending() && read_packet(&packets[i])) {
+		i++;
+	}
+
+	return i;
+}
+
 static bool write_packet(vpn_packet_t *packet) {
 	logger(DEBUG_TRAFFIC, LOG_DEBUG, "Writing packet of %d bytes to fd/%d.", packet->len, device_fd);
 
@@ -237,5 +263,6 @@ const devops_t fd_devops = {
 	.setup = setup_device,
 	.close = close_device,
 	.read = read_packet,
+	.read_batch = read_packets,
 	.write = write_packet,
 };
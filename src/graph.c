@@ -26,16 +26,34 @@
    Actually, the first one alone would suffice but would make unicast packets
    take longer routes than necessary.
 
-   For the MST algorithm we can choose from Prim's or Kruskal's. I personally
-   favour Kruskal's, because we make an extra AVL tree of edges sorted on
-   weights (metric). That tree only has to be updated when an edge is added or
-   removed, and during the MST algorithm we just have go linearly through that
-   tree, adding safe edges until #edges = #nodes - 1. The implementation here
-   however is not so fast, because I tried to avoid having to make a forest and
-   merge trees.
-
-   For the SSSP algorithm Dijkstra's seems to be a nice choice. Currently a
-   simple breadth-first search is presented here.
+   For the MST algorithm we use Kruskal's, because we keep an extra tree of edges
+   sorted on weights (metric). That tree only has to be updated when an edge is
+   added or removed, and during the MST algorithm we just have to go linearly
+   through that tree, adding edges that connect two different trees, until
+   #edges = #nodes - 1. The MST is only recalculated if an edge that changed
+   could be part of it.
+
+   The SSSP tree is in fact two trees. For each node, we pick the edge from the
+   neighbour that gives it the best label, where a path with no indirect edges
+   is always better than one with indirect edges, then fewer hops are better,
+   and ties are broken on the weight of the last edge and then the name of the
+   neighbour. This determines prevedge, via and distance. The second tree
+   ignores indirect edges and determines nexthop, so that meta traffic always
+   takes the shortest path. Since the label of a node only ever increases
+   along a path, a variant of Dijkstra's algorithm finds the unique solution.
+
+   When edges are added or removed, only the nodes whose best edge disappeared
+   or which could get a better label are put back into the queue, together with
+   all the nodes in the subtree below them. Everything else keeps its label.
+   At debug level 10, the full calculation is also done after every change, and
+   any difference with the incremental result is logged.
+
+   Bursts of ADD_EDGE and DEL_EDGE requests do not recalculate the trees for
+   every single request. Instead, graph_schedule() runs graph() once at the
+   start of the next event loop iteration, or after GraphDelay milliseconds,
+   and any other request that is received before then runs it immediately.
+   While a snapshot of the topology is being received, graph_hold() holds
+   back all scheduled runs, and graph_release() runs graph() once at its end.
 
    The SSSP algorithm will also be used to determine whether nodes are directly,
    indirectly or not reachable from the source. It will also set the correct
@@ -45,6 +63,8 @@
 #include "system.h"
 
 #include "connection.h"
+#include "crypto_pool.h"
+#include "device_workers.h"
 #include "edge.h"
 #include "graph.h"
 #include "list.h"
@@ -52,16 +72,69 @@
 #include "netutl.h"
 #include "node.h"
 #include "protocol.h"
+#include "route.h"
 #include "script.h"
 #include "subnet.h"
 #include "xalloc.h"
 #include "address_cache.h"
 
+typedef enum sssp_tree_t {
+	SSSP_ROUTE,             // prevedge, via and distance
+	SSSP_HOPS,              // hopedge, hops and nexthop
+} sssp_tree_t;
+
+// Bits in node_t.graph_flags
+#define GRAPH_RESET_ROUTE 0x01  // the prevedge of this node was removed or changed
+#define GRAPH_RESET_HOPS 0x02   // the hopedge of this node was removed or changed
+#define GRAPH_MEMBER 0x04       // this node's label is being recalculated
+#define GRAPH_QUEUED 0x08       // this node is waiting in the queue
+#define GRAPH_FINAL 0x10        // this node's label has been determined
+
+typedef struct sssp_label_t {
+	const edge_t *edge;     // last edge of the path, NULL for ourself
+	int distance;           // number of hops, -1 if unreachable
+	bool indirect;          // whether the path contains an indirect edge
+} sssp_label_t;
+
+static const sssp_label_t unreachable = {NULL, -1, true};
+
+static int node_name_compare(const node_t *a, const node_t *b) {
+	return strcmp(a->name, b->name);
+}
+
+// Nodes whose labels might have to change since the last call to graph()
+static splay_tree_t dirty_tree = {
+	.compare = (splay_compare_t) node_name_compare,
+};
+
+// Nodes whose reachability might have changed
+static splay_tree_t touched_tree = {
+	.compare = (splay_compare_t) node_name_compare,
+};
+
+// Nodes whose edge to us should be removed if they are unreachable after the next graph()
+static splay_tree_t stale_tree = {
+	.compare = (splay_compare_t) node_name_compare,
+};
+
+static bool graph_valid;        // false until the trees have been calculated once
+static bool mst_dirty = true;
+static int reachable_nodes;     // number of reachable nodes, not counting ourself
+
 /* Implementation of Kruskal's algorithm.
-   Running time: O(EN)
+   Running time: O(E)
    Please note that sorting on weight is already done by add_edge().
 */
 
+static node_t *mst_find(node_t *n) {
+	while(n->mst_set != n) {
+		n->mst_set = n->mst_set->mst_set;
+		n = n->mst_set;
+	}
+
+	return n;
+}
+
 static void mst_kruskal(void) {
 	/* Clear MST status on connections */
 
@@ -71,33 +144,40 @@ static void mst_kruskal(void) {
 
 	logger(DEBUG_SCARY_THINGS, LOG_DEBUG, "Running Kruskal's algorithm:");
 
-	/* Clear visited status on nodes */
+	/* Every node starts in its own tree */
 
 	for splay_each(node_t, n, &node_tree) {
-		n->status.visited = false;
+		n->mst_set = n;
+	}
+
+	for splay_each(edge_t, e, &edge_weight_tree) {
+		e->mst = false;
 	}
 
-	/* Starting point */
+	/* Add safe edges, only the tree containing ourself matters */
+
+	int needed = reachable_nodes;
 
 	for splay_each(edge_t, e, &edge_weight_tree) {
-		if(e->from->status.reachable) {
-			e->from->status.visited = true;
+		if(needed <= 0) {
 			break;
 		}
-	}
 
-	/* Add safe edges */
+		if(!e->reverse || !e->from->status.reachable) {
+			continue;
+		}
 
-	bool skipped = false;
+		node_t *from = mst_find(e->from);
+		node_t *to = mst_find(e->to);
 
-	for splay_each(edge_t, e, &edge_weight_tree) {
-		if(!e->reverse || (e->from->status.visited == e->to->status.visited)) {
-			skipped = true;
+		if(from == to) {
 			continue;
 		}
 
-		e->from->status.visited = true;
-		e->to->status.visited = true;
+		from->mst_set = to;
+		e->mst = true;
+		e->reverse->mst = true;
+		needed--;
 
 		if(e->connection) {
 			e->connection->status.mst = true;
@@ -108,115 +188,548 @@ static void mst_kruskal(void) {
 		}
 
 		logger(DEBUG_SCARY_THINGS, LOG_DEBUG, " Adding edge %s - %s weight %d", e->from->name, e->to->name, e->weight);
+	}
 
-		if(skipped) {
-			skipped = false;
-			next = edge_weight_tree.head;
-		}
+	mst_dirty = false;
+}
+
+/* Labels for the shortest path trees */
+
+static sssp_label_t get_label(const node_t *n, sssp_tree_t tree) {
+	if(n == myself) {
+		return (sssp_label_t) {
+			NULL, 0, false
+		};
+	}
+
+	if(tree == SSSP_ROUTE) {
+		return n->prevedge ? (sssp_label_t) {
+			n->prevedge, n->distance, n->status.indirect
+		} : unreachable;
+	} else {
+		return n->hopedge ? (sssp_label_t) {
+			n->hopedge, n->hops, false
+		} : unreachable;
 	}
 }
 
-// Not putting it into header, the outside world doesn't need to know about it.
-extern void sssp_bfs(void);
+static void set_label(node_t *n, sssp_tree_t tree, sssp_label_t label) {
+	if(tree == SSSP_ROUTE) {
+		n->prevedge = (edge_t *)label.edge;
+		n->distance = label.distance;
+		n->status.indirect = label.indirect;
+	} else {
+		n->hopedge = (edge_t *)label.edge;
+		n->hops = label.distance;
+	}
+}
 
-/* Implementation of a simple breadth-first search algorithm.
-   Running time: O(E)
+static edge_t *get_edge(const node_t *n, sssp_tree_t tree) {
+	return tree == SSSP_ROUTE ? n->prevedge : n->hopedge;
+}
+
+// The label of e->to if it is reached via e
+static sssp_label_t extend_label(sssp_label_t label, const edge_t *e, sssp_tree_t tree) {
+	return (sssp_label_t) {
+		e, label.distance + 1, tree == SSSP_ROUTE && (label.indirect || e->options & OPTION_INDIRECT)
+	};
+}
+
+static int compare_labels(sssp_label_t a, sssp_label_t b) {
+	if(a.distance < 0 || b.distance < 0) {
+		return (a.distance < 0) - (b.distance < 0);
+	}
+
+	if(a.indirect != b.indirect) {
+		return a.indirect - b.indirect;
+	}
+
+	if(a.distance != b.distance) {
+		return a.distance - b.distance;
+	}
+
+	if(a.edge == b.edge) {
+		return 0;
+	}
+
+	if(a.edge->weight != b.edge->weight) {
+		return a.edge->weight < b.edge->weight ? -1 : 1;
+	}
+
+	return strcmp(a.edge->from->name, b.edge->from->name);
+}
+
+static int compare_queued(const node_t *a, const node_t *b, sssp_tree_t tree) {
+	int result = compare_labels(get_label(a, tree), get_label(b, tree));
+	return result ? result : strcmp(a->name, b->name);
+}
+
+static int compare_queued_route(const node_t *a, const node_t *b) {
+	return compare_queued(a, b, SSSP_ROUTE);
+}
+
+static int compare_queued_hops(const node_t *a, const node_t *b) {
+	return compare_queued(a, b, SSSP_HOPS);
+}
+
+/* Dijkstra's algorithm, limited to the nodes that are members of the update.
+   Running time: O(M log M) where M is the number of affected nodes and their edges.
 */
-void sssp_bfs(void) {
-	list_t *todo_list = list_alloc(NULL);
 
-	/* Clear visited status on nodes */
+typedef struct sssp_state_t {
+	sssp_tree_t tree;
+	splay_tree_t queue;
+	list_t members;
+} sssp_state_t;
 
-	for splay_each(node_t, n, &node_tree) {
-		n->status.visited = false;
-		n->status.indirect = true;
-		n->distance = -1;
+// The best label n can get from neighbours whose labels are known
+static sssp_label_t best_label(const node_t *n, sssp_tree_t tree) {
+	sssp_label_t best = unreachable;
+
+	for splay_each(edge_t, e, &n->edge_tree) {
+		const node_t *neighbour = e->to;
+
+		if(!e->reverse || ((neighbour->graph_flags & GRAPH_MEMBER) && !(neighbour->graph_flags & GRAPH_FINAL))) {
+			continue;
+		}
+
+		sssp_label_t label = get_label(neighbour, tree);
+
+		if(label.distance < 0) {
+			continue;
+		}
+
+		label = extend_label(label, e->reverse, tree);
+
+		if(compare_labels(label, best) < 0) {
+			best = label;
+		}
+	}
+
+	return best;
+}
+
+static void queue_node(sssp_state_t *state, node_t *n, sssp_label_t label) {
+	if(n->graph_flags & GRAPH_QUEUED) {
+		splay_delete(&state->queue, n);
+		n->graph_flags &= ~GRAPH_QUEUED;
+	}
+
+	set_label(n, state->tree, label);
+
+	if(label.distance >= 0) {
+		splay_insert(&state->queue, n);
+		n->graph_flags |= GRAPH_QUEUED;
+	}
+}
+
+// Make n and all nodes reached through it members of the update, and clear their labels
+static void add_subtree(sssp_state_t *state, node_t *root, list_t *added) {
+	sssp_tree_t tree = state->tree;
+	list_t *todo = list_alloc(NULL);
+	list_insert_tail(todo, root);
+
+	for list_each(node_t, n, todo) {
+		for splay_each(edge_t, e, &n->edge_tree) {
+			if(e->to != myself && get_edge(e->to, tree) == e) {
+				list_insert_tail(todo, e->to);
+			}
+		}
+
+		if(!(n->graph_flags & GRAPH_MEMBER)) {
+			n->graph_flags |= GRAPH_MEMBER;
+			list_insert_tail(&state->members, n);
+		}
+
+		n->graph_flags &= ~(GRAPH_FINAL | (tree == SSSP_ROUTE ? GRAPH_RESET_ROUTE : GRAPH_RESET_HOPS));
+		queue_node(state, n, unreachable);
+
+		if(tree == SSSP_ROUTE) {
+			n->status.visited = false;
+		}
+
+		list_insert_tail(added, n);
+
+		next = node->next; /* Because the list_insert_tail() above could have added something extra for us! */
+		list_delete_node(todo, node);
 	}
 
-	/* Begin with myself */
+	list_free(todo);
+}
+
+static void seed_nodes(sssp_state_t *state, list_t *nodes) {
+	for list_each(node_t, n, nodes) {
+		queue_node(state, n, best_label(n, state->tree));
+	}
+}
+
+// Whether the label of n could change
+static bool needs_update(const node_t *n, sssp_tree_t tree) {
+	if(n->graph_flags & (tree == SSSP_ROUTE ? GRAPH_RESET_ROUTE : GRAPH_RESET_HOPS)) {
+		return true;
+	}
+
+	sssp_label_t best = best_label(n, tree);
+	sssp_label_t current = get_label(n, tree);
+	return compare_labels(best, current) || best.edge != current.edge;
+}
+
+static void finalize_node(node_t *n, sssp_tree_t tree) {
+	const edge_t *e = get_edge(n, tree);
+	node_t *from = e->from;
+
+	if(tree == SSSP_ROUTE) {
+		n->status.visited = true;
+		n->via = n->status.indirect ? from->via : n;
+		n->options = e->options;
+
+		if(!n->status.reachable || (n->address.sa.sa_family == AF_UNSPEC && e->address.sa.sa_family != AF_UNKNOWN)) {
+			update_node_udp(n, &e->address);
+		}
+	} else {
+		n->nexthop = (from == myself) ? n : from->nexthop;
+	}
+}
+
+static void sssp_run(sssp_state_t *state) {
+	sssp_tree_t tree = state->tree;
+
+	while(state->queue.head) {
+		node_t *n = state->queue.head->data;
+		splay_delete_node(&state->queue, state->queue.head);
+		n->graph_flags &= ~GRAPH_QUEUED;
+		n->graph_flags |= GRAPH_FINAL;
+		finalize_node(n, tree);
+
+		logger(DEBUG_SCARY_THINGS, LOG_DEBUG, " Examining edges from %s", n->name);
+
+		sssp_label_t label = get_label(n, tree);
+
+		for splay_each(edge_t, e, &n->edge_tree) {
+			node_t *to = e->to;
+
+			if(!e->reverse || to == myself) {
+				continue;
+			}
+
+			sssp_label_t candidate = extend_label(label, e, tree);
 
+			if(compare_labels(candidate, get_label(to, tree)) >= 0) {
+				continue;
+			}
+
+			if(to->graph_flags & GRAPH_MEMBER) {
+				if(!(to->graph_flags & GRAPH_FINAL)) {
+					queue_node(state, to, candidate);
+				}
+			} else {
+				// A node outside the update gets a better label, so it and its subtree have to be updated as well
+				list_t added = {0};
+				add_subtree(state, to, &added);
+				seed_nodes(state, &added);
+				list_empty_list(&added);
+			}
+		}
+	}
+}
+
+static void sssp_update(sssp_tree_t tree, bool full) {
+	sssp_state_t state = {
+		.tree = tree,
+		.queue = {.compare = (splay_compare_t)(tree == SSSP_ROUTE ? compare_queued_route : compare_queued_hops)},
+	};
+
+	list_t added = {0};
+
+	if(full) {
+		for splay_each(node_t, n, &node_tree) {
+			if(n != myself && !(n->graph_flags & GRAPH_MEMBER)) {
+				add_subtree(&state, n, &added);
+			}
+		}
+	} else {
+		for splay_each(node_t, n, &dirty_tree) {
+			if(n != myself && !(n->graph_flags & GRAPH_MEMBER) && needs_update(n, tree)) {
+				add_subtree(&state, n, &added);
+			}
+		}
+	}
+
+	seed_nodes(&state, &added);
+	list_empty_list(&added);
+
+	sssp_run(&state);
+
+	for list_each(node_t, n, &state.members) {
+		if(!(n->graph_flags & GRAPH_FINAL)) {
+			set_label(n, tree, unreachable);
+
+			if(tree == SSSP_ROUTE) {
+				n->status.indirect = true;
+			}
+		}
+
+		n->graph_flags &= ~(GRAPH_MEMBER | GRAPH_FINAL);
+
+		if(tree == SSSP_ROUTE && !full) {
+			splay_insert(&touched_tree, n);
+		}
+	}
+
+	list_empty_list(&state.members);
+}
+
+static void sssp_begin(void) {
 	myself->status.visited = true;
 	myself->status.indirect = false;
 	myself->nexthop = myself;
 	myself->prevedge = NULL;
+	myself->hopedge = NULL;
 	myself->via = myself;
 	myself->distance = 0;
-	list_insert_head(todo_list, myself);
+	myself->hops = 0;
+}
 
-	/* Loop while todo_list is filled */
+// Not putting it into header, the outside world doesn't need to know about it.
+extern void sssp_bfs(void);
+extern void sssp_incremental(void);
 
-	for list_each(node_t, n, todo_list) {                   /* "n" is the node from which we start */
-		logger(DEBUG_SCARY_THINGS, LOG_DEBUG, " Examining edges from %s", n->name);
+/* Calculate the shortest path trees from scratch.
+   Running time: O(E log N)
+*/
+void sssp_bfs(void) {
+	sssp_begin();
+	sssp_update(SSSP_ROUTE, true);
+	sssp_update(SSSP_HOPS, true);
+	splay_empty_tree(&dirty_tree);
+	graph_valid = true;
+}
 
-		if(n->distance < 0) {
-			abort();
+/* Update the shortest path trees after edges were added or removed. */
+void sssp_incremental(void) {
+	sssp_begin();
+	sssp_update(SSSP_ROUTE, false);
+	sssp_update(SSSP_HOPS, false);
+	splay_empty_tree(&dirty_tree);
+}
+
+typedef struct sssp_result_t {
+	node_t *node;
+	edge_t *prevedge;
+	edge_t *hopedge;
+	node_t *nexthop;
+	node_t *via;
+	int distance;
+	int hops;
+	uint32_t options;
+	bool visited;
+	bool indirect;
+} sssp_result_t;
+
+static void save_result(sssp_result_t *r, node_t *n) {
+	r->node = n;
+	r->visited = n->status.visited;
+	r->prevedge = n->prevedge;
+	r->hopedge = n->hopedge;
+
+	if(r->visited) {
+		r->indirect = n->status.indirect;
+		r->distance = n->distance;
+		r->hops = n->hops;
+		r->nexthop = n->nexthop;
+		r->via = n->via;
+		r->options = n->options;
+	}
+}
+
+// Compare the result of the incremental update with a full recalculation
+static void sssp_verify(void) {
+	size_t count = node_tree.count;
+	sssp_result_t *incremental = xzalloc(count * sizeof(*incremental));
+	size_t i = 0;
+
+	for splay_each(node_t, n, &node_tree) {
+		save_result(&incremental[i++], n);
+	}
+
+	sssp_bfs();
+
+	for(i = 0; i < count; i++) {
+		sssp_result_t full;
+		memset(&full, 0, sizeof(full));
+		save_result(&full, incremental[i].node);
+
+		if(memcmp(&full, &incremental[i], sizeof(full))) {
+			logger(DEBUG_ALWAYS, LOG_ERR, "Incremental shortest path calculation differs from full calculation for node %s", full.node->name);
 		}
+	}
 
-		for splay_each(edge_t, e, &n->edge_tree) {       /* "e" is the edge connected to "from" */
-			if(!e->reverse || e->to == myself) {
-				continue;
-			}
+	free(incremental);
+}
 
-			/* Situation:
+/* Tracking changes to the graph */
 
-			           /
-			          /
-			   ----->(n)---e-->(e->to)
-			          \
-			           \
+static void mark_dirty(node_t *n) {
+	splay_insert(&dirty_tree, n);
+}
 
-			   Where e is an edge, (n) and (e->to) are nodes.
-			   n->address is set to the e->address of the edge left of n to n.
-			   We are currently examining the edge e right of n from n:
+void graph_add_edge(edge_t *e) {
+	if(!e->reverse) {
+		return;
+	}
 
-			   - If edge e provides for better reachability of e->to, update
-			     e->to and (re)add it to the todo_list to (re)examine the reachability
-			     of nodes behind it.
-			 */
+	// Both directions just became usable
+	mark_dirty(e->to);
+	mark_dirty(e->from);
 
-			bool indirect = n->status.indirect || e->options & OPTION_INDIRECT;
+	if(e->from->status.reachable || e->to->status.reachable) {
+		mst_dirty = true;
+	}
+}
 
-			if(e->to->status.visited
-			                && (!e->to->status.indirect || indirect)
-			                && (e->to->distance != n->distance + 1 || e->weight >= e->to->prevedge->weight)) {
-				continue;
-			}
+static void forget_edge(edge_t *e) {
+	node_t *to = e->to;
 
-			// Only update nexthop if it doesn't increase the path length
+	if(to->prevedge == e) {
+		to->prevedge = NULL;
+		to->graph_flags |= GRAPH_RESET_ROUTE;
+		mark_dirty(to);
+	}
 
-			if(!e->to->status.visited || (e->to->distance == n->distance + 1 && e->weight < e->to->prevedge->weight)) {
-				e->to->nexthop = (n->nexthop == myself) ? e->to : n->nexthop;
-			}
+	if(to->hopedge == e) {
+		to->hopedge = NULL;
+		to->graph_flags |= GRAPH_RESET_HOPS;
+		mark_dirty(to);
+	}
+}
+
+void graph_del_edge(edge_t *e) {
+	forget_edge(e);
+
+	if(e->reverse) {
+		forget_edge(e->reverse);
+	}
+
+	if(e->mst) {
+		mst_dirty = true;
+	}
+}
+
+void graph_update_edge(edge_t *e) {
+	if(e->to->prevedge == e) {
+		e->to->graph_flags |= GRAPH_RESET_ROUTE;
+	}
+
+	if(e->to->hopedge == e) {
+		e->to->graph_flags |= GRAPH_RESET_HOPS;
+	}
 
-			e->to->status.visited = true;
-			e->to->status.indirect = indirect;
-			e->to->prevedge = e;
-			e->to->via = indirect ? n->via : e->to;
-			e->to->options = e->options;
-			e->to->distance = n->distance + 1;
+	mark_dirty(e->to);
 
-			if(!e->to->status.reachable || (e->to->address.sa.sa_family == AF_UNSPEC && e->address.sa.sa_family != AF_UNKNOWN)) {
-				update_node_udp(e->to, &e->address);
+	if(e->from->status.reachable) {
+		mst_dirty = true;
+	}
+}
+
+void graph_del_node(node_t *n) {
+	splay_delete(&dirty_tree, n);
+	splay_delete(&touched_tree, n);
+	splay_delete(&stale_tree, n);
+}
+
+void graph_check_stale_edge(node_t *n) {
+	splay_insert(&stale_tree, n);
+}
+
+/* If a node is not reachable anymore but we remember it had an edge to us, clean it up */
+
+static void purge_stale_edges(void) {
+	for splay_each(node_t, n, &stale_tree) {
+		if(n->status.reachable) {
+			continue;
+		}
+
+		edge_t *e = lookup_edge(n, myself);
+
+		if(e) {
+			if(!tunnelserver) {
+				send_del_edge(everyone, e);
 			}
 
-			list_insert_tail(todo_list, e->to);
+			edge_del(e);
 		}
+	}
 
-		next = node->next; /* Because the list_insert_tail() above could have added something extra for us! */
-		list_delete_node(todo_list, node);
+	splay_empty_tree(&stale_tree);
+}
+
+/* Deferred recalculation */
+
+int graph_delay;
+uint64_t graph_runs;
+uint64_t graph_coalesced;
+
+static timeout_t graph_timeout;
+static bool graph_pending;
+static int graph_holds;
+
+static void graph_handler(void *data) {
+	(void)data;
+	graph();
+}
+
+void graph_schedule(void) {
+	if(graph_pending) {
+		graph_coalesced++;
+		return;
+	}
+
+	graph_pending = true;
+
+	if(!graph_holds) {
+		timeout_add(&graph_timeout, graph_handler, NULL, &(struct timeval) {
+			graph_delay / 1000, graph_delay % 1000 * 1000
+		});
+	}
+}
+
+void graph_flush(void) {
+	if(graph_pending && !graph_holds) {
+		graph();
+	}
+}
+
+void graph_hold(void) {
+	if(!graph_holds++) {
+		timeout_del(&graph_timeout);
 	}
+}
 
-	list_free(todo_list);
+void graph_release(void) {
+	if(!--graph_holds) {
+		graph();
+	}
 }
 
-static void check_reachability(void) {
+void exit_graph(void) {
+	timeout_del(&graph_timeout);
+	graph_pending = false;
+	graph_holds = 0;
+	splay_empty_tree(&dirty_tree);
+	splay_empty_tree(&touched_tree);
+	splay_empty_tree(&stale_tree);
+	graph_valid = false;
+	mst_dirty = true;
+	reachable_nodes = 0;
+}
+
+static void check_reachability(splay_tree_t *nodes) {
 	/* Check reachability status. */
 
-	int reachable_count = 0;
 	int became_reachable_count = 0;
 	int became_unreachable_count = 0;
 
-	for splay_each(node_t, n, &node_tree) {
+	for splay_each(node_t, n, nodes) {
 		if(n->status.visited != n->status.reachable) {
 			n->status.reachable = !n->status.reachable;
 			n->last_state_change = now.tv_sec;
@@ -227,6 +740,7 @@ static void check_reachability(void) {
 
 				if(n != myself) {
 					became_reachable_count++;
+					reachable_nodes++;
 
 					if(n->connection && n->connection->outgoing) {
 						if(!n->address_cache) {
@@ -242,6 +756,7 @@ static void check_reachability(void) {
 
 				if(n != myself) {
 					became_unreachable_count++;
+					reachable_nodes--;
 				}
 			}
 
@@ -254,6 +769,8 @@ static void check_reachability(void) {
 			n->status.validkey = false;
 
 			if(n->status.sptps) {
+				crypto_pool_cancel(n);
+				device_workers_cancel(n);
 				sptps_stop(&n->sptps);
 				n->status.waitingforkey = false;
 			}
@@ -301,25 +818,45 @@ static void check_reachability(void) {
 					send_ans_key(n);
 				}
 			}
-		}
 
-		if(n->status.reachable && n != myself) {
-			reachable_count++;
+			mst_dirty = true;
 		}
 	}
 
 	if(device_standby) {
-		if(reachable_count == 0 && became_unreachable_count > 0) {
+		if(reachable_nodes == 0 && became_unreachable_count > 0) {
 			device_disable();
-		} else if(reachable_count > 0 && reachable_count == became_reachable_count) {
+		} else if(reachable_nodes > 0 && reachable_nodes == became_reachable_count) {
 			device_enable();
 		}
 	}
 }
 
 void graph(void) {
+	timeout_del(&graph_timeout);
+	graph_pending = false;
+	graph_runs++;
+
 	subnet_cache_flush_tables();
-	sssp_bfs();
-	check_reachability();
-	mst_kruskal();
+	route_cache_flush();
+
+	if(!graph_valid) {
+		sssp_bfs();
+		check_reachability(&node_tree);
+	} else if(debug_level >= DEBUG_SCARY_THINGS) {
+		sssp_incremental();
+		sssp_verify();
+		splay_empty_tree(&touched_tree);
+		check_reachability(&node_tree);
+	} else {
+		sssp_incremental();
+		check_reachability(&touched_tree);
+		splay_empty_tree(&touched_tree);
+	}
+
+	if(mst_dirty) {
+		mst_kruskal();
+	}
+
+	purge_stale_edges();
 }
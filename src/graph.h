@@ -21,6 +21,30 @@
     51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
+extern int graph_delay;
+extern uint64_t graph_runs;
+extern uint64_t graph_coalesced;
+
 extern void graph(void);
+extern void exit_graph(void);
+
+/* Run graph() once after the current burst of changes, instead of immediately */
+extern void graph_schedule(void);
+
+/* Run a scheduled graph() right now, if there is one */
+extern void graph_flush(void);
+
+/* Hold back scheduled runs of graph() until a matching graph_release(), which runs it once */
+extern void graph_hold(void);
+extern void graph_release(void);
+
+/* After the next graph(), remove the edge from n to us if n has become unreachable */
+extern void graph_check_stale_edge(struct node_t *n);
+
+/* Keep track of changes to the graph since the last call to graph() */
+extern void graph_add_edge(struct edge_t *e);
+extern void graph_del_edge(struct edge_t *e);
+extern void graph_update_edge(struct edge_t *e);
+extern void graph_del_node(struct node_t *n);
 
 #endif
@@ -21,62 +21,181 @@
 */
 
 
+#include "system.h"
+
+#include "xalloc.h"
+
 /* Map 32 bits int onto 0..n-1, without throwing away too many bits if n is 2^8 or 2^16 */
 
 uint32_t modulo(uint32_t hash, size_t n);
 
 #define HASH_SEARCH_ITERATIONS 4
+#define HASH_MIN_SIZE 256
+
+/* Counters shared by all hash tables, added up by hash_stats() */
+
+typedef struct hash_stats_t {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t flushes;
+	uint64_t resizes;
+	uint64_t entries;
+	uint64_t size;
+} hash_stats_t;
+
+/*
+   The tables start small and double in size up to n slots when they fill up.
+   Entries are only valid if they carry the table's current generation,
+   so clearing a table just starts a new generation. Values may be NULL,
+   which allows negative results to be cached as well.
+*/
+
+/* Spread the bits of a hash over the low bits, since the tables can be much smaller than 2^32 */
+
+static inline uint32_t hash_mix(uint32_t hash) {
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bU;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35U;
+	hash ^= hash >> 16;
+	return hash;
+}
 
 #define hash_insert(t, ...) hash_insert_ ## t (__VA_ARGS__)
 #define hash_delete(t, ...) hash_delete_ ## t (__VA_ARGS__)
 #define hash_search(t, ...) hash_search_ ## t (__VA_ARGS__)
 #define hash_clear(t, n) hash_clear_ ## t ((n))
+#define hash_free(t, n) hash_free_ ## t ((n))
+#define hash_stats(t, ...) hash_stats_ ## t (__VA_ARGS__)
 
 #define hash_define(t, n) \
+	typedef struct hash_entry_ ## t { \
+		t key; \
+		uint32_t generation; \
+		const void *value; \
+	} hash_entry_ ## t; \
 	typedef struct hash_ ## t { \
-		t keys[n]; \
-		const void *values[n]; \
+		hash_entry_ ## t *entries; \
+		uint32_t size; \
+		uint32_t used; \
+		uint32_t generation; \
+		hash_stats_t stats; \
 	} hash_ ## t; \
-	static inline uint32_t hash_modulo_ ## t(uint32_t hash) { \
-		return hash & (n - 1); \
+	static inline bool hash_put_ ## t (hash_ ##t *hash, const t *key, const void *value) { \
+		uint32_t mask = hash->size - 1; \
+		uint32_t i = hash_mix(hash_function_ ## t(key)) & mask; \
+		hash_entry_ ## t *free_entry = NULL; \
+		for(uint8_t f=0; f<HASH_SEARCH_ITERATIONS; f++){ \
+			hash_entry_ ## t *entry = &hash->entries[i]; \
+			if(entry->generation != hash->generation) { \
+				if(!free_entry) free_entry = entry; \
+			} else if(!memcmp(key, &entry->key, sizeof(t))) { \
+				entry->value = value; \
+				return true; \
+			} \
+			i = (i + 1) & mask; \
+		} \
+		if(!free_entry) return false; \
+		memcpy(&free_entry->key, key, sizeof(t)); \
+		free_entry->generation = hash->generation; \
+		free_entry->value = value; \
+		hash->used++; \
+		return true; \
+	} \
+	static inline void hash_resize_ ## t (hash_ ##t *hash, uint32_t size) { \
+		hash_entry_ ## t *old = hash->entries; \
+		uint32_t oldsize = hash->size; \
+		uint32_t evicted; \
+		if(!hash->generation) hash->generation = 1; \
+		/* Keep growing if the old entries do not fit, unless the table is as large as it gets */ \
+		do { \
+			if(hash->entries != old) free(hash->entries); \
+			hash->entries = xzalloc(size * sizeof(*hash->entries)); \
+			hash->size = size; \
+			hash->used = 0; \
+			evicted = 0; \
+			for(uint32_t i = 0; i < oldsize; i++) { \
+				if(old[i].generation == hash->generation && !hash_put_ ## t(hash, &old[i].key, old[i].value)) { \
+					evicted++; \
+				} \
+			} \
+			size *= 2; \
+		} while(evicted && size <= (n)); \
+		free(old); \
+		hash->stats.evictions += evicted; \
+		hash->stats.resizes++; \
 	} \
 	static inline void hash_insert_ ## t (hash_ ##t *hash, const t *key, const void *value) { \
-		uint32_t i = hash_modulo_ ## t(hash_function_ ## t(key)); \
-		for(uint8_t f=0; f< (HASH_SEARCH_ITERATIONS - 1); f++){ \
-			if(hash->values[i] == NULL || !memcmp(key, &hash->keys[i], sizeof(t))) { \
-				memcpy(&hash->keys[i], key, sizeof(t)); \
-				hash->values[i] = value; \
-				return; \
+		if(!hash->size) { \
+			hash_resize_ ## t(hash, (n) < HASH_MIN_SIZE ? (n) : HASH_MIN_SIZE); \
+		} else if(hash->size < (n) && hash->used >= hash->size / 4 * 3) { \
+			hash_resize_ ## t(hash, hash->size * 2); \
+		} \
+		while(!hash_put_ ## t(hash, key, value)) { \
+			if(hash->size < (n)) { \
+				hash_resize_ ## t(hash, hash->size * 2); \
+				continue; \
 			} \
-			if(++i == n) i = 0; \
+			/* The table is as large as it gets, replace the entry in the home slot */ \
+			hash_entry_ ## t *entry = &hash->entries[hash_mix(hash_function_ ## t(key)) & (hash->size - 1)]; \
+			memcpy(&entry->key, key, sizeof(t)); \
+			entry->value = value; \
+			hash->stats.evictions++; \
+			return; \
 		} \
-		/* We always pick the last slot. It's unfair. But thats life */ \
-		memcpy(&hash->keys[i], key, sizeof(t)); \
-		hash->values[i] = value; \
 	} \
-	static inline void *hash_search_ ## t (const hash_ ##t *hash, const t *key) { \
-		uint32_t i = hash_modulo_ ## t(hash_function_ ## t(key)); \
-		for(uint8_t f=0; f<HASH_SEARCH_ITERATIONS; f++){ \
-			if(!memcmp(key, &hash->keys[i], sizeof(t))) { \
-				return (void *)hash->values[i]; \
+	static inline bool hash_search_ ## t (hash_ ##t *hash, const t *key, void **value) { \
+		uint32_t mask = hash->size - 1; \
+		uint32_t i = hash_mix(hash_function_ ## t(key)) & mask; \
+		for(uint8_t f=0; hash->size && f<HASH_SEARCH_ITERATIONS; f++){ \
+			const hash_entry_ ## t *entry = &hash->entries[i]; \
+			if(entry->generation == hash->generation && !memcmp(key, &entry->key, sizeof(t))) { \
+				hash->stats.hits++; \
+				*value = (void *)entry->value; \
+				return true; \
 			} \
-			if(++i == n) i = 0; \
+			i = (i + 1) & mask; \
 		} \
-		return NULL; \
+		hash->stats.misses++; \
+		return false; \
 	} \
 	static inline void hash_delete_ ## t (hash_ ##t *hash, const t *key) { \
-		uint32_t i = hash_modulo_ ## t(hash_function_ ## t(key)); \
-		for(uint8_t f=0; f<HASH_SEARCH_ITERATIONS; f++){ \
-			if(!memcmp(key, &hash->keys[i], sizeof(t))) { \
-				hash->values[i] = NULL; \
+		uint32_t mask = hash->size - 1; \
+		uint32_t i = hash_mix(hash_function_ ## t(key)) & mask; \
+		for(uint8_t f=0; hash->size && f<HASH_SEARCH_ITERATIONS; f++){ \
+			hash_entry_ ## t *entry = &hash->entries[i]; \
+			if(entry->generation == hash->generation && !memcmp(key, &entry->key, sizeof(t))) { \
+				entry->generation = 0; \
+				hash->used--; \
 				return; \
 			} \
-			if(++i == n) i = 0; \
+			i = (i + 1) & mask; \
 		} \
 	} \
 	static inline void hash_clear_ ## t(hash_ ##t *hash) { \
-		memset(hash->values, 0, n * sizeof(*hash->values)); \
-		memset(hash->keys, 0, n * sizeof(*hash->keys)); \
+		hash->used = 0; \
+		hash->stats.flushes++; \
+		if(!++hash->generation) { \
+			/* Wrapped around, old entries could look valid again */ \
+			if(hash->entries) memset(hash->entries, 0, hash->size * sizeof(*hash->entries)); \
+			hash->generation = 1; \
+		} \
+	} \
+	static inline void hash_free_ ## t(hash_ ##t *hash) { \
+		free(hash->entries); \
+		hash->entries = NULL; \
+		hash->size = 0; \
+		hash->used = 0; \
+	} \
+	static inline void hash_stats_ ## t(const hash_ ##t *hash, hash_stats_t *stats) { \
+		stats->hits += hash->stats.hits; \
+		stats->misses += hash->stats.misses; \
+		stats->evictions += hash->stats.evictions; \
+		stats->flushes += hash->stats.flushes; \
+		stats->resizes += hash->stats.resizes; \
+		stats->entries += hash->used; \
+		stats->size += hash->size; \
 	}
 
 
@@ -238,6 +238,10 @@
 #include <netinet/tcp.h>
 #endif
 
+#ifdef HAVE_NETINET_UDP_H
+#include <netinet/udp.h>
+#endif
+
 #ifdef HAVE_NETINET_IN6_H
 #include <netinet/in6.h>
 #endif
@@ -25,6 +25,7 @@
 
 #include "../conf.h"
 #include "../device.h"
+#include "../ethernet.h"
 #include "../logger.h"
 #include "../names.h"
 #include "../route.h"
@@ -43,6 +44,28 @@ static char *type = NULL;
 static char ifrname[IFNAMSIZ];
 static const char *device_info;
 
+/* Open another queue of a multi-queue interface */
+static int open_queue(struct ifreq *ifr) {
+	int fd = open(device, O_RDWR | O_NONBLOCK);
+
+	if(fd < 0) {
+		return -1;
+	}
+
+#ifdef FD_CLOEXEC
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+
+	if(ioctl(fd, TUNSETIFF, ifr)) {
+		int saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+		return -1;
+	}
+
+	return fd;
+}
+
 static bool setup_device(void) {
 	if(!get_config_string(lookup_config(&config_tree, "Device"), &device)) {
 		device = xstrdup(DEFAULT_DEVICE);
@@ -98,6 +121,30 @@ static bool setup_device(void) {
 
 #endif
 
+	int queues = 1;
+
+	if(get_config_int(lookup_config(&config_tree, "DeviceQueues"), &queues)) {
+		if(queues < 1 || queues > MAX_DEVICE_QUEUES) {
+			logger(DEBUG_ALWAYS, LOG_ERR, "DeviceQueues must be between 1 and %d!", MAX_DEVICE_QUEUES);
+			return false;
+		}
+
+#ifdef IFF_MULTI_QUEUE
+
+		if(queues > 1) {
+			ifr.ifr_flags |= IFF_MULTI_QUEUE;
+		}
+
+#else
+
+		if(queues > 1) {
+			logger(DEBUG_ALWAYS, LOG_WARNING, "Multi-queue tun/tap devices are not supported, using a single queue");
+			queues = 1;
+		}
+
+#endif
+	}
+
 	if(iface) {
 		strncpy(ifr.ifr_name, iface, IFNAMSIZ);
 		ifr.ifr_name[IFNAMSIZ - 1] = 0;
@@ -115,6 +162,27 @@ static bool setup_device(void) {
 
 	logger(DEBUG_ALWAYS, LOG_INFO, "%s is a %s", device, device_info);
 
+	/* The kernel picks the queue for each packet by its flow,
+	   so packets of the same connection are still read in order. */
+
+	device_queue_fd[0] = device_fd;
+	device_queues = 1;
+
+	while(device_queues < (size_t)queues) {
+		int fd = open_queue(&ifr);
+
+		if(fd < 0) {
+			logger(DEBUG_ALWAYS, LOG_WARNING, "Could not open queue %lu of %s: %s", (unsigned long)device_queues, ifrname, strerror(errno));
+			break;
+		}
+
+		device_queue_fd[device_queues++] = fd;
+	}
+
+	if(device_queues > 1) {
+		logger(DEBUG_ALWAYS, LOG_INFO, "Using %lu queues of %s", (unsigned long)device_queues, ifrname);
+	}
+
 	if(ifr.ifr_flags & IFF_TAP) {
 		struct ifreq ifr_mac = {0};
 
@@ -129,6 +197,12 @@ static bool setup_device(void) {
 }
 
 static void close_device(void) {
+	for(size_t i = 1; i < device_queues; i++) {
+		close(device_queue_fd[i]);
+	}
+
+	device_queues = 0;
+
 	close(device_fd);
 	device_fd = -1;
 
@@ -141,19 +215,18 @@ static void close_device(void) {
 	device_info = NULL;
 }
 
-static bool read_packet(vpn_packet_t *packet) {
+/* Read a single packet from fd. Nothing is logged, so that device workers can
+   use this as well. Returns false with errno set if no packet could be read. */
+static bool read_from(int fd, vpn_packet_t *packet) {
 	ssize_t inlen;
 
 	switch(device_type) {
 	case DEVICE_TYPE_TUN:
-		inlen = read(device_fd, DATA(packet) + 10, MTU - 10);
+		inlen = read(fd, DATA(packet) + 10, MTU - 10);
 
 		if(inlen <= 0) {
-			logger(DEBUG_ALWAYS, LOG_ERR, "Error while reading from %s %s: %s",
-			       device_info, device, strerror(errno));
-
-			if(errno == EBADFD) {  /* File descriptor in bad state */
-				event_exit();
+			if(!inlen) {
+				errno = EIO;
 			}
 
 			return false;
@@ -164,11 +237,13 @@ static bool read_packet(vpn_packet_t *packet) {
 		break;
 
 	case DEVICE_TYPE_TAP:
-		inlen = read(device_fd, DATA(packet), MTU);
+		inlen = read(fd, DATA(packet), MTU);
 
 		if(inlen <= 0) {
-			logger(DEBUG_ALWAYS, LOG_ERR, "Error while reading from %s %s: %s",
-			       device_info, device, strerror(errno));
+			if(!inlen) {
+				errno = EIO;
+			}
+
 			return false;
 		}
 
@@ -179,47 +254,194 @@ static bool read_packet(vpn_packet_t *packet) {
 		abort();
 	}
 
+	return true;
+}
+
+/* Read a single packet from the device. When draining, running out of
+   packets is expected and is not reported as an error. */
+static bool read_one_packet(vpn_packet_t *packet, bool drain) {
+	if(!read_from(device_fd, packet)) {
+		if(drain && errno == EAGAIN) {
+			return false;
+		}
+
+		logger(DEBUG_ALWAYS, LOG_ERR, "Error while reading from %s %s: %s",
+		       device_info, device, strerror(errno));
+
+		if(device_type == DEVICE_TYPE_TUN && errno == EBADFD) {  /* File descriptor in bad state */
+			event_exit();
+		}
+
+		return false;
+	}
+
 	logger(DEBUG_TRAFFIC, LOG_DEBUG, "Read packet of %d bytes from %s", packet->len,
 	       device_info);
 
 	return true;
 }
 
+static bool read_packet(vpn_packet_t *packet) {
+	return read_one_packet(packet, false);
+}
+
+static size_t read_packets(vpn_packet_t *packets, size_t count) {
+	if(!count || !read_one_packet(&packets[0], false)) {
+		return 0;
+	}
+
+	size_t i = 1;
+
+	while(i < count && read_one_packet(&packets[i], true)) {
+		i++;
+	}
+
+	return i;
+}
+
+/* Read as many packets as one queue has ready, up to count. This is called by
+   device workers, so it must not log. Returns 0 with errno set on errors. */
+static size_t read_queue(size_t queue, vpn_packet_t *packets, size_t count) {
+	int fd = device_queue_fd[queue];
+	size_t i = 0;
+
+	while(i < count && read_from(fd, &packets[i])) {
+		i++;
+	}
+
+	return i;
+}
+
+/* Pick the queue to write a packet to by its addresses, so packets of
+   one flow always enter the kernel through the same queue, and the
+   per-queue receive packet steering settings (rps_cpus) apply to them. */
+static int write_fd(const vpn_packet_t *packet) {
+	if(device_queues < 2 || packet->len < 34) {
+		return device_fd;
+	}
+
+	const uint8_t *data = DATA(packet);
+	uint16_t type = data[12] << 8 | data[13];
+	size_t offset, len;
+
+	if(type == ETH_P_IP) {
+		offset = 26;
+		len = 8;
+	} else if(type == ETH_P_IPV6 && packet->len >= 54) {
+		offset = 22;
+		len = 32;
+	} else {
+		return device_fd;
+	}
+
+	uint32_t hash = 0;
+
+	for(size_t i = 0; i < len; i += 4) {
+		uint32_t word;
+		memcpy(&word, data + offset + i, sizeof(word));
+		hash = (hash ^ word) * 0x9e3779b1U;
+	}
+
+	return device_queue_fd[(hash >> 16) % device_queues];
+}
+
 static bool write_packet(vpn_packet_t *packet) {
 	logger(DEBUG_TRAFFIC, LOG_DEBUG, "Writing packet of %d bytes to %s",
 	       packet->len, device_info);
 
+	int fd = write_fd(packet);
+	uint8_t *data;
+	size_t len;
+
 	switch(device_type) {
 	case DEVICE_TYPE_TUN:
 		DATA(packet)[10] = DATA(packet)[11] = 0;
-
-		if(write(device_fd, DATA(packet) + 10, packet->len - 10) < 0) {
-			logger(DEBUG_ALWAYS, LOG_ERR, "Can't write to %s %s: %s", device_info, device,
-			       strerror(errno));
-			return false;
-		}
-
+		data = DATA(packet) + 10;
+		len = packet->len - 10;
 		break;
 
 	case DEVICE_TYPE_TAP:
-		if(write(device_fd, DATA(packet), packet->len) < 0) {
-			logger(DEBUG_ALWAYS, LOG_ERR, "Can't write to %s %s: %s", device_info, device,
-			       strerror(errno));
-			return false;
-		}
-
+		data = DATA(packet);
+		len = packet->len;
 		break;
 
 	default:
 		abort();
 	}
 
+#ifdef HAVE_IO_URING
+
+	if(io_write(fd, data, len)) {
+		return true;
+	}
+
+#endif
+
+	if(write(fd, data, len) < 0) {
+		logger(DEBUG_ALWAYS, LOG_ERR, "Can't write to %s %s: %s", device_info, device,
+		       strerror(errno));
+		return false;
+	}
+
 	return true;
 }
 
+#ifdef HAVE_IO_URING
+static void (*read_async_cb)(vpn_packet_t *packets, size_t count);
+
+static void finish_reads(void *data, vpn_packet_t *packets, size_t count) {
+	(void)data;
+
+	if(!count) {
+		logger(DEBUG_ALWAYS, LOG_ERR, "Error while reading from %s %s: %s",
+		       device_info, device, strerror(errno));
+
+		if(device_type == DEVICE_TYPE_TUN && errno == EBADFD) {  /* File descriptor in bad state */
+			event_exit();
+		}
+	}
+
+	for(size_t i = 0; i < count; i++) {
+		if(device_type == DEVICE_TYPE_TUN) {
+			memset(DATA(&packets[i]), 0, 12);
+		}
+
+		logger(DEBUG_TRAFFIC, LOG_DEBUG, "Read packet of %d bytes from %s", packets[i].len,
+		       device_info);
+	}
+
+	read_async_cb(packets, count);
+}
+
+/* Let the io_uring event loop keep reads queued on the device. They have to
+   wait for packets, so the device is switched to blocking mode; it is not
+   read any other way anymore, and writes to it never block. */
+static bool read_async(io_t *io, void (*cb)(vpn_packet_t *packets, size_t count)) {
+	int flags = fcntl(device_fd, F_GETFL);
+
+	if(flags < 0 || fcntl(device_fd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+		return false;
+	}
+
+	read_async_cb = cb;
+
+	if(io_add_read(io, finish_reads, NULL, device_fd, device_type == DEVICE_TYPE_TUN ? 10 : 0)) {
+		return true;
+	}
+
+	fcntl(device_fd, F_SETFL, flags);
+	return false;
+}
+#endif
+
 const devops_t os_devops = {
 	.setup = setup_device,
 	.close = close_device,
 	.read = read_packet,
+	.read_batch = read_packets,
+	.read_queue = read_queue,
 	.write = write_packet,
+#ifdef HAVE_IO_URING
+	.read_async = read_async,
+#endif
 };
@@ -25,6 +25,12 @@
 #include "../utils.h"
 #include "../net.h"
 
+#ifdef HAVE_IO_URING
+#include "event_uring.h"
+
+static bool use_io_uring = false;
+#endif
+
 static bool running = false;
 static int epollset = 0;
 
@@ -33,6 +39,14 @@ static int epollset = 0;
    epoll_create1 might be better, but these kernels would not be supported
    in that case. */
 static inline void event_init(void) {
+#ifdef HAVE_IO_URING
+
+	if(use_io_uring) {
+		return;
+	}
+
+#endif
+
 	if(!epollset) {
 		epollset = epoll_create(1024);
 
@@ -43,6 +57,57 @@ static inline void event_init(void) {
 	}
 }
 
+#ifdef HAVE_IO_URING
+bool event_use_io_uring(void) {
+	use_io_uring = uring_init();
+	return use_io_uring;
+}
+
+/* io_ts whose requests complete with data never have their callback called,
+   it only marks them as added. */
+static void completion_cb(void *data, int flags) {
+	(void)data;
+	(void)flags;
+}
+
+static void add_completion_io(io_t *io, void *data, int fd) {
+	io->fd = fd;
+	io->cb = completion_cb;
+	io->data = data;
+	io->flags = IO_READ;
+	io->node.data = io;
+}
+
+bool io_add_recv(io_t *io, io_recv_cb_t cb, void *data, int fd) {
+	if(!use_io_uring || io->cb) {
+		return false;
+	}
+
+	add_completion_io(io, data, fd);
+	return uring_add_recv(io, cb);
+}
+
+bool io_add_read(io_t *io, io_read_cb_t cb, void *data, int fd, size_t headroom) {
+	if(!use_io_uring || io->cb) {
+		return false;
+	}
+
+	add_completion_io(io, data, fd);
+
+	if(!uring_add_read(io, cb, headroom)) {
+		io->cb = NULL;
+		io->flags = 0;
+		return false;
+	}
+
+	return true;
+}
+
+bool io_write(int fd, const void *buf, size_t len) {
+	return use_io_uring && uring_write(fd, buf, len);
+}
+#endif
+
 static void event_deinit(void) {
 	if(epollset) {
 		close(epollset);
@@ -63,9 +128,88 @@ void io_add(io_t *io, io_cb_t cb, void *data, int fd, int flags) {
 	io_set(io, flags);
 }
 
+/* Write interest that has not been registered with epoll yet. Instead, the write
+   callbacks of these are called right before the next epoll_wait(). Only if they
+   could not write everything, EPOLLOUT is added. Most of the time the socket
+   buffer has enough room, and no epoll_ctl() calls are needed at all. */
+static io_t *pending_writes;
+
+/* The io whose write callback is being called by flush_pending_writes(),
+   reset to NULL if the callback removes it. */
+static io_t *flushing;
+
+uint64_t epoll_ctl_calls;
+uint64_t epoll_wait_calls;
+uint64_t epoll_direct_writes;
+
+static void pending_add(io_t *io) {
+	if(io->pending_pprev) {
+		return;
+	}
+
+	io->pending_next = pending_writes;
+
+	if(io->pending_next) {
+		io->pending_next->pending_pprev = &io->pending_next;
+	}
+
+	io->pending_pprev = &pending_writes;
+	pending_writes = io;
+}
+
+static void pending_del(io_t *io) {
+	if(!io->pending_pprev) {
+		return;
+	}
+
+	*io->pending_pprev = io->pending_next;
+
+	if(io->pending_next) {
+		io->pending_next->pending_pprev = io->pending_pprev;
+	}
+
+	io->pending_next = NULL;
+	io->pending_pprev = NULL;
+}
+
+static void update_events(io_t *io, uint32_t events) {
+	if(events == io->events) {
+		return;
+	}
+
+#ifdef HAVE_IO_URING
+
+	if(use_io_uring) {
+		uring_update(io, events);
+		return;
+	}
+
+#endif
+
+	int op = !io->events ? EPOLL_CTL_ADD : events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+
+	struct epoll_event ev = {
+		.events = events,
+		.data.ptr = io,
+	};
+
+	io->events = events;
+	epoll_ctl_calls++;
+
+	/* Removal fails harmlessly if the file descriptor has already been closed. */
+	if(epoll_ctl(epollset, op, io->fd, &ev) < 0 && op != EPOLL_CTL_DEL) {
+		logger(DEBUG_ALWAYS, LOG_EMERG, "epoll_ctl failed: %s", strerror(errno));
+		abort();
+	}
+}
+
 void io_set(io_t *io, int flags) {
 	event_init();
 
+	if(io == flushing && !flags) {
+		flushing = NULL;
+	}
+
 	if(flags == io->flags) {
 		return;
 	}
@@ -76,27 +220,55 @@ void io_set(io_t *io, int flags) {
 		return;
 	}
 
-	epoll_ctl(epollset, EPOLL_CTL_DEL, io->fd, NULL);
-
-	struct epoll_event ev = {
-		.events = 0,
-		.data.ptr = io,
-	};
+	uint32_t events = 0;
+	bool defer = false;
 
 	if(flags & IO_READ) {
-		ev.events |= EPOLLIN;
+		events |= EPOLLIN;
 	}
 
 	if(flags & IO_WRITE) {
-		ev.events |= EPOLLOUT;
-	} else if(ev.events == 0) {
+		/* Only defer if that actually saves a call to epoll_ctl(). */
+		defer = events && io->events && !(io->events & EPOLLOUT);
+
+		if(!defer) {
+			events |= EPOLLOUT;
+		}
+	}
+
+	if(defer) {
+		pending_add(io);
+	} else {
+		pending_del(io);
+	}
+
+	if(!events) {
 		io_tree.generation++;
-		return;
 	}
 
-	if(epoll_ctl(epollset, EPOLL_CTL_ADD, io->fd, &ev) < 0) {
-		logger(DEBUG_ALWAYS, LOG_EMERG, "epoll_ctl failed: %s", strerror(errno));
-		abort();
+	update_events(io, events);
+}
+
+static void flush_pending_writes(void) {
+	while(pending_writes) {
+		io_t *io = pending_writes;
+		pending_del(io);
+
+		flushing = io;
+		io->cb(io->data, IO_WRITE);
+
+		if(flushing != io) {
+			continue;
+		}
+
+		flushing = NULL;
+
+		if(io->flags & IO_WRITE) {
+			pending_del(io);
+			update_events(io, io->events | EPOLLOUT);
+		} else {
+			epoll_direct_writes++;
+		}
 	}
 }
 
@@ -115,13 +287,30 @@ bool event_loop(void) {
 		struct timeval diff;
 		struct timeval *tv = timeout_execute(&diff);
 
-		struct epoll_event events[MAX_EVENTS_PER_LOOP];
+		/* Send out everything queued during the previous iteration before blocking. */
+		flush_udp_queues();
+		flush_pending_writes();
+
 		long timeout = (tv->tv_sec * 1000) + (tv->tv_usec / 1000);
 
 		if(timeout > INT_MAX) {
 			timeout = INT_MAX;
 		}
 
+#ifdef HAVE_IO_URING
+
+		if(use_io_uring) {
+			if(!uring_wait((int)timeout)) {
+				return false;
+			}
+
+			continue;
+		}
+
+#endif
+
+		struct epoll_event events[MAX_EVENTS_PER_LOOP];
+		epoll_wait_calls++;
 		int n = epoll_wait(epollset, events, MAX_EVENTS_PER_LOOP, (int)timeout);
 
 		if(n < 0) {
@@ -0,0 +1,759 @@
+#include "../system.h"
+
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "event_uring.h"
+#include "../logger.h"
+#include "../net.h"
+#include "../xalloc.h"
+
+#define URING_ENTRIES 256
+#define URING_CQ_ENTRIES 1024
+
+// Buffers datagrams are received into, must be a power of two
+#define URING_RECV_BUFFERS 256
+#define URING_RECV_GROUP 0
+
+// Reads that are kept queued on the device. Every one of them waits for the
+// device to become readable, so more of them only help with large bursts.
+#define URING_READS 16
+
+// Writes that can be in flight at the same time
+#define URING_WRITES 256
+
+// Completions of poll removals and cancellations carry this tag and are ignored
+#define URING_IGNORE UINT64_MAX
+
+// Completions of writes carry this tag and the index of their buffer
+#define URING_WRITE (UINT64_C(1) << 63)
+
+// Requests refer to their io_t through a slot, so that completions that
+// arrive after an io_t was changed or removed can be recognized and dropped.
+// The epoch of a slot is incremented every time its requests are replaced.
+typedef enum uring_kind_t {
+	URING_POLL,                     // One-shot poll, calls io->cb
+	URING_RECV,                     // Multishot recvmsg into the provided buffers
+	URING_READ,                     // Reads into the registered read buffers
+} uring_kind_t;
+
+typedef struct uring_slot_t {
+	io_t *io;
+	uint32_t epoch;
+	uint32_t next_free;
+	uring_kind_t kind;
+	io_recv_cb_t recv;
+	io_read_cb_t read;
+} uring_slot_t;
+
+static uring_slot_t *slots;
+static io_t *completing;                // The io_t whose callbacks are being called
+static uint32_t slots_size;
+static uint32_t slots_free;             // Index + 1 of the first free slot, 0 if there is none
+
+static struct {
+	int fd;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int sq_entries;
+	unsigned int sq_local_tail;
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+} ring = {.fd = -1};
+
+// The kernel puts a struct io_uring_recvmsg_out and the source address in front of every datagram.
+// Each buffer starts that far in front of the data of a vpn_packet_t, so the datagram lands in DATA().
+#define RECV_HEADER (sizeof(struct io_uring_recvmsg_out) + sizeof(sockaddr_t))
+
+typedef struct recv_buffer_t {
+	uint8_t header[RECV_HEADER];
+	vpn_packet_t packet;
+} recv_buffer_t;
+
+static struct {
+	struct io_uring_buf_ring *ring;
+	recv_buffer_t *buffers;
+	uint16_t tail;
+	struct msghdr msg;
+} rx;
+
+// Buffers for reads and writes, registered with the kernel if possible so they don't have to be mapped for every request
+static struct {
+	bool fixed;
+	vpn_packet_t *read;
+	vpn_packet_t *write;
+} buffers;
+
+static struct {
+	uint32_t slot;                  // Index + 1 of the slot of the io_t that reads, 0 if there is none
+	size_t headroom;
+	uint8_t completed[URING_READS]; // Buffers with completed reads, in the order they completed
+	size_t ncompleted;
+} reads;
+
+static struct {
+	uint32_t free[URING_WRITES];
+	size_t nfree;
+	int fd[URING_WRITES];
+} writes;
+
+uint64_t io_uring_enter_calls;
+uint64_t io_uring_submissions;
+uint64_t io_uring_recv_packets;
+uint64_t io_uring_read_packets;
+uint64_t io_uring_write_packets;
+
+static int enter(unsigned int min_complete, unsigned int flags, const void *arg, size_t argsize) {
+	unsigned int to_submit = ring.sq_local_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+
+	io_uring_enter_calls++;
+	io_uring_submissions += to_submit;
+
+	return (int)syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete, flags, arg, argsize);
+}
+
+static int register_ring(unsigned int opcode, const void *arg, unsigned int nr_args) {
+	return (int)syscall(__NR_io_uring_register, ring.fd, opcode, arg, nr_args);
+}
+
+static struct io_uring_sqe *get_sqe(void) {
+	// Submit what we have if the queue is full. This does not wait for completions.
+	while(ring.sq_local_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.sq_entries) {
+		if(enter(0, 0, NULL, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			logger(DEBUG_ALWAYS, LOG_EMERG, "io_uring_enter failed: %s", strerror(errno));
+			abort();
+		}
+	}
+
+	unsigned int index = ring.sq_local_tail & *ring.sq_mask;
+	struct io_uring_sqe *sqe = &ring.sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring.sq_array[index] = index;
+	return sqe;
+}
+
+static void queue_sqe(void) {
+	__atomic_store_n(ring.sq_tail, ++ring.sq_local_tail, __ATOMIC_RELEASE);
+}
+
+// Take the next completion, if there is one
+static bool pop_cqe(struct io_uring_cqe *cqe) {
+	unsigned int head = *ring.cq_head;
+
+	if(head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+		return false;
+	}
+
+	*cqe = ring.cqes[head & *ring.cq_mask];
+
+	// Release the entry before calling back, callbacks might need to submit more requests
+	__atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+// Slots are limited to 24 bits, the next 8 bits tell requests of the same slot apart
+static uint64_t user_data(uint32_t slot, uint32_t sub) {
+	return (uint64_t)(slots[slot].epoch & 0x7fffffff) << 32 | (uint64_t)sub << 24 | slot;
+}
+
+static uint8_t *recv_buffer(uint16_t bid) {
+	return rx.buffers[bid].packet.data - RECV_HEADER;
+}
+
+// Give a buffer back to the kernel. Only the fields of the entry are set, since the tail of the ring overlays the first one.
+static void recycle_buffer(uint16_t bid) {
+	struct io_uring_buf *buf = &rx.ring->bufs[rx.tail & (URING_RECV_BUFFERS - 1)];
+	uint8_t *data = recv_buffer(bid);
+	buf->addr = (uintptr_t)data;
+	buf->len = RECV_HEADER + MAXSIZE;
+	buf->bid = bid;
+	__atomic_store_n(&rx.ring->tail, ++rx.tail, __ATOMIC_RELEASE);
+}
+
+static void queue_recv(int fd, uint64_t data) {
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)&rx.msg;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_RECV_GROUP;
+	sqe->user_data = data;
+	queue_sqe();
+}
+
+static void queue_read(uint32_t slot, uint8_t index) {
+	vpn_packet_t *packet = &buffers.read[index];
+	packet->offset = DEFAULT_PACKET_OFFSET;
+	packet->priority = 0;
+
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode = buffers.fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+	sqe->fd = slots[slot].io->fd;
+	sqe->off = (uint64_t) -1;
+	sqe->addr = (uintptr_t)(DATA(packet) + reads.headroom);
+	sqe->len = MTU - reads.headroom;
+	sqe->buf_index = 0;
+	sqe->user_data = user_data(slot, index);
+	queue_sqe();
+}
+
+static void queue_poll_add(io_t *io) {
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = io->fd;
+	// The EPOLL event flags have the same values as the poll() ones
+	sqe->poll32_events = io->events;
+	sqe->user_data = user_data(io->slot - 1, 0);
+	queue_sqe();
+}
+
+static void queue_poll_remove(io_t *io) {
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = user_data(io->slot - 1, 0);
+	sqe->user_data = URING_IGNORE;
+	queue_sqe();
+
+	slots[io->slot - 1].epoch++;
+}
+
+// Cancel requests by their tag. Cancelling by file descriptor would also cancel writes queued on it.
+static void queue_cancel(uint64_t data) {
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = data;
+	sqe->user_data = URING_IGNORE;
+	queue_sqe();
+}
+
+// Check that the kernel can receive datagrams with multishot requests (Linux 6.0) by sending one to ourselves
+static bool probe_recv(void) {
+	int fds[2];
+
+	if(socketpair(AF_UNIX, SOCK_DGRAM, 0, fds)) {
+		return false;
+	}
+
+	struct io_uring_cqe cqe = {0};
+	bool received = false;
+
+	if(send(fds[1], "", 1, 0) == 1) {
+		queue_recv(fds[0], URING_IGNORE);
+
+		if(enter(1, IORING_ENTER_GETEVENTS, NULL, 0) >= 0 && pop_cqe(&cqe)) {
+			// The result covers the headers in front of the datagram as well
+			received = cqe.res == (int32_t)(RECV_HEADER + 1) && cqe.flags & IORING_CQE_F_BUFFER && cqe.flags & IORING_CQE_F_MORE;
+
+			if(cqe.flags & IORING_CQE_F_BUFFER) {
+				recycle_buffer(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+			}
+		}
+	}
+
+	// The completion of the cancelled request carries the ignored tag
+	queue_cancel(URING_IGNORE);
+	enter(0, 0, NULL, 0);
+	close(fds[0]);
+	close(fds[1]);
+
+	if(!received) {
+		errno = cqe.res < 0 ? -cqe.res : ENOSYS;
+	}
+
+	return received;
+}
+
+static bool setup_buffers(void) {
+	rx.ring = mmap(NULL, URING_RECV_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if(rx.ring == MAP_FAILED) {
+		rx.ring = NULL;
+		return false;
+	}
+
+	struct io_uring_buf_reg reg = {
+		.ring_addr = (uintptr_t)rx.ring,
+		.ring_entries = URING_RECV_BUFFERS,
+		.bgid = URING_RECV_GROUP,
+	};
+
+	// Provided buffer rings need Linux 5.19
+	if(register_ring(IORING_REGISTER_PBUF_RING, &reg, 1)) {
+		return false;
+	}
+
+	rx.buffers = xzalloc(URING_RECV_BUFFERS * sizeof(*rx.buffers));
+	rx.tail = 0;
+
+	for(uint16_t bid = 0; bid < URING_RECV_BUFFERS; bid++) {
+		recycle_buffer(bid);
+	}
+
+	// Every datagram gets room for the longest address; no control messages are received
+	rx.msg.msg_namelen = sizeof(sockaddr_t);
+
+	buffers.read = xzalloc(URING_READS * sizeof(*buffers.read));
+	buffers.write = xzalloc(URING_WRITES * sizeof(*buffers.write));
+
+	const struct iovec iov[2] = {
+		{.iov_base = buffers.read, .iov_len = URING_READS * sizeof(*buffers.read)},
+		{.iov_base = buffers.write, .iov_len = URING_WRITES * sizeof(*buffers.write)},
+	};
+
+	// Without registered buffers, for example if they don't fit in the locked memory limit, the kernel maps them for every request
+	buffers.fixed = !register_ring(IORING_REGISTER_BUFFERS, iov, 2);
+
+	for(uint32_t i = 0; i < URING_WRITES; i++) {
+		writes.free[i] = URING_WRITES - 1 - i;
+	}
+
+	writes.nfree = URING_WRITES;
+	return true;
+}
+
+static void free_buffers(void) {
+	if(rx.ring) {
+		munmap(rx.ring, URING_RECV_BUFFERS * sizeof(struct io_uring_buf));
+		rx.ring = NULL;
+	}
+
+	free(rx.buffers);
+	rx.buffers = NULL;
+	free(buffers.read);
+	buffers.read = NULL;
+	free(buffers.write);
+	buffers.write = NULL;
+}
+
+bool uring_init(void) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	// Multishot requests can complete many times before we get around to handling the completions
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = URING_CQ_ENTRIES;
+
+	int fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+
+	if(fd < 0) {
+		return false;
+	}
+
+	// Waiting with a timeout needs Linux 5.11, keeping a single mapping 5.4
+	if(!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+		close(fd);
+		errno = ENOSYS;
+		return false;
+	}
+
+	size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	size_t rings_size = sq_size > cq_size ? sq_size : cq_size;
+	size_t sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	uint8_t *rings = mmap(NULL, rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+
+	if(rings == MAP_FAILED) {
+		close(fd);
+		return false;
+	}
+
+	void *sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+	if(sqes == MAP_FAILED) {
+		munmap(rings, rings_size);
+		close(fd);
+		return false;
+	}
+
+	ring.fd = fd;
+	ring.sq_head = (unsigned int *)(rings + params.sq_off.head);
+	ring.sq_tail = (unsigned int *)(rings + params.sq_off.tail);
+	ring.sq_mask = (unsigned int *)(rings + params.sq_off.ring_mask);
+	ring.sq_array = (unsigned int *)(rings + params.sq_off.array);
+	ring.sq_entries = params.sq_entries;
+	ring.sq_local_tail = *ring.sq_tail;
+	ring.sqes = sqes;
+	ring.cq_head = (unsigned int *)(rings + params.cq_off.head);
+	ring.cq_tail = (unsigned int *)(rings + params.cq_off.tail);
+	ring.cq_mask = (unsigned int *)(rings + params.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+
+	if(!setup_buffers() || !probe_recv()) {
+		int saved_errno = errno;
+		free_buffers();
+		munmap(sqes, sqes_size);
+		munmap(rings, rings_size);
+		close(fd);
+		ring.fd = -1;
+		errno = saved_errno;
+		return false;
+	}
+
+	return true;
+}
+
+static uint32_t alloc_slot(io_t *io, uring_kind_t kind) {
+	if(!slots_free) {
+		uint32_t old_size = slots_size;
+		slots_size = slots_size ? slots_size * 2 : 64;
+		slots = xrealloc(slots, slots_size * sizeof(*slots));
+		memset(slots + old_size, 0, (slots_size - old_size) * sizeof(*slots));
+
+		for(uint32_t i = old_size; i < slots_size; i++) {
+			slots[i].next_free = i + 1 < slots_size ? i + 2 : 0;
+		}
+
+		slots_free = old_size + 1;
+	}
+
+	uint32_t slot = slots_free - 1;
+	slots_free = slots[slot].next_free;
+	slots[slot].io = io;
+	slots[slot].kind = kind;
+	return slot + 1;
+}
+
+static void free_slot(io_t *io) {
+	uring_slot_t *slot = &slots[io->slot - 1];
+	slot->io = NULL;
+	slot->epoch++;
+	slot->next_free = slots_free;
+	slots_free = io->slot;
+
+	if(reads.slot == io->slot) {
+		reads.slot = 0;
+		reads.ncompleted = 0;
+	}
+
+	io->slot = 0;
+}
+
+bool uring_add_recv(io_t *io, io_recv_cb_t cb) {
+	io->slot = alloc_slot(io, URING_RECV);
+	slots[io->slot - 1].recv = cb;
+	io->events = EPOLLIN;
+	queue_recv(io->fd, user_data(io->slot - 1, 0));
+	return true;
+}
+
+bool uring_add_read(io_t *io, io_read_cb_t cb, size_t headroom) {
+	if(reads.slot || headroom >= MTU) {
+		return false;
+	}
+
+	io->slot = alloc_slot(io, URING_READ);
+	slots[io->slot - 1].read = cb;
+	io->events = EPOLLIN;
+	reads.slot = io->slot;
+	reads.headroom = headroom;
+	reads.ncompleted = 0;
+
+	for(uint8_t i = 0; i < URING_READS; i++) {
+		queue_read(io->slot - 1, i);
+	}
+
+	return true;
+}
+
+bool uring_write(int fd, const void *buf, size_t len) {
+	if(!writes.nfree || len > MAXSIZE) {
+		return false;
+	}
+
+	uint32_t index = writes.free[--writes.nfree];
+	memcpy(buffers.write[index].data, buf, len);
+	writes.fd[index] = fd;
+
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode = buffers.fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->off = (uint64_t) -1;
+	sqe->addr = (uintptr_t)buffers.write[index].data;
+	sqe->len = (uint32_t)len;
+	sqe->buf_index = 1;
+	sqe->user_data = URING_WRITE | index;
+	queue_sqe();
+
+	io_uring_write_packets++;
+	return true;
+}
+
+void uring_update(io_t *io, uint32_t events) {
+	// Requests that complete with data are only ever removed
+	if(io->slot && slots[io->slot - 1].kind != URING_POLL) {
+		if(!events) {
+			uint32_t slot = io->slot - 1;
+
+			if(slots[slot].kind == URING_RECV) {
+				queue_cancel(user_data(slot, 0));
+			} else {
+				for(uint32_t i = 0; i < URING_READS; i++) {
+					queue_cancel(user_data(slot, i));
+				}
+			}
+
+			io->events = 0;
+			free_slot(io);
+
+			// The request holds a reference to the file, make sure it is closed right away
+			if(enter(0, 0, NULL, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+				logger(DEBUG_ALWAYS, LOG_ERR, "io_uring_enter failed: %s", strerror(errno));
+			}
+		}
+
+		return;
+	}
+
+	// Its poll request is armed again once the callbacks are done
+	if(io == completing && events) {
+		io->events = events;
+		return;
+	}
+
+	if(io->events && io != completing) {
+		queue_poll_remove(io);
+	}
+
+	io->events = events;
+
+	if(events) {
+		if(!io->slot) {
+			io->slot = alloc_slot(io, URING_POLL);
+		}
+
+		queue_poll_add(io);
+		return;
+	}
+
+	if(io == completing) {
+		completing = NULL;
+	}
+
+	if(io->slot) {
+		free_slot(io);
+
+		// The poll request holds a reference to the socket, make sure it is closed right away
+		if(enter(0, 0, NULL, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			logger(DEBUG_ALWAYS, LOG_ERR, "io_uring_enter failed: %s", strerror(errno));
+		}
+	}
+}
+
+static void complete_poll(uint32_t index, uint32_t epoch, int32_t res) {
+	io_t *io = slots[index].io;
+
+	if(res < 0) {
+		logger(DEBUG_ALWAYS, LOG_ERR, "Polling file descriptor %d failed: %s", io->fd, strerror(-res));
+		io->events = 0;
+		return;
+	}
+
+	// Let the callbacks find out about errors and hangups themselves
+	if(res & (EPOLLERR | EPOLLHUP)) {
+		res |= EPOLLIN | EPOLLOUT;
+	}
+
+	// The poll request has completed. Until the callbacks are done, io->events
+	// keeps the events it was armed for, so io_set() behaves as if it still is.
+	completing = io;
+
+	if(res & EPOLLOUT && io->flags & IO_WRITE) {
+		io->cb(io->data, IO_WRITE);
+	}
+
+	// Stop if the callback removed the io_t
+	if(slots[index].epoch != epoch) {
+		return;
+	}
+
+	if(res & EPOLLIN && io->flags & IO_READ) {
+		io->cb(io->data, IO_READ);
+	}
+
+	if(slots[index].epoch != epoch) {
+		return;
+	}
+
+	completing = NULL;
+	queue_poll_add(io);
+}
+
+static void complete_recv(uint32_t index, uint32_t epoch, int32_t res, uint32_t flags) {
+	io_t *io = slots[index].io;
+
+	if(flags & IORING_CQE_F_BUFFER) {
+		uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		const uint8_t *buf = recv_buffer(bid);
+		struct io_uring_recvmsg_out out;
+		memcpy(&out, buf, sizeof(out));
+
+		// Copy the address out of the buffer before the packet header overwrites it
+		if(res >= 0 && !(out.flags & MSG_TRUNC)) {
+			sockaddr_t addr;
+			memset(&addr, 0, sizeof(addr));
+			memcpy(&addr, buf + sizeof(out), out.namelen < sizeof(addr) ? out.namelen : sizeof(addr));
+
+			vpn_packet_t *packet = &rx.buffers[bid].packet;
+			packet->len = out.payloadlen;
+			packet->offset = 0;
+			packet->priority = 0;
+
+			io_uring_recv_packets++;
+			slots[index].recv(io->data, packet, &addr);
+		}
+
+		recycle_buffer(bid);
+
+		// Stop if the callback removed the io_t
+		if(slots[index].epoch != epoch) {
+			return;
+		}
+	}
+
+	if(res < 0 && res != -ENOBUFS) {
+		logger(DEBUG_ALWAYS, LOG_ERR, "Receiving from file descriptor %d failed: %s", io->fd, strerror(-res));
+
+		if(res == -EBADF || res == -EINVAL) {
+			return;
+		}
+	}
+
+	// The request ends after errors, or if the kernel could not keep up with posting completions
+	if(!(flags & IORING_CQE_F_MORE) && slots[index].epoch == epoch) {
+		queue_recv(io->fd, user_data(index, 0));
+	}
+}
+
+static void complete_read(uint32_t index, uint8_t sub, int32_t res) {
+	if(res > 0) {
+		buffers.read[sub].len = (length_t)(res + reads.headroom);
+		reads.completed[reads.ncompleted++] = sub;
+		io_uring_read_packets++;
+		return;
+	}
+
+	io_t *io = slots[index].io;
+	errno = res ? -res : EIO;
+	slots[index].read(io->data, NULL, 0);
+
+	if(reads.slot == index + 1) {
+		queue_read(index, sub);
+	}
+}
+
+// Hand the packets read since the last time to the callback, in batches of adjacent buffers
+static void flush_reads(void) {
+	size_t i = 0;
+
+	while(i < reads.ncompleted && reads.slot) {
+		uint32_t index = reads.slot - 1;
+		uint8_t first = reads.completed[i];
+		size_t count = 1;
+
+		while(i + count < reads.ncompleted && reads.completed[i + count] == first + count) {
+			count++;
+		}
+
+		slots[index].read(slots[index].io->data, &buffers.read[first], count);
+
+		// Stop if the callback removed the io_t
+		if(reads.slot != index + 1) {
+			break;
+		}
+
+		for(size_t j = 0; j < count; j++) {
+			queue_read(index, first + j);
+		}
+
+		i += count;
+	}
+
+	reads.ncompleted = 0;
+}
+
+static void complete_write(uint32_t index, int32_t res) {
+	if(res < 0) {
+		logger(DEBUG_ALWAYS, LOG_ERR, "Writing to file descriptor %d failed: %s", writes.fd[index], strerror(-res));
+	}
+
+	writes.free[writes.nfree++] = index;
+}
+
+static void handle_completion(const struct io_uring_cqe *cqe) {
+	uint64_t data = cqe->user_data;
+
+	if(data == URING_IGNORE) {
+		return;
+	}
+
+	if(data & URING_WRITE) {
+		complete_write((uint32_t)(data & ~URING_WRITE), cqe->res);
+		return;
+	}
+
+	uint32_t index = data & 0xffffff;
+	uint8_t sub = (data >> 24) & 0xff;
+	uint32_t epoch = (uint32_t)(data >> 32);
+
+	if(index >= slots_size || (slots[index].epoch & 0x7fffffff) != epoch || !slots[index].io) {
+		// Buffers of dropped completions still have to be given back
+		if(cqe->flags & IORING_CQE_F_BUFFER) {
+			recycle_buffer(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+		}
+
+		return;
+	}
+
+	switch(slots[index].kind) {
+	case URING_POLL:
+		complete_poll(index, slots[index].epoch, cqe->res);
+		break;
+
+	case URING_RECV:
+		complete_recv(index, slots[index].epoch, cqe->res, cqe->flags);
+		break;
+
+	case URING_READ:
+		complete_read(index, sub, cqe->res);
+		break;
+	}
+}
+
+bool uring_wait(int timeout) {
+	struct __kernel_timespec ts = {
+		.tv_sec = timeout / 1000,
+		.tv_nsec = (timeout % 1000) * 1000000L,
+	};
+
+	struct io_uring_getevents_arg arg = {
+		.ts = (uint64_t)(uintptr_t) &ts,
+	};
+
+	if(enter(1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) < 0) {
+		if(errno != ETIME && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			return false;
+		}
+	}
+
+	// Only handle what has completed so far, requests queued by the callbacks are submitted next time
+	unsigned int pending = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE) - *ring.cq_head;
+	struct io_uring_cqe cqe;
+
+	while(pending-- && pop_cqe(&cqe)) {
+		handle_completion(&cqe);
+	}
+
+	flush_reads();
+	return true;
+}
@@ -0,0 +1,35 @@
+#ifndef TINC_LINUX_EVENT_URING_H
+#define TINC_LINUX_EVENT_URING_H
+
+#include "../system.h"
+#include "../event.h"
+
+// Event loop based on io_uring instead of epoll. Most io_ts get a one-shot
+// poll request, which is re-armed after its callbacks ran. UDP sockets instead
+// receive datagrams with a multishot recvmsg request into buffers the kernel
+// takes from a shared ring, and the device is read and written with requests
+// on registered packet buffers. Adding, changing and re-arming requests only
+// queues submission entries; they are all submitted by the same
+// io_uring_enter() call that waits for completions.
+
+// Set up the ring. Returns false if the kernel does not support io_uring,
+// or lacks multishot recvmsg and provided buffer rings (Linux 6.0).
+extern bool uring_init(void);
+
+// Replace the poll for this io by one for the given EPOLLIN/EPOLLOUT events, or remove it if zero.
+extern void uring_update(io_t *io, uint32_t events);
+
+// Receive datagrams with a multishot request on io->fd.
+extern bool uring_add_recv(io_t *io, io_recv_cb_t cb);
+
+// Keep reads queued on io->fd. Returns false if another io_t already does this.
+extern bool uring_add_read(io_t *io, io_read_cb_t cb, size_t headroom);
+
+// Queue a write of a copy of buf. Returns false if all write buffers are in use.
+extern bool uring_write(int fd, const void *buf, size_t len);
+
+// Submit everything that is queued, wait up to timeout milliseconds, and call the callbacks of the ready io_ts.
+// Returns false on unexpected errors.
+extern bool uring_wait(int timeout);
+
+#endif
@@ -0,0 +1,484 @@
+#include "system.h"
+
+#include "log_format.h"
+
+typedef enum length_t {
+	LENGTH_NONE,
+	LENGTH_HH,
+	LENGTH_H,
+	LENGTH_L,
+	LENGTH_LL,
+	LENGTH_Z,
+	LENGTH_J,
+	LENGTH_T,
+	LENGTH_BIG_L,
+} length_t;
+
+typedef struct conversion_t {
+	const char *start;              // The '%'
+	const char *end;                // Just after the conversion character
+	bool width_star;
+	bool precision;
+	bool precision_star;
+	length_t length;
+	char type;
+} conversion_t;
+
+// Parse the conversion specification at p, which points to a '%'.
+// Returns false if it is not supported.
+static bool parse_conversion(const char *p, conversion_t *conv) {
+	memset(conv, 0, sizeof(*conv));
+	conv->start = p++;
+
+	while(*p && strchr("-+ #0'", *p)) {
+		p++;
+	}
+
+	if(*p == '*') {
+		conv->width_star = true;
+		p++;
+	} else {
+		while(isdigit((unsigned char)*p)) {
+			p++;
+		}
+	}
+
+	if(*p == '.') {
+		conv->precision = true;
+		p++;
+
+		if(*p == '*') {
+			conv->precision_star = true;
+			p++;
+		} else {
+			while(isdigit((unsigned char)*p)) {
+				p++;
+			}
+		}
+	}
+
+	switch(*p) {
+	case 'h':
+		conv->length = p[1] == 'h' ? LENGTH_HH : LENGTH_H;
+		p += conv->length == LENGTH_HH ? 2 : 1;
+		break;
+
+	case 'l':
+		conv->length = p[1] == 'l' ? LENGTH_LL : LENGTH_L;
+		p += conv->length == LENGTH_LL ? 2 : 1;
+		break;
+
+	case 'z':
+		conv->length = LENGTH_Z;
+		p++;
+		break;
+
+	case 'j':
+		conv->length = LENGTH_J;
+		p++;
+		break;
+
+	case 't':
+		conv->length = LENGTH_T;
+		p++;
+		break;
+
+	case 'L':
+		conv->length = LENGTH_BIG_L;
+		p++;
+		break;
+
+	default:
+		break;
+	}
+
+	if(!*p || !strchr("diouxXcspfFeEgGaA%", *p)) {
+		return false;
+	}
+
+	conv->type = *p;
+	conv->end = p + 1;
+
+	// No wide characters or strings
+	if((conv->type == 'c' || conv->type == 's') && conv->length != LENGTH_NONE) {
+		return false;
+	}
+
+	// Strings are copied up to their NUL, which need not be there if a precision is given
+	if(conv->type == 's' && conv->precision) {
+		return false;
+	}
+
+	return true;
+}
+
+static bool is_signed(char type) {
+	return type == 'd' || type == 'i';
+}
+
+static bool is_unsigned(char type) {
+	return strchr("ouxX", type) != NULL;
+}
+
+static bool is_float(char type) {
+	return strchr("fFeEgGaA", type) != NULL;
+}
+
+typedef struct packer_t {
+	uint8_t *buf;
+	size_t size;
+	size_t len;
+} packer_t;
+
+static bool put(packer_t *p, const void *data, size_t len) {
+	if(len > p->size - p->len) {
+		return false;
+	}
+
+	memcpy(p->buf + p->len, data, len);
+	p->len += len;
+	return true;
+}
+
+bool log_pack_args(uint8_t *buf, size_t size, size_t *len, const char *format, va_list ap) {
+	packer_t p = {buf, size, 0};
+
+	for(const char *f = strchr(format, '%'); f; f = strchr(f, '%')) {
+		conversion_t conv;
+
+		if(!parse_conversion(f, &conv)) {
+			return false;
+		}
+
+		f = conv.end;
+
+		if(conv.type == '%') {
+			continue;
+		}
+
+		if(conv.width_star) {
+			int width = va_arg(ap, int);
+
+			if(!put(&p, &width, sizeof(width))) {
+				return false;
+			}
+		}
+
+		if(conv.precision_star) {
+			int precision = va_arg(ap, int);
+
+			if(!put(&p, &precision, sizeof(precision))) {
+				return false;
+			}
+		}
+
+		bool ok;
+
+		if(is_signed(conv.type) || conv.type == 'c') {
+			intmax_t value;
+
+			switch(conv.length) {
+			case LENGTH_L:
+				value = va_arg(ap, long);
+				break;
+
+			case LENGTH_LL:
+				value = va_arg(ap, long long);
+				break;
+
+			case LENGTH_Z:
+				value = va_arg(ap, ssize_t);
+				break;
+
+			case LENGTH_J:
+				value = va_arg(ap, intmax_t);
+				break;
+
+			case LENGTH_T:
+				value = va_arg(ap, ptrdiff_t);
+				break;
+
+			case LENGTH_NONE:
+			case LENGTH_HH:
+			case LENGTH_H:
+			case LENGTH_BIG_L:
+			default:
+				value = va_arg(ap, int);
+				break;
+			}
+
+			ok = put(&p, &value, sizeof(value));
+		} else if(is_unsigned(conv.type)) {
+			uintmax_t value;
+
+			switch(conv.length) {
+			case LENGTH_L:
+				value = va_arg(ap, unsigned long);
+				break;
+
+			case LENGTH_LL:
+				value = va_arg(ap, unsigned long long);
+				break;
+
+			case LENGTH_Z:
+				value = va_arg(ap, size_t);
+				break;
+
+			case LENGTH_J:
+				value = va_arg(ap, uintmax_t);
+				break;
+
+			case LENGTH_T:
+				value = (uintmax_t)va_arg(ap, ptrdiff_t);
+				break;
+
+			case LENGTH_NONE:
+			case LENGTH_HH:
+			case LENGTH_H:
+			case LENGTH_BIG_L:
+			default:
+				value = va_arg(ap, unsigned int);
+				break;
+			}
+
+			ok = put(&p, &value, sizeof(value));
+		} else if(is_float(conv.type)) {
+			if(conv.length == LENGTH_BIG_L) {
+				long double value = va_arg(ap, long double);
+				ok = put(&p, &value, sizeof(value));
+			} else {
+				double value = va_arg(ap, double);
+				ok = put(&p, &value, sizeof(value));
+			}
+		} else if(conv.type == 'p') {
+			void *value = va_arg(ap, void *);
+			ok = put(&p, &value, sizeof(value));
+		} else {
+			const char *value = va_arg(ap, const char *);
+
+			if(!value) {
+				value = "(null)";
+			}
+
+			ok = put(&p, value, strlen(value) + 1);
+		}
+
+		if(!ok) {
+			return false;
+		}
+	}
+
+	*len = p.len;
+	return true;
+}
+
+typedef struct unpacker_t {
+	const uint8_t *buf;
+	size_t len;
+	size_t offset;
+} unpacker_t;
+
+static bool get(unpacker_t *u, void *data, size_t len) {
+	if(len > u->len - u->offset) {
+		return false;
+	}
+
+	memcpy(data, u->buf + u->offset, len);
+	u->offset += len;
+	return true;
+}
+
+// Copy the conversion specification, with the values of '*' filled in
+static bool copy_spec(char *spec, size_t size, const conversion_t *conv, unpacker_t *u) {
+	size_t len = 0;
+
+	for(const char *c = conv->start; c < conv->end; c++) {
+		int n;
+
+		if(*c == '*') {
+			int value;
+
+			if(!get(u, &value, sizeof(value))) {
+				return false;
+			}
+
+			n = snprintf(spec + len, size - len, "%d", value);
+		} else {
+			n = snprintf(spec + len, size - len, "%c", *c);
+		}
+
+		if(n < 0 || (size_t)n >= size - len) {
+			return false;
+		}
+
+		len += n;
+	}
+
+	return true;
+}
+
+// The format strings below are copied from the original format, which the compiler already checked
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+#endif
+
+static int format_value(char *out, size_t size, const char *spec, const conversion_t *conv, unpacker_t *u) {
+	if(is_signed(conv->type) || conv->type == 'c') {
+		intmax_t value;
+
+		if(!get(u, &value, sizeof(value))) {
+			return -1;
+		}
+
+		switch(conv->length) {
+		case LENGTH_L:
+			return snprintf(out, size, spec, (long)value);
+
+		case LENGTH_LL:
+			return snprintf(out, size, spec, (long long)value);
+
+		case LENGTH_Z:
+			return snprintf(out, size, spec, (ssize_t)value);
+
+		case LENGTH_J:
+			return snprintf(out, size, spec, value);
+
+		case LENGTH_T:
+			return snprintf(out, size, spec, (ptrdiff_t)value);
+
+		case LENGTH_NONE:
+		case LENGTH_HH:
+		case LENGTH_H:
+		case LENGTH_BIG_L:
+		default:
+			return snprintf(out, size, spec, (int)value);
+		}
+	}
+
+	if(is_unsigned(conv->type)) {
+		uintmax_t value;
+
+		if(!get(u, &value, sizeof(value))) {
+			return -1;
+		}
+
+		switch(conv->length) {
+		case LENGTH_L:
+			return snprintf(out, size, spec, (unsigned long)value);
+
+		case LENGTH_LL:
+			return snprintf(out, size, spec, (unsigned long long)value);
+
+		case LENGTH_Z:
+			return snprintf(out, size, spec, (size_t)value);
+
+		case LENGTH_J:
+			return snprintf(out, size, spec, value);
+
+		case LENGTH_T:
+			return snprintf(out, size, spec, (ptrdiff_t)value);
+
+		case LENGTH_NONE:
+		case LENGTH_HH:
+		case LENGTH_H:
+		case LENGTH_BIG_L:
+		default:
+			return snprintf(out, size, spec, (unsigned int)value);
+		}
+	}
+
+	if(is_float(conv->type)) {
+		if(conv->length == LENGTH_BIG_L) {
+			long double value;
+			return get(u, &value, sizeof(value)) ? snprintf(out, size, spec, value) : -1;
+		}
+
+		double value;
+		return get(u, &value, sizeof(value)) ? snprintf(out, size, spec, value) : -1;
+	}
+
+	if(conv->type == 'p') {
+		void *value;
+		return get(u, &value, sizeof(value)) ? snprintf(out, size, spec, value) : -1;
+	}
+
+	// A string, stored with its terminating NUL
+	if(u->offset >= u->len) {
+		return -1;
+	}
+
+	const char *value = (const char *)u->buf + u->offset;
+	const char *nul = memchr(value, 0, u->len - u->offset);
+
+	if(!nul) {
+		return -1;
+	}
+
+	u->offset += nul - value + 1;
+	return snprintf(out, size, spec, value);
+}
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
+bool log_format_args(char *out, size_t size, const char *format, const uint8_t *args, size_t len) {
+	unpacker_t u = {args, len, 0};
+	size_t outlen = 0;
+
+	if(!size) {
+		return false;
+	}
+
+	*out = 0;
+
+	for(const char *f = format; *f;) {
+		const char *percent = strchr(f, '%');
+		size_t literal = percent ? (size_t)(percent - f) : strlen(f);
+
+		// Copy literal text, truncating like snprintf() does
+		size_t room = size - 1 - outlen;
+		size_t copy = literal < room ? literal : room;
+		memcpy(out + outlen, f, copy);
+		outlen += copy;
+		out[outlen] = 0;
+
+		if(!percent) {
+			break;
+		}
+
+		conversion_t conv;
+
+		if(!parse_conversion(percent, &conv)) {
+			return false;
+		}
+
+		f = conv.end;
+
+		if(conv.type == '%') {
+			if(outlen < size - 1) {
+				out[outlen++] = '%';
+				out[outlen] = 0;
+			}
+
+			continue;
+		}
+
+		char spec[64];
+
+		if(!copy_spec(spec, sizeof(spec), &conv, &u)) {
+			return false;
+		}
+
+		int n = format_value(out + outlen, size - outlen, spec, &conv, &u);
+
+		if(n < 0) {
+			return false;
+		}
+
+		outlen += (size_t)n < size - outlen ? (size_t)n : size - 1 - outlen;
+	}
+
+	return u.offset == u.len;
+}
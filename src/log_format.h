@@ -0,0 +1,20 @@
+#ifndef TINC_LOG_FORMAT_H
+#define TINC_LOG_FORMAT_H
+
+#include "system.h"
+
+// The arguments of a printf-style format, copied into a buffer so that the
+// message can be formatted later, possibly by another thread. Strings are
+// copied, all other arguments are stored by value. Conversions that write
+// through pointers (%n), take wide characters, or limit the length of a
+// string (%.*s) are not supported.
+
+// Pack the arguments for format into buf, and store the number of bytes used in len.
+// Returns false if they do not fit or the format is not supported.
+extern bool log_pack_args(uint8_t *buf, size_t size, size_t *len, const char *format, va_list ap);
+
+// Format packed arguments the same way vsnprintf() would have formatted the original ones.
+// The result is always NUL-terminated. Returns false if the arguments do not match the format.
+extern bool log_format_args(char *out, size_t size, const char *format, const uint8_t *args, size_t len);
+
+#endif
@@ -0,0 +1,278 @@
+#include "system.h"
+
+#include <pthread.h>
+
+#include "log_format.h"
+#include "log_queue.h"
+#include "logger.h"
+#include "xalloc.h"
+
+// Largest formatted message or set of packed arguments in a record
+#define MAX_RECORD_DATA 2048
+
+// Smallest ring that always has room for a couple of records
+#define MIN_RING_SIZE 8192
+
+// Records are stored back to back and never wrap around the end of the ring.
+// A record size of zero means the rest of the ring is unused, and the next record is at the start.
+typedef struct log_record_t {
+	uint32_t size;                  // Including this header and padding to a multiple of 8
+	int32_t priority;
+	int64_t time;
+	uint32_t format_len;            // Length of the format including its NUL, 0 if the message is formatted already
+	uint32_t data_len;              // Length of the message including its NUL, or of the packed arguments
+} log_record_t;
+
+uint64_t log_queue_records;
+uint64_t log_queue_deferred;
+uint64_t log_queue_dropped;
+
+static uint8_t *ring;
+static size_t ring_size;
+static size_t head;                     // Only changed by the main thread
+static size_t tail;                     // Only changed by the log thread
+static bool sleeping;                   // The log thread waits for wake_cond
+static bool stopping;
+
+static log_write_t write_message;
+static log_flush_t flush_messages;
+
+static pthread_t thread;
+static bool running;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t drained_cond = PTHREAD_COND_INITIALIZER;
+
+static size_t record_size(size_t format_len, size_t data_len) {
+	return (sizeof(log_record_t) + format_len + data_len + 7) & ~(size_t)7;
+}
+
+static void write_record(const log_record_t *record) {
+	const char *data = (const char *)(record + 1);
+	char message[1024];
+
+	if(!record->format_len) {
+		write_message(record->priority, (time_t)record->time, data);
+		return;
+	}
+
+	const uint8_t *args = (const uint8_t *)data + record->format_len;
+
+	if(!log_format_args(message, sizeof(message), data, args, record->data_len)) {
+		snprintf(message, sizeof(message), "Could not format log message \"%s\"", data);
+	}
+
+	write_message(record->priority, (time_t)record->time, message);
+}
+
+static void *log_thread(void *arg) {
+	(void)arg;
+
+	size_t pos = tail;
+
+	while(true) {
+		if(pos != __atomic_load_n(&head, __ATOMIC_SEQ_CST)) {
+			size_t offset = pos % ring_size;
+			uint32_t size;
+			memcpy(&size, ring + offset, sizeof(size));
+
+			if(!size) {
+				pos += ring_size - offset;
+			} else {
+				write_record((const log_record_t *)(ring + offset));
+				pos += size;
+			}
+
+			__atomic_store_n(&tail, pos, __ATOMIC_RELEASE);
+			continue;
+		}
+
+		flush_messages();
+
+		// The main thread checks sleeping after publishing a record, so either it wakes us up, or we see the record here
+		pthread_mutex_lock(&lock);
+		__atomic_store_n(&sleeping, true, __ATOMIC_SEQ_CST);
+
+		if(pos == __atomic_load_n(&head, __ATOMIC_SEQ_CST)) {
+			pthread_cond_broadcast(&drained_cond);
+
+			if(stopping) {
+				pthread_mutex_unlock(&lock);
+				break;
+			}
+
+			pthread_cond_wait(&wake_cond, &lock);
+		}
+
+		__atomic_store_n(&sleeping, false, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&lock);
+	}
+
+	return NULL;
+}
+
+// Find room for a record, or count it as dropped.
+static log_record_t *reserve(size_t size, size_t *start) {
+	size_t used = head - __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+	size_t pos = head;
+	size_t contiguous = ring_size - pos % ring_size;
+	size_t needed = size <= contiguous ? size : contiguous + size;
+
+	if(needed > ring_size - used) {
+		log_queue_dropped++;
+		return NULL;
+	}
+
+	if(size > contiguous) {
+		memset(ring + pos % ring_size, 0, sizeof(uint32_t));
+		pos += contiguous;
+	}
+
+	*start = pos;
+	return (log_record_t *)(ring + pos % ring_size);
+}
+
+static void commit(size_t end) {
+	__atomic_store_n(&head, end, __ATOMIC_SEQ_CST);
+	log_queue_records++;
+
+	if(__atomic_load_n(&sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&lock);
+		pthread_cond_signal(&wake_cond);
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+void log_queue_text(int priority, time_t time, const char *message) {
+	size_t len = strlen(message) + 1;
+
+	if(len > MAX_RECORD_DATA) {
+		len = MAX_RECORD_DATA;
+	}
+
+	size_t size = record_size(0, len);
+	size_t start;
+	log_record_t *record = reserve(size, &start);
+
+	if(!record) {
+		return;
+	}
+
+	record->size = (uint32_t)size;
+	record->priority = priority;
+	record->time = time;
+	record->format_len = 0;
+	record->data_len = (uint32_t)len;
+
+	char *data = (char *)(record + 1);
+	memcpy(data, message, len - 1);
+	data[len - 1] = 0;
+
+	commit(start + size);
+}
+
+bool log_queue_format(int priority, time_t time, const char *format, va_list ap) {
+	uint8_t args[MAX_RECORD_DATA];
+	size_t format_len = strlen(format) + 1;
+
+	if(format_len > MAX_RECORD_DATA) {
+		return false;
+	}
+
+	size_t args_len;
+	va_list aq;
+	va_copy(aq, ap);
+	bool packed = log_pack_args(args, sizeof(args), &args_len, format, aq);
+	va_end(aq);
+
+	if(!packed) {
+		return false;
+	}
+
+	size_t size = record_size(format_len, args_len);
+	size_t start;
+	log_record_t *record = reserve(size, &start);
+
+	if(!record) {
+		return true;
+	}
+
+	record->size = (uint32_t)size;
+	record->priority = priority;
+	record->time = time;
+	record->format_len = (uint32_t)format_len;
+	record->data_len = (uint32_t)args_len;
+
+	uint8_t *data = (uint8_t *)(record + 1);
+	memcpy(data, format, format_len);
+	memcpy(data + format_len, args, args_len);
+
+	log_queue_deferred++;
+	commit(start + size);
+	return true;
+}
+
+void log_queue_flush(void) {
+	if(!running) {
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+
+	while(!sleeping || __atomic_load_n(&tail, __ATOMIC_ACQUIRE) != head) {
+		pthread_cond_signal(&wake_cond);
+		pthread_cond_wait(&drained_cond, &lock);
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+bool log_queue_running(void) {
+	return running;
+}
+
+bool log_queue_start(size_t size, log_write_t write, log_flush_t flush) {
+	if(running) {
+		return true;
+	}
+
+	if(size < MIN_RING_SIZE) {
+		size = MIN_RING_SIZE;
+	}
+
+	ring_size = size & ~(size_t)7;
+	ring = xzalloc(ring_size);
+	head = tail = 0;
+	sleeping = stopping = false;
+	write_message = write;
+	flush_messages = flush;
+
+	int err = pthread_create(&thread, NULL, log_thread, NULL);
+
+	if(err) {
+		free(ring);
+		ring = NULL;
+		logger(DEBUG_ALWAYS, LOG_ERR, "Unable to start log thread: [%d] %s", err, strerror(err));
+		return false;
+	}
+
+	running = true;
+	return true;
+}
+
+void log_queue_stop(void) {
+	if(!running) {
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_cond_signal(&wake_cond);
+	pthread_mutex_unlock(&lock);
+
+	pthread_join(thread, NULL);
+
+	running = false;
+	free(ring);
+	ring = NULL;
+}
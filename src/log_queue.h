@@ -0,0 +1,61 @@
+#ifndef TINC_LOG_QUEUE_H
+#define TINC_LOG_QUEUE_H
+
+#include "system.h"
+
+// A ring buffer of log messages, written out by a separate thread so that
+// logging never waits for a disk, a terminal or syslog. Only the main thread
+// adds messages. When the ring is full, messages are dropped and counted.
+
+// Write one message to the log. Called by the log thread only.
+typedef void (*log_write_t)(int priority, time_t time, const char *message);
+
+// Called by the log thread when it has written everything that was queued.
+typedef void (*log_flush_t)(void);
+
+#ifdef HAVE_LOG_QUEUE
+extern uint64_t log_queue_records;
+extern uint64_t log_queue_deferred;
+extern uint64_t log_queue_dropped;
+
+// Start the log thread with a ring of the given size in bytes.
+extern bool log_queue_start(size_t size, log_write_t write, log_flush_t flush);
+
+// Write out everything that is still queued, and stop the log thread.
+extern void log_queue_stop(void);
+
+extern bool log_queue_running(void);
+
+// Queue a formatted message.
+extern void log_queue_text(int priority, time_t time, const char *message);
+
+// Queue a message to be formatted by the log thread.
+// Returns false if that is not possible for this format, the caller then has to format it itself.
+extern bool log_queue_format(int priority, time_t time, const char *format, va_list ap);
+
+// Wait until the log thread has written everything that was queued.
+extern void log_queue_flush(void);
+#else
+static inline bool log_queue_running(void) {
+	return false;
+}
+
+static inline void log_queue_text(int priority, time_t time, const char *message) {
+	(void)priority;
+	(void)time;
+	(void)message;
+}
+
+static inline bool log_queue_format(int priority, time_t time, const char *format, va_list ap) {
+	(void)priority;
+	(void)time;
+	(void)format;
+	(void)ap;
+	return false;
+}
+
+static inline void log_queue_flush(void) {
+}
+#endif
+
+#endif
@@ -24,6 +24,7 @@
 #include "meta.h"
 #include "names.h"
 #include "logger.h"
+#include "log_queue.h"
 #include "connection.h"
 #include "control_common.h"
 #include "process.h"
@@ -88,17 +89,23 @@ static priority_disp_t get_priority(int priority) {
 	}
 }
 
-// Formats current time to the second.
-// Reuses result so repeated calls within the same second are more efficient.
-static const char *current_time_str(void) {
-	static char timestr[sizeof("2000-12-31 12:34:56")] = "";
-	static time_t last_time = 0;
+#define TIMESTR_SIZE sizeof("2000-12-31 12:34:56")
 
+static time_t current_time(void) {
 	if(!now.tv_sec) {
 		gettimeofday(&now, NULL);
 	}
 
-	time_t now_sec = now.tv_sec;
+	return now.tv_sec;
+}
+
+// Formats current time to the second.
+// Reuses result so repeated calls within the same second are more efficient.
+static const char *current_time_str(void) {
+	static char timestr[TIMESTR_SIZE] = "";
+	static time_t last_time = 0;
+
+	time_t now_sec = current_time();
 
 	if(!*timestr || now_sec != last_time) {
 		last_time = now_sec;
@@ -110,7 +117,7 @@ static const char *current_time_str(void) {
 
 // Format log entry with time, log level, and (possibly) colors, remembering if it was colorized.
 // Returns true if buffer has been changed.
-static bool format_pretty(char *buf, size_t buflen, int prio, const char *message, bool colorize, bool *colorized) {
+static bool format_pretty(char *buf, size_t buflen, int prio, const char *timestr, const char *message, bool colorize, bool *colorized) {
 	// If we already wrote to buffer, and its colorization matches, we're done here
 	if(*buf && colorize == *colorized) {
 		return false;
@@ -128,7 +135,6 @@ static bool format_pretty(char *buf, size_t buflen, int prio, const char *messag
 		timecol = ansi_codes[GRAY];
 	}
 
-	const char *timestr = current_time_str();
 	snprintf(buf, buflen, "%s%s %s%-7s%s %s", timecol, timestr, color, priority.name, reset, message);
 	return true;
 }
@@ -137,51 +143,106 @@ static bool should_log(debug_t level) {
 	return (level <= debug_level && logmode != LOGMODE_NULL) || logcontrol;
 }
 
-static void real_logger(debug_t level, int priority, const char *message) {
+// Write a message to stderr, the log file or syslog
+static void write_log(int priority, const char *timestr, const char *message, bool flush) {
 	char pretty[1024] = "";
 	bool pretty_colorized = false;
-	static bool suppress = false;
 
-	if(suppress) {
-		return;
-	}
+	switch(logmode) {
+	case LOGMODE_STDERR:
+		format_pretty(pretty, sizeof(pretty), priority, timestr, message, colorize_stderr, &pretty_colorized);
+		fprintf(stderr, "%s\n", pretty);
 
-	if(level <= debug_level) {
-		switch(logmode) {
-		case LOGMODE_STDERR:
-			format_pretty(pretty, sizeof(pretty), priority, message, colorize_stderr, &pretty_colorized);
-			fprintf(stderr, "%s\n", pretty);
+		if(flush) {
 			fflush(stderr);
-			break;
+		}
+
+		break;
+
+	case LOGMODE_FILE:
+		fprintf(logfile, "%s %s[%ld]: %s\n", timestr, logident, (long)logpid, message);
 
-		case LOGMODE_FILE: {
-			const char *timestr = current_time_str();
-			fprintf(logfile, "%s %s[%ld]: %s\n", timestr, logident, (long)logpid, message);
+		if(flush) {
 			fflush(logfile);
-			break;
 		}
 
-		case LOGMODE_SYSLOG:
+		break;
+
+	case LOGMODE_SYSLOG:
 #ifdef HAVE_WINDOWS
-			{
-				const char *messages[] = {message};
-				ReportEvent(loghandle, priority, 0, 0, NULL, 1, 0, messages, NULL);
-			}
+		{
+			const char *messages[] = {message};
+			ReportEvent(loghandle, priority, 0, 0, NULL, 1, 0, messages, NULL);
+		}
 
 #else
 #ifdef HAVE_SYSLOG_H
-			syslog(priority, "%s", message);
+		syslog(priority, "%s", message);
 #endif
 #endif
-			break;
+		break;
 
-		case LOGMODE_NULL:
-		default:
-			break;
+	case LOGMODE_NULL:
+	default:
+		break;
+	}
+}
+
+#ifdef HAVE_LOG_QUEUE
+// Called by the log thread
+static void write_queued(int priority, time_t time, const char *message) {
+	char timestr[TIMESTR_SIZE];
+	struct tm tm;
+	strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", localtime_r(&time, &tm));
+
+	size_t len = strlen(message);
+
+	if(len && message[len - 1] == '\n') {
+		char copy[1024];
+		snprintf(copy, sizeof(copy), "%.*s", (int)len - 1, message);
+		write_log(priority, timestr, copy, false);
+	} else {
+		write_log(priority, timestr, message, false);
+	}
+}
+
+static void flush_queued(void) {
+	if(logmode == LOGMODE_STDERR) {
+		fflush(stderr);
+	} else if(logmode == LOGMODE_FILE) {
+		fflush(logfile);
+	}
+}
+
+bool start_log_queue(size_t size) {
+	return log_queue_start(size, write_queued, flush_queued);
+}
+#endif
+
+// Messages that are about to be followed by an abort() are never queued
+static bool can_queue(int priority) {
+	return log_queue_running() && priority > LOG_CRIT;
+}
+
+static void real_logger(debug_t level, int priority, const char *message) {
+	char pretty[1024] = "";
+	bool pretty_colorized = false;
+	static bool suppress = false;
+
+	if(suppress) {
+		return;
+	}
+
+	if(level <= debug_level) {
+		if(can_queue(priority)) {
+			log_queue_text(priority, current_time(), message);
+		} else {
+			log_queue_flush();
+			write_log(priority, current_time_str(), message, true);
 		}
 
 		if(umbilical && do_detach) {
-			format_pretty(pretty, sizeof(pretty), priority, message, umbilical_colorize, &pretty_colorized);
+			format_pretty(pretty, sizeof(pretty), priority, current_time_str(), message, umbilical_colorize, &pretty_colorized);
 
 			if(write(umbilical, pretty, strlen(pretty)) == -1 || write(umbilical, "\n", 1) == -1) {
 				// Other end broken, nothing we can do about it.
@@ -206,7 +267,7 @@ static void real_logger(debug_t level, int priority, const char *message) {
 				continue;
 			}
 
-			if(format_pretty(pretty, sizeof(pretty), priority, message, c->status.log_color, &pretty_colorized)) {
+			if(format_pretty(pretty, sizeof(pretty), priority, current_time_str(), message, c->status.log_color, &pretty_colorized)) {
 				msglen = strlen(pretty);
 			}
 
@@ -228,6 +289,15 @@ void logger(debug_t level, int priority, const char *format, ...) {
 	}
 
 	va_start(ap, format);
+
+	// If the message only goes to the log, the log thread can format it
+	if(level <= debug_level && !logcontrol && !(umbilical && do_detach) && can_queue(priority)) {
+		if(log_queue_format(priority, current_time(), format, ap)) {
+			va_end(ap);
+			return;
+		}
+	}
+
 	int len = vsnprintf(message, sizeof(message), format, ap);
 	message[sizeof(message) - 1] = 0;
 	va_end(ap);
@@ -324,6 +394,7 @@ void reopenlogger(void) {
 		return;
 	}
 
+	log_queue_flush();
 	fflush(logfile);
 	FILE *newfile = fopen(logfilename, "a");
 
@@ -338,6 +409,8 @@ void reopenlogger(void) {
 
 
 void closelogger(void) {
+	log_queue_flush();
+
 	switch(logmode) {
 	case LOGMODE_FILE:
 		fclose(logfile);
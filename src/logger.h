@@ -79,4 +79,9 @@ extern void reopenlogger(void);
 extern void logger(debug_t level, int priority, const char *format, ...) ATTR_FORMAT(printf, 3, 4);
 extern void closelogger(void);
 
+#ifdef HAVE_LOG_QUEUE
+// Hand log messages to a separate thread from now on, through a ring buffer of the given size in bytes.
+extern bool start_log_queue(size_t size);
+#endif
+
 #endif
@@ -96,6 +96,20 @@ bool send_meta(connection_t *c, const void *buffer, size_t length) {
 	return true;
 }
 
+bool send_meta_binary(connection_t *c, const void *buffer, size_t length) {
+	logger(DEBUG_META, LOG_DEBUG, "Sending %lu bytes of binary metadata to %s (%s)",
+	       (unsigned long)length, c->name, c->hostname);
+
+	return sptps_send_record(&c->sptps, META_BINARY_RECORD, buffer, length);
+}
+
+bool send_meta_snapshot(connection_t *c, const void *buffer, size_t length) {
+	logger(DEBUG_META, LOG_DEBUG, "Sending %lu bytes of snapshot to %s (%s)",
+	       (unsigned long)length, c->name, c->hostname);
+
+	return sptps_send_record(&c->sptps, META_SNAPSHOT_RECORD, buffer, length);
+}
+
 void send_meta_raw(connection_t *c, const void *buffer, size_t length) {
 	if(!c) {
 		logger(DEBUG_ALWAYS, LOG_ERR, "send_meta() called with NULL pointer!");
@@ -138,6 +152,16 @@ bool receive_meta_sptps(void *handle, uint8_t type, const void *vdata, uint16_t
 		return true;
 	}
 
+	/* Binary encoded requests are in records of their own */
+
+	if(type == META_BINARY_RECORD && !c->tcplen) {
+		return receive_meta_request(c, data, length);
+	}
+
+	if(type == META_SNAPSHOT_RECORD && !c->tcplen) {
+		return receive_meta_snapshot(c, data, length);
+	}
+
 	/* Are we receiving a TCPpacket? */
 
 	if(c->tcplen) {
@@ -0,0 +1,409 @@
+#include "system.h"
+
+#include "meta_request.h"
+#include "protocol.h"
+
+// Field types: 'x' and 'd' are 32 bit numbers written in hexadecimal and decimal in the
+// text encoding, 's' are strings without whitespace. Fields after a '|' are optional,
+// but must either all be present or all be absent.
+
+static const char *const schemas[LAST] = {
+	[ADD_EDGE] = "xssssxd|ss",
+	[DEL_EDGE] = "xss",
+	[ADD_SUBNET] = "xss",
+	[DEL_SUBNET] = "xss",
+};
+
+bool meta_request_known(int type) {
+	return type >= 0 && type < LAST && schemas[type];
+}
+
+// Type of field i, or 0 if there is no such field
+static char field_type(int type, size_t i) {
+	for(const char *p = schemas[type]; *p; p++) {
+		if(*p == '|') {
+			continue;
+		}
+
+		if(!i--) {
+			return *p;
+		}
+	}
+
+	return 0;
+}
+
+// Whether count fields is a valid number of fields for this type
+static bool valid_count(int type, size_t count) {
+	const char *schema = schemas[type];
+	const char *optional = strchr(schema, '|');
+	size_t all = strlen(schema) - (optional ? 1 : 0);
+
+	return count == all || (optional && count == (size_t)(optional - schema));
+}
+
+static char *reserve(meta_request_t *r, size_t len) {
+	if(len > sizeof(r->buffer) - r->used) {
+		return NULL;
+	}
+
+	char *p = r->buffer + r->used;
+	r->used += len;
+	return p;
+}
+
+static char *copy_string(meta_request_t *r, const char *data, size_t len) {
+	char *p = reserve(r, len + 1);
+
+	if(p) {
+		memcpy(p, data, len);
+		p[len] = 0;
+	}
+
+	return p;
+}
+
+static void reset(meta_request_t *r, int type) {
+	r->type = type;
+	r->count = 0;
+	r->rest = "";
+	r->text = NULL;
+	r->binary = NULL;
+	r->binlen = 0;
+	r->used = 0;
+}
+
+void meta_request_init(meta_request_t *r, int type) {
+	reset(r, type);
+}
+
+void meta_request_add_number(meta_request_t *r, uint32_t number) {
+	if(r->count < META_MAX_FIELDS) {
+		r->numbers[r->count++] = number;
+	}
+}
+
+void meta_request_add_string(meta_request_t *r, const char *string) {
+	if(r->count < META_MAX_FIELDS) {
+		r->strings[r->count++] = string;
+	}
+}
+
+/* Text encoding */
+
+static bool is_space(char c) {
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
+
+static const char *skip_space(const char *p) {
+	while(is_space(*p)) {
+		p++;
+	}
+
+	return p;
+}
+
+static size_t token_length(const char *p) {
+	size_t len = 0;
+
+	while(p[len] && !is_space(p[len])) {
+		len++;
+	}
+
+	return len;
+}
+
+static bool parse_number(const char *token, size_t len, int base, uint32_t *number) {
+	char buf[16];
+
+	if(!len || len >= sizeof(buf)) {
+		return false;
+	}
+
+	memcpy(buf, token, len);
+	buf[len] = 0;
+
+	char *end;
+	errno = 0;
+
+	if(base == 16) {
+		unsigned long value = strtoul(buf, &end, 16);
+
+		if(value > UINT32_MAX) {
+			return false;
+		}
+
+		*number = (uint32_t)value;
+	} else {
+		long value = strtol(buf, &end, 10);
+
+		if(value < INT32_MIN || value > INT32_MAX) {
+			return false;
+		}
+
+		*number = (uint32_t)(int32_t)value;
+	}
+
+	return !errno && !*end;
+}
+
+bool meta_request_parse_text(meta_request_t *r, const char *text) {
+	const char *p = skip_space(text);
+	char *end;
+	long type = strtol(p, &end, 10);
+
+	if(end == p || !meta_request_known((int)type)) {
+		return false;
+	}
+
+	reset(r, (int)type);
+	r->text = text;
+	p = skip_space(end);
+
+	for(char ftype; (ftype = field_type(r->type, r->count)) && *p; p = skip_space(p)) {
+		size_t len = token_length(p);
+
+		if(ftype == 's') {
+			if(len >= MAX_STRING_SIZE || !(r->strings[r->count] = copy_string(r, p, len))) {
+				return false;
+			}
+		} else if(!parse_number(p, len, ftype == 'x' ? 16 : 10, &r->numbers[r->count])) {
+			return false;
+		}
+
+		r->count++;
+		p += len;
+	}
+
+	r->rest = p;
+	return valid_count(r->type, r->count);
+}
+
+static char *append(char *p, char *end, const char *data, size_t len) {
+	if(!p || len > (size_t)(end - p)) {
+		return NULL;
+	}
+
+	memcpy(p, data, len);
+	return p + len;
+}
+
+static char *append_number(char *p, char *end, uint32_t number, char ftype) {
+	char digits[12];
+	char *d = digits + sizeof(digits);
+	bool negative = ftype == 'd' && (int32_t)number < 0;
+	unsigned int base = ftype == 'x' ? 16 : 10;
+
+	if(negative) {
+		number = -number;
+	}
+
+	do {
+		*--d = "0123456789abcdef"[number % base];
+		number /= base;
+	} while(number);
+
+	if(negative) {
+		*--d = '-';
+	}
+
+	return append(p, end, d, digits + sizeof(digits) - d);
+}
+
+const char *meta_request_text(meta_request_t *r) {
+	if(r->text) {
+		return r->text;
+	}
+
+	char *start = r->buffer + r->used;
+	char *end = r->buffer + sizeof(r->buffer);
+	char *p = append_number(start, end, (uint32_t)r->type, 'd');
+
+	for(size_t i = 0; i < r->count; i++) {
+		char ftype = field_type(r->type, i);
+		p = append(p, end, " ", 1);
+
+		if(ftype == 's') {
+			p = append(p, end, r->strings[i], strlen(r->strings[i]));
+		} else {
+			p = append_number(p, end, r->numbers[i], ftype);
+		}
+	}
+
+	if(*r->rest) {
+		p = append(p, end, " ", 1);
+		p = append(p, end, r->rest, strlen(r->rest));
+	}
+
+	p = append(p, end, "", 1);
+
+	if(!p) {
+		return NULL;
+	}
+
+	r->used = p - r->buffer;
+	r->text = start;
+	return r->text;
+}
+
+/* Binary encoding */
+
+static const uint8_t *get_bytes(const uint8_t **p, const uint8_t *end, size_t len) {
+	if(len > (size_t)(end - *p)) {
+		return NULL;
+	}
+
+	const uint8_t *data = *p;
+	*p += len;
+	return data;
+}
+
+static bool get_u16(const uint8_t **p, const uint8_t *end, uint16_t *value) {
+	const uint8_t *data = get_bytes(p, end, 2);
+
+	if(data) {
+		*value = (uint16_t)(data[0] << 8 | data[1]);
+	}
+
+	return data;
+}
+
+static bool get_u32(const uint8_t **p, const uint8_t *end, uint32_t *value) {
+	const uint8_t *data = get_bytes(p, end, 4);
+
+	if(data) {
+		*value = (uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 | (uint32_t)data[2] << 8 | data[3];
+	}
+
+	return data;
+}
+
+// Strings must look exactly like they would after parsing the text encoding
+static bool valid_string(const uint8_t *data, size_t len, bool rest) {
+	if(!rest && !len) {
+		return false;
+	}
+
+	for(size_t i = 0; i < len; i++) {
+		if(!data[i] || data[i] == '\n' || (!rest && is_space((char)data[i]))) {
+			return false;
+		}
+	}
+
+	return !rest || !len || !is_space((char)data[0]);
+}
+
+bool meta_request_parse_binary(meta_request_t *r, const void *vdata, size_t len) {
+	const uint8_t *p = vdata;
+	const uint8_t *end = p + len;
+
+	if(len < 2 || !meta_request_known(p[0]) || !valid_count(p[0], p[1])) {
+		return false;
+	}
+
+	reset(r, p[0]);
+	size_t count = p[1];
+	p += 2;
+
+	for(; r->count < count; r->count++) {
+		if(field_type(r->type, r->count) == 's') {
+			uint16_t slen;
+			const uint8_t *data;
+
+			if(!get_u16(&p, end, &slen) || slen >= MAX_STRING_SIZE || !(data = get_bytes(&p, end, slen)) || !valid_string(data, slen, false)) {
+				return false;
+			}
+
+			if(!(r->strings[r->count] = copy_string(r, (const char *)data, slen))) {
+				return false;
+			}
+		} else if(!get_u32(&p, end, &r->numbers[r->count])) {
+			return false;
+		}
+	}
+
+	uint16_t restlen;
+	const uint8_t *rest;
+
+	if(!get_u16(&p, end, &restlen) || !(rest = get_bytes(&p, end, restlen)) || !valid_string(rest, restlen, true) || p != end) {
+		return false;
+	}
+
+	if(!(r->rest = copy_string(r, (const char *)rest, restlen))) {
+		return false;
+	}
+
+	r->binary = vdata;
+	r->binlen = len;
+	return true;
+}
+
+static uint8_t *put_u16(uint8_t *p, const uint8_t *end, size_t value) {
+	if(!p || value > 0xffff || end - p < 2) {
+		return NULL;
+	}
+
+	*p++ = (uint8_t)(value >> 8);
+	*p++ = (uint8_t)value;
+	return p;
+}
+
+static uint8_t *put_u32(uint8_t *p, const uint8_t *end, uint32_t value) {
+	if(!p || end - p < 4) {
+		return NULL;
+	}
+
+	*p++ = (uint8_t)(value >> 24);
+	*p++ = (uint8_t)(value >> 16);
+	*p++ = (uint8_t)(value >> 8);
+	*p++ = (uint8_t)value;
+	return p;
+}
+
+static uint8_t *put_string(uint8_t *p, const uint8_t *end, const char *string) {
+	size_t len = strlen(string);
+	p = put_u16(p, end, len);
+
+	if(!p || len > (size_t)(end - p)) {
+		return NULL;
+	}
+
+	memcpy(p, string, len);
+	return p + len;
+}
+
+const uint8_t *meta_request_binary(meta_request_t *r, size_t *len) {
+	if(!r->binary) {
+		uint8_t *start = (uint8_t *)r->buffer + r->used;
+		uint8_t *end = (uint8_t *)r->buffer + sizeof(r->buffer);
+		uint8_t *p = start;
+
+		if(end - p < 2 || r->count > 0xff) {
+			return NULL;
+		}
+
+		*p++ = (uint8_t)r->type;
+		*p++ = (uint8_t)r->count;
+
+		for(size_t i = 0; i < r->count; i++) {
+			if(field_type(r->type, i) == 's') {
+				p = put_string(p, end, r->strings[i]);
+			} else {
+				p = put_u32(p, end, r->numbers[i]);
+			}
+		}
+
+		p = put_string(p, end, r->rest);
+
+		if(!p) {
+			return NULL;
+		}
+
+		r->used = (char *)p - r->buffer;
+		r->binary = start;
+		r->binlen = p - start;
+	}
+
+	*len = r->binlen;
+	return r->binary;
+}
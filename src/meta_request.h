@@ -0,0 +1,66 @@
+#ifndef TINC_META_REQUEST_H
+#define TINC_META_REQUEST_H
+
+#include "system.h"
+
+#include "net.h"
+
+// Requests that are flooded through the whole VPN, parsed into fields, so they can be
+// handled and forwarded without going through printf() and scanf() every time.
+//
+// Each request has a text encoding, a line with the request number followed by
+// its fields separated by spaces, and a binary encoding, which is sent in SPTPS
+// records of type META_BINARY_RECORD to peers with protocol minor 8 or later:
+//
+//   uint8_t type, uint8_t count, count fields, uint16_t restlen, restlen bytes
+//
+// Numbers are 32 bits big endian, and strings are a 16 bit big endian length
+// followed by that many bytes. Any text following the last known field is kept
+// in rest, so extensions added by newer versions survive being forwarded.
+
+#define META_BINARY_RECORD 1
+#define META_BINARY_MINOR 8
+
+// A snapshot record starts with a flags byte, followed by many binary encoded
+// ADD_SUBNET and ADD_EDGE requests, each preceded by its length as a 16 bit big
+// endian number. They are used to send the whole topology to peers with protocol
+// minor 9 or later at once. The last record of a snapshot has SNAPSHOT_LAST set,
+// even if it holds no requests.
+
+#define META_SNAPSHOT_RECORD 2
+#define META_SNAPSHOT_MINOR 9
+#define SNAPSHOT_LAST 0x01
+#define META_MAX_FIELDS 10
+
+typedef struct meta_request_t {
+	int type;
+	size_t count;                           // Number of fields present
+	uint32_t numbers[META_MAX_FIELDS];      // Values of the number fields
+	const char *strings[META_MAX_FIELDS];   // Values of the string fields
+	const char *rest;                       // Text after the last known field, never NULL
+	const char *text;                       // Text encoding without newline, NULL until needed
+	const uint8_t *binary;                  // Binary encoding, NULL until needed
+	size_t binlen;
+	size_t used;
+	char buffer[3 * MAXBUFSIZE];            // Storage for decoded strings and generated encodings
+} meta_request_t;
+
+// Whether the request type has a parsed form and a binary encoding.
+extern bool meta_request_known(int type);
+
+// Start building a request to send, then add its fields in order.
+// Strings are not copied, they must stay valid until the request has been sent.
+extern void meta_request_init(meta_request_t *r, int type);
+extern void meta_request_add_number(meta_request_t *r, uint32_t number);
+extern void meta_request_add_string(meta_request_t *r, const char *string);
+
+// Parse a request. The input must stay valid while the request is used.
+// Returns false if the request is malformed or does not have all the required fields.
+extern bool meta_request_parse_text(meta_request_t *r, const char *text);
+extern bool meta_request_parse_binary(meta_request_t *r, const void *data, size_t len);
+
+// Get the encodings, generating them if necessary. Returns NULL if they do not fit.
+extern const char *meta_request_text(meta_request_t *r);
+extern const uint8_t *meta_request_binary(meta_request_t *r, size_t *len);
+
+#endif
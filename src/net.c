@@ -118,6 +118,8 @@ void tarpit(int fd) {
 void terminate_connection(connection_t *c, bool report) {
 	logger(DEBUG_CONNECTIONS, LOG_NOTICE, "Closing connection with %s (%s)", c->name, c->hostname);
 
+	end_receiving_snapshot(c);
+
 	if(c->node) {
 		if(c->node->connection == c) {
 			c->node->connection = NULL;
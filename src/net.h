@@ -46,6 +46,8 @@
 
 #define MAXSOCKETS 8    /* Probably overkill... */
 
+#define MAX_DEVICE_BATCH 64 /* Maximum number of packets read from the device per event */
+
 typedef struct mac_t {
 	uint8_t x[6];
 } mac_t;
@@ -107,11 +109,22 @@ typedef struct vpn_packet_t {
 #define PKT_MAC 2
 #define PKT_PROBE 4
 
+#if defined(HAVE_SENDMMSG) && defined(UDP_SEGMENT)
+#define HAVE_UDP_GSO 1
+#endif
+
+#if defined(HAVE_RECVMMSG) && defined(UDP_GRO)
+#define HAVE_UDP_GRO 1
+#endif
+
 typedef struct listen_socket_t {
 	io_t tcp;
 	io_t udp;
 	sockaddr_t sa;
 	bool bindto;
+	bool udp_gso;           /* the kernel can split coalesced datagrams for us */
+	bool udp_gro;           /* the kernel can coalesce received datagrams */
+	bool udp_multishot;     /* datagrams are received by an io_uring request */
 	int priority;
 } listen_socket_t;
 
@@ -151,6 +164,7 @@ extern io_t unix_socket;
 extern int keylifetime;
 extern int udp_rcvbuf;
 extern int udp_sndbuf;
+extern bool udp_offload;
 extern bool udp_rcvbuf_warnings;
 extern bool udp_sndbuf_warnings;
 extern int max_connection_burst;
@@ -163,6 +177,12 @@ extern bool disablebuggypeers;
 extern int contradicting_add_edge;
 extern int contradicting_del_edge;
 extern time_t last_config_check;
+extern uint64_t device_read_batches;
+extern uint64_t device_read_packets;
+extern uint64_t udp_send_batches;
+extern uint64_t udp_send_packets;
+extern uint64_t udp_gso_packets;
+extern uint64_t udp_gro_packets;
 
 extern char *proxyhost;
 extern char *proxyport;
@@ -187,15 +207,19 @@ extern char *scriptextension;
 
 extern void retry_outgoing(outgoing_t *outgoing);
 extern void handle_incoming_vpn_data(void *data, int flags);
+extern void handle_incoming_vpn_datagram(void *data, vpn_packet_t *pkt, sockaddr_t *addr);
 extern void finish_connecting(struct connection_t *c);
 extern bool do_outgoing_connection(struct outgoing_t *outgoing);
 extern void handle_new_meta_connection(void *data, int flags);
 extern void handle_new_unix_connection(void *data, int flags);
 extern int setup_listen_socket(const sockaddr_t *sa);
 extern int setup_vpn_in_socket(const sockaddr_t *sa);
+extern void setup_udp_offload(listen_socket_t *ls);
 extern bool send_sptps_data(struct node_t *to, struct node_t *from, int type, const void *data, size_t len);
 extern bool receive_sptps_record(void *handle, uint8_t type, const void *data, uint16_t len);
 extern void send_packet(struct node_t *n, vpn_packet_t *packet);
+extern void send_packets(struct node_t *n, vpn_packet_t **packets, size_t count);
+extern void flush_udp_queues(void);
 extern void receive_tcppacket(struct connection_t *c, const char *buffer, size_t length);
 extern bool receive_tcppacket_sptps(struct connection_t *c, const char *buffer, size_t length);
 extern void broadcast_packet(const struct node_t *n, vpn_packet_t *packet);
@@ -211,6 +235,7 @@ extern int main_loop(void);
 extern void terminate_connection(struct connection_t *c, bool report);
 extern bool node_read_ecdsa_public_key(struct node_t *n);
 extern void handle_device_data(void *data, int flags);
+extern void handle_device_packets(vpn_packet_t *packets, size_t count);
 extern void handle_meta_connection_data(struct connection_t *c);
 extern void regenerate_key(void);
 extern void purge(void);
@@ -42,6 +42,8 @@
 #include "connection.h"
 #include "compression.h"
 #include "crypto.h"
+#include "crypto_pool.h"
+#include "device_workers.h"
 #include "digest.h"
 #include "device.h"
 #include "ethernet.h"
@@ -54,6 +56,7 @@
 #include "route.h"
 #include "utils.h"
 #include "random.h"
+#include "xalloc.h"
 
 /* The minimum size of a probe is 14 bytes, but since we normally use CBC mode
    encryption, we can add a few extra random bytes without increasing the
@@ -76,6 +79,7 @@ static void *lz4_state = NULL;
 #endif // HAVE_LZ4
 
 static void send_udppacket(node_t *, vpn_packet_t *);
+static bool send_sptps_record_udp(node_t *n, uint8_t type, uint8_t *data, uint16_t len);
 
 unsigned replaywin = 32;
 bool localdiscovery = true;
@@ -84,6 +88,13 @@ int udp_discovery_keepalive_interval = 10;
 int udp_discovery_interval = 2;
 int udp_discovery_timeout = 30;
 
+uint64_t device_read_batches = 0;
+uint64_t device_read_packets = 0;
+uint64_t udp_send_batches = 0;
+uint64_t udp_send_packets = 0;
+uint64_t udp_gso_packets = 0;
+uint64_t udp_gro_packets = 0;
+
 #define MAX_SEQNO 1073741824
 
 static void try_fix_mtu(node_t *n) {
@@ -118,6 +129,7 @@ static void reduce_mtu(node_t *n, int mtu) {
 	}
 
 	try_fix_mtu(n);
+	device_workers_update();
 }
 
 static void udp_probe_timeout_handler(void *data) {
@@ -134,6 +146,7 @@ static void udp_probe_timeout_handler(void *data) {
 	n->mtuprobes = 0;
 	n->minmtu = 0;
 	n->maxmtu = MTU;
+	device_workers_update();
 }
 
 static void send_udp_probe_reply(node_t *n, vpn_packet_t *packet, length_t len) {
@@ -416,6 +429,20 @@ static bool try_mac(node_t *n, const vpn_packet_t *inpkt) {
 #endif
 }
 
+/* The UDP packet currently being decrypted in place by SPTPS, if any. */
+static vpn_packet_t *sptps_inpkt;
+
+static void sptps_receive_failed(node_t *n) {
+	/* Uh-oh. It might be that the tunnel is stuck in some corrupted state,
+	   so let's restart SPTPS in case that helps. But don't do that too often
+	   to prevent storms, and because that would make life a little too easy
+	   for external attackers trying to DoS us. */
+	if(n->last_req_key < now.tv_sec - 10) {
+		logger(DEBUG_PROTOCOL, LOG_ERR, "Failed to decode raw TCP packet from %s (%s), restarting SPTPS", n->name, n->hostname);
+		send_req_key(n);
+	}
+}
+
 static bool receive_udppacket(node_t *n, vpn_packet_t *inpkt) {
 	if(n->status.sptps) {
 		if(!n->sptps.state) {
@@ -430,19 +457,13 @@ static bool receive_udppacket(node_t *n, vpn_packet_t *inpkt) {
 		}
 
 		n->status.udppacket = true;
-		bool result = sptps_receive_data(&n->sptps, DATA(inpkt), inpkt->len);
+		sptps_inpkt = inpkt;
+		bool result = sptps_receive_datagram(&n->sptps, DATA(inpkt), inpkt->len);
+		sptps_inpkt = NULL;
 		n->status.udppacket = false;
 
 		if(!result) {
-			/* Uh-oh. It might be that the tunnel is stuck in some corrupted state,
-			   so let's restart SPTPS in case that helps. But don't do that too often
-			   to prevent storms, and because that would make life a little too easy
-			   for external attackers trying to DoS us. */
-			if(n->last_req_key < now.tv_sec - 10) {
-				logger(DEBUG_PROTOCOL, LOG_ERR, "Failed to decode raw TCP packet from %s (%s), restarting SPTPS", n->name, n->hostname);
-				send_req_key(n);
-			}
-
+			sptps_receive_failed(n);
 			return false;
 		}
 
@@ -674,6 +695,20 @@ bool receive_tcppacket_sptps(connection_t *c, const char *data, size_t len) {
 	return true;
 }
 
+/* Probes are always sent synchronously, because the way they are sent depends on the node's current state.
+   The data must be inside a vpn_packet_t, after at least one byte of headroom. */
+static void send_sptps_record(node_t *n, uint8_t type, uint8_t *data, uint16_t len) {
+	if(crypto_pool_send(n, type, data, len)) {
+		return;
+	}
+
+	crypto_pool_flush(n);
+
+	if(!send_sptps_record_udp(n, type, data, len)) {
+		sptps_send_record(&n->sptps, type, data, len);
+	}
+}
+
 static void send_sptps_packet(node_t *n, vpn_packet_t *origpkt) {
 	if(!n->status.validkey && !n->connection) {
 		return;
@@ -700,7 +735,7 @@ static void send_sptps_packet(node_t *n, vpn_packet_t *origpkt) {
 	vpn_packet_t outpkt;
 
 	if(n->outcompression != COMPRESS_NONE) {
-		outpkt.offset = 0;
+		outpkt.offset = DEFAULT_PACKET_OFFSET;
 		length_t len = compress_packet(DATA(&outpkt) + offset, DATA(origpkt) + offset, origpkt->len - offset, n->outcompression);
 
 		if(!len) {
@@ -719,7 +754,7 @@ static void send_sptps_packet(node_t *n, vpn_packet_t *origpkt) {
 	if(n->connection && origpkt->len > n->minmtu) {
 		send_tcppacket(n->connection, origpkt);
 	} else {
-		sptps_send_record(&n->sptps, type, DATA(origpkt) + offset, origpkt->len - offset);
+		send_sptps_record(n, type, DATA(origpkt) + offset, origpkt->len - offset);
 	}
 }
 
@@ -801,6 +836,258 @@ static void choose_local_address(const node_t *n, const sockaddr_t **sa, size_t
 	}
 }
 
+static void udp_send_error(const node_id_t *id, int origlen, int err) {
+	node_t *n = lookup_node_id(id);
+
+	if(!n) {
+		return;
+	}
+
+	if(sockmsgsize(err)) {
+		reduce_mtu(n, origlen - 1);
+	} else {
+		logger(DEBUG_TRAFFIC, LOG_WARNING, "Error sending packet to %s (%s): %s", n->name, n->hostname, sockstrerror(err));
+	}
+}
+
+#ifdef HAVE_SENDMMSG
+/* Outgoing datagrams are queued per listening socket, and sent using a single
+   sendmmsg() call when the queue is full or at the end of the event loop iteration.
+   With UDP segmentation offload, consecutive datagrams of the same size to the same
+   address are coalesced into one message that the kernel splits up again. */
+
+#define MAX_SEND_MSG 64
+#define UDP_GSO_MAX_BYTES 65000
+
+typedef struct udp_queue_t {
+	unsigned int msgs;                      /* number of messages queued */
+	unsigned int slots;                     /* number of datagrams in those messages */
+	struct mmsghdr msg[MAX_SEND_MSG];
+	sockaddr_t addr[MAX_SEND_MSG];
+	size_t msglen[MAX_SEND_MSG];
+	size_t segsize[MAX_SEND_MSG];           /* size of coalesced datagrams, 0 if the message can't be extended */
+#ifdef HAVE_UDP_GSO
+	union {
+		char buf[CMSG_SPACE(sizeof(uint16_t))];
+		size_t align;
+	} control[MAX_SEND_MSG];
+#endif
+	struct iovec iov[MAX_SEND_MSG];
+	node_id_t id[MAX_SEND_MSG];
+	int origlen[MAX_SEND_MSG];
+	uint8_t data[MAX_SEND_MSG][MAXSIZE];
+} udp_queue_t;
+
+static udp_queue_t udp_queue[MAXSOCKETS];
+
+static void udp_send_failed(size_t sock, const struct msghdr *hdr, int err) {
+	udp_queue_t *q = &udp_queue[sock];
+	size_t first = hdr->msg_iov - q->iov;
+
+#ifdef HAVE_UDP_GSO
+
+	if(hdr->msg_iovlen > 1) {
+		if(sockmsgsize(err) || err == EINVAL) {
+			/* The segment size no longer fits the path MTU, the kernel returns EINVAL if it shrank
+			   after the message was built. Lower the MTU and send the datagrams one by one. */
+			node_t *n = lookup_node_id(&q->id[first]);
+
+			if(n) {
+				reduce_mtu(n, q->origlen[first] - 1);
+			}
+		} else if(err == EIO || err == ENOPROTOOPT) {
+			/* The kernel refused to segment the datagrams for us, send them one by one from now on. */
+			logger(DEBUG_ALWAYS, LOG_WARNING, "UDP segmentation offload failed, disabling it: %s", sockstrerror(err));
+			listen_socket[sock].udp_gso = false;
+		} else {
+			udp_send_error(&q->id[first], q->origlen[first], err);
+			return;
+		}
+
+		for(size_t i = first; i < first + hdr->msg_iovlen; i++) {
+			udp_send_batches++;
+
+			if(sendto(listen_socket[sock].udp.fd, q->iov[i].iov_base, q->iov[i].iov_len, 0, hdr->msg_name, hdr->msg_namelen) < 0) {
+				if(!sockwouldblock(sockerrno)) {
+					udp_send_error(&q->id[i], q->origlen[i], sockerrno);
+				}
+			} else {
+				udp_send_packets++;
+			}
+		}
+
+		return;
+	}
+
+#endif
+
+	udp_send_error(&q->id[first], q->origlen[first], err);
+}
+
+static void flush_udp_queue(size_t sock) {
+	udp_queue_t *q = &udp_queue[sock];
+	unsigned int sent = 0;
+
+	while(sent < q->msgs) {
+		int result = sendmmsg(listen_socket[sock].udp.fd, q->msg + sent, q->msgs - sent, 0);
+		udp_send_batches++;
+
+		if(result > 0) {
+			for(unsigned int i = sent; i < sent + result; i++) {
+				size_t count = q->msg[i].msg_hdr.msg_iovlen;
+				udp_send_packets += count;
+
+				if(count > 1) {
+					udp_gso_packets += count;
+				}
+			}
+
+			sent += result;
+			continue;
+		}
+
+		/* Only the first message can have failed, skip it and send the rest. */
+
+		if(sockerrno == EINTR) {
+			continue;
+		}
+
+		if(sockwouldblock(sockerrno)) {
+			break;
+		}
+
+		udp_send_failed(sock, &q->msg[sent].msg_hdr, sockerrno);
+		sent++;
+	}
+
+	q->msgs = 0;
+	q->slots = 0;
+}
+
+void flush_udp_queues(void) {
+	for(int i = 0; i < listen_sockets; i++) {
+		if(udp_queue[i].msgs) {
+			flush_udp_queue(i);
+		}
+	}
+}
+
+/* Returns a buffer the caller can build the next datagram for sock in,
+   so it can be queued without copying it. */
+static uint8_t *udp_send_buffer(size_t sock) {
+	return udp_queue[sock].data[udp_queue[sock].slots];
+}
+
+#ifdef HAVE_UDP_GSO
+/* Try to append the datagram in the last slot to the last message.
+   All datagrams in a message must have the same size, except the last one which may be shorter. */
+static bool coalesce_udp_datagram(udp_queue_t *q, const sockaddr_t *sa, size_t len) {
+	if(!q->msgs) {
+		return false;
+	}
+
+	unsigned int m = q->msgs - 1;
+	size_t segsize = q->segsize[m];
+
+	if(!segsize || len > segsize || q->iov[q->slots - 2].iov_len != segsize || q->msglen[m] + len > UDP_GSO_MAX_BYTES || sockaddrcmp(sa, &q->addr[m])) {
+		return false;
+	}
+
+	struct msghdr *hdr = &q->msg[m].msg_hdr;
+
+	if(hdr->msg_iovlen++ == 1) {
+		hdr->msg_control = q->control[m].buf;
+		hdr->msg_controllen = sizeof(q->control[m].buf);
+
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+		cmsg->cmsg_level = IPPROTO_UDP;
+		cmsg->cmsg_type = UDP_SEGMENT;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+
+		uint16_t gso_size = segsize;
+		memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+	}
+
+	q->msglen[m] += len;
+	return true;
+}
+#endif
+
+static void udp_send(const node_t *n, size_t sock, const sockaddr_t *sa, const void *data, size_t len, int origlen, bool coalesce) {
+	udp_queue_t *q = &udp_queue[sock];
+	unsigned int i = q->slots++;
+
+	if(data != q->data[i]) {
+		memcpy(q->data[i], data, len);
+	}
+
+	q->id[i] = n->id;
+	q->origlen[i] = origlen;
+
+	q->iov[i] = (struct iovec) {
+		.iov_base = q->data[i],
+		.iov_len = len,
+	};
+
+#ifdef HAVE_UDP_GSO
+	coalesce = coalesce && listen_socket[sock].udp_gso;
+
+	if(coalesce && coalesce_udp_datagram(q, sa, len)) {
+		if(q->slots == MAX_SEND_MSG) {
+			flush_udp_queue(sock);
+		}
+
+		return;
+	}
+
+#endif
+
+	unsigned int m = q->msgs++;
+	q->addr[m] = *sa;
+	q->msglen[m] = len;
+	q->segsize[m] = coalesce ? len : 0;
+
+	q->msg[m].msg_hdr = (struct msghdr) {
+		.msg_name = &q->addr[m].sa,
+		.msg_namelen = SALEN(sa->sa),
+		.msg_iov = &q->iov[i],
+		.msg_iovlen = 1,
+	};
+
+	if(q->slots == MAX_SEND_MSG) {
+		flush_udp_queue(sock);
+	}
+}
+
+#else
+
+static inline void flush_udp_queue(size_t sock) {
+	(void)sock;
+}
+
+void flush_udp_queues(void) {
+}
+
+static uint8_t *udp_send_buffer(size_t sock) {
+	(void)sock;
+	static uint8_t buf[MAXSIZE];
+	return buf;
+}
+
+static void udp_send(const node_t *n, size_t sock, const sockaddr_t *sa, const void *data, size_t len, int origlen, bool coalesce) {
+	(void)coalesce;
+	udp_send_batches++;
+
+	if(sendto(listen_socket[sock].udp.fd, data, len, 0, &sa->sa, SALEN(sa->sa)) < 0) {
+		if(!sockwouldblock(sockerrno)) {
+			udp_send_error(&n->id, origlen, sockerrno);
+		}
+	} else {
+		udp_send_packets++;
+	}
+}
+#endif
+
 static void send_udppacket(node_t *n, vpn_packet_t *origpkt) {
 	if(!n->status.reachable) {
 		logger(DEBUG_TRAFFIC, LOG_INFO, "Trying to send UDP packet to unreachable node %s (%s)", n->name, n->hostname);
@@ -911,6 +1198,8 @@ static void send_udppacket(node_t *n, vpn_packet_t *origpkt) {
 	}
 
 	if(priorityinheritance && origpriority != listen_socket[sock].priority) {
+		/* Datagrams already queued must go out with the old priority. */
+		flush_udp_queue(sock);
 		listen_socket[sock].priority = origpriority;
 
 		switch(sa->sa.sa_family) {
@@ -942,29 +1231,99 @@ static void send_udppacket(node_t *n, vpn_packet_t *origpkt) {
 		}
 	}
 
-	if(sendto(listen_socket[sock].udp.fd, (void *)SEQNO(inpkt), inpkt->len, 0, &sa->sa, SALEN(sa->sa)) < 0 && !sockwouldblock(sockerrno)) {
-		if(sockmsgsize(sockerrno)) {
-			reduce_mtu(n, origlen - 1);
-		} else {
-			logger(DEBUG_TRAFFIC, LOG_WARNING, "Error sending packet to %s (%s): %s", n->name, n->hostname, sockstrerror(sockerrno));
-		}
-	}
+	udp_send(n, sock, sa, SEQNO(inpkt), inpkt->len, origlen, false);
 
 end:
 	origpkt->len = origlen;
 #endif
 }
 
+/* Choose the node to send an SPTPS record to, and return whether it can be sent to it via UDP.
+   This is not possible for handshake packets, if TCPOnly is in use, if this is a relay packet
+   that the other node cannot understand, or if this packet is larger than the MTU. */
+static bool choose_sptps_relay(node_t *to, const node_t *from, int type, size_t origlen, node_t **relay) {
+	*relay = (to->via != myself && (type == PKT_PROBE || origlen <= to->via->minmtu)) ? to->via : to->nexthop;
+	bool direct = from == myself && to == *relay;
+	bool relay_supported = ((*relay)->options >> 24) >= 4;
+	bool tcponly = (myself->options | (*relay)->options) & OPTION_TCPONLY;
+
+	return !(type == SPTPS_HANDSHAKE || tcponly || (!direct && !relay_supported) || (type != PKT_PROBE && origlen > (*relay)->minmtu));
+}
+
+/* Choose the address and socket to send UDP packets to relay with. */
+static void choose_sptps_address(const node_t *relay, const sockaddr_t **sa, size_t *sock) {
+	*sa = NULL;
+
+	if(relay->status.send_locally) {
+		choose_local_address(relay, sa, sock);
+	}
+
+	if(!*sa) {
+		choose_udp_address(relay, sa, sock);
+	}
+}
+
+/* Write the destination and source IDs in front of an SPTPS datagram if the relay understands them.
+   Returns a pointer to where the datagram itself goes. */
+static uint8_t *put_sptps_ids(const node_t *to, const node_t *from, const node_t *relay, uint8_t *buf) {
+	if((relay->options >> 24) < 4) {
+		return buf;
+	}
+
+	if(from == myself && to == relay) {
+		/* Inform the recipient that this packet was sent directly. */
+		node_id_t nullid = {0};
+		memcpy(buf, &nullid, sizeof(nullid));
+	} else {
+		memcpy(buf, &to->id, sizeof(to->id));
+	}
+
+	buf += sizeof(to->id);
+	memcpy(buf, &from->id, sizeof(from->id));
+	return buf + sizeof(from->id);
+}
+
+/* Encrypt a data record straight into the UDP send buffer, so the payload is not copied around first.
+   The byte before data must be writable. Returns false if the record has to be sent the regular way. */
+static bool send_sptps_record_udp(node_t *n, uint8_t type, uint8_t *data, uint16_t len) {
+	node_t *relay;
+
+	if(!n->sptps.outstate || !choose_sptps_relay(n, myself, type, len, &relay)) {
+		return false;
+	}
+
+	const sockaddr_t *sa;
+	size_t sock;
+	choose_sptps_address(relay, &sa, &sock);
+
+	uint8_t *buf = udp_send_buffer(sock);
+	uint8_t *record = put_sptps_ids(n, myself, relay, buf);
+
+	if(!sptps_seal_record(&n->sptps, type, data, len, record)) {
+		return false;
+	}
+
+	logger(DEBUG_TRAFFIC, LOG_INFO, "Sending packet from %s (%s) to %s (%s) via %s (%s) (UDP)", myself->name, myself->hostname, n->name, n->hostname, relay->name, relay->hostname);
+
+	udp_send(relay, sock, sa, buf, record - buf + len + SPTPS_DATAGRAM_OVERHEAD, len, true);
+	return true;
+}
+
 bool send_sptps_data(node_t *to, node_t *from, int type, const void *data, size_t len) {
 	size_t origlen = len - SPTPS_DATAGRAM_OVERHEAD;
-	node_t *relay = (to->via != myself && (type == PKT_PROBE || origlen <= to->via->minmtu)) ? to->via : to->nexthop;
-	bool direct = from == myself && to == relay;
-	bool relay_supported = (relay->options >> 24) >= 4;
-	bool tcponly = (myself->options | relay->options) & OPTION_TCPONLY;
+	node_t *relay;
 
-	/* Send it via TCP if it is a handshake packet, TCPOnly is in use, this is a relay packet that the other node cannot understand, or this packet is larger than the MTU. */
+	/* Probes and handshake records of our own must not overtake data records still being encrypted */
+	if(from == myself) {
+		crypto_pool_flush(to);
 
-	if(type == SPTPS_HANDSHAKE || tcponly || (!direct && !relay_supported) || (type != PKT_PROBE && origlen > relay->minmtu)) {
+		/* A key exchange changes the outgoing key, which the device workers must stop using first */
+		if(type == SPTPS_HANDSHAKE) {
+			device_workers_cancel(to);
+		}
+	}
+
+	if(!choose_sptps_relay(to, from, type, origlen, &relay)) {
 		if(type != SPTPS_HANDSHAKE && (to->nexthop->connection->options >> 24) >= 7) {
 			const size_t buflen = len + sizeof(to->id) + sizeof(from->id);
 			uint8_t *buf = alloca(buflen);
@@ -992,56 +1351,19 @@ bool send_sptps_data(node_t *to, node_t *from, int type, const void *data, size_
 		}
 	}
 
-	size_t overhead = 0;
-
-	if(relay_supported) {
-		overhead += sizeof(to->id) + sizeof(from->id);
-	}
-
-	char *buf = alloca(len + overhead);
-	char *buf_ptr = buf;
-
-	if(relay_supported) {
-		if(direct) {
-			/* Inform the recipient that this packet was sent directly. */
-			node_id_t nullid = {0};
-			memcpy(buf_ptr, &nullid, sizeof(nullid));
-			buf_ptr += sizeof(nullid);
-		} else {
-			memcpy(buf_ptr, &to->id, sizeof(to->id));
-			buf_ptr += sizeof(to->id);
-		}
-
-		memcpy(buf_ptr, &from->id, sizeof(from->id));
-		buf_ptr += sizeof(from->id);
+	const sockaddr_t *sa;
+	size_t sock;
+	choose_sptps_address(relay, &sa, &sock);
 
-	}
+	uint8_t *buf = udp_send_buffer(sock);
+	uint8_t *buf_ptr = put_sptps_ids(to, from, relay, buf);
 
-	/* TODO: if this copy turns out to be a performance concern, change sptps_send_record() to add some "pre-padding" to the buffer and use that instead */
 	memcpy(buf_ptr, data, len);
 	buf_ptr += len;
 
-	const sockaddr_t *sa = NULL;
-	size_t sock;
-
-	if(relay->status.send_locally) {
-		choose_local_address(relay, &sa, &sock);
-	}
-
-	if(!sa) {
-		choose_udp_address(relay, &sa, &sock);
-	}
-
 	logger(DEBUG_TRAFFIC, LOG_INFO, "Sending packet from %s (%s) to %s (%s) via %s (%s) (UDP)", from->name, from->hostname, to->name, to->hostname, relay->name, relay->hostname);
 
-	if(sendto(listen_socket[sock].udp.fd, buf, buf_ptr - buf, 0, &sa->sa, SALEN(sa->sa)) < 0 && !sockwouldblock(sockerrno)) {
-		if(sockmsgsize(sockerrno)) {
-			reduce_mtu(relay, (int)origlen - 1);
-		} else {
-			logger(DEBUG_TRAFFIC, LOG_WARNING, "Error sending UDP SPTPS packet to %s (%s): %s", relay->name, relay->hostname, sockstrerror(sockerrno));
-			return false;
-		}
-	}
+	udp_send(relay, sock, sa, buf, buf_ptr - buf, (int)origlen, type != PKT_PROBE);
 
 	return true;
 }
@@ -1056,6 +1378,7 @@ bool receive_sptps_record(void *handle, uint8_t type, const void *data, uint16_t
 			logger(DEBUG_META, LOG_INFO, "SPTPS key exchange with %s (%s) successful", from->name, from->hostname);
 		}
 
+		device_workers_update();
 		return true;
 	}
 
@@ -1064,9 +1387,10 @@ bool receive_sptps_record(void *handle, uint8_t type, const void *data, uint16_t
 		return false;
 	}
 
-	vpn_packet_t inpkt;
-	inpkt.offset = DEFAULT_PACKET_OFFSET;
-	inpkt.priority = 0;
+	vpn_packet_t pkt;
+	vpn_packet_t *inpkt = &pkt;
+	pkt.offset = DEFAULT_PACKET_OFFSET;
+	pkt.priority = 0;
 
 	if(type == PKT_PROBE) {
 		if(!from->status.udppacket) {
@@ -1074,14 +1398,14 @@ bool receive_sptps_record(void *handle, uint8_t type, const void *data, uint16_t
 			return false;
 		}
 
-		inpkt.len = len;
-		memcpy(DATA(&inpkt), data, len);
+		pkt.len = len;
+		memcpy(DATA(&pkt), data, len);
 
-		if(inpkt.len > from->maxrecentlen) {
-			from->maxrecentlen = inpkt.len;
+		if(pkt.len > from->maxrecentlen) {
+			from->maxrecentlen = pkt.len;
 		}
 
-		udp_probe_h(from, &inpkt, len);
+		udp_probe_h(from, &pkt, len);
 		return true;
 	}
 
@@ -1101,48 +1425,55 @@ bool receive_sptps_record(void *handle, uint8_t type, const void *data, uint16_t
 	int offset = (type & PKT_MAC) ? 0 : 14;
 
 	if(type & PKT_COMPRESSED) {
-		length_t ulen = uncompress_packet(DATA(&inpkt) + offset, (const uint8_t *)data, len, from->incompression);
+		length_t ulen = uncompress_packet(DATA(inpkt) + offset, (const uint8_t *)data, len, from->incompression);
 
 		if(!ulen) {
 			return false;
 		} else {
-			inpkt.len = ulen + offset;
+			inpkt->len = ulen + offset;
 		}
 
-		if(inpkt.len > MAXSIZE) {
+		if(inpkt->len > MAXSIZE) {
 			abort();
 		}
+	} else if(sptps_inpkt && (const uint8_t *)data >= sptps_inpkt->data + DEFAULT_PACKET_OFFSET + offset && (const uint8_t *)data + len <= sptps_inpkt->data + sizeof(sptps_inpkt->data)) {
+		/* The record was decrypted in place in the UDP packet, and there is enough room in front of it to use it as is.
+		   The packet might be forwarded to a legacy node, which needs the default headroom for its sequence number. */
+		inpkt = sptps_inpkt;
+		inpkt->offset = (length_t)((const uint8_t *)data - inpkt->data - offset);
+		inpkt->len = len + offset;
+		inpkt->priority = 0;
 	} else {
-		memcpy(DATA(&inpkt) + offset, data, len);
-		inpkt.len = len + offset;
+		memcpy(DATA(inpkt) + offset, data, len);
+		inpkt->len = len + offset;
 	}
 
 	/* Generate the Ethernet packet type if necessary */
 	if(offset) {
-		switch(DATA(&inpkt)[14] >> 4) {
+		switch(DATA(inpkt)[14] >> 4) {
 		case 4:
-			DATA(&inpkt)[12] = 0x08;
-			DATA(&inpkt)[13] = 0x00;
+			DATA(inpkt)[12] = 0x08;
+			DATA(inpkt)[13] = 0x00;
 			break;
 
 		case 6:
-			DATA(&inpkt)[12] = 0x86;
-			DATA(&inpkt)[13] = 0xDD;
+			DATA(inpkt)[12] = 0x86;
+			DATA(inpkt)[13] = 0xDD;
 			break;
 
 		default:
 			logger(DEBUG_TRAFFIC, LOG_ERR,
 			       "Unknown IP version %d while reading packet from %s (%s)",
-			       DATA(&inpkt)[14] >> 4, from->name, from->hostname);
+			       DATA(inpkt)[14] >> 4, from->name, from->hostname);
 			return false;
 		}
 	}
 
-	if(from->status.udppacket && inpkt.len > from->maxrecentlen) {
-		from->maxrecentlen = inpkt.len;
+	if(from->status.udppacket && inpkt->len > from->maxrecentlen) {
+		from->maxrecentlen = inpkt->len;
 	}
 
-	receive_packet(from, &inpkt);
+	receive_packet(from, inpkt);
 	return true;
 }
 
@@ -1159,6 +1490,8 @@ static void try_sptps(node_t *n) {
 		send_req_key(n);
 	} else if(n->last_req_key + 10 < now.tv_sec) {
 		logger(DEBUG_ALWAYS, LOG_DEBUG, "No key from %s after 10 seconds, restarting SPTPS", n->name);
+		crypto_pool_cancel(n);
+		device_workers_cancel(n);
 		sptps_stop(&n->sptps);
 		n->status.waitingforkey = false;
 		send_req_key(n);
@@ -1604,6 +1937,29 @@ void send_packet(node_t *n, vpn_packet_t *packet) {
 	try_tx(via, true);
 }
 
+void send_packets(node_t *n, vpn_packet_t **packets, size_t count) {
+	// Only SPTPS packets benefit from being handled together
+	if(n == myself || !n->status.reachable || !n->status.sptps) {
+		for(size_t i = 0; i < count; i++) {
+			send_packet(n, packets[i]);
+		}
+
+		return;
+	}
+
+	// Encrypt all packets for this node in one go, so they end up next to each other in the UDP queue
+	for(size_t i = 0; i < count; i++) {
+		logger(DEBUG_TRAFFIC, LOG_ERR, "Sending packet of %d bytes to %s (%s)", packets[i]->len, n->name, n->hostname);
+
+		n->out_packets++;
+		n->out_bytes += packets[i]->len;
+
+		send_sptps_packet(n, packets[i]);
+	}
+
+	try_tx(n, true);
+}
+
 void broadcast_packet(const node_t *from, vpn_packet_t *packet) {
 	// Always give ourself a copy of the packet.
 	if(from != myself) {
@@ -1672,6 +2028,13 @@ static node_t *try_harder(const sockaddr_t *from, const vpn_packet_t *pkt) {
 			continue;
 		}
 
+		/* SPTPS datagrams from nodes that support relaying always carry their source ID,
+		   and handle_incoming_vpn_packet() already looked that up, so the MAC can never match here. */
+
+		if(n->status.sptps && (n->options >> 24) >= 4) {
+			continue;
+		}
+
 		bool soft = false;
 
 		for splay_each(edge_t, e, &n->edge_tree) {
@@ -1708,6 +2071,38 @@ static node_t *try_harder(const sockaddr_t *from, const vpn_packet_t *pkt) {
 	return match;
 }
 
+/* Called once a UDP packet from n has been authenticated. */
+static void udppacket_received(node_t *n, size_t sock, const sockaddr_t *addr, bool direct) {
+	n->sock = sock;
+
+	if(direct && sockaddrcmp(addr, &n->address)) {
+		update_node_udp(n, addr);
+	}
+
+	/* If the packet went through a relay, help the sender find the appropriate MTU
+	   through the relay path. */
+
+	if(!direct) {
+		send_mtu_info(myself, n, MTU);
+	}
+}
+
+/* Called when a worker thread has decrypted an SPTPS datagram from job->node. */
+static void receive_sptps_datagram(crypto_job_t *job) {
+	node_t *from = job->node;
+
+	from->status.udppacket = true;
+	bool result = sptps_receive_opened_datagram(&from->sptps, job->verified, job->data, job->outlen);
+	from->status.udppacket = false;
+
+	if(!result) {
+		sptps_receive_failed(from);
+		return;
+	}
+
+	udppacket_received(job->via, job->sock, &job->addr, job->direct);
+}
+
 static void handle_incoming_vpn_packet(listen_socket_t *ls, vpn_packet_t *pkt, sockaddr_t *addr) {
 	char *hostname;
 	node_id_t nullid = {0};
@@ -1808,23 +2203,70 @@ skip_harder:
 		from = n;
 	}
 
+	if(from->status.sptps && crypto_pool_receive(from, n, ls - listen_socket, addr, direct, DATA(pkt), pkt->len, receive_sptps_datagram)) {
+		return;
+	}
+
 	if(!receive_udppacket(from, pkt)) {
 		return;
 	}
 
-	n->sock = ls - listen_socket;
+	udppacket_received(n, ls - listen_socket, addr, direct);
+}
 
-	if(direct && sockaddrcmp(addr, &n->address)) {
-		update_node_udp(n, addr);
+#ifdef HAVE_UDP_GRO
+/* Returns the size of the datagrams the kernel coalesced into a message, or 0 if it didn't. */
+static size_t udp_gro_size(struct msghdr *hdr) {
+	for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+		if(cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+			int gso_size;
+			memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+			return gso_size > 0 ? (size_t)gso_size : 0;
+		}
 	}
 
-	/* If the packet went through a relay, help the sender find the appropriate MTU
-	   through the relay path. */
+	return 0;
+}
 
-	if(!direct) {
-		send_mtu_info(myself, n, MTU);
+/* Split a coalesced message back into the original datagrams. The start of the message
+   is in the packet buffer, the rest in the overflow buffer behind it. */
+static void receive_udp_segments(listen_socket_t *ls, const vpn_packet_t *pkt, const uint8_t *overflow, size_t len, size_t segsize, sockaddr_t *addr) {
+	static vpn_packet_t seg;
+
+	if(segsize > MAXSIZE) {
+		return;
+	}
+
+	for(size_t off = 0; off < len; off += segsize) {
+		size_t seglen = MIN(segsize, len - off);
+		size_t head = off < MAXSIZE ? MIN(seglen, MAXSIZE - off) : 0;
+
+		seg.offset = 0;
+		memcpy(DATA(&seg), DATA(pkt) + off, head);
+
+		/* Only touch the overflow buffer if part of the segment is in it */
+		if(seglen > head) {
+			memcpy(DATA(&seg) + head, overflow + off + head - MAXSIZE, seglen - head);
+		}
+
+		seg.len = seglen;
+
+		udp_gro_packets++;
+		handle_incoming_vpn_packet(ls, &seg, addr);
 	}
 }
+#endif
+
+/* Called by the io_uring event loop for each datagram it received on a UDP socket. */
+void handle_incoming_vpn_datagram(void *data, vpn_packet_t *pkt, sockaddr_t *addr) {
+	listen_socket_t *ls = data;
+
+	if(!pkt->len || pkt->len > MAXSIZE) {
+		return;
+	}
+
+	handle_incoming_vpn_packet(ls, pkt, addr);
+}
 
 void handle_incoming_vpn_data(void *data, int flags) {
 	(void)data;
@@ -1837,12 +2279,33 @@ void handle_incoming_vpn_data(void *data, int flags) {
 	static vpn_packet_t pkt[MAX_MSG];
 	static sockaddr_t addr[MAX_MSG];
 	static struct mmsghdr msg[MAX_MSG];
-	static struct iovec iov[MAX_MSG];
+	static struct iovec iov[MAX_MSG][2];
+
+#ifdef HAVE_UDP_GRO
+	/* Coalesced messages can be up to 64 kB, anything not fitting in the packet goes here. */
+	static uint8_t (*overflow)[65536 - MAXSIZE];
+	static union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		size_t align;
+	} control[MAX_MSG];
+	static bool last_gro = false;
+	bool gro = ls->udp_gro;
+
+	if(gro && !overflow) {
+		overflow = xmalloc(MAX_MSG * sizeof(*overflow));
+	}
+
+	if(gro != last_gro) {
+		last_gro = gro;
+		num = MAX_MSG;
+	}
+
+#endif
 
 	for(int i = 0; i < num; i++) {
 		pkt[i].offset = 0;
 
-		iov[i] = (struct iovec) {
+		iov[i][0] = (struct iovec) {
 			.iov_base = DATA(&pkt[i]),
 			.iov_len = MAXSIZE,
 		};
@@ -1850,9 +2313,24 @@ void handle_incoming_vpn_data(void *data, int flags) {
 		msg[i].msg_hdr = (struct msghdr) {
 			.msg_name = &addr[i].sa,
 			.msg_namelen = sizeof(addr)[i],
-			.msg_iov = &iov[i],
+			.msg_iov = iov[i],
 			.msg_iovlen = 1,
 		};
+
+#ifdef HAVE_UDP_GRO
+
+		if(gro) {
+			iov[i][1] = (struct iovec) {
+				.iov_base = overflow[i],
+				.iov_len = sizeof(overflow[i]),
+			};
+
+			msg[i].msg_hdr.msg_iovlen = 2;
+			msg[i].msg_hdr.msg_control = control[i].buf;
+			msg[i].msg_hdr.msg_controllen = sizeof(control[i].buf);
+		}
+
+#endif
 	}
 
 	num = recvmmsg(ls->udp.fd, msg, MAX_MSG, MSG_DONTWAIT, NULL);
@@ -1866,12 +2344,26 @@ void handle_incoming_vpn_data(void *data, int flags) {
 	}
 
 	for(int i = 0; i < num; i++) {
-		pkt[i].len = msg[i].msg_len;
+		size_t len = msg[i].msg_len;
+
+#ifdef HAVE_UDP_GRO
+
+		if(gro) {
+			size_t segsize = udp_gro_size(&msg[i].msg_hdr);
+
+			if(segsize && segsize < len) {
+				receive_udp_segments(ls, &pkt[i], overflow[i], len, segsize, &addr[i]);
+				continue;
+			}
+		}
+
+#endif
 
-		if(pkt[i].len <= 0 || pkt[i].len > MAXSIZE) {
+		if(len <= 0 || len > MAXSIZE) {
 			continue;
 		}
 
+		pkt[i].len = len;
 		handle_incoming_vpn_packet(ls, &pkt[i], &addr[i]);
 	}
 
@@ -1898,19 +2390,42 @@ void handle_incoming_vpn_data(void *data, int flags) {
 }
 
 void handle_device_data(void *data, int flags) {
-	(void)data;
 	(void)flags;
-	vpn_packet_t packet;
-	packet.offset = DEFAULT_PACKET_OFFSET;
-	packet.priority = 0;
-	static int errors = 0;
+	size_t queue = (uintptr_t)data;
+	static vpn_packet_t packets[MAX_DEVICE_BATCH];
+	size_t count;
 
-	if(devops.read(&packet)) {
-		errors = 0;
-		myself->in_packets++;
-		myself->in_bytes += packet.len;
-		route(myself, &packet);
+	for(size_t i = 0; i < MAX_DEVICE_BATCH; i++) {
+		packets[i].offset = DEFAULT_PACKET_OFFSET;
+		packets[i].priority = 0;
+	}
+
+	// Drain as many packets as the device has ready, up to one batch.
+
+	if(queue) {
+		count = devops.read_queue(queue, packets, MAX_DEVICE_BATCH);
+
+		if(!count) {
+			if(errno == EAGAIN) {
+				return;
+			}
+
+			logger(DEBUG_ALWAYS, LOG_ERR, "Error while reading from queue %lu of %s: %s", (unsigned long)queue, device, strerror(errno));
+		}
+	} else if(devops.read_batch) {
+		count = devops.read_batch(packets, MAX_DEVICE_BATCH);
 	} else {
+		count = devops.read(&packets[0]) ? 1 : 0;
+	}
+
+	handle_device_packets(packets, count);
+}
+
+/* Route packets read from the device. No packets means reading failed. */
+void handle_device_packets(vpn_packet_t *packets, size_t count) {
+	static int errors = 0;
+
+	if(!count) {
 		sleep_millis(errors * 50);
 		errors++;
 
@@ -1918,5 +2433,18 @@ void handle_device_data(void *data, int flags) {
 			logger(DEBUG_ALWAYS, LOG_ERR, "Too many errors from %s, exiting!", device);
 			event_exit();
 		}
+
+		return;
 	}
+
+	errors = 0;
+	device_read_batches++;
+	device_read_packets += count;
+
+	for(size_t i = 0; i < count; i++) {
+		myself->in_packets++;
+		myself->in_bytes += packets[i].len;
+	}
+
+	route_batch(myself, packets, count);
 }
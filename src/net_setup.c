@@ -22,18 +22,22 @@
 
 #include "system.h"
 
+#include "chacha-poly1305/chacha-poly1305.h"
 #include "cipher.h"
 #include "conf_net.h"
 #include "conf.h"
 #include "connection.h"
 #include "compression.h"
 #include "control.h"
+#include "crypto_pool.h"
+#include "device_workers.h"
 #include "crypto.h"
 #include "device.h"
 #include "digest.h"
 #include "ecdsa.h"
 #include "graph.h"
 #include "logger.h"
+#include "log_queue.h"
 #include "names.h"
 #include "net.h"
 #include "netutl.h"
@@ -53,6 +57,10 @@
 
 ports_t myport;
 static io_t device_io;
+static io_t device_queue_io[MAX_DEVICE_QUEUES];
+int device_queue_fd[MAX_DEVICE_QUEUES];
+static bool device_workers_running;
+size_t device_queues = 0;
 devops_t devops;
 bool device_standby = false;
 
@@ -248,6 +256,9 @@ static void read_interpreter(void) {
 }
 
 bool setup_myself_reloadable(void) {
+	// Cached routing decisions depend on options like Forwarding and DirectOnly
+	route_cache_flush();
+
 	read_interpreter();
 
 	free(scriptextension);
@@ -464,7 +475,7 @@ bool setup_myself_reloadable(void) {
 
 	for splay_each(subnet_t, s, &subnet_tree) {
 		if(!s->owner) {
-			splay_delete_node(&subnet_tree, node);
+			subnet_del(NULL, s);
 		}
 	}
 
@@ -519,6 +530,19 @@ bool setup_myself_reloadable(void) {
 		maxtimeout = 900;
 	}
 
+	if(get_config_int(lookup_config(&config_tree, "GraphDelay"), &graph_delay)) {
+		if(graph_delay < 0) {
+			logger(DEBUG_ALWAYS, LOG_ERR, "GraphDelay cannot be negative!");
+			return false;
+		}
+	} else {
+		graph_delay = 0;
+	}
+
+	if(!get_config_bool(lookup_config(&config_tree, "BinaryMeta"), &binary_meta)) {
+		binary_meta = true;
+	}
+
 	char *afname = NULL;
 
 	if(get_config_string(lookup_config(&config_tree, "AddressFamily"), &afname)) {
@@ -617,6 +641,22 @@ static int bind_reusing_port(const sockaddr_t *sa, int from_fd, bind_fn_t setup)
 	return fd;
 }
 
+/* Receive datagrams with multishot io_uring requests if possible, otherwise when the socket is readable. */
+static void add_udp_io(listen_socket_t *ls, int fd) {
+	ls->udp_multishot = false;
+
+#ifdef HAVE_IO_URING
+
+	if(io_add_recv(&ls->udp, handle_incoming_vpn_datagram, ls, fd)) {
+		ls->udp_multishot = true;
+		return;
+	}
+
+#endif
+
+	io_add(&ls->udp, handle_incoming_vpn_data, ls, fd, IO_READ);
+}
+
 /*
   Add listening sockets.
 */
@@ -707,7 +747,8 @@ static bool add_listen_address(char *address, bool bindto) {
 
 		listen_socket_t *sock = &listen_socket[listen_sockets];
 		io_add(&sock->tcp, handle_new_meta_connection, sock, tcp_fd, IO_READ);
-		io_add(&sock->udp, handle_incoming_vpn_data, sock, udp_fd, IO_READ);
+		add_udp_io(sock, udp_fd);
+		setup_udp_offload(sock);
 
 		if(debug_level >= DEBUG_CONNECTIONS) {
 			int tcp_port = get_bound_port(tcp_fd);
@@ -888,6 +929,8 @@ static bool setup_myself(void) {
 		udp_sndbuf_warnings = true;
 	}
 
+	get_config_bool(lookup_config(&config_tree, "UDPOffload"), &udp_offload);
+
 	get_config_int(lookup_config(&config_tree, "FWMark"), &fwmark);
 #ifndef SO_MARK
 
@@ -910,6 +953,46 @@ static bool setup_myself(void) {
 		sptps_replaywin = replaywin;
 	}
 
+	int crypto_threads;
+
+	if(get_config_int(lookup_config(&config_tree, "CryptoThreads"), &crypto_threads) && crypto_threads) {
+		if(crypto_threads < 0) {
+			logger(DEBUG_ALWAYS, LOG_ERR, "CryptoThreads cannot be negative!");
+			return false;
+		}
+
+#ifdef HAVE_CRYPTO_POOL
+
+		if(!crypto_pool_start(crypto_threads)) {
+			return false;
+		}
+
+#else
+		logger(DEBUG_ALWAYS, LOG_WARNING, "CryptoThreads was requested, but tinc isn't built with thread support!");
+#endif
+	}
+
+	int log_queue_size;
+
+	if(get_config_int(lookup_config(&config_tree, "LogQueueSize"), &log_queue_size) && log_queue_size) {
+		if(log_queue_size < 0) {
+			logger(DEBUG_ALWAYS, LOG_ERR, "LogQueueSize cannot be negative!");
+			return false;
+		}
+
+#ifdef HAVE_LOG_QUEUE
+
+		if(!start_log_queue((size_t)log_queue_size)) {
+			return false;
+		}
+
+#else
+		logger(DEBUG_ALWAYS, LOG_WARNING, "LogQueueSize was requested, but tinc isn't built with thread support!");
+#endif
+	}
+
+	logger(DEBUG_CONNECTIONS, LOG_INFO, "Using %s ChaCha20-Poly1305 implementation", chacha_poly1305_get_kernel());
+
 #ifndef DISABLE_LEGACY
 	/* Generate packet encryption key */
 
@@ -1080,8 +1163,20 @@ static bool setup_myself(void) {
 		return false;
 	}
 
-	if(device_fd >= 0) {
-		io_add(&device_io, handle_device_data, NULL, device_fd, IO_READ);
+#ifdef HAVE_DEVICE_WORKERS
+
+	if(device_workers_start()) {
+		device_workers_running = true;
+	} else
+#endif
+	{
+		if(device_fd >= 0 && !(devops.read_async && devops.read_async(&device_io, handle_device_packets))) {
+			io_add(&device_io, handle_device_data, NULL, device_fd, IO_READ);
+		}
+
+		for(size_t i = 1; i < device_queues; i++) {
+			io_add(&device_queue_io[i], handle_device_data, (void *)(uintptr_t)i, device_queue_fd[i], IO_READ);
+		}
 	}
 
 	/* Open sockets */
@@ -1123,7 +1218,8 @@ static bool setup_myself(void) {
 			}
 
 			io_add(&listen_socket[i].tcp, (io_cb_t)handle_new_meta_connection, &listen_socket[i], tcp_fd, IO_READ);
-			io_add(&listen_socket[i].udp, (io_cb_t)handle_incoming_vpn_data, &listen_socket[i], udp_fd, IO_READ);
+			add_udp_io(&listen_socket[i], udp_fd);
+			setup_udp_offload(&listen_socket[i]);
 
 			if(debug_level >= DEBUG_CONNECTIONS) {
 				char *hostname = sockaddr2hostname(&sa);
@@ -1220,6 +1316,22 @@ bool setup_network(void) {
 	init_connections();
 	init_subnets();
 
+	/* This has to be decided before any file descriptor is added to the event loop */
+
+	bool use_io_uring = false;
+
+	if(get_config_bool(lookup_config(&config_tree, "IOUring"), &use_io_uring) && use_io_uring) {
+#ifdef HAVE_IO_URING
+
+		if(!event_use_io_uring()) {
+			logger(DEBUG_ALWAYS, LOG_WARNING, "Could not set up io_uring, using epoll instead: %s", strerror(errno));
+		}
+
+#else
+		logger(DEBUG_ALWAYS, LOG_WARNING, "io_uring support was not compiled in");
+#endif
+	}
+
 	if(get_config_int(lookup_config(&config_tree, "PingInterval"), &pinginterval)) {
 		if(pinginterval < 1) {
 			pinginterval = 86400;
@@ -1283,6 +1395,14 @@ void close_network_connections(void) {
 		free_connection(myself->connection);
 	}
 
+#ifdef HAVE_DEVICE_WORKERS
+	device_workers_stop();
+#endif
+#ifdef HAVE_CRYPTO_POOL
+	crypto_pool_stop();
+#endif
+	flush_udp_queues();
+
 	for(int i = 0; i < listen_sockets; i++) {
 		io_del(&listen_socket[i].tcp);
 		io_del(&listen_socket[i].udp);
@@ -1291,8 +1411,10 @@ void close_network_connections(void) {
 	}
 
 	exit_requests();
+	exit_graph();
 	exit_edges();
 	exit_subnets();
+	route_cache_free();
 	exit_nodes();
 	exit_connections();
 
@@ -1303,10 +1425,18 @@ void close_network_connections(void) {
 	free(myport.tcp);
 	free(myport.udp);
 
-	if(device_fd >= 0) {
-		io_del(&device_io);
+	if(!device_workers_running) {
+		if(device_fd >= 0) {
+			io_del(&device_io);
+		}
+
+		for(size_t i = 1; i < device_queues; i++) {
+			io_del(&device_queue_io[i]);
+		}
 	}
 
+	device_workers_running = false;
+
 	if(devops.close) {
 		devops.close();
 	}
@@ -1316,5 +1446,9 @@ void close_network_connections(void) {
 	free(scriptextension);
 	free(scriptinterpreter);
 
+#ifdef HAVE_LOG_QUEUE
+	log_queue_stop();
+#endif
+
 	return;
 }
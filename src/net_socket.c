@@ -42,6 +42,7 @@ int udp_rcvbuf = 1024 * 1024;
 int udp_sndbuf = 1024 * 1024;
 bool udp_rcvbuf_warnings;
 bool udp_sndbuf_warnings;
+bool udp_offload = true;
 int max_connection_burst = 10;
 int fwmark;
 
@@ -398,6 +399,37 @@ int setup_vpn_in_socket(const sockaddr_t *sa) {
 	return nfd;
 } /* int setup_vpn_in_socket */
 
+/* Enable UDP segmentation and receive offload on a socket returned by setup_vpn_in_socket(),
+   if the kernel supports it. */
+void setup_udp_offload(listen_socket_t *ls) {
+	ls->udp_gso = false;
+	ls->udp_gro = false;
+
+	if(!udp_offload) {
+		return;
+	}
+
+#ifdef HAVE_UDP_GSO
+	{
+		/* The segment size is passed with each message, this only checks for support. */
+		int option = 0;
+		ls->udp_gso = !setsockopt(ls->udp.fd, IPPROTO_UDP, UDP_SEGMENT, (void *)&option, sizeof(option));
+	}
+#endif
+
+#ifdef HAVE_UDP_GRO
+
+	/* Multishot requests receive one datagram per buffer, coalesced ones would not fit */
+	if(!ls->udp_multishot) {
+		int option = 1;
+		ls->udp_gro = !setsockopt(ls->udp.fd, IPPROTO_UDP, UDP_GRO, (void *)&option, sizeof(option));
+	}
+#endif
+
+	logger(DEBUG_CONNECTIONS, LOG_DEBUG, "UDP segmentation offload %s, receive offload %s",
+	       ls->udp_gso ? "enabled" : "not available", ls->udp_gro ? "enabled" : "not available");
+}
+
 static void retry_outgoing_handler(void *data) {
 	setup_outgoing_connection(data, true);
 }
@@ -22,10 +22,15 @@
 
 #include "address_cache.h"
 #include "control_common.h"
+#include "crypto_pool.h"
+#include "device_workers.h"
+#include "graph.h"
+#include "hash.h"
 #include "logger.h"
 #include "net.h"
 #include "netutl.h"
 #include "node.h"
+#include "route.h"
 #include "splay_tree.h"
 #include "utils.h"
 #include "xalloc.h"
@@ -38,36 +43,154 @@ static int node_compare(const node_t *a, const node_t *b) {
 	return strcmp(a->name, b->name);
 }
 
-static int node_id_compare(const node_t *a, const node_t *b) {
-	return memcmp(&a->id, &b->id, sizeof(node_id_t));
+splay_tree_t node_tree = {
+	.compare = (splay_compare_t) node_compare,
+	.delete = (splay_action_t) free_node,
+};
+
+/*
+   Every received packet is looked up by its source address and node ID,
+   so these lookups use open addressing hash tables instead of splay trees.
+   Linear probing keeps a lookup within one or two cache lines, and each slot
+   also holds the full hash, so other nodes are rarely touched while probing.
+   Several nodes can have the same key, a lookup returns the first one found.
+*/
+
+typedef struct node_slot_t {
+	uint32_t hash;
+	node_t *node;           // NULL if the slot is empty
+} node_slot_t;
+
+typedef struct node_index_t {
+	node_slot_t *slots;
+	uint32_t size;          // A power of two, or 0 if nothing was ever added
+	uint32_t count;
+} node_index_t;
+
+#define NODE_INDEX_MIN_SIZE 64
+
+static node_index_t node_id_index;
+static node_index_t node_udp_index;
+
+static uint32_t node_id_hash(const node_id_t *id) {
+	uint32_t hash;
+	memcpy(&hash, id->x, sizeof(hash));
+	return hash_mix(hash ^ (uint32_t)id->x[4] << 8 ^ id->x[5]);
 }
 
-static int node_udp_compare(const node_t *a, const node_t *b) {
-	int result = sockaddrcmp(&a->address, &b->address);
+static uint32_t string_hash(uint32_t hash, const char *str) {
+	for(const uint8_t *p = (const uint8_t *)str; *p; p++) {
+		hash = hash * 31 + *p;
+	}
+
+	return hash;
+}
+
+// Only hashes the fields sockaddrcmp() looks at
+static uint32_t sockaddr_hash(const sockaddr_t *sa) {
+	uint32_t hash = sa->sa.sa_family;
+
+	switch(sa->sa.sa_family) {
+	case AF_INET:
+		hash = hash_mix(hash ^ sa->in.sin_addr.s_addr) ^ sa->in.sin_port;
+		break;
+
+	case AF_INET6: {
+		uint32_t words[4];
+		memcpy(words, &sa->in6.sin6_addr, sizeof(words));
 
-	if(result) {
-		return result;
+		for(int i = 0; i < 4; i++) {
+			hash = hash_mix(hash ^ words[i]);
+		}
+
+		hash ^= sa->in6.sin6_port;
+		break;
+	}
+
+	case AF_UNKNOWN:
+		hash = string_hash(string_hash(hash, sa->unknown.address), sa->unknown.port);
+		break;
+
+	default:
+		break;
 	}
 
-	return (a->name && b->name) ? strcmp(a->name, b->name) : 0;
+	return hash_mix(hash);
 }
 
-splay_tree_t node_tree = {
-	.compare = (splay_compare_t) node_compare,
-	.delete = (splay_action_t) free_node,
-};
+static void index_put(node_index_t *index, uint32_t hash, node_t *n) {
+	uint32_t mask = index->size - 1;
+	uint32_t i = hash & mask;
 
-static splay_tree_t node_id_tree = {
-	.compare = (splay_compare_t) node_id_compare,
-};
+	while(index->slots[i].node) {
+		i = (i + 1) & mask;
+	}
 
-static splay_tree_t node_udp_tree = {
-	.compare = (splay_compare_t) node_udp_compare,
-};
+	index->slots[i].hash = hash;
+	index->slots[i].node = n;
+	index->count++;
+}
+
+static void index_add(node_index_t *index, uint32_t hash, node_t *n) {
+	// Keep the table at most half full, so probe sequences stay short
+	if((index->count + 1) * 2 > index->size) {
+		node_slot_t *old = index->slots;
+		uint32_t oldsize = index->size;
+
+		index->size = oldsize ? oldsize * 2 : NODE_INDEX_MIN_SIZE;
+		index->slots = xzalloc(index->size * sizeof(*index->slots));
+		index->count = 0;
+
+		for(uint32_t i = 0; i < oldsize; i++) {
+			if(old[i].node) {
+				index_put(index, old[i].hash, old[i].node);
+			}
+		}
+
+		free(old);
+	}
+
+	index_put(index, hash, n);
+}
+
+static void index_del(node_index_t *index, uint32_t hash, const node_t *n) {
+	if(!index->size) {
+		return;
+	}
+
+	uint32_t mask = index->size - 1;
+	uint32_t i = hash & mask;
+
+	while(index->slots[i].node != n) {
+		if(!index->slots[i].node) {
+			return;
+		}
+
+		i = (i + 1) & mask;
+	}
+
+	// Shift back later entries of the same probe sequence, so no tombstones are needed
+	for(uint32_t j = (i + 1) & mask; index->slots[j].node; j = (j + 1) & mask) {
+		uint32_t home = index->slots[j].hash & mask;
+
+		if(((j - home) & mask) >= ((j - i) & mask)) {
+			index->slots[i] = index->slots[j];
+			i = j;
+		}
+	}
+
+	index->slots[i].node = NULL;
+	index->count--;
+}
+
+static void index_free(node_index_t *index) {
+	free(index->slots);
+	memset(index, 0, sizeof(*index));
+}
 
 void exit_nodes(void) {
-	splay_empty_tree(&node_udp_tree);
-	splay_empty_tree(&node_id_tree);
+	index_free(&node_udp_index);
+	index_free(&node_id_index);
 	splay_empty_tree(&node_tree);
 }
 
@@ -107,6 +230,8 @@ void free_node(node_t *n) {
 #endif
 
 	ecdsa_free(n->ecdsa);
+	crypto_pool_cancel(n);
+	device_workers_cancel(n);
 	sptps_stop(&n->sptps);
 
 	timeout_del(&n->udp_ping_timeout);
@@ -128,11 +253,11 @@ void node_add(node_t *n) {
 	memcpy(&n->id, buf, sizeof(n->id));
 
 	splay_insert(&node_tree, n);
-	splay_insert(&node_id_tree, n);
+	index_add(&node_id_index, node_id_hash(&n->id), n);
 }
 
 void node_del(node_t *n) {
-	splay_delete(&node_udp_tree, n);
+	index_del(&node_udp_index, sockaddr_hash(&n->address), n);
 
 	for splay_each(subnet_t, s, &n->subnet_tree) {
 		subnet_del(n, s);
@@ -142,26 +267,56 @@ void node_del(node_t *n) {
 		edge_del(e);
 	}
 
-	splay_delete(&node_id_tree, n);
+	graph_del_node(n);
+	route_cache_flush();
+	index_del(&node_id_index, node_id_hash(&n->id), n);
 	splay_delete(&node_tree, n);
 }
 
-node_t *lookup_node(char *name) {
+node_t *lookup_node(const char *name) {
 	node_t n = {0};
 
-	n.name = name;
+	n.name = (char *)name;
 
 	return splay_search(&node_tree, &n);
 }
 
 node_t *lookup_node_id(const node_id_t *id) {
-	node_t n = {.id = *id};
-	return splay_search(&node_id_tree, &n);
+	if(!node_id_index.count) {
+		return NULL;
+	}
+
+	uint32_t hash = node_id_hash(id);
+	uint32_t mask = node_id_index.size - 1;
+
+	for(uint32_t i = hash & mask; node_id_index.slots[i].node; i = (i + 1) & mask) {
+		const node_slot_t *slot = &node_id_index.slots[i];
+
+		if(slot->hash == hash && !memcmp(&slot->node->id, id, sizeof(*id))) {
+			return slot->node;
+		}
+	}
+
+	return NULL;
 }
 
 node_t *lookup_node_udp(const sockaddr_t *sa) {
-	node_t tmp = {.address = *sa};
-	return splay_search(&node_udp_tree, &tmp);
+	if(!node_udp_index.count) {
+		return NULL;
+	}
+
+	uint32_t hash = sockaddr_hash(sa);
+	uint32_t mask = node_udp_index.size - 1;
+
+	for(uint32_t i = hash & mask; node_udp_index.slots[i].node; i = (i + 1) & mask) {
+		const node_slot_t *slot = &node_udp_index.slots[i];
+
+		if(slot->hash == hash && !sockaddrcmp(&slot->node->address, sa)) {
+			return slot->node;
+		}
+	}
+
+	return NULL;
 }
 
 void update_node_udp(node_t *n, const sockaddr_t *sa) {
@@ -170,7 +325,7 @@ void update_node_udp(node_t *n, const sockaddr_t *sa) {
 		return;
 	}
 
-	splay_delete(&node_udp_tree, n);
+	index_del(&node_udp_index, sockaddr_hash(&n->address), n);
 
 	if(sa) {
 		n->address = *sa;
@@ -183,7 +338,7 @@ void update_node_udp(node_t *n, const sockaddr_t *sa) {
 			}
 		}
 
-		splay_insert(&node_udp_tree, n);
+		index_add(&node_udp_index, sockaddr_hash(&n->address), n);
 		free(n->hostname);
 		n->hostname = sockaddr2hostname(&n->address);
 		logger(DEBUG_PROTOCOL, LOG_DEBUG, "UDP address of %s set to %s", n->name, n->hostname);
@@ -196,6 +351,7 @@ void update_node_udp(node_t *n, const sockaddr_t *sa) {
 	n->mtuprobes = 0;
 	n->minmtu = 0;
 	n->maxmtu = MTU;
+	device_workers_update();
 }
 
 bool dump_nodes(connection_t *c) {
@@ -79,6 +79,10 @@ typedef struct node_t {
 	struct node_t *nexthop;                 /* nearest node from us to him */
 	struct edge_t *prevedge;                /* nearest node from him to us */
 	struct node_t *via;                     /* next hop for UDP packets */
+	int hops;                               /* length of the shortest path to him, ignoring indirect edges */
+	struct edge_t *hopedge;                 /* last edge of that shortest path */
+	uint8_t graph_flags;                    /* bookkeeping for updating the graph incrementally */
+	struct node_t *mst_set;                 /* bookkeeping for Kruskal's algorithm */
 
 	splay_tree_t subnet_tree;               /* Pointer to a tree of subnets belonging to this node */
 
@@ -125,7 +129,7 @@ extern void free_node(node_t *n);
 extern node_t *new_node(const char *name) ATTR_MALLOC ATTR_DEALLOCATOR(free_node);
 extern void node_add(node_t *n);
 extern void node_del(node_t *n);
-extern node_t *lookup_node(char *name);
+extern node_t *lookup_node(const char *name);
 extern node_t *lookup_node_id(const node_id_t *id);
 extern node_t *lookup_node_udp(const sockaddr_t *sa);
 extern bool dump_nodes(struct connection_t *c);
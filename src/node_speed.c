@@ -0,0 +1,148 @@
+// Compare the hash tables used by lookup_node_udp() and lookup_node_id()
+// with the splay trees they replaced, for networks of various sizes.
+
+#include "system.h"
+
+#include "connection.h"
+#include "netutl.h"
+#include "node.h"
+#include "splay_tree.h"
+#include "xalloc.h"
+
+static struct timespec start;
+static struct timespec end;
+static double elapsed;
+static double rate;
+static unsigned int count;
+
+static void clock_start(void) {
+	count = 0;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
+}
+
+static bool clock_countto(double seconds) {
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
+	elapsed = (double) end.tv_sec + (double) end.tv_nsec * 1e-9
+	          - (double) start.tv_sec - (double) start.tv_nsec * 1e-9;
+
+	if(elapsed < seconds) {
+		return ++count;
+	}
+
+	rate = count / elapsed;
+	return false;
+}
+
+// The comparison functions of the old node_id_tree and node_udp_tree
+
+static int node_id_compare(const node_t *a, const node_t *b) {
+	return memcmp(&a->id, &b->id, sizeof(node_id_t));
+}
+
+static int node_udp_compare(const node_t *a, const node_t *b) {
+	int result = sockaddrcmp(&a->address, &b->address);
+
+	if(result) {
+		return result;
+	}
+
+	return (a->name && b->name) ? strcmp(a->name, b->name) : 0;
+}
+
+// Each lookup is for a different node, like packets arriving from many peers
+#define LOOKUPS 1024
+
+static void print_rate(const char *name, size_t nodes, double duration) {
+	fprintf(stderr, "%-12s %6zu nodes for %lg seconds: %7.2lf ns/lookup\n", name, nodes, duration, 1e9 / (rate * LOOKUPS));
+}
+
+static void run_benchmark(size_t nodes, double duration) {
+	splay_tree_t id_tree = {.compare = (splay_compare_t) node_id_compare};
+	splay_tree_t udp_tree = {.compare = (splay_compare_t) node_udp_compare};
+	node_t **list = xzalloc(nodes * sizeof(*list));
+
+	for(size_t i = 0; i < nodes; i++) {
+		char name[32];
+		snprintf(name, sizeof(name), "node%zu", i);
+
+		sockaddr_t sa = {0};
+		sa.in.sin_family = AF_INET;
+		sa.in.sin_addr.s_addr = htonl(0x0a000000 | (uint32_t)i);
+		sa.in.sin_port = htons(655);
+
+		node_t *n = new_node(name);
+		node_add(n);
+		update_node_udp(n, &sa);
+		splay_insert(&id_tree, n);
+		splay_insert(&udp_tree, n);
+		list[i] = n;
+	}
+
+	const node_t *order[LOOKUPS];
+
+	for(size_t i = 0; i < LOOKUPS; i++) {
+		order[i] = list[rand() % nodes];
+	}
+
+	for(clock_start(); clock_countto(duration);) {
+		for(size_t i = 0; i < LOOKUPS; i++) {
+			if(lookup_node_udp(&order[i]->address) != order[i]) {
+				abort();
+			}
+		}
+	}
+
+	print_rate("UDP hash", nodes, duration);
+
+	for(clock_start(); clock_countto(duration);) {
+		for(size_t i = 0; i < LOOKUPS; i++) {
+			node_t tmp = {.address = order[i]->address};
+
+			if(splay_search(&udp_tree, &tmp) != order[i]) {
+				abort();
+			}
+		}
+	}
+
+	print_rate("UDP tree", nodes, duration);
+
+	for(clock_start(); clock_countto(duration);) {
+		for(size_t i = 0; i < LOOKUPS; i++) {
+			if(lookup_node_id(&order[i]->id) != order[i]) {
+				abort();
+			}
+		}
+	}
+
+	print_rate("ID hash", nodes, duration);
+
+	for(clock_start(); clock_countto(duration);) {
+		for(size_t i = 0; i < LOOKUPS; i++) {
+			node_t tmp = {.id = order[i]->id};
+
+			if(splay_search(&id_tree, &tmp) != order[i]) {
+				abort();
+			}
+		}
+	}
+
+	print_rate("ID tree", nodes, duration);
+
+	splay_empty_tree(&id_tree);
+	splay_empty_tree(&udp_tree);
+	free(list);
+	exit_nodes();
+}
+
+int main(int argc, char *argv[]) {
+	static const size_t sizes[] = {100, 1000, 10000};
+	double duration = argc > 1 ? atof(argv[1]) : 1;
+
+	srand(1);
+
+	for(size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+		run_benchmark(sizes[i], duration);
+	}
+
+	return 0;
+}
@@ -23,6 +23,7 @@
 #include "conf.h"
 #include "connection.h"
 #include "crypto.h"
+#include "graph.h"
 #include "logger.h"
 #include "meta.h"
 #include "protocol.h"
@@ -32,6 +33,7 @@
 bool tunnelserver = false;
 bool strictsubnets = false;
 bool experimental = true;
+bool binary_meta = true;
 
 static inline bool is_valid_request(request_t req) {
 	return req > ALL && req < LAST;
@@ -56,10 +58,10 @@ const request_entry_t *get_request_entry(request_t req) {
 		[TERMREQ] = {termreq_h, "TERMREQ"},
 		[PING] = {ping_h, "PING"},
 		[PONG] = {pong_h, "PONG"},
-		[ADD_SUBNET] = {add_subnet_h, "ADD_SUBNET"},
-		[DEL_SUBNET] = {del_subnet_h, "DEL_SUBNET"},
-		[ADD_EDGE] = {add_edge_h, "ADD_EDGE"},
-		[DEL_EDGE] = {del_edge_h, "DEL_EDGE"},
+		[ADD_SUBNET] = {NULL, "ADD_SUBNET", add_subnet_h},
+		[DEL_SUBNET] = {NULL, "DEL_SUBNET", del_subnet_h},
+		[ADD_EDGE] = {NULL, "ADD_EDGE", add_edge_h},
+		[DEL_EDGE] = {NULL, "DEL_EDGE", del_edge_h},
 		[KEY_CHANGED] = {key_changed_h, "KEY_CHANGED"},
 		[REQ_KEY] = {req_key_h, "REQ_KEY"},
 		[ANS_KEY] = {ans_key_h, "ANS_KEY"},
@@ -75,20 +77,12 @@ const request_entry_t *get_request_entry(request_t req) {
 	return &request_entries[req];
 }
 
-static int past_request_compare(const past_request_t *a, const past_request_t *b) {
-	return strcmp(a->request, b->request);
-}
+/* Maximum number of slots in each bucket of past_requests, 8 bytes each */
 
-static void free_past_request(past_request_t *r) {
-	if(r) {
-		free((char *)r->request);
-		free(r);
-	}
-}
+#define PAST_REQUEST_BUCKET_SIZE 0x10000
 
-static splay_tree_t past_request_tree = {
-	.compare = (splay_compare_t) past_request_compare,
-	.delete = (splay_action_t) free_past_request,
+dedup_t past_requests = {
+	.max_size = PAST_REQUEST_BUCKET_SIZE,
 };
 
 /* Generic request routines - takes care of logging and error
@@ -144,6 +138,180 @@ void forward_request(connection_t *from, const char *request) {
 	broadcast_meta(from, tmp, tmplen);
 }
 
+/* Requests with a binary encoding are sent in that form to peers that understand it,
+   as text to all others. Whatever form a request was received in is passed on as is. */
+
+/* While a snapshot is being sent, requests for that connection are collected into records of up to this size */
+
+#define SNAPSHOT_RECORD_SIZE 16384
+
+static connection_t *snapshot_connection;
+static uint8_t snapshot_buffer[SNAPSHOT_RECORD_SIZE];
+static size_t snapshot_len;
+
+uint64_t snapshot_records_sent;
+uint64_t snapshot_records_received;
+uint64_t snapshot_requests_received;
+uint64_t snapshots_received;
+uint64_t snapshot_graph_runs;
+
+// Send the requests collected so far. The last record is sent even if it is empty.
+static bool flush_snapshot(bool last) {
+	if(snapshot_len == 1 && !last) {
+		return true;
+	}
+
+	size_t len = snapshot_len;
+	snapshot_buffer[0] = last ? SNAPSHOT_LAST : 0;
+	snapshot_len = 1;
+	snapshot_records_sent++;
+
+	return send_meta_snapshot(snapshot_connection, snapshot_buffer, len);
+}
+
+static bool add_to_snapshot(const uint8_t *data, size_t len) {
+	if(snapshot_len + 2 + len > sizeof(snapshot_buffer) && !flush_snapshot(false)) {
+		return false;
+	}
+
+	if(1 + 2 + len > sizeof(snapshot_buffer)) {
+		return send_meta_binary(snapshot_connection, data, len);
+	}
+
+	snapshot_buffer[snapshot_len++] = (uint8_t)(len >> 8);
+	snapshot_buffer[snapshot_len++] = (uint8_t)len;
+	memcpy(snapshot_buffer + snapshot_len, data, len);
+	snapshot_len += len;
+	return true;
+}
+
+/* Everything sent to c until end_snapshot() is bundled into as few records as possible,
+   if c understands snapshot records. */
+
+void begin_snapshot(connection_t *c) {
+	if(binary_meta && c->protocol_minor >= META_SNAPSHOT_MINOR) {
+		snapshot_connection = c;
+		snapshot_len = 1;
+	}
+}
+
+void end_snapshot(void) {
+	if(snapshot_connection) {
+		flush_snapshot(true);
+		snapshot_connection = NULL;
+	}
+}
+
+static bool send_meta_request_to(connection_t *c, meta_request_t *r) {
+	if(binary_meta && c->protocol_minor >= META_BINARY_MINOR) {
+		size_t len;
+		const uint8_t *data = meta_request_binary(r, &len);
+
+		if(!data) {
+			logger(DEBUG_ALWAYS, LOG_ERR, "Output buffer overflow while sending request to %s (%s)",
+			       c->name, c->hostname);
+			return false;
+		}
+
+		if(c == snapshot_connection) {
+			if(r->type == ADD_SUBNET || r->type == ADD_EDGE) {
+				return add_to_snapshot(data, len);
+			}
+
+			flush_snapshot(false);
+		}
+
+		return send_meta_binary(c, data, len);
+	}
+
+	const char *text = meta_request_text(r);
+
+	if(!text) {
+		logger(DEBUG_ALWAYS, LOG_ERR, "Output buffer overflow while sending request to %s (%s)",
+		       c->name, c->hostname);
+		return false;
+	}
+
+	size_t len = strlen(text);
+	char *tmp = alloca(len + 1);
+	memcpy(tmp, text, len);
+	tmp[len] = '\n';
+	return send_meta(c, tmp, len + 1);
+}
+
+static const char *meta_request_log_text(meta_request_t *r) {
+	const char *text = debug_level >= DEBUG_META ? meta_request_text(r) : NULL;
+	return text ? text : "";
+}
+
+bool send_meta_request(connection_t *c, meta_request_t *r) {
+	logger(DEBUG_META, LOG_DEBUG, "Sending %s to %s (%s): %s", get_request_entry(r->type)->name, c->name, c->hostname, meta_request_log_text(r));
+
+	if(c != everyone) {
+		return send_meta_request_to(c, r);
+	}
+
+	for list_each(connection_t, other, &connection_list)
+		if(other->edge) {
+			send_meta_request_to(other, r);
+		}
+
+	return true;
+}
+
+void forward_meta_request(connection_t *from, meta_request_t *r) {
+	logger(DEBUG_META, LOG_DEBUG, "Forwarding %s from %s (%s): %s", get_request_entry(r->type)->name, from->name, from->hostname, meta_request_log_text(r));
+
+	for list_each(connection_t, c, &connection_list)
+		if(c != from && c->edge) {
+			send_meta_request_to(c, r);
+		}
+}
+
+static bool handle_request(connection_t *c, const request_entry_t *entry, request_t reqno, const char *request, meta_request_t *r) {
+	if((c->allow_request != ALL) && (c->allow_request != reqno)) {
+		logger(DEBUG_ALWAYS, LOG_ERR, "Unauthorized request from %s (%s)", c->name, c->hostname);
+		return false;
+	}
+
+	/* A snapshot consists of nothing but snapshot records, so anything else ends it */
+
+	end_receiving_snapshot(c);
+
+	/* Only edge updates may be handled before the graph is brought up to date */
+
+	if(reqno != ADD_EDGE && reqno != DEL_EDGE) {
+		graph_flush();
+	}
+
+	bool result;
+
+	if(entry->parsed) {
+		meta_request_t parsed;
+
+		if(!r && !meta_request_parse_text(r = &parsed, request)) {
+			logger(DEBUG_ALWAYS, LOG_ERR, "Got bad %s from %s (%s)", entry->name, c->name, c->hostname);
+			return false;
+		}
+
+		result = entry->parsed(c, r);
+	} else {
+		result = entry->handler(c, request);
+	}
+
+	if(!result) {
+		/* Something went wrong. Probably scriptkiddies. Terminate. */
+
+		if(reqno != TERMREQ) {
+			logger(DEBUG_ALWAYS, LOG_ERR, "Error while processing %s from %s (%s)", entry->name, c->name, c->hostname);
+		}
+
+		return false;
+	}
+
+	return true;
+}
+
 bool receive_request(connection_t *c, const char *request) {
 	if(c->outgoing && proxytype == PROXY_HTTP && c->allow_request == ID) {
 		if(!request[0] || request[0] == '\r') {
@@ -164,7 +332,7 @@ bool receive_request(connection_t *c, const char *request) {
 	int reqno = atoi(request);
 
 	if(reqno || *request == '0') {
-		if(!is_valid_request(reqno) || !get_request_entry(reqno)->handler) {
+		if(!is_valid_request(reqno) || (!get_request_entry(reqno)->handler && !get_request_entry(reqno)->parsed)) {
 			logger(DEBUG_META, LOG_DEBUG, "Unknown request from %s (%s): %s", c->name, c->hostname, request);
 			return false;
 		}
@@ -172,74 +340,163 @@ bool receive_request(connection_t *c, const char *request) {
 		const request_entry_t *entry = get_request_entry(reqno);
 		logger(DEBUG_META, LOG_DEBUG, "Got %s from %s (%s): %s", entry->name, c->name, c->hostname, request);
 
-		if((c->allow_request != ALL) && (c->allow_request != reqno)) {
-			logger(DEBUG_ALWAYS, LOG_ERR, "Unauthorized request from %s (%s)", c->name, c->hostname);
+		return handle_request(c, entry, reqno, request, NULL);
+	} else {
+		logger(DEBUG_ALWAYS, LOG_ERR, "Bogus data received from %s (%s)", c->name, c->hostname);
+		return false;
+	}
+}
+
+bool receive_meta_request(connection_t *c, const void *data, size_t len) {
+	meta_request_t r;
+
+	if(!meta_request_parse_binary(&r, data, len)) {
+		logger(DEBUG_ALWAYS, LOG_ERR, "Bogus binary data received from %s (%s)", c->name, c->hostname);
+		return false;
+	}
+
+	const request_entry_t *entry = get_request_entry(r.type);
+	logger(DEBUG_META, LOG_DEBUG, "Got %s from %s (%s): %s", entry->name, c->name, c->hostname, meta_request_log_text(&r));
+
+	return handle_request(c, entry, r.type, NULL, &r);
+}
+
+/* The graph is held back from the first record of a snapshot until its last one,
+   so the whole snapshot only causes a single recalculation. Since that holds back
+   the graph for all connections, the last record has to arrive within PingTimeout. */
+
+static void snapshot_timeout_handler(void *data) {
+	connection_t *c = data;
+
+	logger(DEBUG_ALWAYS, LOG_WARNING, "Snapshot from %s (%s) did not end in time", c->name, c->hostname);
+	end_receiving_snapshot(c);
+	terminate_connection(c, c->edge);
+}
+
+bool receive_meta_snapshot(connection_t *c, const void *data, size_t len) {
+	const uint8_t *p = data;
+	const uint8_t *end = p + len;
+	meta_request_t r;
+
+	if(c->allow_request != ALL) {
+		logger(DEBUG_ALWAYS, LOG_ERR, "Unauthorized request from %s (%s)", c->name, c->hostname);
+		return false;
+	}
+
+	if(!len) {
+		logger(DEBUG_ALWAYS, LOG_ERR, "Bogus snapshot received from %s (%s)", c->name, c->hostname);
+		return false;
+	}
+
+	snapshot_records_received++;
+
+	if(!c->status.snapshot) {
+		c->status.snapshot = true;
+		c->snapshot_graph_runs = graph_runs;
+		graph_hold();
+
+		timeout_add(&c->snapshot_timeout, snapshot_timeout_handler, c, &(struct timeval) {
+			pingtimeout, jitter()
+		});
+	}
+
+	uint8_t flags = *p++;
+
+	while(p < end) {
+		size_t framelen = end - p >= 2 ? (size_t)(p[0] << 8 | p[1]) : SIZE_MAX;
+
+		if(framelen > (size_t)(end - p - 2) || !meta_request_parse_binary(&r, p + 2, framelen) || (r.type != ADD_SUBNET && r.type != ADD_EDGE)) {
+			logger(DEBUG_ALWAYS, LOG_ERR, "Bogus snapshot received from %s (%s)", c->name, c->hostname);
 			return false;
 		}
 
-		if(!entry->handler(c, request)) {
-			/* Something went wrong. Probably scriptkiddies. Terminate. */
+		p += 2 + framelen;
+		snapshot_requests_received++;
 
-			if(reqno != TERMREQ) {
-				logger(DEBUG_ALWAYS, LOG_ERR, "Error while processing %s from %s (%s)", entry->name, c->name, c->hostname);
-			}
+		const request_entry_t *entry = get_request_entry(r.type);
+		logger(DEBUG_META, LOG_DEBUG, "Got %s from %s (%s): %s", entry->name, c->name, c->hostname, meta_request_log_text(&r));
 
+		if(!entry->parsed(c, &r)) {
+			logger(DEBUG_ALWAYS, LOG_ERR, "Error while processing %s from %s (%s)", entry->name, c->name, c->hostname);
 			return false;
 		}
-	} else {
-		logger(DEBUG_ALWAYS, LOG_ERR, "Bogus data received from %s (%s)", c->name, c->hostname);
-		return false;
+	}
+
+	if(flags & SNAPSHOT_LAST) {
+		end_receiving_snapshot(c);
 	}
 
 	return true;
 }
 
+void end_receiving_snapshot(connection_t *c) {
+	if(!c->status.snapshot) {
+		return;
+	}
+
+	c->status.snapshot = false;
+	timeout_del(&c->snapshot_timeout);
+	graph_release();
+	snapshots_received++;
+	snapshot_graph_runs += graph_runs - c->snapshot_graph_runs;
+}
+
 static timeout_t past_request_timeout;
 
+/* Requests are remembered for at least PingInterval seconds, until all the buckets after theirs have been used */
+
+static struct timeval past_request_interval(void) {
+	// Round up, so that DEDUP_BUCKETS - 1 intervals are never shorter than PingInterval
+	int interval = (pinginterval + DEDUP_BUCKETS - 2) / (DEDUP_BUCKETS - 1);
+
+	return (struct timeval) {
+		interval > 0 ? interval : 1, jitter()
+	};
+}
+
 static void age_past_requests(void *data) {
 	(void)data;
-	int left = 0, deleted = 0;
 
-	for splay_each(past_request_t, p, &past_request_tree) {
-		if(p->firstseen + pinginterval <= now.tv_sec) {
-			splay_delete_node(&past_request_tree, node), deleted++;
-		} else {
-			left++;
-		}
+	dedup_rotate(&past_requests);
+
+	size_t left = dedup_entries(&past_requests);
+	logger(DEBUG_SCARY_THINGS, LOG_DEBUG, "Aging past requests: %zu left", left);
+
+	if(left) {
+		struct timeval interval = past_request_interval();
+		timeout_set(&past_request_timeout, &interval);
+	}
+}
+
+static bool seen_request_data(const void *data, size_t len) {
+	if(dedup_check(&past_requests, data, len)) {
+		logger(DEBUG_SCARY_THINGS, LOG_DEBUG, "Already seen request");
+		return true;
 	}
 
-	if(left || deleted) {
-		logger(DEBUG_SCARY_THINGS, LOG_DEBUG, "Aging past requests: deleted %d, left %d", deleted, left);
+	if(!past_request_timeout.cb) {
+		struct timeval interval = past_request_interval();
+		timeout_add(&past_request_timeout, age_past_requests, NULL, &interval);
 	}
 
-	if(left)
-		timeout_set(&past_request_timeout, &(struct timeval) {
-		10, jitter()
-	});
+	return false;
 }
 
 bool seen_request(const char *request) {
-	past_request_t *new, p = {0};
+	return seen_request_data(request, strlen(request));
+}
 
-	p.request = request;
+/* Requests with a binary encoding are remembered in that form, so it does not matter in which form a copy arrives */
 
-	if(splay_search(&past_request_tree, &p)) {
-		logger(DEBUG_SCARY_THINGS, LOG_DEBUG, "Already seen request");
-		return true;
-	} else {
-		new = xmalloc(sizeof(*new));
-		new->request = xstrdup(request);
-		new->firstseen = now.tv_sec;
-		splay_insert(&past_request_tree, new);
-		timeout_add(&past_request_timeout, age_past_requests, NULL, &(struct timeval) {
-			10, jitter()
-		});
-		return false;
-	}
+bool seen_meta_request(meta_request_t *r) {
+	size_t len;
+	const uint8_t *data = meta_request_binary(r, &len);
+
+	return data ? seen_request_data(data, len) : seen_request(meta_request_text(r));
 }
 
 void exit_requests(void) {
-	splay_empty_tree(&past_request_tree);
+	dedup_free(&past_requests);
 
 	timeout_del(&past_request_timeout);
 }
@@ -23,11 +23,12 @@
 
 #include "ecdsa.h"
 #include "connection.h"
+#include "meta_request.h"
 
 /* Protocol version. Different major versions are incompatible. */
 
 #define PROT_MAJOR 17
-#define PROT_MINOR 7
+#define PROT_MINOR 9
 
 STATIC_ASSERT(PROT_MINOR <= 255, "PROT_MINOR must not exceed 255");
 
@@ -57,20 +58,18 @@ typedef enum request_t {
 } request_t;
 
 typedef bool (request_handler_t)(connection_t *c, const char *request);
-
-typedef struct past_request_t {
-	const char *request;
-	time_t firstseen;
-} past_request_t;
+typedef bool (meta_request_handler_t)(connection_t *c, meta_request_t *r);
 
 typedef struct {
 	request_handler_t *const handler;
 	const char *name;
+	meta_request_handler_t *const parsed;   /* Used instead of handler for requests with a binary encoding */
 } request_entry_t;
 
 extern bool tunnelserver;
 extern bool strictsubnets;
 extern bool experimental;
+extern bool binary_meta;
 
 extern int invitation_lifetime;
 extern ecdsa_t *invitation_key;
@@ -83,6 +82,7 @@ extern ecdsa_t *invitation_key;
 #define MAX_STRING_SIZE 2049
 #define MAX_STRING "%2048s"
 
+#include "dedup.h"
 #include "edge.h"
 #include "net.h"
 #include "node.h"
@@ -93,9 +93,25 @@ extern ecdsa_t *invitation_key;
 extern bool send_request(struct connection_t *c, const char *format, ...) ATTR_FORMAT(printf, 2, 3);
 extern void forward_request(struct connection_t *c, const char *request);
 extern bool receive_request(struct connection_t *c, const char *request);
+extern bool receive_meta_request(struct connection_t *c, const void *data, size_t len);
+extern bool send_meta_request(struct connection_t *c, meta_request_t *r);
+extern void forward_meta_request(struct connection_t *from, meta_request_t *r);
+extern void begin_snapshot(struct connection_t *c);
+extern void end_snapshot(void);
+extern bool receive_meta_snapshot(struct connection_t *c, const void *data, size_t len);
+extern void end_receiving_snapshot(struct connection_t *c);
+
+extern uint64_t snapshot_records_sent;
+extern uint64_t snapshot_records_received;
+extern uint64_t snapshot_requests_received;
+extern uint64_t snapshots_received;
+extern uint64_t snapshot_graph_runs;
+
+extern dedup_t past_requests;
 
 extern void exit_requests(void);
 extern bool seen_request(const char *request);
+extern bool seen_meta_request(meta_request_t *r);
 
 extern const request_entry_t *get_request_entry(request_t req);
 
@@ -131,10 +147,10 @@ extern request_handler_t ack_h;
 extern request_handler_t termreq_h;
 extern request_handler_t ping_h;
 extern request_handler_t pong_h;
-extern request_handler_t add_subnet_h;
-extern request_handler_t del_subnet_h;
-extern request_handler_t add_edge_h;
-extern request_handler_t del_edge_h;
+extern meta_request_handler_t add_subnet_h;
+extern meta_request_handler_t del_subnet_h;
+extern meta_request_handler_t add_edge_h;
+extern meta_request_handler_t del_edge_h;
 extern request_handler_t key_changed_h;
 extern request_handler_t req_key_h;
 extern request_handler_t ans_key_h;
@@ -871,23 +871,25 @@ static void send_everything(connection_t *c) {
 		send_tcppacket(c, &zeropkt.pkt);
 	}
 
+	begin_snapshot(c);
+
 	if(tunnelserver) {
 		for splay_each(subnet_t, s, &myself->subnet_tree) {
 			send_add_subnet(c, s);
 		}
+	} else {
+		for splay_each(node_t, n, &node_tree) {
+			for splay_each(subnet_t, s, &n->subnet_tree) {
+				send_add_subnet(c, s);
+			}
 
-		return;
-	}
-
-	for splay_each(node_t, n, &node_tree) {
-		for splay_each(subnet_t, s, &n->subnet_tree) {
-			send_add_subnet(c, s);
-		}
-
-		for splay_each(edge_t, e, &n->edge_tree) {
-			send_add_edge(c, e);
+			for splay_each(edge_t, e, &n->edge_tree) {
+				send_add_edge(c, e);
+			}
 		}
 	}
+
+	end_snapshot();
 }
 
 static bool upgrade_h(connection_t *c, const char *request) {
@@ -37,51 +37,44 @@
 bool send_add_edge(connection_t *c, const edge_t *e) {
 	bool x;
 	char *address, *port;
+	char *local_address = NULL, *local_port = NULL;
+	meta_request_t r;
 
 	sockaddr2str(&e->address, &address, &port);
 
+	meta_request_init(&r, ADD_EDGE);
+	meta_request_add_number(&r, prng(UINT32_MAX));
+	meta_request_add_string(&r, e->from->name);
+	meta_request_add_string(&r, e->to->name);
+	meta_request_add_string(&r, address);
+	meta_request_add_string(&r, port);
+	meta_request_add_number(&r, e->options);
+	meta_request_add_number(&r, (uint32_t)e->weight);
+
 	if(e->local_address.sa.sa_family) {
-		char *local_address, *local_port;
 		sockaddr2str(&e->local_address, &local_address, &local_port);
-
-		x = send_request(c, "%d %x %s %s %s %s %x %d %s %s", ADD_EDGE, prng(UINT32_MAX),
-		                 e->from->name, e->to->name, address, port,
-		                 e->options, e->weight, local_address, local_port);
-		free(local_address);
-		free(local_port);
-	} else {
-		x = send_request(c, "%d %x %s %s %s %s %x %d", ADD_EDGE, prng(UINT32_MAX),
-		                 e->from->name, e->to->name, address, port,
-		                 e->options, e->weight);
+		meta_request_add_string(&r, local_address);
+		meta_request_add_string(&r, local_port);
 	}
 
+	x = send_meta_request(c, &r);
+
 	free(address);
 	free(port);
+	free(local_address);
+	free(local_port);
 
 	return x;
 }
 
-bool add_edge_h(connection_t *c, const char *request) {
+bool add_edge_h(connection_t *c, meta_request_t *r) {
 	edge_t *e;
 	node_t *from, *to;
-	char from_name[MAX_STRING_SIZE];
-	char to_name[MAX_STRING_SIZE];
-	char to_address[MAX_STRING_SIZE];
-	char to_port[MAX_STRING_SIZE];
-	char address_local[MAX_STRING_SIZE];
-	char port_local[MAX_STRING_SIZE];
+	const char *from_name = r->strings[1];
+	const char *to_name = r->strings[2];
 	sockaddr_t address, local_address = {0};
-	uint32_t options;
-	int weight;
-
-	int parameter_count = sscanf(request, "%*d %*x "MAX_STRING" "MAX_STRING" "MAX_STRING" "MAX_STRING" %x %d "MAX_STRING" "MAX_STRING,
-	                             from_name, to_name, to_address, to_port, &options, &weight, address_local, port_local);
-
-	if(parameter_count != 6 && parameter_count != 8) {
-		logger(DEBUG_ALWAYS, LOG_ERR, "Got bad %s from %s (%s)", "ADD_EDGE", c->name,
-		       c->hostname);
-		return false;
-	}
+	uint32_t options = r->numbers[5];
+	int weight = (int32_t)r->numbers[6];
 
 	/* Check if names are valid */
 
@@ -91,7 +84,7 @@ bool add_edge_h(connection_t *c, const char *request) {
 		return false;
 	}
 
-	if(seen_request(request)) {
+	if(seen_meta_request(r)) {
 		return true;
 	}
 
@@ -123,10 +116,10 @@ bool add_edge_h(connection_t *c, const char *request) {
 
 	/* Convert addresses */
 
-	address = str2sockaddr(to_address, to_port);
+	address = str2sockaddr(r->strings[3], r->strings[4]);
 
-	if(parameter_count >= 8) {
-		local_address = str2sockaddr(address_local, port_local);
+	if(r->count > 7) {
+		local_address = str2sockaddr(r->strings[7], r->strings[8]);
 	}
 
 	/* Check if edge already exists */
@@ -180,6 +173,8 @@ bool add_edge_h(connection_t *c, const char *request) {
 			e->weight = weight;
 			splay_insert_node(&edge_weight_tree, node);
 		}
+
+		graph_update_edge(e);
 	} else if(from == myself) {
 		logger(DEBUG_PROTOCOL, LOG_WARNING, "Got %s from %s (%s) for ourself which does not exist",
 		       "ADD_EDGE", c->name, c->hostname);
@@ -206,33 +201,33 @@ bool add_edge_h(connection_t *c, const char *request) {
 	/* Tell the rest about the new edge */
 
 	if(!tunnelserver) {
-		forward_request(c, request);
+		forward_meta_request(c, r);
 	}
 
 	/* Run MST before or after we tell the rest? */
 
-	graph();
+	graph_schedule();
 
 	return true;
 }
 
 bool send_del_edge(connection_t *c, const edge_t *e) {
-	return send_request(c, "%d %x %s %s", DEL_EDGE, prng(UINT32_MAX),
-	                    e->from->name, e->to->name);
+	meta_request_t r;
+
+	meta_request_init(&r, DEL_EDGE);
+	meta_request_add_number(&r, prng(UINT32_MAX));
+	meta_request_add_string(&r, e->from->name);
+	meta_request_add_string(&r, e->to->name);
+
+	return send_meta_request(c, &r);
 }
 
-bool del_edge_h(connection_t *c, const char *request) {
+bool del_edge_h(connection_t *c, meta_request_t *r) {
 	edge_t *e;
-	char from_name[MAX_STRING_SIZE];
-	char to_name[MAX_STRING_SIZE];
+	const char *from_name = r->strings[1];
+	const char *to_name = r->strings[2];
 	node_t *from, *to;
 
-	if(sscanf(request, "%*d %*x "MAX_STRING" "MAX_STRING, from_name, to_name) != 2) {
-		logger(DEBUG_ALWAYS, LOG_ERR, "Got bad %s from %s (%s)", "DEL_EDGE", c->name,
-		       c->hostname);
-		return false;
-	}
-
 	/* Check if names are valid */
 
 	if(!check_id(from_name) || !check_id(to_name) || !strcmp(from_name, to_name)) {
@@ -241,7 +236,7 @@ bool del_edge_h(connection_t *c, const char *request) {
 		return false;
 	}
 
-	if(seen_request(request)) {
+	if(seen_meta_request(r)) {
 		return true;
 	}
 
@@ -293,7 +288,7 @@ bool del_edge_h(connection_t *c, const char *request) {
 	/* Tell the rest about the deleted edge */
 
 	if(!tunnelserver) {
-		forward_request(c, request);
+		forward_meta_request(c, r);
 	}
 
 	/* Delete the edge */
@@ -302,21 +297,8 @@ bool del_edge_h(connection_t *c, const char *request) {
 
 	/* Run MST before or after we tell the rest? */
 
-	graph();
-
-	/* If the node is not reachable anymore but we remember it had an edge to us, clean it up */
-
-	if(!to->status.reachable) {
-		e = lookup_edge(to, myself);
-
-		if(e) {
-			if(!tunnelserver) {
-				send_del_edge(everyone, e);
-			}
-
-			edge_del(e);
-		}
-	}
+	graph_check_stale_edge(to);
+	graph_schedule();
 
 	return true;
 }
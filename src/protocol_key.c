@@ -23,6 +23,8 @@
 #include "cipher.h"
 #include "connection.h"
 #include "crypto.h"
+#include "crypto_pool.h"
+#include "device_workers.h"
 #include "logger.h"
 #include "net.h"
 #include "netutl.h"
@@ -123,6 +125,8 @@ bool send_req_key(node_t *to) {
 		char *label = alloca(labellen);
 		snprintf(label, labellen, "tinc UDP key expansion %s %s", myself->name, to->name);
 
+		crypto_pool_cancel(to);
+		device_workers_cancel(to);
 		sptps_stop(&to->sptps);
 		to->status.validkey = false;
 		to->status.waitingforkey = true;
@@ -245,6 +249,8 @@ static bool req_key_ext_h(connection_t *c, const char *request, node_t *from, no
 		const size_t labellen = 25 + strlen(from->name) + strlen(myself->name);
 		char *label = alloca(labellen);
 		snprintf(label, labellen, "tinc UDP key expansion %s %s", from->name, myself->name);
+		crypto_pool_cancel(from);
+		device_workers_cancel(from);
 		sptps_stop(&from->sptps);
 		from->status.validkey = false;
 		from->status.waitingforkey = true;
@@ -531,6 +537,7 @@ bool ans_key_h(connection_t *c, const char *request) {
 	}
 
 	from->outcompression = compression;
+	device_workers_update();
 
 	/* SPTPS or old-style key exchange? */
 
@@ -37,21 +37,22 @@ bool send_add_subnet(connection_t *c, const subnet_t *subnet) {
 		return false;
 	}
 
-	return send_request(c, "%d %x %s %s", ADD_SUBNET, prng(UINT32_MAX), subnet->owner->name, netstr);
+	meta_request_t r;
+
+	meta_request_init(&r, ADD_SUBNET);
+	meta_request_add_number(&r, prng(UINT32_MAX));
+	meta_request_add_string(&r, subnet->owner->name);
+	meta_request_add_string(&r, netstr);
+
+	return send_meta_request(c, &r);
 }
 
-bool add_subnet_h(connection_t *c, const char *request) {
-	char subnetstr[MAX_STRING_SIZE];
-	char name[MAX_STRING_SIZE];
+bool add_subnet_h(connection_t *c, meta_request_t *r) {
+	const char *name = r->strings[1];
+	const char *subnetstr = r->strings[2];
 	node_t *owner;
 	subnet_t s = {0}, *new, *old;
 
-	if(sscanf(request, "%*d %*x " MAX_STRING " " MAX_STRING, name, subnetstr) != 2) {
-		logger(DEBUG_ALWAYS, LOG_ERR, "Got bad %s from %s (%s)", "ADD_SUBNET", c->name,
-		       c->hostname);
-		return false;
-	}
-
 	/* Check if owner name is valid */
 
 	if(!check_id(name)) {
@@ -68,7 +69,7 @@ bool add_subnet_h(connection_t *c, const char *request) {
 		return false;
 	}
 
-	if(seen_request(request)) {
+	if(seen_meta_request(r)) {
 		return true;
 	}
 
@@ -117,7 +118,7 @@ bool add_subnet_h(connection_t *c, const char *request) {
 	if(strictsubnets) {
 		logger(DEBUG_ALWAYS, LOG_WARNING, "Ignoring unauthorized %s from %s (%s): %s",
 		       "ADD_SUBNET", c->name, c->hostname, subnetstr);
-		forward_request(c, request);
+		forward_meta_request(c, r);
 		return true;
 	}
 
@@ -133,7 +134,7 @@ bool add_subnet_h(connection_t *c, const char *request) {
 	/* Tell the rest */
 
 	if(!tunnelserver) {
-		forward_request(c, request);
+		forward_meta_request(c, r);
 	}
 
 	/* Fast handoff of roaming MAC addresses */
@@ -152,21 +153,22 @@ bool send_del_subnet(connection_t *c, const subnet_t *s) {
 		return false;
 	}
 
-	return send_request(c, "%d %x %s %s", DEL_SUBNET, prng(UINT32_MAX), s->owner->name, netstr);
+	meta_request_t r;
+
+	meta_request_init(&r, DEL_SUBNET);
+	meta_request_add_number(&r, prng(UINT32_MAX));
+	meta_request_add_string(&r, s->owner->name);
+	meta_request_add_string(&r, netstr);
+
+	return send_meta_request(c, &r);
 }
 
-bool del_subnet_h(connection_t *c, const char *request) {
-	char subnetstr[MAX_STRING_SIZE];
-	char name[MAX_STRING_SIZE];
+bool del_subnet_h(connection_t *c, meta_request_t *r) {
+	const char *name = r->strings[1];
+	const char *subnetstr = r->strings[2];
 	node_t *owner;
 	subnet_t s = {0}, *find;
 
-	if(sscanf(request, "%*d %*x " MAX_STRING " " MAX_STRING, name, subnetstr) != 2) {
-		logger(DEBUG_ALWAYS, LOG_ERR, "Got bad %s from %s (%s)", "DEL_SUBNET", c->name,
-		       c->hostname);
-		return false;
-	}
-
 	/* Check if owner name is valid */
 
 	if(!check_id(name)) {
@@ -183,7 +185,7 @@ bool del_subnet_h(connection_t *c, const char *request) {
 		return false;
 	}
 
-	if(seen_request(request)) {
+	if(seen_meta_request(r)) {
 		return true;
 	}
 
@@ -215,7 +217,7 @@ bool del_subnet_h(connection_t *c, const char *request) {
 		       "DEL_SUBNET", c->name, c->hostname, name);
 
 		if(strictsubnets) {
-			forward_request(c, request);
+			forward_meta_request(c, r);
 		}
 
 		return true;
@@ -237,7 +239,7 @@ bool del_subnet_h(connection_t *c, const char *request) {
 	/* Tell the rest */
 
 	if(!tunnelserver) {
-		forward_request(c, request);
+		forward_meta_request(c, r);
 	}
 
 	if(strictsubnets) {
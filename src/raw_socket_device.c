@@ -90,10 +90,16 @@ static void close_device(void) {
 	device_info = NULL;
 }
 
-static bool read_packet(vpn_packet_t *packet) {
+/* Read a single packet from the device. When draining, running out of
+   packets is expected and is not reported as an error. */
+static bool read_one_packet(vpn_packet_t *packet, bool drain) {
 	ssize_t inlen;
 
-	if((inlen = read(device_fd, DATA(packet), MTU)) <= 0) {
+	if((inlen = recv(device_fd, DATA(packet), MTU, drain ? MSG_DONTWAIT : 0)) <= 0) {
+		if(drain && inlen < 0 && errno == EAGAIN) {
+			return false;
+		}
+
 		logger(DEBUG_ALWAYS, LOG_ERR, "Error while reading from %s %s: %s", device_info,
 		       device, strerror(errno));
 		return false;
@@ -107,6 +113,24 @@ static bool read_packet(vpn_packet_t *packet) {
 	return true;
 }
 
+static bool read_packet(vpn_packet_t *packet) {
+	return read_one_packet(packet, false);
+}
+
+static size_t read_packets(vpn_packet_t *packets, size_t count) {
+	if(!count || !read_one_packet(&packets[0], false)) {
+		return 0;
+	}
+
+	size_t i = 1;
+
+	while(i < count && read_one_packet(&packets[i], true)) {
+		i++;
+	}
+
+	return i;
+}
+
 static bool write_packet(vpn_packet_t *packet) {
 	logger(DEBUG_TRAFFIC, LOG_DEBUG, "Writing packet of %d bytes to %s",
 	       packet->len, device_info);
@@ -124,6 +148,7 @@ const devops_t raw_socket_devops = {
 	.setup = setup_device,
 	.close = close_device,
 	.read = read_packet,
+	.read_batch = read_packets,
 	.write = write_packet,
 };
 
@@ -138,6 +163,7 @@ const devops_t raw_socket_devops = {
 	.setup = not_supported,
 	.close = NULL,
 	.read = NULL,
+	.read_batch = NULL,
 	.write = NULL,
 };
 #endif
@@ -20,10 +20,14 @@
 
 #include "system.h"
 
+#include "capture.h"
+#include "checksum.h"
 #include "connection.h"
 #include "control_common.h"
 #include "crypto.h"
+#include "device_workers.h"
 #include "ethernet.h"
+#include "hash.h"
 #include "ipv4.h"
 #include "ipv6.h"
 #include "logger.h"
@@ -58,29 +62,139 @@ static const size_t opt_size = sizeof(struct nd_opt_hdr);
 
 static timeout_t age_subnets_timeout;
 
-/* RFC 1071 */
+/* Flow cache
 
-static uint16_t inet_checksum(void *vdata, size_t len, uint16_t prevsum) {
-	uint8_t *data = vdata;
-	uint16_t word;
-	uint32_t checksum = prevsum ^ 0xFFFF;
+   Remembers which node packets from a given source to a given destination
+   address are sent to, once all the checks in route_ipv4() and route_ipv6()
+   that only depend on the subnets, the graph and the configuration passed.
+   It is flushed whenever any of those change. Checks that depend on the
+   packet itself, and the path MTU which can change at any time, are still
+   done for every packet.
+*/
+
+typedef struct route_flow_t {
+	const node_t *source;
+	uint32_t address[4];            // IPv4 addresses only use the first word
+	uint32_t family;
+	uint32_t padding;               // Keys are compared with memcmp()
+} route_flow_t;
+
+static uint32_t hash_function_route_flow_t(const route_flow_t *p) {
+	uint32_t hash = hash_seed ^ p->family;
+	uintptr_t source = (uintptr_t)p->source;
 
-	while(len >= 2) {
-		memcpy(&word, data, sizeof(word));
-		checksum += word;
-		data += 2;
-		len -= 2;
+	for(int i = 0; i < 4; i++) {
+		hash = (uint32_t)((uint64_t)hash + p->address[i]);
+		hash = (uint32_t)((uint64_t)hash * 0x9e370001U);
 	}
 
-	if(len) {
-		checksum += *data;
+	return hash ^ (uint32_t)(source >> 4);
+}
+
+hash_define(route_flow_t, SUBNET_HASH_SIZE)
+
+hash_new(route_flow_t, flow_cache);
+
+static void flow_key(route_flow_t *key, const node_t *source, int family, const void *address, size_t len) {
+	memset(key, 0, sizeof(*key));
+	key->source = source;
+	key->family = (uint32_t)family;
+	memcpy(key->address, address, len);
+}
+
+/* Batch routing
+
+   While route_batch() runs, unicast packets are not sent right away, but
+   collected here. Afterwards they are sent grouped by destination, so all
+   packets for one node are encrypted back to back.
+*/
+
+typedef struct route_batch_entry_t {
+	node_t *owner;
+	vpn_packet_t *packet;
+} route_batch_entry_t;
+
+static route_batch_entry_t batch[MAX_DEVICE_BATCH];
+static size_t batch_len;
+static bool batching;
+
+uint64_t route_batch_packets;
+uint64_t route_batch_groups;
+
+static void flush_batch(void) {
+	vpn_packet_t *group[MAX_DEVICE_BATCH];
+
+	for(size_t i = 0; i < batch_len; i++) {
+		node_t *owner = batch[i].owner;
+
+		if(!owner) {
+			continue;
+		}
+
+		// Collect the remaining packets for this node, keeping their order
+		size_t count = 0;
+
+		for(size_t j = i; j < batch_len; j++) {
+			if(batch[j].owner == owner) {
+				group[count++] = batch[j].packet;
+				batch[j].owner = NULL;
+			}
+		}
+
+		route_batch_groups++;
+		send_packets(owner, group, count);
+	}
+
+	batch_len = 0;
+}
+
+static void route_send(node_t *owner, vpn_packet_t *packet) {
+	if(!batching) {
+		send_packet(owner, packet);
+		return;
 	}
 
-	while(checksum >> 16) {
-		checksum = (checksum & 0xFFFF) + (checksum >> 16);
+	if(batch_len == MAX_DEVICE_BATCH) {
+		flush_batch();
+	}
+
+	batch[batch_len].owner = owner;
+	batch[batch_len].packet = packet;
+	batch_len++;
+	route_batch_packets++;
+}
+
+static void route_cache_insert(const route_flow_t *flow, node_t *owner) {
+	hash_insert(route_flow_t, &flow_cache, flow, owner);
+
+	// Device workers forward packets from the device by these decisions
+	if(flow->source == myself) {
+		device_workers_learn();
+	}
+}
+
+void route_cache_flush(void) {
+	hash_clear(route_flow_t, &flow_cache);
+	device_workers_update();
+}
+
+void route_cache_walk(const node_t *source, route_cache_cb_t cb, void *arg) {
+	for(uint32_t i = 0; i < flow_cache.size; i++) {
+		const hash_entry_route_flow_t *entry = &flow_cache.entries[i];
+
+		if(entry->generation == flow_cache.generation && entry->key.source == source) {
+			cb(arg, (int)entry->key.family, entry->key.address, (node_t *)entry->value);
+		}
 	}
+}
+
+void route_cache_free(void) {
+	hash_free(route_flow_t, &flow_cache);
+}
 
-	return (uint16_t) ~checksum;
+void route_cache_stats(hash_stats_t *stats) {
+	memset(stats, 0, sizeof(*stats));
+	hash_stats(route_flow_t, &flow_cache, stats);
 }
 
 static bool ratelimit(int frequency) {
@@ -352,12 +466,8 @@ static bool do_decrement_ttl(node_t *source, vpn_packet_t *packet) {
 		DATA(packet)[ethlen + 8]--;
 		uint16_t new = DATA(packet)[ethlen + 8] << 8 | DATA(packet)[ethlen + 9];
 
-		uint32_t checksum = DATA(packet)[ethlen + 10] << 8 | DATA(packet)[ethlen + 11];
-		checksum += old + (~new & 0xFFFF);
-
-		while(checksum >> 16) {
-			checksum = (checksum & 0xFFFF) + (checksum >> 16);
-		}
+		uint16_t checksum = DATA(packet)[ethlen + 10] << 8 | DATA(packet)[ethlen + 11];
+		checksum = inet_checksum_update(checksum, old, new);
 
 		DATA(packet)[ethlen + 10] = checksum >> 8;
 		DATA(packet)[ethlen + 11] = checksum & 0xff;
@@ -465,7 +575,7 @@ static void clamp_mss(const node_t *source, const node_t *via, vpn_packet_t *pac
 		/* Found it */
 		uint16_t oldmss = DATA(packet)[start + 22 + i] << 8 | DATA(packet)[start + 23 + i];
 		uint16_t newmss = mtu - start - 20;
-		uint32_t csum = DATA(packet)[start + 16] << 8 | DATA(packet)[start + 17];
+		uint16_t csum = DATA(packet)[start + 16] << 8 | DATA(packet)[start + 17];
 
 		if(oldmss <= newmss) {
 			break;
@@ -476,12 +586,14 @@ static void clamp_mss(const node_t *source, const node_t *via, vpn_packet_t *pac
 		/* Update the MSS value and the checksum */
 		DATA(packet)[start + 22 + i] = newmss >> 8;
 		DATA(packet)[start + 23 + i] = newmss & 0xff;
-		csum ^= 0xffff;
-		csum += oldmss ^ 0xffff;
-		csum += newmss;
-		csum = (csum & 0xffff) + (csum >> 16);
-		csum += csum >> 16;
-		csum ^= 0xffff;
+
+		/* After an odd number of padding bytes, the MSS straddles two words of the checksum */
+		if(i % 2) {
+			csum = inet_checksum_update(csum, (uint16_t)(oldmss << 8 | oldmss >> 8), (uint16_t)(newmss << 8 | newmss >> 8));
+		} else {
+			csum = inet_checksum_update(csum, oldmss, newmss);
+		}
+
 		DATA(packet)[start + 16] = csum >> 8;
 		DATA(packet)[start + 17] = csum & 0xff;
 		break;
@@ -623,67 +735,79 @@ static void route_ipv4(node_t *source, vpn_packet_t *packet) {
 	}
 
 	subnet_t *subnet;
+	node_t *owner;
 	node_t *via;
 	ipv4_t dest;
+	route_flow_t flow;
 
 	memcpy(&dest, &DATA(packet)[30], sizeof(dest));
-	subnet = lookup_subnet_ipv4(&dest);
+	flow_key(&flow, source, AF_INET, &dest, sizeof(dest));
 
-	if(!subnet) {
-		logger(DEBUG_TRAFFIC, LOG_WARNING, "Cannot route packet from %s (%s): unknown IPv4 destination address %d.%d.%d.%d",
-		       source->name, source->hostname,
-		       dest.x[0],
-		       dest.x[1],
-		       dest.x[2],
-		       dest.x[3]);
-
-		route_ipv4_unreachable(source, packet, ether_size, ICMP_DEST_UNREACH, ICMP_NET_UNKNOWN);
-		return;
-	}
+	if(hash_search(route_flow_t, &flow_cache, &flow, (void **)&owner)) {
+		via = (owner->via == myself) ? owner->nexthop : owner->via;
+	} else {
+		subnet = lookup_subnet_ipv4(&dest);
 
-	if(!subnet->owner) {
-		route_broadcast(source, packet);
-		return;
-	}
+		if(!subnet) {
+			logger(DEBUG_TRAFFIC, LOG_WARNING, "Cannot route packet from %s (%s): unknown IPv4 destination address %d.%d.%d.%d",
+			       source->name, source->hostname,
+			       dest.x[0],
+			       dest.x[1],
+			       dest.x[2],
+			       dest.x[3]);
 
-	if(subnet->owner == source) {
-		logger(DEBUG_TRAFFIC, LOG_WARNING, "Packet looping back to %s (%s)!", source->name, source->hostname);
-		return;
-	}
+			route_ipv4_unreachable(source, packet, ether_size, ICMP_DEST_UNREACH, ICMP_NET_UNKNOWN);
+			return;
+		}
 
-	if(!subnet->owner->status.reachable) {
-		route_ipv4_unreachable(source, packet, ether_size, ICMP_DEST_UNREACH, ICMP_NET_UNREACH);
-		return;
-	}
+		owner = subnet->owner;
 
-	if(forwarding_mode == FMODE_OFF && source != myself && subnet->owner != myself) {
-		route_ipv4_unreachable(source, packet, ether_size, ICMP_DEST_UNREACH, ICMP_NET_ANO);
-		return;
-	}
+		if(!owner) {
+			route_broadcast(source, packet);
+			return;
+		}
 
-	if(decrement_ttl && source != myself && subnet->owner != myself)
-		if(!do_decrement_ttl(source, packet)) {
+		if(owner == source) {
+			logger(DEBUG_TRAFFIC, LOG_WARNING, "Packet looping back to %s (%s)!", source->name, source->hostname);
 			return;
 		}
 
-	if(priorityinheritance) {
-		packet->priority = DATA(packet)[15];
-	}
+		if(!owner->status.reachable) {
+			route_ipv4_unreachable(source, packet, ether_size, ICMP_DEST_UNREACH, ICMP_NET_UNREACH);
+			return;
+		}
+
+		if(forwarding_mode == FMODE_OFF && source != myself && owner != myself) {
+			route_ipv4_unreachable(source, packet, ether_size, ICMP_DEST_UNREACH, ICMP_NET_ANO);
+			return;
+		}
 
-	via = (subnet->owner->via == myself) ? subnet->owner->nexthop : subnet->owner->via;
+		via = (owner->via == myself) ? owner->nexthop : owner->via;
 
-	if(via == source) {
-		logger(DEBUG_TRAFFIC, LOG_ERR, "Routing loop for packet from %s (%s)!", source->name, source->hostname);
-		return;
+		if(via == source) {
+			logger(DEBUG_TRAFFIC, LOG_ERR, "Routing loop for packet from %s (%s)!", source->name, source->hostname);
+			return;
+		}
+
+		if(directonly && owner != via) {
+			route_ipv4_unreachable(source, packet, ether_size, ICMP_DEST_UNREACH, ICMP_NET_ANO);
+			return;
+		}
+
+		route_cache_insert(&flow, owner);
 	}
 
-	if(directonly && subnet->owner != via) {
-		route_ipv4_unreachable(source, packet, ether_size, ICMP_DEST_UNREACH, ICMP_NET_ANO);
-		return;
+	if(decrement_ttl && source != myself && owner != myself)
+		if(!do_decrement_ttl(source, packet)) {
+			return;
+		}
+
+	if(priorityinheritance) {
+		packet->priority = DATA(packet)[15];
 	}
 
 	if(via && packet->len > MAX(via->mtu, 590) && via != myself) {
-		logger(DEBUG_TRAFFIC, LOG_INFO, "Packet for %s (%s) length %d larger than MTU %d", subnet->owner->name, subnet->owner->hostname, packet->len, via->mtu);
+		logger(DEBUG_TRAFFIC, LOG_INFO, "Packet for %s (%s) length %d larger than MTU %d", owner->name, owner->hostname, packet->len, via->mtu);
 
 		if(DATA(packet)[20] & 0x40) {
 			packet->len = MAX(via->mtu, 590);
@@ -697,7 +821,7 @@ static void route_ipv4(node_t *source, vpn_packet_t *packet) {
 
 	clamp_mss(source, via, packet);
 
-	send_packet(subnet->owner, packet);
+	route_send(owner, packet);
 }
 
 static void route_neighborsol(node_t *source, vpn_packet_t *packet);
@@ -713,71 +837,83 @@ static void route_ipv6(node_t *source, vpn_packet_t *packet) {
 	}
 
 	subnet_t *subnet;
+	node_t *owner;
 	node_t *via;
 	ipv6_t dest;
+	route_flow_t flow;
 
 	memcpy(&dest, &DATA(packet)[38], sizeof(dest));
-	subnet = lookup_subnet_ipv6(&dest);
+	flow_key(&flow, source, AF_INET6, &dest, sizeof(dest));
 
-	if(!subnet) {
-		logger(DEBUG_TRAFFIC, LOG_WARNING, "Cannot route packet from %s (%s): unknown IPv6 destination address %hx:%hx:%hx:%hx:%hx:%hx:%hx:%hx",
-		       source->name, source->hostname,
-		       ntohs(dest.x[0]),
-		       ntohs(dest.x[1]),
-		       ntohs(dest.x[2]),
-		       ntohs(dest.x[3]),
-		       ntohs(dest.x[4]),
-		       ntohs(dest.x[5]),
-		       ntohs(dest.x[6]),
-		       ntohs(dest.x[7]));
-
-		route_ipv6_unreachable(source, packet, ether_size, ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_ADDR);
-		return;
-	}
+	if(hash_search(route_flow_t, &flow_cache, &flow, (void **)&owner)) {
+		via = (owner->via == myself) ? owner->nexthop : owner->via;
+	} else {
+		subnet = lookup_subnet_ipv6(&dest);
+
+		if(!subnet) {
+			logger(DEBUG_TRAFFIC, LOG_WARNING, "Cannot route packet from %s (%s): unknown IPv6 destination address %hx:%hx:%hx:%hx:%hx:%hx:%hx:%hx",
+			       source->name, source->hostname,
+			       ntohs(dest.x[0]),
+			       ntohs(dest.x[1]),
+			       ntohs(dest.x[2]),
+			       ntohs(dest.x[3]),
+			       ntohs(dest.x[4]),
+			       ntohs(dest.x[5]),
+			       ntohs(dest.x[6]),
+			       ntohs(dest.x[7]));
+
+			route_ipv6_unreachable(source, packet, ether_size, ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_ADDR);
+			return;
+		}
 
-	if(!subnet->owner) {
-		route_broadcast(source, packet);
-		return;
-	}
+		owner = subnet->owner;
 
-	if(subnet->owner == source) {
-		logger(DEBUG_TRAFFIC, LOG_WARNING, "Packet looping back to %s (%s)!", source->name, source->hostname);
-		return;
-	}
+		if(!owner) {
+			route_broadcast(source, packet);
+			return;
+		}
 
-	if(!subnet->owner->status.reachable) {
-		route_ipv6_unreachable(source, packet, ether_size, ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_NOROUTE);
-		return;
-	}
+		if(owner == source) {
+			logger(DEBUG_TRAFFIC, LOG_WARNING, "Packet looping back to %s (%s)!", source->name, source->hostname);
+			return;
+		}
 
-	if(forwarding_mode == FMODE_OFF && source != myself && subnet->owner != myself) {
-		route_ipv6_unreachable(source, packet, ether_size, ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_ADMIN);
-		return;
-	}
+		if(!owner->status.reachable) {
+			route_ipv6_unreachable(source, packet, ether_size, ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_NOROUTE);
+			return;
+		}
 
-	if(decrement_ttl && source != myself && subnet->owner != myself)
-		if(!do_decrement_ttl(source, packet)) {
+		if(forwarding_mode == FMODE_OFF && source != myself && owner != myself) {
+			route_ipv6_unreachable(source, packet, ether_size, ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_ADMIN);
 			return;
 		}
 
-	if(priorityinheritance) {
-		packet->priority = ((DATA(packet)[14] & 0x0f) << 4) | (DATA(packet)[15] >> 4);
-	}
+		via = (owner->via == myself) ? owner->nexthop : owner->via;
+
+		if(via == source) {
+			logger(DEBUG_TRAFFIC, LOG_ERR, "Routing loop for packet from %s (%s)!", source->name, source->hostname);
+			return;
+		}
 
-	via = (subnet->owner->via == myself) ? subnet->owner->nexthop : subnet->owner->via;
+		if(directonly && owner != via) {
+			route_ipv6_unreachable(source, packet, ether_size, ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_ADMIN);
+			return;
+		}
 
-	if(via == source) {
-		logger(DEBUG_TRAFFIC, LOG_ERR, "Routing loop for packet from %s (%s)!", source->name, source->hostname);
-		return;
+		route_cache_insert(&flow, owner);
 	}
 
-	if(directonly && subnet->owner != via) {
-		route_ipv6_unreachable(source, packet, ether_size, ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_ADMIN);
-		return;
+	if(decrement_ttl && source != myself && owner != myself)
+		if(!do_decrement_ttl(source, packet)) {
+			return;
+		}
+
+	if(priorityinheritance) {
+		packet->priority = ((DATA(packet)[14] & 0x0f) << 4) | (DATA(packet)[15] >> 4);
 	}
 
 	if(via && packet->len > MAX(via->mtu, 1294) && via != myself) {
-		logger(DEBUG_TRAFFIC, LOG_INFO, "Packet for %s (%s) length %d larger than MTU %d", subnet->owner->name, subnet->owner->hostname, packet->len, via->mtu);
+		logger(DEBUG_TRAFFIC, LOG_INFO, "Packet for %s (%s) length %d larger than MTU %d", owner->name, owner->hostname, packet->len, via->mtu);
 		packet->len = MAX(via->mtu, 1294);
 		route_ipv6_unreachable(source, packet, ether_size, ICMP6_PACKET_TOO_BIG, 0);
 		return;
@@ -785,7 +921,7 @@ static void route_ipv6(node_t *source, vpn_packet_t *packet) {
 
 	clamp_mss(source, via, packet);
 
-	send_packet(subnet->owner, packet);
+	route_send(owner, packet);
 }
 
 /* RFC 2461 */
@@ -1103,33 +1239,12 @@ static void route_mac(node_t *source, vpn_packet_t *packet) {
 
 	clamp_mss(source, via, packet);
 
-	send_packet(subnet->owner, packet);
-}
-
-static void send_pcap(vpn_packet_t *packet) {
-	pcap = false;
-
-	for list_each(connection_t, c, &connection_list) {
-		if(!c->status.pcap) {
-			continue;
-		}
-
-		pcap = true;
-		int len = packet->len;
-
-		if(c->outmaclength && c->outmaclength < len) {
-			len = c->outmaclength;
-		}
-
-		if(send_request(c, "%d %d %d", CONTROL, REQ_PCAP, len)) {
-			send_meta(c, DATA(packet), len);
-		}
-	}
+	route_send(subnet->owner, packet);
 }
 
 void route(node_t *source, vpn_packet_t *packet) {
 	if(pcap) {
-		send_pcap(packet);
+		capture_packet(packet);
 	}
 
 	if(forwarding_mode == FMODE_KERNEL && source != myself) {
@@ -1174,3 +1289,14 @@ void route(node_t *source, vpn_packet_t *packet) {
 		break;
 	}
 }
+
+void route_batch(node_t *source, vpn_packet_t *packets, size_t count) {
+	batching = true;
+
+	for(size_t i = 0; i < count; i++) {
+		route(source, &packets[i]);
+	}
+
+	batching = false;
+	flush_batch();
+}
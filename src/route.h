@@ -21,6 +21,7 @@
     51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
+#include "hash.h"
 #include "net.h"
 #include "node.h"
 
@@ -54,6 +55,21 @@ extern bool pcap;
 
 extern mac_t mymac;
 
+extern uint64_t route_batch_packets;
+extern uint64_t route_batch_groups;
+
 extern void route(struct node_t *source, struct vpn_packet_t *packet);
 
+// Route several packets, and send those that go to the same node together. Packets to different nodes may be reordered.
+extern void route_batch(struct node_t *source, struct vpn_packet_t *packets, size_t count);
+
+// Forget all cached routing decisions. Must be called whenever subnets, nodes, the graph or the configuration change.
+extern void route_cache_flush(void);
+extern void route_cache_free(void);
+
+// Call cb for every cached routing decision for packets from source, with the destination address in network byte order.
+typedef void (*route_cache_cb_t)(void *arg, int family, const void *address, struct node_t *owner);
+extern void route_cache_walk(const struct node_t *source, route_cache_cb_t cb, void *arg);
+extern void route_cache_stats(hash_stats_t *stats);
+
 #endif
@@ -108,18 +108,30 @@ static void free_sptps_key(sptps_key_t *key) {
 	xzfree(key, sizeof(sptps_key_t));
 }
 
-// Send a record (datagram version, accepts all record types, handles encryption and authentication).
-static bool send_record_priv_datagram(sptps_t *s, uint8_t type, const void *data, uint16_t len) {
-	uint8_t *buffer = alloca(len + 21UL);
+// Reserve the next sequence number of a datagram session.
+// Device worker threads reserve them too, using the same atomic increment.
+static uint32_t next_datagram_seqno(sptps_t *s) {
+	return __atomic_fetch_add(&s->outseqno, 1, __ATOMIC_RELAXED);
+}
 
+// Write the header and payload of a datagram record to buffer, which must have room for len + 21 bytes.
+static uint32_t datagram_header(sptps_t *s, uint8_t type, const void *data, uint16_t len, uint8_t *buffer) {
 	// Create header with sequence number, length and record type
-	uint32_t seqno = s->outseqno++;
+	uint32_t seqno = next_datagram_seqno(s);
 	uint32_t netseqno = ntohl(seqno);
 
 	memcpy(buffer, &netseqno, 4);
 	buffer[4] = type;
 	memcpy(buffer + 5, data, len);
 
+	return seqno;
+}
+
+// Send a record (datagram version, accepts all record types, handles encryption and authentication).
+static bool send_record_priv_datagram(sptps_t *s, uint8_t type, const void *data, uint16_t len) {
+	uint8_t *buffer = alloca(len + 21UL);
+	uint32_t seqno = datagram_header(s, type, data, len, buffer);
+
 	if(s->outstate) {
 		// If first handshake has finished, encrypt and HMAC
 		chacha_poly1305_encrypt(s->outcipher, seqno, buffer + 4, len + 1, buffer + 4, NULL);
@@ -129,6 +141,7 @@ static bool send_record_priv_datagram(sptps_t *s, uint8_t type, const void *data
 		return s->send_data(s->handle, type, buffer, len + 5UL);
 	}
 }
+
 // Send a record (private version, accepts all record types, handles encryption and authentication).
 static bool send_record_priv(sptps_t *s, uint8_t type, const void *data, uint16_t len) {
 	if(s->datagram) {
@@ -170,6 +183,59 @@ bool sptps_send_record(sptps_t *s, uint8_t type, const void *data, uint16_t len)
 	return send_record_priv(s, type, data, len);
 }
 
+// Prepare an application record for sptps_seal_datagram(), reserving its sequence number.
+bool sptps_prepare_datagram(sptps_t *s, uint8_t type, const void *data, uint16_t len, uint8_t *buffer) {
+	if(!s->datagram || !s->outstate) {
+		return error(s, EINVAL, "Handshake phase not finished yet");
+	}
+
+	if(type >= SPTPS_HANDSHAKE) {
+		return error(s, EINVAL, "Invalid application record type");
+	}
+
+	datagram_header(s, type, data, len, buffer);
+	return true;
+}
+
+// Encrypt an application record directly into out, which must have room for len + SPTPS_DATAGRAM_OVERHEAD bytes.
+// This avoids copying the payload, which may also be encrypted in place if data is out + 5.
+// The byte preceding data is used to hold the record type during encryption, and restored afterwards.
+bool sptps_seal_record(sptps_t *s, uint8_t type, uint8_t *data, uint16_t len, uint8_t *out) {
+	if(!s->datagram || !s->outstate) {
+		return error(s, EINVAL, "Handshake phase not finished yet");
+	}
+
+	if(type >= SPTPS_HANDSHAKE) {
+		return error(s, EINVAL, "Invalid application record type");
+	}
+
+	sptps_seal_record_with(s->outcipher, next_datagram_seqno(s), type, data, len, out);
+	return true;
+}
+
+// The same as sptps_seal_record(), but with a sequence number the caller reserved from the session's outseqno
+// and a private copy of the session's outgoing cipher, so this can be called from any thread.
+void sptps_seal_record_with(chacha_poly1305_ctx_t *cipher, uint32_t seqno, uint8_t type, uint8_t *data, uint16_t len, uint8_t *out) {
+	uint32_t netseqno = htonl(seqno);
+	memcpy(out, &netseqno, 4);
+
+	uint8_t saved = data[-1];
+	data[-1] = type;
+	chacha_poly1305_encrypt(cipher, seqno, data - 1, len + 1, out + 4, NULL);
+
+	if(out + 4 != data - 1) {
+		data[-1] = saved;
+	}
+}
+
+// Encrypt a prepared datagram record in place. The cipher must be a private copy of
+// the session's outgoing cipher, so this can be called from any thread.
+void sptps_seal_datagram(chacha_poly1305_ctx_t *cipher, uint8_t *buffer, uint16_t len) {
+	uint32_t seqno;
+	memcpy(&seqno, buffer, 4);
+	chacha_poly1305_encrypt(cipher, ntohl(seqno), buffer + 4, len + 1, buffer + 4, NULL);
+}
+
 // Send a Key EXchange record, containing a random nonce and an ECDHE public key.
 static bool send_kex(sptps_t *s) {
 	// Make room for our KEX message, which we will keep around since send_sig() needs it.
@@ -525,13 +591,53 @@ bool sptps_verify_datagram(sptps_t *s, const void *vdata, size_t len) {
 		return false;
 	}
 
-	uint8_t *buffer = alloca(len);
-	size_t outlen;
-	return chacha_poly1305_decrypt(s->incipher, seqno, data + 4, len - 4, buffer, &outlen);
+	return chacha_poly1305_verify(s->incipher, seqno, data + 4, len - 4);
 }
 
-// Receive incoming data, datagram version.
-static bool sptps_receive_data_datagram(sptps_t *s, const uint8_t *data, size_t len) {
+// Receive a decrypted datagram record. The buffer must have room for one more byte.
+static bool receive_datagram_record(sptps_t *s, uint32_t seqno, uint8_t *buffer, size_t len) {
+	if(!sptps_check_seqno(s, seqno, true)) {
+		return false;
+	}
+
+	// Append a NULL byte for safety.
+	buffer[len] = 0;
+
+	const uint8_t *data = buffer;
+	uint8_t type = *(data++);
+	len--;
+
+	if(type < SPTPS_HANDSHAKE) {
+		if(!s->instate) {
+			return error(s, EIO, "Application record received before handshake finished");
+		}
+
+		if(!s->receive_record(s->handle, type, data, len)) {
+			return false;
+		}
+	} else if(type == SPTPS_HANDSHAKE) {
+		if(!receive_handshake(s, data, len)) {
+			return false;
+		}
+	} else {
+		return error(s, EIO, "Invalid record type %d", type);
+	}
+
+	return true;
+}
+
+// Receive incoming data, datagram version. Encrypted records are decrypted in place.
+bool sptps_receive_datagram(sptps_t *s, void *vdata, size_t len) {
+	uint8_t *data = vdata;
+
+	if(!s->state) {
+		return error(s, EIO, "Invalid session state zero");
+	}
+
+	if(!s->datagram) {
+		return error(s, EINVAL, "Not a datagram session");
+	}
+
 	if(len < (s->instate ? 21 : 5)) {
 		return error(s, EIO, "Received short packet");
 	}
@@ -561,43 +667,40 @@ static bool sptps_receive_data_datagram(sptps_t *s, const uint8_t *data, size_t
 
 	// Decrypt
 
-	uint8_t *buffer = alloca(len);
 	size_t outlen;
 
-	if(!chacha_poly1305_decrypt(s->incipher, seqno, data, len, buffer, &outlen)) {
+	if(!chacha_poly1305_decrypt(s->incipher, seqno, data, len, data, &outlen)) {
 		return error(s, EIO, "Failed to decrypt and verify packet");
 	}
 
-	if(!sptps_check_seqno(s, seqno, true)) {
+	return receive_datagram_record(s, seqno, data, outlen);
+}
+
+// Decrypt and verify an encrypted datagram in place. The cipher must be a private copy
+// of the session's incoming cipher, so this can be called from any thread.
+bool sptps_open_datagram(chacha_poly1305_ctx_t *cipher, uint8_t *buffer, size_t len, size_t *outlen) {
+	if(len < 21) {
 		return false;
 	}
 
-	// Append a NULL byte for safety.
-	buffer[outlen] = 0;
-
-	data = buffer;
-	len = outlen;
-
-	uint8_t type = *(data++);
-	len--;
+	uint32_t seqno;
+	memcpy(&seqno, buffer, 4);
+	return chacha_poly1305_decrypt(cipher, ntohl(seqno), buffer + 4, len - 4, buffer + 4, outlen);
+}
 
-	if(type < SPTPS_HANDSHAKE) {
-		if(!s->instate) {
-			return error(s, EIO, "Application record received before handshake finished");
-		}
+// Receive a datagram that was processed by sptps_open_datagram().
+bool sptps_receive_opened_datagram(sptps_t *s, bool verified, uint8_t *buffer, size_t outlen) {
+	if(!s->state || !s->instate) {
+		return error(s, EIO, "Invalid session state");
+	}
 
-		if(!s->receive_record(s->handle, type, data, len)) {
-			return false;
-		}
-	} else if(type == SPTPS_HANDSHAKE) {
-		if(!receive_handshake(s, data, len)) {
-			return false;
-		}
-	} else {
-		return error(s, EIO, "Invalid record type %d", type);
+	if(!verified) {
+		return error(s, EIO, "Failed to decrypt and verify packet");
 	}
 
-	return true;
+	uint32_t seqno;
+	memcpy(&seqno, buffer, 4);
+	return receive_datagram_record(s, ntohl(seqno), buffer + 4, outlen);
 }
 
 // Receive incoming data. Check if it contains a complete record, if so, handle it.
@@ -610,7 +713,9 @@ size_t sptps_receive_data(sptps_t *s, const void *vdata, size_t len) {
 	}
 
 	if(s->datagram) {
-		return sptps_receive_data_datagram(s, data, len) ? len : false;
+		uint8_t *buffer = alloca(len);
+		memcpy(buffer, data, len);
+		return sptps_receive_datagram(s, buffer, len) ? len : false;
 	}
 
 	// First read the 2 length bytes.
@@ -86,7 +86,7 @@ typedef struct sptps {
 
 	bool outstate;
 	chacha_poly1305_ctx_t *outcipher;
-	uint32_t outseqno;
+	uint32_t outseqno;              // Only changed atomically in datagram sessions
 
 	ecdsa_t *mykey;
 	ecdsa_t *hiskey;
@@ -111,7 +111,17 @@ extern bool sptps_start(sptps_t *s, void *handle, bool initiator, bool datagram,
 extern bool sptps_stop(sptps_t *s);
 extern bool sptps_send_record(sptps_t *s, uint8_t type, const void *data, uint16_t len);
 extern size_t sptps_receive_data(sptps_t *s, const void *data, size_t len);
+extern bool sptps_receive_datagram(sptps_t *s, void *data, size_t len);
 extern bool sptps_force_kex(sptps_t *s);
 extern bool sptps_verify_datagram(sptps_t *s, const void *data, size_t len);
+extern bool sptps_seal_record(sptps_t *s, uint8_t type, uint8_t *data, uint16_t len, uint8_t *out);
+
+// Split datagram processing, which allows the cipher work to be done outside of the
+// thread that owns the session. Buffers must have room for len + 21 bytes.
+extern bool sptps_prepare_datagram(sptps_t *s, uint8_t type, const void *data, uint16_t len, uint8_t *buffer);
+extern void sptps_seal_datagram(chacha_poly1305_ctx_t *cipher, uint8_t *buffer, uint16_t len);
+extern bool sptps_open_datagram(chacha_poly1305_ctx_t *cipher, uint8_t *buffer, size_t len, size_t *outlen);
+extern void sptps_seal_record_with(chacha_poly1305_ctx_t *cipher, uint32_t seqno, uint8_t type, uint8_t *data, uint16_t len, uint8_t *out);
+extern bool sptps_receive_opened_datagram(sptps_t *s, bool verified, uint8_t *buffer, size_t outlen);
 
 #endif
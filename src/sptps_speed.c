@@ -22,6 +22,8 @@
 
 #include <poll.h>
 
+#include "chacha-poly1305/chacha-poly1305.h"
+#include "chacha-poly1305/kernel.h"
 #include "crypto.h"
 #include "ecdh.h"
 #include "ecdsa.h"
@@ -105,6 +107,72 @@ static bool clock_countto(double seconds) {
 	return false;
 }
 
+static void print_bitrate(void) {
+	if(rate > 1e9) {
+		fprintf(stderr, "%7.2lf Gbit/s\n", rate / 1e9);
+	} else if(rate > 1e6) {
+		fprintf(stderr, "%7.2lf Mbit/s\n", rate / 1e6);
+	} else {
+		fprintf(stderr, "%7.2lf kbit/s\n", rate / 1e3);
+	}
+}
+
+// Compare the single pass ChaCha20-Poly1305 implementation with the two pass one
+static int run_aead_benchmark(int argc, char *argv[]) {
+	static const size_t sizes[] = {64, 512, 1400, 9000};
+	static uint8_t key[CHACHA_POLY1305_KEYLEN], plain[9000], sealed[9000 + 16], opened[9000];
+	double duration = argc > 1 ? atof(argv[1]) : 10;
+
+	randomize(key, sizeof(key));
+	randomize(plain, sizeof(plain));
+
+	chacha_poly1305_ctx_t *cipher = chacha_poly1305_init();
+	chacha_poly1305_set_key(cipher, key);
+
+	fprintf(stderr, "Using the %s ChaCha20-Poly1305 implementation\n", chacha_poly1305_get_kernel());
+
+	for(size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+		size_t len = sizes[i];
+
+		for(int fused = 1; fused >= 0; fused--) {
+			const char *name = fused ? "single pass" : "two pass";
+
+			fprintf(stderr, "Encrypt %4zu bytes, %-11s for %lg seconds: ", len, name, duration);
+
+			for(clock_start(); clock_countto(duration);) {
+				if(fused) {
+					chacha_poly1305_encrypt(cipher, count, plain, len, sealed, NULL);
+				} else {
+					chacha_poly1305_encrypt_twopass(cipher, count, plain, len, sealed, NULL);
+				}
+			}
+
+			rate *= len * 8;
+			print_bitrate();
+
+			chacha_poly1305_encrypt(cipher, 0, plain, len, sealed, NULL);
+
+			fprintf(stderr, "Decrypt %4zu bytes, %-11s for %lg seconds: ", len, name, duration);
+
+			for(clock_start(); clock_countto(duration);) {
+				bool ok = fused
+				          ? chacha_poly1305_decrypt(cipher, 0, sealed, len + 16, opened, NULL)
+				          : chacha_poly1305_decrypt_twopass(cipher, 0, sealed, len + 16, opened, NULL);
+
+				if(!ok) {
+					abort();
+				}
+			}
+
+			rate *= len * 8;
+			print_bitrate();
+		}
+	}
+
+	chacha_poly1305_exit(cipher);
+	return 0;
+}
+
 static int run_benchmark(int argc, char *argv[]) {
 	ecdsa_t *key1, *key2;
 	ecdh_t *ecdh1, *ecdh2;
@@ -309,6 +377,30 @@ static int run_benchmark(int argc, char *argv[]) {
 	sptps_stop(&sptps1);
 	sptps_stop(&sptps2);
 
+	// Raw cipher throughput of each ChaCha20-Poly1305 implementation this CPU supports
+
+	for(const chacha_poly1305_kernel_t *const *k = chacha_poly1305_kernels; *k; k++) {
+		if(!(*k)->supported() || !chacha_poly1305_set_kernel((*k)->name)) {
+			continue;
+		}
+
+		chacha_poly1305_ctx_t *cipher = chacha_poly1305_init();
+		chacha_poly1305_set_key(cipher, buf2);
+
+		fprintf(stderr, "ChaCha20-Poly1305/%-9s for %lg seconds: ", (*k)->name, duration);
+
+		for(clock_start(); clock_countto(duration);) {
+			chacha_poly1305_encrypt(cipher, count, buf1, 1451, buf3, NULL);
+		}
+
+		rate *= 1451 * 8;
+		print_bitrate();
+
+		chacha_poly1305_exit(cipher);
+	}
+
+	chacha_poly1305_set_kernel(NULL);
+
 	// Clean up
 
 	close(fd[0]);
@@ -323,7 +415,13 @@ int main(int argc, char *argv[]) {
 	random_init();
 	crypto_init();
 
-	int result = run_benchmark(argc, argv);
+	int result;
+
+	if(argc > 1 && !strcmp(argv[1], "aead")) {
+		result = run_aead_benchmark(argc - 1, argv + 1);
+	} else {
+		result = run_benchmark(argc, argv);
+	}
 
 	random_exit();
 
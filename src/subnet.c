@@ -28,8 +28,10 @@
 #include "net.h"
 #include "netutl.h"
 #include "node.h"
+#include "route.h"
 #include "script.h"
 #include "subnet.h"
+#include "subnet_trie.h"
 #include "xalloc.h"
 #include "sandbox.h"
 
@@ -40,6 +42,10 @@ splay_tree_t subnet_tree = {
 	.delete = (splay_action_t) free_subnet,
 };
 
+/* Longest prefix match tries, kept in sync with subnet_tree */
+static subnet_trie_t ipv4_trie = {.bits = 32};
+static subnet_trie_t ipv6_trie = {.bits = 128};
+
 /* Subnet lookup cache */
 
 static uint32_t wrapping_add32(uint32_t a, uint32_t b) {
@@ -69,7 +75,7 @@ static uint32_t hash_function_ipv4_t(const ipv4_t *p) {
 #else
 	// ensure that we have a /24 with no collisions on 32bit
 	return hash ^ ntohs(halfwidth[0]);
-#endif // _____LP64_____
+#endif // SUBNET_HASH_SIZE >= 0x10000
 #else
 	// 10.0.x.x/16 part
 	hash = wrapping_add32(hash, wrapping_mul32(halfwidth[0], 0x9e370001U));
@@ -137,8 +143,12 @@ void init_subnets(void) {
 }
 
 void exit_subnets(void) {
+	subnet_trie_clear(&ipv4_trie);
+	subnet_trie_clear(&ipv6_trie);
 	splay_empty_tree(&subnet_tree);
-	subnet_cache_flush_tables();
+	hash_free(ipv4_t, &ipv4_cache);
+	hash_free(ipv6_t, &ipv6_cache);
+	hash_free(mac_t, &mac_cache);
 }
 
 void init_subnet_tree(splay_tree_t *tree) {
@@ -163,6 +173,13 @@ void subnet_cache_flush_tables(void) {
 	hash_clear(mac_t, &mac_cache);
 }
 
+void subnet_cache_stats(hash_stats_t *stats) {
+	memset(stats, 0, sizeof(*stats));
+	hash_stats(ipv4_t, &ipv4_cache, stats);
+	hash_stats(ipv6_t, &ipv6_cache, stats);
+	hash_stats(mac_t, &mac_cache, stats);
+}
+
 static void subnet_cache_flush(subnet_t *subnet) {
 	switch(subnet->type) {
 	case SUBNET_IPV4:
@@ -191,16 +208,48 @@ static void subnet_cache_flush(subnet_t *subnet) {
 
 /* Adding and removing subnets */
 
+static void subnet_trie_update(subnet_t *subnet, bool add) {
+	subnet_trie_t *trie;
+	const void *address;
+	size_t prefixlength;
+
+	switch(subnet->type) {
+	case SUBNET_IPV4:
+		trie = &ipv4_trie;
+		address = &subnet->net.ipv4.address;
+		prefixlength = subnet->net.ipv4.prefixlength;
+		break;
+
+	case SUBNET_IPV6:
+		trie = &ipv6_trie;
+		address = &subnet->net.ipv6.address;
+		prefixlength = subnet->net.ipv6.prefixlength;
+		break;
+
+	case SUBNET_MAC:
+	default:
+		return;
+	}
+
+	if(add) {
+		subnet_trie_add(trie, address, prefixlength, subnet);
+	} else {
+		subnet_trie_del(trie, address, prefixlength, subnet);
+	}
+}
+
 void subnet_add(node_t *n, subnet_t *subnet) {
 	subnet->owner = n;
 
 	splay_insert(&subnet_tree, subnet);
+	subnet_trie_update(subnet, true);
 
 	if(n) {
 		splay_insert(&n->subnet_tree, subnet);
 	}
 
 	subnet_cache_flush(subnet);
+	route_cache_flush();
 }
 
 void subnet_del(node_t *n, subnet_t *subnet) {
@@ -208,9 +257,10 @@ void subnet_del(node_t *n, subnet_t *subnet) {
 		splay_delete(&n->subnet_tree, subnet);
 	}
 
-	splay_delete(&subnet_tree, subnet);
-
+	subnet_trie_update(subnet, false);
 	subnet_cache_flush(subnet);
+	route_cache_flush();
+	splay_delete(&subnet_tree, subnet);
 }
 
 /* Subnet lookup routines */
@@ -221,11 +271,12 @@ subnet_t *lookup_subnet(node_t *owner, const subnet_t *subnet) {
 
 subnet_t *lookup_subnet_mac(const node_t *owner, const mac_t *address) {
 	subnet_t *r = NULL;
+	void *cached;
 
 	// Check if this address is cached
 
-	if((r = hash_search(mac_t, &mac_cache, address))) {
-		return r;
+	if(hash_search(mac_t, &mac_cache, address, &cached)) {
+		return cached;
 	}
 
 	// Search all subnets for a matching one
@@ -244,9 +295,10 @@ subnet_t *lookup_subnet_mac(const node_t *owner, const mac_t *address) {
 		}
 	}
 
-	// Cache the result
+	// Cache the result. A miss in the subnets of a single owner
+	// says nothing about the others, so only cache those if searching all subnets.
 
-	if(r) {
+	if(r || !owner) {
 		hash_insert(mac_t, &mac_cache, address, r);
 	}
 
@@ -254,69 +306,41 @@ subnet_t *lookup_subnet_mac(const node_t *owner, const mac_t *address) {
 }
 
 subnet_t *lookup_subnet_ipv4(const ipv4_t *address) {
-	subnet_t *r = NULL;
+	void *cached;
 
 	// Check if this address is cached
 
-	if((r = hash_search(ipv4_t, &ipv4_cache, address))) {
-		return r;
+	if(hash_search(ipv4_t, &ipv4_cache, address, &cached)) {
+		return cached;
 	}
 
-	// Search all subnets for a matching one
+	// Find the longest matching prefix
 
-	for splay_each(subnet_t, p, &subnet_tree) {
-		if(!p || p->type != SUBNET_IPV4) {
-			continue;
-		}
-
-		if(!maskcmp(address, &p->net.ipv4.address, p->net.ipv4.prefixlength)) {
-			r = p;
-
-			if(!p->owner || p->owner->status.reachable) {
-				break;
-			}
-		}
-	}
+	subnet_t *r = subnet_trie_lookup(&ipv4_trie, address);
 
-	// Cache the result
+	// Cache the result, also if nothing matched
 
-	if(r) {
-		hash_insert(ipv4_t, &ipv4_cache, address, r);
-	}
+	hash_insert(ipv4_t, &ipv4_cache, address, r);
 
 	return r;
 }
 
 subnet_t *lookup_subnet_ipv6(const ipv6_t *address) {
-	subnet_t *r = NULL;
+	void *cached;
 
 	// Check if this address is cached
 
-	if((r = hash_search(ipv6_t, &ipv6_cache, address))) {
-		return r;
+	if(hash_search(ipv6_t, &ipv6_cache, address, &cached)) {
+		return cached;
 	}
 
-	// Search all subnets for a matching one
-
-	for splay_each(subnet_t, p, &subnet_tree) {
-		if(!p || p->type != SUBNET_IPV6) {
-			continue;
-		}
-
-		if(!maskcmp(address, &p->net.ipv6.address, p->net.ipv6.prefixlength)) {
-			r = p;
+	// Find the longest matching prefix
 
-			if(!p->owner || p->owner->status.reachable) {
-				break;
-			}
-		}
-	}
+	subnet_t *r = subnet_trie_lookup(&ipv6_trie, address);
 
-	// Cache the result
+	// Cache the result, also if nothing matched
 
-	if(r) {
-		hash_insert(ipv6_t, &ipv6_cache, address, r);
-	}
+	hash_insert(ipv6_t, &ipv6_cache, address, r);
 
 	return r;
 }
@@ -21,6 +21,7 @@
     51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
+#include "hash.h"
 #include "net.h"
 #include "node.h"
 
@@ -63,6 +64,7 @@ typedef struct subnet_t {
 #define MAXNETSTR 64
 
 extern splay_tree_t subnet_tree;
+extern uint32_t hash_seed;
 
 extern int subnet_compare(const struct subnet_t *a, const struct subnet_t *b);
 extern void free_subnet(subnet_t *subnet);
@@ -87,5 +89,6 @@ extern subnet_t *lookup_subnet_ipv6(const ipv6_t *address);
 extern bool dump_subnets(struct connection_t *c);
 extern void subnet_cache_flush_tables(void);
 extern void subnet_cache_flush_table(subnet_type_t ipver);
+extern void subnet_cache_stats(hash_stats_t *stats);
 
 #endif
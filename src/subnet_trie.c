@@ -0,0 +1,185 @@
+#include "system.h"
+
+#include "connection.h"
+#include "node.h"
+#include "splay_tree.h"
+#include "subnet.h"
+#include "subnet_trie.h"
+#include "xalloc.h"
+
+struct subnet_trie_node_t {
+	subnet_trie_node_t *child[2];
+	size_t prefixlength;
+	uint8_t key[16];        // Only the first prefixlength bits are significant
+	splay_tree_t subnets;   // Subnets with exactly this prefix, empty if this node only branches
+};
+
+static int bit(const uint8_t *key, size_t i) {
+	return (key[i / 8] >> (7 - i % 8)) & 1;
+}
+
+// Number of leading bits a and b have in common, up to max.
+static size_t common_bits(const uint8_t *a, const uint8_t *b, size_t max) {
+	size_t i = 0;
+
+	while(i + 8 <= max && a[i / 8] == b[i / 8]) {
+		i += 8;
+	}
+
+	while(i < max && bit(a, i) == bit(b, i)) {
+		i++;
+	}
+
+	return i;
+}
+
+static subnet_trie_node_t *new_trie_node(subnet_trie_t *trie, const uint8_t *key, size_t prefixlength) {
+	subnet_trie_node_t *node = xzalloc(sizeof(*node));
+	node->prefixlength = prefixlength;
+	memcpy(node->key, key, trie->bits / 8);
+	init_subnet_tree(&node->subnets);
+	trie->nodes++;
+	return node;
+}
+
+static void free_trie_node(subnet_trie_t *trie, subnet_trie_node_t *node) {
+	splay_empty_tree(&node->subnets);
+	free(node);
+	trie->nodes--;
+}
+
+// Find the node for the given prefix, creating it and any branch node needed to attach it.
+static subnet_trie_node_t *get_trie_node(subnet_trie_t *trie, const uint8_t *key, size_t prefixlength) {
+	subnet_trie_node_t **link = &trie->root;
+
+	while(*link) {
+		subnet_trie_node_t *node = *link;
+		size_t common = common_bits(key, node->key, prefixlength < node->prefixlength ? prefixlength : node->prefixlength);
+
+		if(common < node->prefixlength) {
+			// The new prefix diverges from this node, or is a prefix of it.
+			subnet_trie_node_t *parent = new_trie_node(trie, key, common);
+			parent->child[bit(node->key, common)] = node;
+			*link = parent;
+
+			if(common == prefixlength) {
+				return parent;
+			}
+
+			subnet_trie_node_t *leaf = new_trie_node(trie, key, prefixlength);
+			parent->child[bit(key, common)] = leaf;
+			return leaf;
+		}
+
+		if(node->prefixlength == prefixlength) {
+			return node;
+		}
+
+		link = &node->child[bit(key, node->prefixlength)];
+	}
+
+	*link = new_trie_node(trie, key, prefixlength);
+	return *link;
+}
+
+void subnet_trie_add(subnet_trie_t *trie, const void *address, size_t prefixlength, subnet_t *subnet) {
+	subnet_trie_node_t *node = get_trie_node(trie, address, prefixlength);
+	splay_insert(&node->subnets, subnet);
+}
+
+// Remove a node that has no subnets left, if it does not need to branch anymore.
+static void prune_trie_node(subnet_trie_t *trie, subnet_trie_node_t **link) {
+	subnet_trie_node_t *node = *link;
+
+	if(node->subnets.head || (node->child[0] && node->child[1])) {
+		return;
+	}
+
+	*link = node->child[0] ? node->child[0] : node->child[1];
+	free_trie_node(trie, node);
+}
+
+void subnet_trie_del(subnet_trie_t *trie, const void *address, size_t prefixlength, subnet_t *subnet) {
+	const uint8_t *key = address;
+	subnet_trie_node_t **parent = NULL;
+	subnet_trie_node_t **link = &trie->root;
+
+	while(*link) {
+		subnet_trie_node_t *node = *link;
+
+		if(node->prefixlength > prefixlength || common_bits(key, node->key, node->prefixlength) < node->prefixlength) {
+			return;
+		}
+
+		if(node->prefixlength == prefixlength) {
+			splay_delete(&node->subnets, subnet);
+			prune_trie_node(trie, link);
+
+			// The parent might now be a branch node with only one child left
+			if(parent) {
+				prune_trie_node(trie, parent);
+			}
+
+			return;
+		}
+
+		parent = link;
+		link = &node->child[bit(key, node->prefixlength)];
+	}
+}
+
+static void clear_trie_node(subnet_trie_t *trie, subnet_trie_node_t *node) {
+	if(!node) {
+		return;
+	}
+
+	clear_trie_node(trie, node->child[0]);
+	clear_trie_node(trie, node->child[1]);
+	free_trie_node(trie, node);
+}
+
+void subnet_trie_clear(subnet_trie_t *trie) {
+	clear_trie_node(trie, trie->root);
+	trie->root = NULL;
+}
+
+subnet_t *subnet_trie_lookup(const subnet_trie_t *trie, const void *address) {
+	const uint8_t *key = address;
+	const subnet_trie_node_t *matches[129];
+	size_t count = 0;
+
+	// Collect all nodes with a matching prefix, from short to long
+
+	for(const subnet_trie_node_t *node = trie->root; node;) {
+		if(maskcmp(key, node->key, node->prefixlength)) {
+			break;
+		}
+
+		if(node->subnets.head) {
+			matches[count++] = node;
+		}
+
+		if(node->prefixlength >= trie->bits) {
+			break;
+		}
+
+		node = node->child[bit(key, node->prefixlength)];
+	}
+
+	// Prefer the longest prefix with a reachable owner, otherwise fall back
+	// to the last matching subnet in the order of subnet_tree.
+
+	subnet_t *r = NULL;
+
+	while(count--) {
+		for splay_each(subnet_t, p, &matches[count]->subnets) {
+			r = p;
+
+			if(!p->owner || p->owner->status.reachable) {
+				return r;
+			}
+		}
+	}
+
+	return r;
+}
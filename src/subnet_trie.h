@@ -0,0 +1,29 @@
+#ifndef TINC_SUBNET_TRIE_H
+#define TINC_SUBNET_TRIE_H
+
+#include "system.h"
+
+#include "subnet.h"
+
+// Path-compressed binary trie used for longest-prefix-match lookups of IPv4 and IPv6 subnets.
+// Each node holds the subnets that have exactly its prefix, in the same order as subnet_tree,
+// so lookups return the same subnet as a linear scan of subnet_tree would.
+
+typedef struct subnet_trie_node_t subnet_trie_node_t;
+
+typedef struct subnet_trie_t {
+	subnet_trie_node_t *root;
+	size_t bits;            // Length of the addresses stored in this trie
+	size_t nodes;           // Number of nodes, including those that only branch
+} subnet_trie_t;
+
+extern void subnet_trie_add(subnet_trie_t *trie, const void *address, size_t prefixlength, subnet_t *subnet);
+extern void subnet_trie_del(subnet_trie_t *trie, const void *address, size_t prefixlength, subnet_t *subnet);
+extern void subnet_trie_clear(subnet_trie_t *trie);
+
+// Find the subnet with the longest prefix matching address.
+// Subnets owned by unreachable nodes are skipped as long as there are other candidates,
+// just like lookup_subnet_ipv4() and lookup_subnet_ipv6() always did.
+extern subnet_t *subnet_trie_lookup(const subnet_trie_t *trie, const void *address);
+
+#endif
@@ -29,7 +29,7 @@
 # define strsignal(p) ""
 #endif
 
-#if _____LP64_____
+#ifdef __LP64__
 #define SUBNET_HASH_SIZE 0x10000
 #else
 #define SUBNET_HASH_SIZE 0x1000
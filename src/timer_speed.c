@@ -0,0 +1,156 @@
+// Compare the timing wheel used by the timeout functions with the splay tree it replaced,
+// for a workload where every node keeps rescheduling its own timer.
+
+#include "system.h"
+
+#include "splay_tree.h"
+#include "timer_wheel.h"
+#include "xalloc.h"
+
+static struct timespec start;
+static struct timespec end;
+static double elapsed;
+static double rate;
+static unsigned int count;
+
+static void clock_start(void) {
+	count = 0;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
+}
+
+static bool clock_countto(double seconds) {
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
+	elapsed = (double) end.tv_sec + (double) end.tv_nsec * 1e-9
+	          - (double) start.tv_sec - (double) start.tv_nsec * 1e-9;
+
+	if(elapsed < seconds) {
+		return ++count;
+	}
+
+	rate = count / elapsed;
+	return false;
+}
+
+typedef struct bench_timer_t {
+	wheel_node_t node;
+	struct timeval tv;
+	splay_node_t tree_node;
+} bench_timer_t;
+
+// The comparison function of the old timeout_tree
+
+static int timeout_compare(const bench_timer_t *a, const bench_timer_t *b) {
+	if(timercmp(&a->tv, &b->tv, <)) {
+		return -1;
+	}
+
+	if(timercmp(&a->tv, &b->tv, >)) {
+		return 1;
+	}
+
+	uintptr_t ap = (uintptr_t)a;
+	uintptr_t bp = (uintptr_t)b;
+	return ap < bp ? -1 : ap > bp ? 1 : 0;
+}
+
+// Each round reschedules this many timers by up to ten seconds, then lets one millisecond pass
+#define RESCHEDULES 64
+
+static struct timeval delay[RESCHEDULES];
+
+static void print_rate(const char *name, size_t timers, double duration) {
+	fprintf(stderr, "%-12s %6zu timers for %lg seconds: %7.2lf ns/reschedule\n", name, timers, duration, 1e9 / (rate * RESCHEDULES));
+}
+
+static void run_benchmark(size_t timers, double duration) {
+	bench_timer_t *list = xzalloc(timers * sizeof(*list));
+	struct timeval now = {1000000, 0};
+	size_t next = 0;
+
+	// Splay tree, exactly like timeout_set() and timeout_execute() used it
+
+	splay_tree_t tree = {.compare = (splay_compare_t) timeout_compare};
+
+	for(size_t i = 0; i < timers; i++) {
+		list[i].tree_node.data = &list[i];
+		timeradd(&now, &delay[i % RESCHEDULES], &list[i].tv);
+		splay_insert_node(&tree, &list[i].tree_node);
+	}
+
+	for(clock_start(); clock_countto(duration);) {
+		for(size_t i = 0; i < RESCHEDULES; i++) {
+			bench_timer_t *timer = &list[next++ % timers];
+			splay_unlink_node(&tree, &timer->tree_node);
+			timeradd(&now, &delay[i], &timer->tv);
+			splay_insert_node(&tree, &timer->tree_node);
+		}
+
+		now.tv_usec += 1000;
+
+		if(now.tv_usec >= 1000000) {
+			now.tv_sec++;
+			now.tv_usec -= 1000000;
+		}
+
+		while(tree.head) {
+			bench_timer_t *timer = tree.head->data;
+
+			if(!timercmp(&timer->tv, &now, <)) {
+				break;
+			}
+
+			splay_unlink_node(&tree, &timer->tree_node);
+			timeradd(&now, &delay[next % RESCHEDULES], &timer->tv);
+			splay_insert_node(&tree, &timer->tree_node);
+		}
+	}
+
+	print_rate("splay tree", timers, duration);
+
+	// Timing wheel with millisecond ticks
+
+	timer_wheel_t wheel = {.now = 1000000000};
+	uint64_t tick = wheel.now;
+
+	for(size_t i = 0; i < timers; i++) {
+		const struct timeval *d = &delay[i % RESCHEDULES];
+		wheel_add(&wheel, &list[i].node, tick + (uint64_t)d->tv_sec * 1000 + (uint64_t)d->tv_usec / 1000);
+	}
+
+	for(clock_start(); clock_countto(duration);) {
+		for(size_t i = 0; i < RESCHEDULES; i++) {
+			bench_timer_t *timer = &list[next++ % timers];
+			wheel_del(&wheel, &timer->node);
+			wheel_add(&wheel, &timer->node, tick + (uint64_t)delay[i].tv_sec * 1000 + (uint64_t)delay[i].tv_usec / 1000);
+		}
+
+		wheel_advance(&wheel, ++tick);
+
+		for(wheel_node_t *node; (node = wheel_pop_expired(&wheel));) {
+			const struct timeval *d = &delay[next % RESCHEDULES];
+			wheel_add(&wheel, node, tick + (uint64_t)d->tv_sec * 1000 + (uint64_t)d->tv_usec / 1000);
+		}
+	}
+
+	print_rate("timing wheel", timers, duration);
+
+	free(list);
+}
+
+int main(int argc, char *argv[]) {
+	static const size_t sizes[] = {100, 1000, 10000, 100000};
+	double duration = argc > 1 ? atof(argv[1]) : 1;
+
+	srand(1);
+
+	for(size_t i = 0; i < RESCHEDULES; i++) {
+		delay[i].tv_sec = rand() % 10;
+		delay[i].tv_usec = 1000 + rand() % 999000;
+	}
+
+	for(size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+		run_benchmark(sizes[i], duration);
+	}
+
+	return 0;
+}
@@ -0,0 +1,226 @@
+#include "system.h"
+
+#include "timer_wheel.h"
+
+#define WHEEL_RANGE_BITS (WHEEL_BITS * WHEEL_LEVELS)
+
+static inline unsigned int lowest_bit(uint64_t x) {
+#ifdef __GNUC__
+	return (unsigned int)__builtin_ctzll(x);
+#else
+	unsigned int bit = 0;
+
+	while(!(x & 1)) {
+		x >>= 1;
+		bit++;
+	}
+
+	return bit;
+#endif
+}
+
+static inline unsigned int slot_index(uint64_t tick, unsigned int level) {
+	return (tick >> (level * WHEEL_BITS)) & (WHEEL_SLOTS - 1);
+}
+
+static void list_insert(wheel_node_t **head, wheel_node_t *node) {
+	node->next = *head;
+
+	if(node->next) {
+		node->next->pprev = &node->next;
+	}
+
+	node->pprev = head;
+	*head = node;
+}
+
+static void append_expired(timer_wheel_t *wheel, wheel_node_t *node) {
+	wheel_node_t **tail = wheel->expired ? wheel->expired_tail : &wheel->expired;
+
+	node->next = NULL;
+	node->pprev = tail;
+	*tail = node;
+	wheel->expired_tail = &node->next;
+}
+
+// Put a timer in the right place relative to the current time
+static void place(timer_wheel_t *wheel, wheel_node_t *node) {
+	if(node->expires <= wheel->now) {
+		append_expired(wheel, node);
+		return;
+	}
+
+	uint64_t diff = (node->expires ^ wheel->now) >> WHEEL_BITS;
+	unsigned int level = 0;
+
+	while(diff && level < WHEEL_LEVELS) {
+		diff >>= WHEEL_BITS;
+		level++;
+	}
+
+	if(level == WHEEL_LEVELS) {
+		list_insert(&wheel->far, node);
+		return;
+	}
+
+	unsigned int slot = slot_index(node->expires, level);
+	list_insert(&wheel->slots[level][slot], node);
+	wheel->occupied[level] |= (uint64_t)1 << slot;
+}
+
+void wheel_add(timer_wheel_t *wheel, wheel_node_t *node, uint64_t expires) {
+	node->expires = expires;
+	wheel->count++;
+	place(wheel, node);
+}
+
+void wheel_del(timer_wheel_t *wheel, wheel_node_t *node) {
+	if(wheel->expired && wheel->expired_tail == &node->next) {
+		wheel->expired_tail = node->pprev;
+	}
+
+	*node->pprev = node->next;
+
+	if(node->next) {
+		node->next->pprev = node->pprev;
+	}
+
+	node->next = NULL;
+	node->pprev = NULL;
+	wheel->count--;
+
+	// Clear the bit in the occupied bitmap if this emptied a slot
+	for(unsigned int level = 0; level < WHEEL_LEVELS; level++) {
+		unsigned int slot = slot_index(node->expires, level);
+
+		if(!wheel->slots[level][slot]) {
+			wheel->occupied[level] &= ~((uint64_t)1 << slot);
+		}
+	}
+}
+
+wheel_node_t *wheel_pop_expired(timer_wheel_t *wheel) {
+	wheel_node_t *node = wheel->expired;
+
+	if(node) {
+		wheel_del(wheel, node);
+	}
+
+	return node;
+}
+
+// Move all the timers in a slot to where they belong now
+static void cascade(timer_wheel_t *wheel, wheel_node_t **head) {
+	wheel_node_t *node = *head;
+	*head = NULL;
+
+	while(node) {
+		wheel_node_t *next = node->next;
+		place(wheel, node);
+		node = next;
+	}
+}
+
+// The first tick after the current one at which a slot has to be emptied
+static bool next_event(const timer_wheel_t *wheel, uint64_t *tick) {
+	for(unsigned int level = 0; level < WHEEL_LEVELS; level++) {
+		if(wheel->occupied[level]) {
+			unsigned int shift = level * WHEEL_BITS;
+			uint64_t base = wheel->now >> (shift + WHEEL_BITS) << (shift + WHEEL_BITS);
+			*tick = base | (uint64_t)lowest_bit(wheel->occupied[level]) << shift;
+			return true;
+		}
+	}
+
+	if(wheel->far) {
+		*tick = ((wheel->now >> WHEEL_RANGE_BITS) + 1) << WHEEL_RANGE_BITS;
+		return true;
+	}
+
+	return false;
+}
+
+// Place all timers again relative to an earlier time, after the clock went backwards
+static void rebase(timer_wheel_t *wheel, uint64_t now) {
+	wheel_node_t *expired = wheel->expired;
+	wheel->expired = NULL;
+	wheel->now = now;
+
+	cascade(wheel, &expired);
+	cascade(wheel, &wheel->far);
+
+	for(unsigned int level = 0; level < WHEEL_LEVELS; level++) {
+		uint64_t occupied = wheel->occupied[level];
+		wheel->occupied[level] = 0;
+
+		for(unsigned int slot = 0; slot < WHEEL_SLOTS; slot++) {
+			if(occupied & ((uint64_t)1 << slot)) {
+				cascade(wheel, &wheel->slots[level][slot]);
+			}
+		}
+	}
+}
+
+void wheel_advance(timer_wheel_t *wheel, uint64_t now) {
+	if(now < wheel->now) {
+		rebase(wheel, now);
+		return;
+	}
+
+	while(wheel->now < now) {
+		uint64_t tick;
+
+		// Nothing happens in between, so skip ahead
+		if(!next_event(wheel, &tick) || tick > now) {
+			wheel->now = now;
+			return;
+		}
+
+		wheel->now = tick;
+
+		if(!(tick & (((uint64_t)1 << WHEEL_RANGE_BITS) - 1))) {
+			cascade(wheel, &wheel->far);
+		}
+
+		for(unsigned int level = WHEEL_LEVELS; level--;) {
+			if(tick & (((uint64_t)1 << (level * WHEEL_BITS)) - 1)) {
+				continue;
+			}
+
+			unsigned int slot = slot_index(tick, level);
+			wheel->occupied[level] &= ~((uint64_t)1 << slot);
+			cascade(wheel, &wheel->slots[level][slot]);
+		}
+	}
+}
+
+bool wheel_next_expiry(const timer_wheel_t *wheel, uint64_t *expires) {
+	if(wheel->expired) {
+		*expires = wheel->expired->expires;
+		return true;
+	}
+
+	// The earliest timer is in the first occupied slot of the lowest occupied level
+	const wheel_node_t *list = wheel->far;
+
+	for(unsigned int level = 0; level < WHEEL_LEVELS; level++) {
+		if(wheel->occupied[level]) {
+			list = wheel->slots[level][lowest_bit(wheel->occupied[level])];
+			break;
+		}
+	}
+
+	if(!list) {
+		return false;
+	}
+
+	*expires = list->expires;
+
+	for(const wheel_node_t *node = list->next; node; node = node->next) {
+		if(node->expires < *expires) {
+			*expires = node->expires;
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,52 @@
+#ifndef TINC_TIMER_WHEEL_H
+#define TINC_TIMER_WHEEL_H
+
+#include "system.h"
+
+// Hierarchical timing wheel. Time is counted in ticks; each level has WHEEL_SLOTS
+// slots, and a slot at level L covers WHEEL_SLOTS^L ticks. A timer is kept at the level
+// of the highest WHEEL_BITS-bit group in which its expiry time differs from the current
+// time, so adding and removing timers takes constant time. When the current time
+// reaches the start of a slot at a higher level, its timers are moved to lower levels.
+// Timers further away than the wheel covers wait in a separate list.
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 5
+
+typedef struct wheel_node_t {
+	struct wheel_node_t *next;
+	struct wheel_node_t **pprev;            // NULL if the node is not in a wheel
+	uint64_t expires;
+} wheel_node_t;
+
+typedef struct timer_wheel_t {
+	uint64_t now;                           // All timers in the slots expire after this tick
+	uint64_t occupied[WHEEL_LEVELS];        // Bitmap of non-empty slots
+	wheel_node_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+	wheel_node_t *far;                      // Timers beyond the range of the slots
+	wheel_node_t *expired;                  // Timers that are due, in the order they became due
+	wheel_node_t **expired_tail;
+	size_t count;                           // Number of timers, including expired ones
+} timer_wheel_t;
+
+static inline bool wheel_contains(const wheel_node_t *node) {
+	return node->pprev;
+}
+
+// Add a timer, it must not be in a wheel already.
+// If it expires at or before the current tick, it is put on the expired list right away.
+extern void wheel_add(timer_wheel_t *wheel, wheel_node_t *node, uint64_t expires);
+extern void wheel_del(timer_wheel_t *wheel, wheel_node_t *node);
+
+// Advance the current time, moving all timers that expire at or before it to the expired list.
+// If the time is earlier than the current time, all timers are placed again relative to it.
+extern void wheel_advance(timer_wheel_t *wheel, uint64_t now);
+
+// Remove and return the first expired timer, or NULL if there is none.
+extern wheel_node_t *wheel_pop_expired(timer_wheel_t *wheel);
+
+// Get the expiry time of the earliest timer. Returns false if there are no timers.
+extern bool wheel_next_expiry(const timer_wheel_t *wheel, uint64_t *expires);
+
+#endif
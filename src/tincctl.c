@@ -26,6 +26,8 @@
 
 #include "xalloc.h"
 #include "protocol.h"
+#include "bpf.h"
+#include "capture.h"
 #include "control_common.h"
 #include "crypto.h"
 #include "ecdsagen.h"
@@ -176,6 +178,7 @@ static void usage(bool status) {
 		        "    connections              - all meta connections with ourself\n"
 		        "    [di]graph                - graph of the VPN in dotty format\n"
 		        "    invitations              - outstanding invitations\n"
+		        "    stats                    - internal daemon statistics\n"
 		        "  info NODE|SUBNET|ADDRESS   Give information about a particular NODE, SUBNET or ADDRESS.\n"
 		        "  purge                      Purge unreachable nodes\n"
 		        "  debug N                    Set debug level\n"
@@ -184,7 +187,9 @@ static void usage(bool status) {
 #ifdef HAVE_CURSES
 		        "  top                        Show real-time statistics\n"
 #endif
-		        "  pcap [snaplen]             Dump traffic in pcap format [up to snaplen bytes per packet]\n"
+		        "  pcap [snaplen [sample [filter]]]\n"
+		        "                             Dump traffic in pcap format [up to snaplen bytes per packet,\n"
+		        "                             one out of every sample packets, matching a tcpdump -ddd filter]\n"
 		        "  log [level]                Dump log output [up to the specified level]\n"
 		        "  export                     Export host configuration of local node to standard output\n"
 		        "  export-all                 Export all host configuration files to standard output\n"
@@ -578,10 +583,14 @@ bool sendline(int fd, const char *format, ...) {
 	return true;
 }
 
-static void pcap(int fd, FILE *out, uint32_t snaplen) {
-	sendline(fd, "%d %d %d", CONTROL, REQ_PCAP, snaplen);
-	char data[9018];
+typedef struct pcap_packet_t {
+	uint32_t tv_sec;
+	uint32_t tv_usec;
+	uint32_t len;
+	uint32_t origlen;
+} pcap_packet_t;
 
+static void pcap_header(FILE *out, uint32_t snaplen) {
 	struct {
 		uint32_t magic;
 		uint16_t major;
@@ -594,31 +603,197 @@ static void pcap(int fd, FILE *out, uint32_t snaplen) {
 		0xa1b2c3d4,
 		2, 4,
 		0, 0,
-		snaplen ? snaplen : sizeof(data),
+		snaplen,
 		1,
 	};
 
-	struct {
-		uint32_t tv_sec;
-		uint32_t tv_usec;
-		uint32_t len;
-		uint32_t origlen;
-	} packet;
+	fwrite(&header, sizeof(header), 1, out);
+	fflush(out);
+}
+
+#ifdef HAVE_CAPTURE_RING
+// Receive a line together with a file descriptor, leaving the line in the receive buffer
+static int recvfd(int fd) {
+	char cmsgbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = {
+		.iov_base = buffer + blen,
+		.iov_len = sizeof(buffer) - blen,
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cmsgbuf,
+		.msg_controllen = sizeof(cmsgbuf),
+	};
+
+	ssize_t nrecv;
+
+	do {
+		nrecv = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	} while(nrecv == -1 && errno == EINTR);
+
+	if(nrecv <= 0) {
+		return -1;
+	}
+
+	blen += nrecv;
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+	if(!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+		return -1;
+	}
+
+	int received;
+	memcpy(&received, CMSG_DATA(cmsg), sizeof(received));
+	return received;
+}
+
+// Read packets from a ring buffer shared with tincd. Returns false if tincd cannot provide one.
+static bool pcap_ring(int fd, FILE *out, uint32_t snaplen, uint32_t sample, const char *filter) {
+	// The reply must be the first thing we receive
+	if(blen || !sendline(fd, "%d %d %u %u %s", CONTROL, REQ_PCAP_RING, snaplen, sample, filter)) {
+		return false;
+	}
+
+	int ringfd = recvfd(fd);
+	char line[64];
+	int code, req, result;
+	unsigned long size;
+
+	if(!recvline(fd, line, sizeof(line)) || sscanf(line, "%d %d %d %lu", &code, &req, &result, &size) != 4 ||
+	                code != CONTROL || req != REQ_PCAP_RING || result || ringfd < 0) {
+		if(ringfd >= 0) {
+			close(ringfd);
+		}
+
+		return false;
+	}
+
+	size_t map_size = sizeof(capture_ring_t) + size;
+	capture_ring_t *ring = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ringfd, 0);
+	close(ringfd);
 
+	if(ring == MAP_FAILED) {
+		fprintf(stderr, "Could not map capture buffer: %s\n", strerror(errno));
+		return true;
+	}
+
+	if(ring->magic != CAPTURE_RING_MAGIC || ring->size != size || size % CAPTURE_RECORD_ALIGN) {
+		fprintf(stderr, "Invalid capture buffer received from tincd\n");
+		munmap(ring, map_size);
+		return true;
+	}
+
+	pcap_header(out, snaplen ? snaplen : MAXSIZE);
+
+	uint64_t tail = ring->tail;
+	uint64_t dropped = 0;
+
+	while(true) {
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+		if(head == tail) {
+			fflush(out);
+
+			// Ask tincd to send a line when new packets arrive, then check again to avoid missing a wakeup
+			__atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+
+			if(__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == tail && !recvline(fd, line, sizeof(line))) {
+				break;
+			}
+
+			continue;
+		}
+
+		while(tail != head) {
+			size_t offset = tail % size;
+			uint32_t rsize;
+			memcpy(&rsize, ring->data + offset, sizeof(rsize));
+
+			if(!rsize) {
+				tail += size - offset;
+				continue;
+			}
+
+			capture_record_t record;
+
+			if(rsize < sizeof(record) || rsize > size - offset) {
+				fprintf(stderr, "Invalid record in capture buffer\n");
+				munmap(ring, map_size);
+				return true;
+			}
+
+			memcpy(&record, ring->data + offset, sizeof(record));
+
+			if(record.caplen > rsize - sizeof(record)) {
+				fprintf(stderr, "Invalid record in capture buffer\n");
+				munmap(ring, map_size);
+				return true;
+			}
+
+			pcap_packet_t packet = {
+				.tv_sec = record.tv_sec,
+				.tv_usec = record.tv_usec,
+				.len = record.caplen,
+				.origlen = record.origlen,
+			};
+
+			fwrite(&packet, sizeof(packet), 1, out);
+			fwrite(ring->data + offset + sizeof(record), record.caplen, 1, out);
+			tail += rsize;
+		}
+
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+		uint64_t now_dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+
+		if(now_dropped != dropped) {
+			fprintf(stderr, "%"PRIu64" packets dropped because the capture buffer was full\n", now_dropped - dropped);
+			dropped = now_dropped;
+		}
+	}
+
+	munmap(ring, map_size);
+	return true;
+}
+#endif
+
+static void pcap(int fd, FILE *out, uint32_t snaplen, uint32_t sample, const char *filter) {
+#ifdef HAVE_CAPTURE_RING
+
+	if(pcap_ring(fd, out, snaplen, sample, filter)) {
+		return;
+	}
+
+#endif
+
+	if(!sendline(fd, "%d %d %u %u %s", CONTROL, REQ_PCAP, snaplen, sample, filter)) {
+		return;
+	}
+
+	char data[9018];
+	pcap_packet_t packet;
 	struct timeval tv;
 
-	fwrite(&header, sizeof(header), 1, out);
-	fflush(out);
+	pcap_header(out, snaplen ? snaplen : sizeof(data));
 
-	char line[32];
+	char line[64];
 
 	while(recvline(fd, line, sizeof(line))) {
 		int code, req;
-		unsigned long len;
-		int n = sscanf(line, "%d %d %lu", &code, &req, &len);
+		unsigned long len, origlen;
+		int n = sscanf(line, "%d %d %lu %lu", &code, &req, &len, &origlen);
 		gettimeofday(&tv, NULL);
 
-		if(n != 3 || code != CONTROL || req != REQ_PCAP || len > sizeof(data)) {
+		// Older versions of tincd do not send the original length
+		if(n == 3) {
+			origlen = len;
+		} else if(n != 4) {
+			break;
+		}
+
+		if(code != CONTROL || req != REQ_PCAP || len > sizeof(data)) {
 			break;
 		}
 
@@ -629,7 +804,7 @@ static void pcap(int fd, FILE *out, uint32_t snaplen) {
 		packet.tv_sec = tv.tv_sec;
 		packet.tv_usec = tv.tv_usec;
 		packet.len = len;
-		packet.origlen = len;
+		packet.origlen = origlen;
 		fwrite(&packet, sizeof(packet), 1, out);
 		fwrite(data, len, 1, out);
 		fflush(out);
@@ -1217,6 +1392,8 @@ static int cmd_dump(int argc, char *argv[]) {
 		sendline(fd, "%d %d", CONTROL, REQ_DUMP_NODES);
 		sendline(fd, "%d %d", CONTROL, REQ_DUMP_EDGES);
 		do_graph = 2;
+	} else if(!strcasecmp(argv[1], "stats")) {
+		sendline(fd, "%d %d", CONTROL, REQ_DUMP_STATS);
 	} else {
 		fprintf(stderr, "Unknown dump type '%s'.\n", argv[1]);
 		usage(true);
@@ -1356,6 +1533,19 @@ static int cmd_dump(int argc, char *argv[]) {
 		}
 		break;
 
+		case REQ_DUMP_STATS: {
+			uint64_t value;
+			int n = sscanf(line, "%*d %*d %4095s %"PRIu64, node, &value);
+
+			if(n != 2) {
+				fprintf(stderr, "Unable to parse stats dump from tincd.\n");
+				return 1;
+			}
+
+			printf("%s %"PRIu64"\n", node, value);
+		}
+		break;
+
 		default:
 			fprintf(stderr, "Unable to parse dump from tincd.\n");
 			return 1;
@@ -1507,16 +1697,48 @@ static int cmd_top(int argc, char *argv[]) {
 }
 
 static int cmd_pcap(int argc, char *argv[]) {
-	if(argc > 2) {
-		fprintf(stderr, "Too many arguments!\n");
-		return 1;
+	uint32_t snaplen = argc > 1 ? atoi(argv[1]) : 0;
+	uint32_t sample = argc > 2 ? atoi(argv[2]) : 1;
+
+	// The filter may be passed as one argument or as separate numbers
+	char filter[4000] = "";
+
+	if(argc > 3) {
+		char text[4000] = "";
+
+		for(int i = 3; i < argc; i++) {
+			strncat(text, argv[i], sizeof(text) - 1 - strlen(text));
+			strncat(text, " ", sizeof(text) - 1 - strlen(text));
+		}
+
+		bpf_program_t prog;
+
+		if(!bpf_parse(&prog, text)) {
+			fprintf(stderr, "Invalid filter, it should be the output of tcpdump -ddd.\n");
+			return 1;
+		}
+
+		// Send it on a single line
+		size_t len = snprintf(filter, sizeof(filter), "%lu", (unsigned long)prog.len);
+
+		for(size_t i = 0; i < prog.len && len < sizeof(filter); i++) {
+			const bpf_insn_t *insn = &prog.insns[i];
+			len += snprintf(filter + len, sizeof(filter) - len, ",%u %u %u %lu", insn->code, insn->jt, insn->jf, (unsigned long)insn->k);
+		}
+
+		bpf_free(&prog);
+
+		if(len >= sizeof(filter)) {
+			fprintf(stderr, "Filter is too long.\n");
+			return 1;
+		}
 	}
 
 	if(!connect_tincd(true)) {
 		return 1;
 	}
 
-	pcap(fd, stdout, argc > 1 ? atoi(argv[1]) : 0);
+	pcap(fd, stdout, snaplen, sample, filter);
 	return 0;
 }
 
@@ -1670,13 +1892,16 @@ const var_t variables[] = {
 	/* Server configuration */
 	{"AddressFamily", VAR_SERVER | VAR_SAFE},
 	{"AutoConnect", VAR_SERVER | VAR_SAFE},
+	{"BinaryMeta", VAR_SERVER | VAR_SAFE},
 	{"BindToAddress", VAR_SERVER | VAR_MULTIPLE},
 	{"BindToInterface", VAR_SERVER},
 	{"Broadcast", VAR_SERVER | VAR_SAFE},
 	{"BroadcastSubnet", VAR_SERVER | VAR_MULTIPLE | VAR_SAFE},
 	{"ConnectTo", VAR_SERVER | VAR_MULTIPLE | VAR_SAFE},
+	{"CryptoThreads", VAR_SERVER},
 	{"DecrementTTL", VAR_SERVER | VAR_SAFE},
 	{"Device", VAR_SERVER},
+	{"DeviceQueues", VAR_SERVER},
 	{"DeviceStandby", VAR_SERVER},
 	{"DeviceType", VAR_SERVER},
 	{"DirectOnly", VAR_SERVER | VAR_SAFE},
@@ -1684,15 +1909,18 @@ const var_t variables[] = {
 	{"ExperimentalProtocol", VAR_SERVER},
 	{"Forwarding", VAR_SERVER},
 	{"FWMark", VAR_SERVER},
+	{"GraphDelay", VAR_SERVER | VAR_SAFE},
 	{"GraphDumpFile", VAR_SERVER | VAR_OBSOLETE},
 	{"Hostnames", VAR_SERVER},
 	{"IffOneQueue", VAR_SERVER},
 	{"Interface", VAR_SERVER},
+	{"IOUring", VAR_SERVER},
 	{"InvitationExpire", VAR_SERVER},
 	{"KeyExpire", VAR_SERVER | VAR_SAFE},
 	{"ListenAddress", VAR_SERVER | VAR_MULTIPLE},
 	{"LocalDiscovery", VAR_SERVER | VAR_SAFE},
 	{"LogLevel", VAR_SERVER},
+	{"LogQueueSize", VAR_SERVER},
 	{"MACExpire", VAR_SERVER | VAR_SAFE},
 	{"MaxConnectionBurst", VAR_SERVER | VAR_SAFE},
 	{"MaxOutputBufferSize", VAR_SERVER | VAR_SAFE},
@@ -1718,6 +1946,7 @@ const var_t variables[] = {
 	{"UDPDiscoveryTimeout", VAR_SERVER | VAR_SAFE},
 	{"MTUInfoInterval", VAR_SERVER | VAR_SAFE},
 	{"UDPInfoInterval", VAR_SERVER | VAR_SAFE},
+	{"UDPOffload", VAR_SERVER},
 	{"UDPRcvBuf", VAR_SERVER},
 	{"UDPSndBuf", VAR_SERVER},
 	{"UPnP", VAR_SERVER},
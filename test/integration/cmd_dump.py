@@ -3,6 +3,7 @@
 """Test dump commands."""
 
 import subprocess as subp
+import sys
 
 from testlib import check
 from testlib.log import log
@@ -11,6 +12,7 @@ from testlib.test import Test
 
 SUBNETS_FOO = ("10.0.0.0/16", "10.1.2.0/24")
 SUBNETS_BAR = ("10.3.2.0/27", "fe80::/64")
+SUBNETS_SNAPSHOT = tuple(f"10.4.{i // 256}.{i % 256}/32" for i in range(1500))
 SUBNETS_BROADCAST = len(
     (
         "ff:ff:ff:ff:ff:ff owner (broadcast)",
@@ -27,6 +29,7 @@ ONLINE_REQUESTS = (
     ("graph",),
     ("nodes",),
     ("reachable", "nodes"),
+    ("stats",),
     ("subnets",),
 )
 
@@ -124,7 +127,13 @@ def run_connected_tests(foo: Tinc, bar: Tinc) -> None:
 
     log.info("dump connected subnets")
     out, _ = foo.cmd("dump", "subnets")
-    check.lines(out, SUBNETS_BROADCAST + len(SUBNETS_FOO) + len(SUBNETS_BAR))
+    check.lines(
+        out,
+        SUBNETS_BROADCAST
+        + len(SUBNETS_FOO)
+        + len(SUBNETS_BAR)
+        + len(SUBNETS_SNAPSHOT),
+    )
     for sub in (*SUBNETS_FOO, *SUBNETS_BAR):
         check.is_in(sub, out)
 
@@ -134,6 +143,29 @@ def run_connected_tests(foo: Tinc, bar: Tinc) -> None:
         check.is_in(f"{kind} {{", out)
         try_dot(out)
 
+    log.info("dump stats")
+    out, _ = foo.cmd("dump", "stats")
+    check.is_in("device_read_batches ", out)
+    check.is_in("device_read_packets ", out)
+
+    log.info("topology was received in a snapshot")
+    stats = dict(line.split() for line in out.splitlines())
+    check.greater(int(stats["snapshot_records_received"]), 1)
+    check.greater(int(stats["snapshot_requests_received"]), len(SUBNETS_SNAPSHOT) - 1)
+
+    log.info("the whole snapshot caused a single graph run")
+    check.equals(1, int(stats["snapshots_received"]))
+    check.equals(1, int(stats["snapshot_graph_runs"]))
+
+    if sys.platform == "linux":
+        log.info("meta connection writes did not need write interest")
+        check.greater(int(stats["epoll_direct_writes"]), 0)
+
+    if "log_queue_records" in stats:
+        log.info("log messages went through the log thread")
+        check.greater(int(stats["log_queue_records"]), 0)
+        check.greater(int(stats["log_queue_deferred"]), 0)
+
     log.info("dump connected nodes")
     for arg in (("nodes",), ("reachable", "nodes")):
         out, _ = foo.cmd("dump", *arg)
@@ -155,6 +187,7 @@ def run_tests(ctx: Test) -> None:
         run_offline_tests(command, foo)
 
     log.info("start %s", foo)
+    foo.cmd("set", "LogQueueSize", "65536")
     foo.start()
 
     log.info("invite %s", bar)
@@ -170,6 +203,11 @@ def run_tests(ctx: Test) -> None:
     for sub in SUBNETS_BAR:
         bar.cmd("add", "Subnet", sub)
 
+    log.info("add enough %s subnets to need several snapshot records", bar)
+    with open(bar.sub("hosts", bar.name), "a", encoding="utf-8") as f:
+        for sub in SUBNETS_SNAPSHOT:
+            f.write(f"Subnet = {sub}\n")
+
     run_unconnected_tests(foo, bar)
 
     log.info("start %s", bar)
@@ -2,6 +2,8 @@
 
 """Create two network namespaces and run ping between them."""
 
+import struct
+import time
 import typing as T
 
 from testlib import external as ext, util, template, cmd
@@ -18,8 +20,15 @@ IP_FOO = "192.168.1.1"
 IP_BAR = "192.168.1.2"
 MASK = 24
 
+# tcpdump -ddd icmp
+ICMP_FILTER = "6,40 0 0 12,21 0 3 2048,48 0 0 23,21 0 1 1,6 0 0 262144,6 0 0 0"
+NO_FILTER_MATCH = "1,6 0 0 0"
+SNAPLEN = 40
 
-def init(ctx: Test) -> T.Tuple[Tinc, Tinc]:
+
+def init(
+    ctx: Test, crypto_threads: int, queues: int, io_uring: bool
+) -> T.Tuple[Tinc, Tinc]:
     """Initialize new test nodes."""
     foo, bar = ctx.node(), ctx.node()
 
@@ -36,6 +45,9 @@ def init(ctx: Test) -> T.Tuple[Tinc, Tinc]:
         set Interface {foo}
         set Address localhost
         set AutoConnect no
+        set CryptoThreads {crypto_threads}
+        set DeviceQueues {queues}
+        set IOUring {"yes" if io_uring else "no"}
     """
     foo.cmd(stdin=stdin)
     foo.add_script(Script.TINC_UP, template.make_netns_config(foo.name, IP_FOO, MASK))
@@ -48,6 +60,9 @@ def init(ctx: Test) -> T.Tuple[Tinc, Tinc]:
         set Interface {bar}
         set Address localhost
         set AutoConnect no
+        set CryptoThreads {crypto_threads}
+        set DeviceQueues {queues}
+        set IOUring {"yes" if io_uring else "no"}
     """
     bar.cmd(stdin=stdin)
     bar.add_script(Script.TINC_UP, template.make_netns_config(bar.name, IP_BAR, MASK))
@@ -57,8 +72,42 @@ def init(ctx: Test) -> T.Tuple[Tinc, Tinc]:
     return foo, bar
 
 
-with Test("ns-ping") as context:
-    foo_node, bar_node = init(context)
+def stat(node: Tinc, name: str) -> int:
+    """Get the value of a counter from dump stats."""
+    out, _ = node.cmd("dump", "stats")
+    for line in out.splitlines():
+        key, value = line.split()
+        if key == name:
+            return int(value)
+    return 0
+
+
+def capture(node: Tinc, bpf: str = ICMP_FILTER) -> T.List[T.Tuple[int, bytes]]:
+    """Capture packets matching bpf while running ping, return their original lengths and data."""
+    proc = node.tinc("pcap", str(SNAPLEN), "1", bpf, binary=True)
+    time.sleep(1)
+    assert ping(IP_BAR, node.name)
+    time.sleep(1)
+    proc.terminate()
+    out, _ = proc.communicate()
+
+    magic, _, _, _, _, snaplen, _ = struct.unpack_from("=IHHIIII", out)
+    assert magic == 0xA1B2C3D4
+    assert snaplen == SNAPLEN
+
+    packets = []
+    pos = 24
+    while pos < len(out):
+        _, _, caplen, origlen = struct.unpack_from("=IIII", out, pos)
+        pos += 16
+        packets.append((origlen, out[pos : pos + caplen]))
+        pos += caplen
+    return packets
+
+
+def test_ping(ctx: Test, crypto_threads: int, queues: int, io_uring: bool) -> None:
+    """Run ping between two nodes."""
+    foo_node, bar_node = init(ctx, crypto_threads, queues, io_uring)
     bar_node.cmd("start")
 
     log.info("waiting for nodes to come up")
@@ -78,3 +127,67 @@ with Test("ns-ping") as context:
 
     log.info("ping must work after connection is up")
     assert ping(IP_BAR, foo_node.name)
+
+    log.info("routing decisions must be cached")
+    assert stat(foo_node, "route_cache_hits") > 0
+
+    log.info("packets from the device must be routed in batches")
+    assert stat(foo_node, "route_batch_groups") > 0
+    assert stat(foo_node, "route_batch_packets") >= stat(foo_node, "route_batch_groups")
+
+    log.info("pcap must only capture packets matching the filter")
+    packets = capture(foo_node)
+    assert packets
+    for origlen, data in packets:
+        assert len(data) == SNAPLEN
+        assert origlen > SNAPLEN
+        assert data[12:14] == b"\x08\x00" and data[23] == 1
+
+    if crypto_threads:
+        log.info("crypto threads must be used once UDP works")
+        for _ in range(10):
+            if stat(foo_node, "crypto_jobs") and stat(bar_node, "crypto_jobs"):
+                break
+            assert ping(IP_BAR, foo_node.name)
+        assert stat(foo_node, "crypto_jobs") > 0
+        assert stat(bar_node, "crypto_jobs") > 0
+
+    if queues > 1:
+        log.info("queue threads must send packets themselves once UDP works")
+        for _ in range(10):
+            if stat(foo_node, "device_worker_packets"):
+                break
+            assert ping(IP_BAR, foo_node.name)
+        assert stat(foo_node, "device_worker_packets") > 0
+        assert stat(foo_node, "device_worker_snapshots") > 0
+
+        log.info("queue threads must keep sending packets no capture filter matches")
+        sent = stat(foo_node, "device_worker_packets")
+        assert not capture(foo_node, NO_FILTER_MATCH)
+        assert stat(foo_node, "device_worker_packets") > sent
+
+        log.info("packets matching a capture filter must be captured from the queue threads")
+        assert capture(foo_node)
+
+    if io_uring and stat(foo_node, "io_uring_enter_calls"):
+        log.info("io_uring must receive datagrams and do device I/O once UDP works")
+        for _ in range(10):
+            if stat(foo_node, "io_uring_recv_packets"):
+                break
+            assert ping(IP_BAR, foo_node.name)
+        assert stat(foo_node, "io_uring_recv_packets") > 0
+        assert stat(foo_node, "io_uring_read_packets") > 0
+        assert stat(foo_node, "io_uring_write_packets") > 0
+        assert stat(bar_node, "io_uring_recv_packets") > 0
+
+
+for threads, device_queues, uring in (
+    (0, 1, True),
+    (2, 1, False),
+    (0, 4, False),
+):
+    with Test(
+        f"ns-ping with {threads} crypto threads, {device_queues} device queues"
+        f" and io_uring {'enabled' if uring else 'disabled'}"
+    ) as context:
+        test_ping(context, threads, device_queues, uring)
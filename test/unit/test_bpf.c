@@ -0,0 +1,183 @@
+#include "unittest.h"
+#include "../../src/bpf.h"
+
+// tcpdump -ddd ip
+static const char *filter_ip = "4\n40 0 0 12\n21 0 1 2048\n6 0 0 262144\n6 0 0 0\n";
+
+// tcpdump -ddd tcp dst port 80, on a single line
+static const char *filter_tcp_80 =
+        "16,40 0 0 12,21 0 4 34525,48 0 0 20,21 0 11 6,40 0 0 56,21 8 9 80,21 0 8 2048,"
+        "48 0 0 23,21 0 6 6,40 0 0 20,69 4 0 8191,177 0 0 14,72 0 0 16,21 0 1 80,"
+        "6 0 0 262144,6 0 0 0";
+
+static void make_ipv4(uint8_t *packet, size_t len, uint8_t protocol, uint16_t dport) {
+	memset(packet, 0, len);
+	packet[12] = 0x08;
+	packet[14] = 0x45;
+	packet[23] = protocol;
+	packet[36] = dport >> 8;
+	packet[37] = dport & 0xFF;
+}
+
+static void test_bpf_parse(void **state) {
+	(void)state;
+
+	bpf_program_t prog;
+	assert_true(bpf_parse(&prog, filter_ip));
+	assert_int_equal(4, prog.len);
+	assert_int_equal(0x15, prog.insns[1].code);
+	assert_int_equal(1, prog.insns[1].jf);
+	assert_int_equal(2048, prog.insns[1].k);
+	assert_int_equal(262144, prog.insns[2].k);
+	bpf_free(&prog);
+	assert_null(prog.insns);
+
+	assert_true(bpf_parse(&prog, filter_tcp_80));
+	assert_int_equal(16, prog.len);
+	bpf_free(&prog);
+}
+
+static void test_bpf_parse_rejects_bad_text(void **state) {
+	(void)state;
+
+	const char *bad[] = {
+		"",
+		"0",
+		"1",
+		"2,6 0 0 0",
+		"1,6 0 0 0,6 0 0 0",
+		"1,6 0 0",
+		"1,6 0 0 x",
+		"1,6 0 256 0",
+		"1,65536 0 0 0",
+		"1,6 0 0 4294967296",
+		"1,6 0 0 -1",
+		"4097",
+	};
+
+	for(size_t i = 0; i < sizeof(bad) / sizeof(*bad); i++) {
+		bpf_program_t prog;
+		assert_false(bpf_parse(&prog, bad[i]));
+		assert_null(prog.insns);
+	}
+}
+
+static void test_bpf_validate_rejects_bad_programs(void **state) {
+	(void)state;
+
+	const char *bad[] = {
+		// Does not end with a return
+		"1,40 0 0 12",
+		// Jumps out of the program
+		"2,21 1 0 0,6 0 0 0",
+		"2,5 0 0 1,6 0 0 0",
+		// Invalid memory slot
+		"2,96 0 0 16,6 0 0 0",
+		"2,2 0 0 16,6 0 0 0",
+		// Division by constant zero
+		"2,52 0 0 0,6 0 0 0",
+		// Unknown opcodes
+		"2,56 0 0 0,6 0 0 0",
+		"2,255 0 0 0,6 0 0 0",
+		"2,1024 0 0 0,6 0 0 0",
+	};
+
+	for(size_t i = 0; i < sizeof(bad) / sizeof(*bad); i++) {
+		bpf_program_t prog;
+		assert_false(bpf_parse(&prog, bad[i]));
+	}
+}
+
+static void test_bpf_run_filters(void **state) {
+	(void)state;
+
+	uint8_t packet[64];
+	bpf_program_t ip, tcp;
+	assert_true(bpf_parse(&ip, filter_ip));
+	assert_true(bpf_parse(&tcp, filter_tcp_80));
+
+	make_ipv4(packet, sizeof(packet), 6, 80);
+	assert_int_equal(262144, bpf_run(&ip, packet, sizeof(packet)));
+	assert_int_equal(262144, bpf_run(&tcp, packet, sizeof(packet)));
+
+	make_ipv4(packet, sizeof(packet), 6, 443);
+	assert_int_equal(262144, bpf_run(&ip, packet, sizeof(packet)));
+	assert_int_equal(0, bpf_run(&tcp, packet, sizeof(packet)));
+
+	make_ipv4(packet, sizeof(packet), 17, 80);
+	assert_int_equal(0, bpf_run(&tcp, packet, sizeof(packet)));
+
+	// ARP
+	packet[13] = 0x06;
+	assert_int_equal(0, bpf_run(&ip, packet, sizeof(packet)));
+
+	// Loads beyond the end of the packet reject it
+	make_ipv4(packet, sizeof(packet), 6, 80);
+	assert_int_equal(0, bpf_run(&tcp, packet, 36));
+	assert_int_equal(0, bpf_run(&ip, packet, 13));
+
+	bpf_free(&ip);
+	bpf_free(&tcp);
+}
+
+static uint32_t run(const char *text, const uint8_t *packet, uint32_t len) {
+	bpf_program_t prog;
+	assert_true(bpf_parse(&prog, text));
+	uint32_t result = bpf_run(&prog, packet, len);
+	bpf_free(&prog);
+	return result;
+}
+
+static void test_bpf_run_instructions(void **state) {
+	(void)state;
+
+	uint8_t packet[32] = {0};
+	packet[0] = 0x46;
+	packet[24] = 0x12;
+	packet[25] = 0x34;
+
+	// ld #10; add #5; mul #3; sub #1; ret a
+	assert_int_equal(44, run("5,0 0 0 10,4 0 0 5,36 0 0 3,20 0 0 1,22 0 0 0", packet, sizeof(packet)));
+
+	// ld #100; ldx #7; div x; tax; ld #100; mod x; ret a
+	assert_int_equal(100 % 14, run("7,0 0 0 100,1 0 0 7,60 0 0 0,7 0 0 0,0 0 0 100,156 0 0 0,22 0 0 0", packet, sizeof(packet)));
+
+	// ld #0; ldx #0; div x; ret #1: division by zero rejects the packet
+	assert_int_equal(0, run("4,0 0 0 0,1 0 0 0,60 0 0 0,6 0 0 1", packet, sizeof(packet)));
+
+	// ld #0xf0; and #0x3c; or #1; xor #0xff; lsh #4; rsh #2; ret a
+	assert_int_equal(((((0xf0 & 0x3c) | 1) ^ 0xff) << 4) >> 2,
+	                 run("7,0 0 0 240,84 0 0 60,68 0 0 1,164 0 0 255,100 0 0 4,116 0 0 2,22 0 0 0", packet, sizeof(packet)));
+
+	// ld #1; neg; ret a
+	assert_int_equal(UINT32_MAX, run("3,0 0 0 1,132 0 0 0,22 0 0 0", packet, sizeof(packet)));
+
+	// ld #42; st M[3]; ld #0; ldx M[3]; txa; ret a
+	assert_int_equal(42, run("6,0 0 0 42,2 0 0 3,0 0 0 0,97 0 0 3,135 0 0 0,22 0 0 0", packet, sizeof(packet)));
+
+	// ld len; ret a
+	assert_int_equal(sizeof(packet), run("2,128 0 0 0,22 0 0 0", packet, sizeof(packet)));
+
+	// ldx 4*([0]&0xf); ldh [x+0]; ret a
+	assert_int_equal(0x1234, run("3,177 0 0 0,72 0 0 0,22 0 0 0", packet, sizeof(packet)));
+
+	// ldx 4*([0]&0xf); ldh [x+8]: out of bounds
+	assert_int_equal(0, run("3,177 0 0 0,72 0 0 8,22 0 0 0", packet, sizeof(packet)));
+
+	// ldb [24]; jgt #17 jt 0 jf 1; jge #19 jt 0 jf 1; ret #1; jset #2 jt 0 jf 1; ret #3; ret #4
+	assert_int_equal(3, run("7,48 0 0 24,37 0 1 17,53 0 1 19,6 0 0 1,69 0 1 2,6 0 0 3,6 0 0 4", packet, sizeof(packet)));
+
+	// ja 1; ret #1; ret #2
+	assert_int_equal(2, run("3,5 0 0 1,6 0 0 1,6 0 0 2", packet, sizeof(packet)));
+}
+
+int main(void) {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_bpf_parse),
+		cmocka_unit_test(test_bpf_parse_rejects_bad_text),
+		cmocka_unit_test(test_bpf_validate_rejects_bad_programs),
+		cmocka_unit_test(test_bpf_run_filters),
+		cmocka_unit_test(test_bpf_run_instructions),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
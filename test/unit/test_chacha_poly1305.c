@@ -0,0 +1,300 @@
+#include "unittest.h"
+#include "../../src/chacha-poly1305/chacha-poly1305.h"
+#include "../../src/chacha-poly1305/kernel.h"
+
+// Long enough for several CHUNKLEN sized chunks after the first one, and jumbo frames
+#define MAXLEN 9100
+
+static const chacha_poly1305_kernel_t *reference;
+
+// Deterministic pseudo-random data, so failures can be reproduced
+static uint32_t prng_state = 0x12345678;
+
+static uint32_t prng(void) {
+	prng_state ^= prng_state << 13;
+	prng_state ^= prng_state >> 17;
+	prng_state ^= prng_state << 5;
+	return prng_state;
+}
+
+static void fill(uint8_t *buf, size_t len) {
+	for(size_t i = 0; i < len; i++) {
+		buf[i] = (uint8_t)prng();
+	}
+}
+
+static int setup(void **state) {
+	(void)state;
+	reference = chacha_poly1305_kernels[0];
+	return 0;
+}
+
+static void test_chacha_known_answer(void **state) {
+	(void)state;
+
+	static const uint8_t expected[64] = {
+		0x76, 0xb8, 0xe0, 0xad, 0xa0, 0xf1, 0x3d, 0x90, 0x40, 0x5d, 0x6a, 0xe5, 0x53, 0x86, 0xbd, 0x28,
+		0xbd, 0xd2, 0x19, 0xb8, 0xa0, 0x8d, 0xed, 0x1a, 0xa8, 0x36, 0xef, 0xcc, 0x8b, 0x77, 0x0d, 0xc7,
+		0xda, 0x41, 0x59, 0x7c, 0x51, 0x57, 0x48, 0x8d, 0x77, 0x24, 0xe0, 0x3f, 0xb8, 0xd8, 0x4a, 0x37,
+		0x6a, 0x43, 0xb8, 0xf4, 0x15, 0x18, 0xa1, 0x1c, 0xc3, 0x87, 0xb6, 0x69, 0xb2, 0xee, 0x65, 0x86,
+	};
+
+	for(const chacha_poly1305_kernel_t *const *k = chacha_poly1305_kernels; *k; k++) {
+		if(!(*k)->supported()) {
+			continue;
+		}
+
+		const uint8_t key[32] = {0};
+		const uint8_t iv[8] = {0};
+		uint8_t buf[64] = {0};
+		struct chacha_ctx ctx;
+
+		chacha_keysetup(&ctx, key, 256);
+		chacha_ivsetup(&ctx, iv, NULL);
+		(*k)->chacha(&ctx, buf, buf, sizeof(buf));
+
+		assert_memory_equal(expected, buf, sizeof(expected));
+		assert_int_equal(1, ctx.input[12]);
+	}
+}
+
+static void test_poly1305_known_answer(void **state) {
+	(void)state;
+
+	static const uint8_t key[POLY1305_KEYLEN] = {
+		0x85, 0xd6, 0xbe, 0x78, 0x57, 0x55, 0x6d, 0x33, 0x7f, 0x44, 0x52, 0xfe, 0x42, 0xd5, 0x06, 0xa8,
+		0x01, 0x03, 0x80, 0x8a, 0xfb, 0x0d, 0xb2, 0xfd, 0x4a, 0xbf, 0xf6, 0xaf, 0x41, 0x49, 0xf5, 0x1b,
+	};
+	static const uint8_t expected[POLY1305_TAGLEN] = {
+		0xa8, 0x06, 0x1d, 0xc1, 0x30, 0x51, 0x36, 0xc6, 0xc2, 0x2b, 0x8b, 0xaf, 0x0c, 0x01, 0x27, 0xa9,
+	};
+	static const char msg[] = "Cryptographic Forum Research Group";
+
+	for(const chacha_poly1305_kernel_t *const *k = chacha_poly1305_kernels; *k; k++) {
+		if(!(*k)->supported()) {
+			continue;
+		}
+
+		uint8_t tag[POLY1305_TAGLEN];
+		(*k)->poly1305(tag, (const uint8_t *)msg, strlen(msg), key);
+		assert_memory_equal(expected, tag, sizeof(tag));
+	}
+}
+
+static void check_chacha(const chacha_poly1305_kernel_t *kernel, const uint8_t ctr[8]) {
+	uint8_t key[32], iv[8];
+	static uint8_t in[MAXLEN], want[MAXLEN], got[MAXLEN];
+
+	fill(key, sizeof(key));
+	fill(iv, sizeof(iv));
+	fill(in, sizeof(in));
+
+	for(uint32_t len = 0; len <= MAXLEN; len += 1 + prng() % 37) {
+		struct chacha_ctx a, b;
+
+		chacha_keysetup(&a, key, 256);
+		chacha_ivsetup(&a, iv, ctr);
+		b = a;
+
+		reference->chacha(&a, in, want, len);
+		kernel->chacha(&b, in, got, len);
+
+		assert_memory_equal(want, got, len);
+		assert_memory_equal(a.input, b.input, sizeof(a.input));
+	}
+}
+
+static void test_chacha_kernels_match_reference(void **state) {
+	(void)state;
+
+	static const uint8_t ctr_one[8] = {1};
+	static const uint8_t ctr_wrap[8] = {0xfd, 0xff, 0xff, 0xff};
+
+	for(const chacha_poly1305_kernel_t *const *k = chacha_poly1305_kernels; *k; k++) {
+		if((*k)->supported()) {
+			check_chacha(*k, NULL);
+			check_chacha(*k, ctr_one);
+			check_chacha(*k, ctr_wrap);
+		}
+	}
+}
+
+static void test_poly1305_kernels_match_reference(void **state) {
+	(void)state;
+
+	static uint8_t msg[MAXLEN];
+	uint8_t key[POLY1305_KEYLEN];
+
+	fill(msg, sizeof(msg));
+
+	for(const chacha_poly1305_kernel_t *const *k = chacha_poly1305_kernels; *k; k++) {
+		if(!(*k)->supported()) {
+			continue;
+		}
+
+		for(size_t len = 0; len <= MAXLEN; len += 1 + prng() % 23) {
+			uint8_t want[POLY1305_TAGLEN], got[POLY1305_TAGLEN];
+
+			fill(key, sizeof(key));
+			reference->poly1305(want, msg, len, key);
+			(*k)->poly1305(got, msg, len, key);
+
+			assert_memory_equal(want, got, sizeof(want));
+		}
+
+		// Maximum limb values stress the carry propagation
+		memset(msg, 0xff, sizeof(msg));
+		memset(key, 0xff, sizeof(key));
+
+		for(size_t len = 0; len <= 512; len++) {
+			uint8_t want[POLY1305_TAGLEN], got[POLY1305_TAGLEN];
+
+			reference->poly1305(want, msg, len, key);
+			(*k)->poly1305(got, msg, len, key);
+
+			assert_memory_equal(want, got, sizeof(want));
+		}
+
+		fill(msg, sizeof(msg));
+	}
+}
+
+static void test_aead_kernels_agree(void **state) {
+	(void)state;
+
+	uint8_t key[CHACHA_POLY1305_KEYLEN];
+	static uint8_t in[MAXLEN], want[MAXLEN + POLY1305_TAGLEN], got[MAXLEN + POLY1305_TAGLEN], out[MAXLEN];
+
+	fill(key, sizeof(key));
+	fill(in, sizeof(in));
+
+	for(const chacha_poly1305_kernel_t *const *k = chacha_poly1305_kernels; *k; k++) {
+		if(!(*k)->supported()) {
+			continue;
+		}
+
+		assert_true(chacha_poly1305_set_kernel(reference->name));
+		chacha_poly1305_ctx_t *ref = chacha_poly1305_init();
+		assert_true(chacha_poly1305_set_kernel((*k)->name));
+		assert_string_equal((*k)->name, chacha_poly1305_get_kernel());
+		chacha_poly1305_ctx_t *ctx = chacha_poly1305_init();
+
+		chacha_poly1305_set_key(ref, key);
+		chacha_poly1305_set_key(ctx, key);
+
+		for(size_t len = 0; len <= MAXLEN; len += 1 + prng() % 97) {
+			uint64_t seqnr = prng();
+			size_t wantlen, gotlen, outlen;
+
+			assert_true(chacha_poly1305_encrypt(ref, seqnr, in, len, want, &wantlen));
+			assert_true(chacha_poly1305_encrypt(ctx, seqnr, in, len, got, &gotlen));
+			assert_int_equal(len + POLY1305_TAGLEN, gotlen);
+			assert_int_equal(wantlen, gotlen);
+			assert_memory_equal(want, got, gotlen);
+
+			assert_true(chacha_poly1305_verify(ctx, seqnr, got, gotlen));
+			assert_false(chacha_poly1305_verify(ctx, seqnr + 1, got, gotlen));
+			assert_true(chacha_poly1305_decrypt(ctx, seqnr, got, gotlen, out, &outlen));
+			assert_int_equal(len, outlen);
+			assert_memory_equal(in, out, len);
+
+			got[prng() % gotlen] ^= 1;
+			assert_false(chacha_poly1305_verify(ctx, seqnr, got, gotlen));
+			assert_false(chacha_poly1305_decrypt(ctx, seqnr, got, gotlen, out, &outlen));
+		}
+
+		chacha_poly1305_exit(ctx);
+		chacha_poly1305_exit(ref);
+	}
+
+	assert_true(chacha_poly1305_set_kernel(NULL));
+}
+
+static void test_single_pass_matches_twopass(void **state) {
+	(void)state;
+
+	uint8_t key[CHACHA_POLY1305_KEYLEN];
+	static uint8_t in[MAXLEN], want[MAXLEN + POLY1305_TAGLEN], got[MAXLEN + POLY1305_TAGLEN], out[MAXLEN];
+
+	fill(key, sizeof(key));
+	fill(in, sizeof(in));
+
+	for(const chacha_poly1305_kernel_t *const *k = chacha_poly1305_kernels; *k; k++) {
+		if(!(*k)->supported()) {
+			continue;
+		}
+
+		assert_true(chacha_poly1305_set_kernel((*k)->name));
+		chacha_poly1305_ctx_t *ctx = chacha_poly1305_init();
+		chacha_poly1305_set_key(ctx, key);
+
+		for(size_t len = 0; len <= MAXLEN; len += 1 + prng() % 61) {
+			uint64_t seqnr = prng();
+			size_t outlen;
+
+			assert_true(chacha_poly1305_encrypt_twopass(ctx, seqnr, in, len, want, NULL));
+			assert_true(chacha_poly1305_encrypt(ctx, seqnr, in, len, got, NULL));
+			assert_memory_equal(want, got, len + POLY1305_TAGLEN);
+
+			// In place
+			memcpy(got, in, len);
+			assert_true(chacha_poly1305_encrypt(ctx, seqnr, got, len, got, NULL));
+			assert_memory_equal(want, got, len + POLY1305_TAGLEN);
+
+			assert_true(chacha_poly1305_decrypt_twopass(ctx, seqnr, want, len + POLY1305_TAGLEN, out, &outlen));
+			assert_memory_equal(in, out, len);
+			assert_true(chacha_poly1305_decrypt(ctx, seqnr, got, len + POLY1305_TAGLEN, got, &outlen));
+			assert_int_equal(len, outlen);
+			assert_memory_equal(in, got, len);
+		}
+
+		chacha_poly1305_exit(ctx);
+	}
+
+	assert_true(chacha_poly1305_set_kernel(NULL));
+}
+
+static void test_failed_decrypt_wipes_output(void **state) {
+	(void)state;
+
+	uint8_t key[CHACHA_POLY1305_KEYLEN];
+	static uint8_t in[MAXLEN], buf[MAXLEN + POLY1305_TAGLEN], out[MAXLEN];
+	static const uint8_t zero[MAXLEN];
+
+	fill(key, sizeof(key));
+	fill(in, sizeof(in));
+
+	chacha_poly1305_ctx_t *ctx = chacha_poly1305_init();
+	chacha_poly1305_set_key(ctx, key);
+
+	assert_true(chacha_poly1305_encrypt(ctx, 42, in, MAXLEN, buf, NULL));
+	buf[MAXLEN - 1] ^= 0x80;
+
+	memset(out, 0x55, sizeof(out));
+	assert_false(chacha_poly1305_decrypt(ctx, 42, buf, sizeof(buf), out, NULL));
+	assert_memory_equal(zero, out, MAXLEN);
+
+	chacha_poly1305_exit(ctx);
+}
+
+static void test_set_kernel_rejects_unknown(void **state) {
+	(void)state;
+
+	assert_false(chacha_poly1305_set_kernel("no such kernel"));
+	assert_true(chacha_poly1305_set_kernel(NULL));
+	assert_non_null(chacha_poly1305_get_kernel());
+}
+
+int main(void) {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_chacha_known_answer),
+		cmocka_unit_test(test_poly1305_known_answer),
+		cmocka_unit_test(test_chacha_kernels_match_reference),
+		cmocka_unit_test(test_poly1305_kernels_match_reference),
+		cmocka_unit_test(test_aead_kernels_agree),
+		cmocka_unit_test(test_single_pass_matches_twopass),
+		cmocka_unit_test(test_failed_decrypt_wipes_output),
+		cmocka_unit_test(test_set_kernel_rejects_unknown),
+	};
+	return cmocka_run_group_tests(tests, setup, NULL);
+}
@@ -0,0 +1,183 @@
+#include "unittest.h"
+#include "../../src/checksum.h"
+
+// The straightforward RFC 1071 implementation, summing 16 bit words in network byte order
+static uint16_t reference_checksum(const uint8_t *data, size_t len) {
+	uint32_t sum = 0;
+
+	for(size_t i = 0; i + 1 < len; i += 2) {
+		sum += data[i] << 8 | data[i + 1];
+	}
+
+	if(len % 2) {
+		sum += data[len - 1] << 8;
+	}
+
+	while(sum >> 16) {
+		sum = (sum & 0xFFFF) + (sum >> 16);
+	}
+
+	return (uint16_t)~sum;
+}
+
+// The result of inet_checksum() is in the byte order of the data
+static uint16_t checksum(const void *data, size_t len, uint16_t prevsum) {
+	return ntohs(inet_checksum(data, len, prevsum));
+}
+
+static void random_bytes(uint8_t *data, size_t len) {
+	for(size_t i = 0; i < len; i++) {
+		data[i] = (uint8_t)rand();
+	}
+}
+
+static void test_checksum_known_answer(void **state) {
+	(void)state;
+
+	// IPv4 header from the example in RFC 1071 errata and many textbooks
+	const uint8_t header[] = {
+		0x45, 0x00, 0x00, 0x73, 0x00, 0x00, 0x40, 0x00, 0x40, 0x11,
+		0x00, 0x00, 0xc0, 0xa8, 0x00, 0x01, 0xc0, 0xa8, 0x00, 0xc7,
+	};
+
+	assert_int_equal(0xb861, checksum(header, sizeof(header), 0xFFFF));
+	assert_int_equal(0xFFFF, checksum(NULL, 0, 0xFFFF));
+}
+
+static void test_checksum_matches_reference(void **state) {
+	(void)state;
+
+	uint8_t data[1600];
+	srand(1);
+
+	for(int i = 0; i < 2000; i++) {
+		size_t len = (size_t)rand() % sizeof(data);
+		size_t offset = (size_t)rand() % 8;
+
+		// Also test unaligned buffers
+		if(len + offset > sizeof(data)) {
+			len = sizeof(data) - offset;
+		}
+
+		random_bytes(data + offset, len);
+		assert_int_equal(reference_checksum(data + offset, len), checksum(data + offset, len, 0xFFFF));
+	}
+}
+
+static void test_checksum_extremes(void **state) {
+	(void)state;
+
+	uint8_t data[1500];
+
+	// Lots of carries
+	memset(data, 0xFF, sizeof(data));
+
+	for(size_t len = 0; len < 64; len++) {
+		assert_int_equal(reference_checksum(data, len), checksum(data, len, 0xFFFF));
+	}
+
+	assert_int_equal(reference_checksum(data, sizeof(data)), checksum(data, sizeof(data), 0xFFFF));
+
+	memset(data, 0, sizeof(data));
+	assert_int_equal(0xFFFF, checksum(data, sizeof(data), 0xFFFF));
+}
+
+static void test_checksum_can_be_continued(void **state) {
+	(void)state;
+
+	uint8_t data[1500];
+	srand(2);
+
+	for(int i = 0; i < 1000; i++) {
+		size_t len = (size_t)rand() % sizeof(data);
+		size_t split = ((size_t)rand() % (len + 1)) & ~(size_t)1;
+		random_bytes(data, len);
+
+		uint16_t sum = inet_checksum(data, split, 0xFFFF);
+		sum = inet_checksum(data + split, len - split, sum);
+
+		assert_int_equal(reference_checksum(data, len), ntohs(sum));
+	}
+}
+
+static void test_checksum_verifies(void **state) {
+	(void)state;
+
+	uint8_t data[64];
+	srand(3);
+
+	for(int i = 0; i < 1000; i++) {
+		random_bytes(data, sizeof(data));
+		data[10] = data[11] = 0;
+
+		uint16_t sum = inet_checksum(data, sizeof(data), 0xFFFF);
+		memcpy(data + 10, &sum, sizeof(sum));
+
+		// A checksum over data that includes its checksum is zero
+		assert_int_equal(0, inet_checksum(data, sizeof(data), 0xFFFF));
+	}
+}
+
+static void test_checksum_update(void **state) {
+	(void)state;
+
+	uint8_t data[60];
+	srand(4);
+
+	for(int i = 0; i < 10000; i++) {
+		random_bytes(data, sizeof(data));
+		data[10] = data[11] = 0;
+
+		uint16_t sum = checksum(data, sizeof(data), 0xFFFF);
+		data[10] = sum >> 8;
+		data[11] = sum & 0xFF;
+
+		// Change a random word, sometimes in a way that gives carries
+		size_t pos = 12 + ((size_t)rand() % 24) * 2;
+		uint16_t old = data[pos] << 8 | data[pos + 1];
+		uint16_t new = rand() % 4 ? (uint16_t)rand() : (uint16_t)(i % 2 ? 0xFFFF : 0);
+		data[pos] = new >> 8;
+		data[pos + 1] = new & 0xFF;
+
+		sum = inet_checksum_update(sum, old, new);
+		data[10] = sum >> 8;
+		data[11] = sum & 0xFF;
+
+		assert_int_equal(0, inet_checksum(data, sizeof(data), 0xFFFF));
+	}
+}
+
+static void test_checksum_update_decrement_ttl(void **state) {
+	(void)state;
+
+	uint8_t header[20] = {
+		0x45, 0x00, 0x00, 0x73, 0x00, 0x00, 0x40, 0x00, 0x40, 0x11,
+		0x00, 0x00, 0xc0, 0xa8, 0x00, 0x01, 0xc0, 0xa8, 0x00, 0xc7,
+	};
+
+	uint16_t sum = checksum(header, sizeof(header), 0xFFFF);
+
+	while(header[8] > 1) {
+		uint16_t old = header[8] << 8 | header[9];
+		header[8]--;
+		uint16_t new = header[8] << 8 | header[9];
+
+		sum = inet_checksum_update(sum, old, new);
+		header[10] = 0;
+		header[11] = 0;
+		assert_int_equal(checksum(header, sizeof(header), 0xFFFF), sum);
+	}
+}
+
+int main(void) {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_checksum_known_answer),
+		cmocka_unit_test(test_checksum_matches_reference),
+		cmocka_unit_test(test_checksum_extremes),
+		cmocka_unit_test(test_checksum_can_be_continued),
+		cmocka_unit_test(test_checksum_verifies),
+		cmocka_unit_test(test_checksum_update),
+		cmocka_unit_test(test_checksum_update_decrement_ttl),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
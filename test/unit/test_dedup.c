@@ -0,0 +1,104 @@
+#include "unittest.h"
+#include "../../src/dedup.h"
+
+static const uint64_t key[2] = {0x0706050403020100ULL, 0x0f0e0d0c0b0a0908ULL};
+
+static void test_siphash_known_answer(void **state) {
+	(void)state;
+
+	// Test vectors from the SipHash paper, with messages 00 01 02 ...
+	uint8_t msg[15];
+
+	for(size_t i = 0; i < sizeof(msg); i++) {
+		msg[i] = (uint8_t)i;
+	}
+
+	assert_true(siphash24(key, msg, 0) == 0x726fdb47dd0e0e31ULL);
+	assert_true(siphash24(key, msg, 1) == 0x74f839c593dc67fdULL);
+	assert_true(siphash24(key, msg, 15) == 0xa129ca6149be45e5ULL);
+}
+
+static void init_dedup(dedup_t *dedup, uint32_t max_size) {
+	memset(dedup, 0, sizeof(*dedup));
+	dedup->max_size = max_size;
+	dedup->keyed = true;
+	memcpy(dedup->key, key, sizeof(key));
+}
+
+static bool check(dedup_t *dedup, int i) {
+	char request[64];
+	snprintf(request, sizeof(request), "12 %x node%d 10.0.0.%d/32", i, i, i % 256);
+	return dedup_check(dedup, request, strlen(request));
+}
+
+static void test_dedup_detects_duplicates(void **state) {
+	(void)state;
+
+	dedup_t dedup;
+	init_dedup(&dedup, 0x10000);
+
+	for(int i = 0; i < 10000; i++) {
+		assert_false(check(&dedup, i));
+	}
+
+	for(int i = 0; i < 10000; i++) {
+		assert_true(check(&dedup, i));
+	}
+
+	assert_int_equal(10000, dedup_entries(&dedup));
+	assert_int_equal(10000, dedup.duplicates);
+	assert_int_equal(0, dedup.overflows);
+
+	dedup_free(&dedup);
+}
+
+static void test_dedup_forgets_after_rotations(void **state) {
+	(void)state;
+
+	dedup_t dedup;
+	init_dedup(&dedup, 0x10000);
+
+	assert_false(check(&dedup, 1));
+
+	for(int i = 0; i < DEDUP_BUCKETS - 1; i++) {
+		dedup_rotate(&dedup);
+		assert_true(check(&dedup, 1));
+	}
+
+	dedup_rotate(&dedup);
+	assert_int_equal(0, dedup_entries(&dedup));
+	assert_false(check(&dedup, 1));
+
+	dedup_free(&dedup);
+}
+
+static void test_dedup_memory_is_bounded(void **state) {
+	(void)state;
+
+	dedup_t dedup;
+	init_dedup(&dedup, 1024);
+
+	for(int i = 0; i < 100000; i++) {
+		assert_false(check(&dedup, i));
+		assert_true(dedup_size(&dedup) <= DEDUP_BUCKETS * 1024);
+	}
+
+	assert_true(dedup.overflows > 0);
+	assert_int_equal(dedup.overflows, dedup.rotations);
+
+	// The most recent requests are still remembered
+	assert_true(check(&dedup, 99999));
+
+	dedup_free(&dedup);
+	assert_int_equal(0, dedup_size(&dedup));
+}
+
+int main(void) {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_siphash_known_answer),
+		cmocka_unit_test(test_dedup_detects_duplicates),
+		cmocka_unit_test(test_dedup_forgets_after_rotations),
+		cmocka_unit_test(test_dedup_memory_is_bounded),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
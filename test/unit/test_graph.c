@@ -1,9 +1,11 @@
 #include "unittest.h"
 #include "../../src/connection.h"
+#include "../../src/graph.h"
 #include "../../src/node.h"
 #include "../../src/xalloc.h"
 
 extern void sssp_bfs(void);
+extern void sssp_incremental(void);
 
 static void connect_nodes(node_t *from, node_t *to, int weight) {
 	edge_t *direct = new_edge();
@@ -74,6 +76,182 @@ static void test_sssp_bfs(void **state) {
 	assert_ptr_equal(neptune, neptune->via);
 }
 
+#define RANDOM_NODES 24
+#define RANDOM_CHANGES 3000
+
+typedef struct sssp_result_t {
+	edge_t *prevedge;
+	edge_t *hopedge;
+	node_t *nexthop;
+	node_t *via;
+	int distance;
+	int hops;
+	bool visited;
+	bool indirect;
+} sssp_result_t;
+
+static void get_result(sssp_result_t *result, const node_t *n) {
+	memset(result, 0, sizeof(*result));
+	result->visited = n->status.visited;
+	result->prevedge = n->prevedge;
+	result->hopedge = n->hopedge;
+
+	if(result->visited) {
+		result->nexthop = n->nexthop;
+		result->via = n->via;
+		result->distance = n->distance;
+		result->hops = n->hops;
+		result->indirect = n->status.indirect;
+	}
+}
+
+static void random_edge(node_t *from, node_t *to) {
+	edge_t *e = new_edge();
+	e->from = from;
+	e->to = to;
+	e->weight = rand() % 4;
+	e->options = rand() % 4 ? 0 : OPTION_INDIRECT;
+	edge_add(e);
+}
+
+// Keep the graph sparse, so that there are long paths and unreachable nodes
+static void random_change(node_t **nodes) {
+	node_t *from = nodes[rand() % RANDOM_NODES];
+	node_t *to = nodes[rand() % RANDOM_NODES];
+
+	if(from == to) {
+		return;
+	}
+
+	edge_t *e = lookup_edge(from, to);
+
+	if(!e) {
+		if(rand() % 8) {
+			return;
+		}
+
+		random_edge(from, to);
+
+		if(!lookup_edge(to, from) && rand() % 4) {
+			random_edge(to, from);
+		}
+	} else if(rand() % 3) {
+		edge_del(e);
+	} else {
+		// Small weights so that there are plenty of ties
+		splay_node_t *node = splay_unlink(&edge_weight_tree, e);
+		e->weight = rand() % 4;
+		e->options ^= rand() % 2 ? OPTION_INDIRECT : 0;
+		splay_insert_node(&edge_weight_tree, node);
+		graph_update_edge(e);
+	}
+}
+
+static void test_sssp_incremental(void **state) {
+	(void)state;
+
+	node_t *nodes[RANDOM_NODES];
+	nodes[0] = myself;
+
+	for(int i = 1; i < RANDOM_NODES; i++) {
+		char name[16];
+		snprintf(name, sizeof(name), "node%d", i);
+		nodes[i] = make_node(name);
+	}
+
+	srand(1);
+	sssp_bfs();
+
+	for(int i = 0; i < RANDOM_CHANGES; i++) {
+		for(int changes = rand() % 3; changes >= 0; changes--) {
+			random_change(nodes);
+		}
+
+		sssp_incremental();
+
+		sssp_result_t incremental[RANDOM_NODES];
+
+		for(int j = 0; j < RANDOM_NODES; j++) {
+			get_result(&incremental[j], nodes[j]);
+		}
+
+		sssp_bfs();
+
+		for(int j = 0; j < RANDOM_NODES; j++) {
+			sssp_result_t full;
+			get_result(&full, nodes[j]);
+			assert_memory_equal(&full, &incremental[j], sizeof(full));
+		}
+	}
+}
+
+static void test_graph_schedule_coalesces(void **state) {
+	(void)state;
+
+	node_t *mars = make_node("mars");
+	node_t *saturn = make_node("saturn");
+	node_t *neptune = make_node("neptune");
+
+	connect_nodes(myself, mars, 50);
+	graph();
+
+	uint64_t runs = graph_runs;
+	uint64_t coalesced = graph_coalesced;
+
+	connect_nodes(mars, saturn, 10);
+	graph_schedule();
+	connect_nodes(saturn, neptune, 10);
+	graph_schedule();
+	graph_schedule();
+
+	assert_int_equal(runs, graph_runs);
+	assert_int_equal(coalesced + 2, graph_coalesced);
+	assert_null(neptune->nexthop);
+
+	graph_flush();
+
+	assert_int_equal(runs + 1, graph_runs);
+	assert_ptr_equal(mars, neptune->nexthop);
+	assert_ptr_equal(mars, saturn->nexthop);
+
+	// Nothing is pending anymore
+	graph_flush();
+	assert_int_equal(runs + 1, graph_runs);
+}
+
+static void test_graph_hold_runs_once(void **state) {
+	(void)state;
+
+	node_t *mars = make_node("mars");
+	node_t *saturn = make_node("saturn");
+
+	connect_nodes(myself, mars, 50);
+	graph();
+
+	uint64_t runs = graph_runs;
+
+	// Nested holds, like two snapshots being received at the same time
+	graph_hold();
+	graph_hold();
+
+	connect_nodes(mars, saturn, 10);
+	graph_schedule();
+	graph_flush();
+	graph_release();
+	graph_flush();
+
+	assert_int_equal(runs, graph_runs);
+	assert_null(saturn->nexthop);
+
+	graph_release();
+
+	assert_int_equal(runs + 1, graph_runs);
+	assert_ptr_equal(mars, saturn->nexthop);
+
+	graph_flush();
+	assert_int_equal(runs + 1, graph_runs);
+}
+
 static int setup(void **state) {
 	(void)state;
 	myself = new_node("myself");
@@ -82,6 +260,7 @@ static int setup(void **state) {
 
 static int teardown(void **state) {
 	(void)state;
+	exit_graph();
 	free_node(myself);
 	exit_nodes();
 	exit_edges();
@@ -91,6 +270,9 @@ static int teardown(void **state) {
 int main(void) {
 	const struct CMUnitTest tests[] = {
 		cmocka_unit_test_setup_teardown(test_sssp_bfs, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_sssp_incremental, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_graph_schedule_coalesces, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_graph_hold_runs_once, setup, teardown),
 	};
 	return cmocka_run_group_tests(tests, NULL, NULL);
 }
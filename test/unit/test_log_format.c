@@ -0,0 +1,239 @@
+#include "unittest.h"
+#include "../../src/log_format.h"
+#include "../../src/log_queue.h"
+
+// Format the message both ways and compare the results
+static void check_size(size_t size, const char *format, ...) ATTR_FORMAT(printf, 2, 3);
+static void check_size(size_t size, const char *format, ...) {
+	char expected[256];
+	char actual[256];
+	uint8_t args[512];
+	size_t len = 0;
+	va_list ap;
+
+	assert_true(size <= sizeof(expected));
+
+	va_start(ap, format);
+	vsnprintf(expected, size, format, ap);
+	va_end(ap);
+
+	va_start(ap, format);
+	assert_true(log_pack_args(args, sizeof(args), &len, format, ap));
+	va_end(ap);
+
+	assert_true(log_format_args(actual, size, format, args, len));
+	assert_string_equal(expected, actual);
+}
+
+#define check(...) check_size(256, __VA_ARGS__)
+
+static void test_format_matches_vsnprintf(void **state) {
+	(void)state;
+
+	check("no conversions");
+	check("%d %i %u %x %X %o", -42, 17, 42u, 0xbeefu, 0xcafeu, 8u);
+	check("%hhd %hd %ld %lld %zu %jd %td", -1, -300, -100000L, -10000000000LL, (size_t)123456, (intmax_t) -7, (ptrdiff_t)99);
+	check("%lu %llx %hhu %hu", 4000000000UL, 0xdeadbeefcafeULL, 255u, 65535u);
+	check("%c%c%c", 'a', 'b', 'c');
+	check("%s and %s", "this", "that");
+	check("%-10s|%10s", "left", "right");
+	check("%*d|%-*d|%.*d", 6, 42, 6, 42, 4, 7);
+	check("%08.3f %e %g %a", 3.14159, 12345.678, 0.0001, 1.0);
+	check("%Lf", (long double)2.5);
+	check("100%% done, %d%%", 100);
+	check("%p", (void *)0x1234);
+	check("%#x %+d % d", 255u, 5, 5);
+	check("trailing newline %d\n", 1);
+}
+
+static bool pack(uint8_t *buf, size_t size, size_t *len, const char *format, ...) {
+	va_list ap;
+	va_start(ap, format);
+	bool result = log_pack_args(buf, size, len, format, ap);
+	va_end(ap);
+	return result;
+}
+
+static void test_format_null_string(void **state) {
+	(void)state;
+
+	uint8_t args[64];
+	size_t len;
+	char out[64];
+
+	assert_true(pack(args, sizeof(args), &len, "[%s]", (const char *)NULL));
+	assert_true(log_format_args(out, sizeof(out), "[%s]", args, len));
+	assert_string_equal("[(null)]", out);
+}
+
+static void test_format_truncates(void **state) {
+	(void)state;
+
+	check_size(1, "%s", "nothing fits");
+	check_size(5, "abcdefgh");
+	check_size(5, "ab%sgh", "cdef");
+	check_size(8, "%d-%d-%d", 1111, 2222, 3333);
+	check_size(3, "%%%%%%%%");
+}
+
+static void test_pack_rejects_unsupported(void **state) {
+	(void)state;
+
+	uint8_t args[64];
+	size_t len;
+	int n;
+
+	assert_false(pack(args, sizeof(args), &len, "%n", &n));
+	assert_false(pack(args, sizeof(args), &len, "%ls", L"wide"));
+	assert_false(pack(args, sizeof(args), &len, "%lc", 'x'));
+
+	// The string need not be NUL-terminated if it has a precision
+	const char unterminated[4] = {'a', 'b', 'c', 'd'};
+	assert_false(pack(args, sizeof(args), &len, "%.*s", 2, unterminated));
+	assert_false(pack(args, sizeof(args), &len, "%.4s", unterminated));
+	assert_false(pack(args, sizeof(args), &len, "incomplete %"));
+	assert_false(pack(args, sizeof(args), &len, "%y"));
+}
+
+static void test_pack_rejects_overflow(void **state) {
+	(void)state;
+
+	uint8_t args[16];
+	size_t len;
+
+	assert_true(pack(args, sizeof(args), &len, "%d %d", 1, 2));
+	assert_int_equal(2 * sizeof(intmax_t), len);
+	assert_false(pack(args, sizeof(args), &len, "%d %d %d", 1, 2, 3));
+	assert_false(pack(args, sizeof(args), &len, "%s", "a string that is too long"));
+}
+
+static void test_format_rejects_mismatch(void **state) {
+	(void)state;
+
+	uint8_t args[64];
+	size_t len;
+	char out[64];
+
+	assert_true(pack(args, sizeof(args), &len, "%d", 1));
+
+	// Too few and too many arguments
+	assert_false(log_format_args(out, sizeof(out), "%d %d", args, len));
+	assert_false(log_format_args(out, sizeof(out), "none", args, len));
+
+	// Unterminated string
+	memset(args, 'x', sizeof(args));
+	assert_false(log_format_args(out, sizeof(out), "%s", args, sizeof(args)));
+}
+
+#ifdef HAVE_LOG_QUEUE
+static char written[64][64];
+static size_t writes;
+static size_t flushes;
+static size_t mismatches;
+
+// Runs in the log thread, so this cannot use cmocka's assertions
+static void write_message(int priority, time_t time, const char *message) {
+	if(priority != LOG_INFO || time != 1234) {
+		mismatches++;
+	}
+
+	if(writes < 64) {
+		snprintf(written[writes], sizeof(written[writes]), "%s", message);
+	}
+
+	writes++;
+}
+
+static void flush_messages(void) {
+	flushes++;
+}
+
+static void queue_format(const char *format, ...) {
+	va_list ap;
+	va_start(ap, format);
+	assert_true(log_queue_format(LOG_INFO, 1234, format, ap));
+	va_end(ap);
+}
+
+static void test_queue_writes_in_order(void **state) {
+	(void)state;
+
+	writes = flushes = mismatches = 0;
+	log_queue_records = log_queue_deferred = log_queue_dropped = 0;
+
+	assert_true(log_queue_start(0, write_message, flush_messages));
+	assert_true(log_queue_running());
+
+	for(int i = 0; i < 32; i++) {
+		if(i % 2) {
+			queue_format("message %d from %s", i, "queue");
+		} else {
+			char message[64];
+			snprintf(message, sizeof(message), "message %d from %s", i, "queue");
+			log_queue_text(LOG_INFO, 1234, message);
+		}
+	}
+
+	log_queue_flush();
+	assert_int_equal(32, writes);
+	assert_int_equal(0, mismatches);
+	assert_true(flushes > 0);
+
+	for(int i = 0; i < 32; i++) {
+		char expected[64];
+		snprintf(expected, sizeof(expected), "message %d from %s", i, "queue");
+		assert_string_equal(expected, written[i]);
+	}
+
+	assert_int_equal(32, log_queue_records);
+	assert_int_equal(16, log_queue_deferred);
+	assert_int_equal(0, log_queue_dropped);
+
+	log_queue_stop();
+	assert_false(log_queue_running());
+}
+
+static void test_queue_wraps_around(void **state) {
+	(void)state;
+
+	writes = 0;
+	log_queue_records = log_queue_dropped = 0;
+
+	assert_true(log_queue_start(0, write_message, flush_messages));
+
+	// Many more messages than fit in the ring at once
+	char message[1000];
+	memset(message, 'x', sizeof(message) - 1);
+	message[sizeof(message) - 1] = 0;
+
+	for(int i = 0; i < 1000; i++) {
+		log_queue_text(LOG_INFO, 1234, message);
+
+		if(i % 4 == 3) {
+			log_queue_flush();
+		}
+	}
+
+	log_queue_stop();
+
+	assert_int_equal(1000, log_queue_records);
+	assert_int_equal(0, log_queue_dropped);
+	assert_int_equal(1000, writes);
+}
+#endif
+
+int main(void) {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_format_matches_vsnprintf),
+		cmocka_unit_test(test_format_null_string),
+		cmocka_unit_test(test_format_truncates),
+		cmocka_unit_test(test_pack_rejects_unsupported),
+		cmocka_unit_test(test_pack_rejects_overflow),
+		cmocka_unit_test(test_format_rejects_mismatch),
+#ifdef HAVE_LOG_QUEUE
+		cmocka_unit_test(test_queue_writes_in_order),
+		cmocka_unit_test(test_queue_wraps_around),
+#endif
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,227 @@
+#include "unittest.h"
+#include "../../src/meta_request.h"
+#include "../../src/protocol.h"
+
+static const char *const valid_requests[] = {
+	"12 1a2b alice bob 192.168.1.1 655 700000c 42",
+	"12 ffffffff alice bob 192.168.1.1 655 0 -3 10.0.0.1 655",
+	"12 0 alice bob 192.168.1.1 655 0 1 10.0.0.1 655 future extension",
+	"13 123 alice bob",
+	"10 abc alice 10.0.0.0/8#10",
+	"11 abc alice fe80::/64",
+};
+
+static void test_text_round_trip(void **state) {
+	(void)state;
+
+	for(size_t i = 0; i < sizeof(valid_requests) / sizeof(*valid_requests); i++) {
+		meta_request_t r, copy;
+		assert_true(meta_request_parse_text(&r, valid_requests[i]));
+
+		// Rebuild the request field by field and check that it encodes the same way
+		meta_request_init(&copy, r.type);
+		const char *schema = r.type == ADD_EDGE ? "xssssxdss" : "xss";
+
+		for(size_t j = 0; j < r.count; j++) {
+			if(schema[j] == 's') {
+				meta_request_add_string(&copy, r.strings[j]);
+			} else {
+				meta_request_add_number(&copy, r.numbers[j]);
+			}
+		}
+
+		copy.rest = r.rest;
+		assert_string_equal(valid_requests[i], meta_request_text(&copy));
+	}
+}
+
+static void test_binary_round_trip(void **state) {
+	(void)state;
+
+	for(size_t i = 0; i < sizeof(valid_requests) / sizeof(*valid_requests); i++) {
+		meta_request_t r, decoded;
+		size_t len;
+
+		assert_true(meta_request_parse_text(&r, valid_requests[i]));
+
+		const uint8_t *binary = meta_request_binary(&r, &len);
+		assert_non_null(binary);
+		assert_true(meta_request_parse_binary(&decoded, binary, len));
+
+		assert_int_equal(r.type, decoded.type);
+		assert_int_equal(r.count, decoded.count);
+		assert_string_equal(r.rest, decoded.rest);
+		assert_string_equal(valid_requests[i], meta_request_text(&decoded));
+	}
+}
+
+static void test_parse_fields(void **state) {
+	(void)state;
+
+	meta_request_t r;
+	assert_true(meta_request_parse_text(&r, valid_requests[1]));
+
+	assert_int_equal(ADD_EDGE, r.type);
+	assert_int_equal(9, r.count);
+	assert_int_equal(0xffffffff, r.numbers[0]);
+	assert_string_equal("alice", r.strings[1]);
+	assert_string_equal("bob", r.strings[2]);
+	assert_int_equal(-3, (int32_t)r.numbers[6]);
+	assert_string_equal("655", r.strings[8]);
+	assert_string_equal("", r.rest);
+}
+
+static void test_reject_bad_text(void **state) {
+	(void)state;
+
+	static const char *const bad_requests[] = {
+		"",
+		"12",
+		"0 alice 17.8",
+		"15 alice bob",
+		"12 1a2b alice bob 192.168.1.1 655 700000c",
+		"12 1a2b alice bob 192.168.1.1 655 700000c 42 10.0.0.1",
+		"12 1a2b alice bob 192.168.1.1 655 zz 42",
+		"12 1a2b alice bob 192.168.1.1 655 1ffffffff 42",
+		"12 1a2b alice bob 192.168.1.1 655 0 9999999999",
+		"13 123 alice",
+	};
+
+	for(size_t i = 0; i < sizeof(bad_requests) / sizeof(*bad_requests); i++) {
+		meta_request_t r;
+		assert_false(meta_request_parse_text(&r, bad_requests[i]));
+	}
+}
+
+static void test_reject_bad_binary(void **state) {
+	(void)state;
+
+	meta_request_t r;
+	size_t len;
+	assert_true(meta_request_parse_text(&r, "13 123 alice bob"));
+	const uint8_t *binary = meta_request_binary(&r, &len);
+
+	uint8_t frame[64];
+	assert_true(len < sizeof(frame));
+	memcpy(frame, binary, len);
+
+	meta_request_t decoded;
+	assert_true(meta_request_parse_binary(&decoded, frame, len));
+
+	// Truncated or with trailing garbage
+	for(size_t i = 0; i < len; i++) {
+		assert_false(meta_request_parse_binary(&decoded, frame, i));
+	}
+
+	frame[len] = 0;
+	assert_false(meta_request_parse_binary(&decoded, frame, len + 1));
+
+	// Wrong number of fields
+	frame[1] = 2;
+	assert_false(meta_request_parse_binary(&decoded, frame, len));
+	frame[1] = 3;
+
+	// Strings with whitespace or NUL characters
+	const size_t name = 2 + 4 + 2;
+	frame[name] = ' ';
+	assert_false(meta_request_parse_binary(&decoded, frame, len));
+	frame[name] = 0;
+	assert_false(meta_request_parse_binary(&decoded, frame, len));
+}
+
+static void check_accepted_frame(const uint8_t *frame, size_t len) {
+	meta_request_t decoded;
+
+	if(!meta_request_parse_binary(&decoded, frame, len)) {
+		return;
+	}
+
+	// Anything accepted must survive a trip through the text encoding unchanged
+	const char *text = meta_request_text(&decoded);
+	assert_non_null(text);
+
+	meta_request_t reparsed;
+	assert_true(meta_request_parse_text(&reparsed, text));
+
+	size_t relen;
+	const uint8_t *reencoded = meta_request_binary(&reparsed, &relen);
+	assert_non_null(reencoded);
+	assert_int_equal(len, relen);
+	assert_memory_equal(frame, reencoded, len);
+}
+
+static void test_fuzz_binary(void **state) {
+	(void)state;
+
+	uint32_t seed = 1;
+
+	for(size_t i = 0; i < sizeof(valid_requests) / sizeof(*valid_requests); i++) {
+		meta_request_t r;
+		size_t len;
+		assert_true(meta_request_parse_text(&r, valid_requests[i]));
+		const uint8_t *binary = meta_request_binary(&r, &len);
+
+		for(int round = 0; round < 20000; round++) {
+			uint8_t frame[256];
+			memcpy(frame, binary, len);
+			size_t fuzzlen = len;
+
+			for(int flips = 1 + round % 4; flips; flips--) {
+				seed = seed * 1103515245 + 12345;
+				frame[(seed >> 8) % len] ^= (uint8_t)(1 << ((seed >> 4) % 8));
+			}
+
+			if(round % 3 == 0) {
+				seed = seed * 1103515245 + 12345;
+				fuzzlen = (seed >> 8) % (len + 1);
+			}
+
+			check_accepted_frame(frame, fuzzlen);
+		}
+	}
+}
+
+static void test_fuzz_text(void **state) {
+	(void)state;
+
+	static const char alphabet[] = "0123456789abcdefx- \t.:/#";
+	uint32_t seed = 1;
+
+	for(int round = 0; round < 100000; round++) {
+		char text[48];
+		seed = seed * 1103515245 + 12345;
+		size_t len = (seed >> 8) % (sizeof(text) - 3);
+
+		text[0] = '1';
+		text[1] = "0123"[(seed >> 4) % 4];
+
+		for(size_t i = 2; i < len + 2; i++) {
+			seed = seed * 1103515245 + 12345;
+			text[i] = alphabet[(seed >> 8) % (sizeof(alphabet) - 1)];
+		}
+
+		text[len + 2] = 0;
+
+		meta_request_t r;
+
+		if(meta_request_parse_text(&r, text)) {
+			size_t binlen;
+			const uint8_t *binary = meta_request_binary(&r, &binlen);
+			assert_non_null(binary);
+			check_accepted_frame(binary, binlen);
+		}
+	}
+}
+
+int main(void) {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_text_round_trip),
+		cmocka_unit_test(test_binary_round_trip),
+		cmocka_unit_test(test_parse_fields),
+		cmocka_unit_test(test_reject_bad_text),
+		cmocka_unit_test(test_reject_bad_binary),
+		cmocka_unit_test(test_fuzz_binary),
+		cmocka_unit_test(test_fuzz_text),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,100 @@
+#include "unittest.h"
+#include "../../src/connection.h"
+#include "../../src/netutl.h"
+#include "../../src/node.h"
+
+#define NODES 300
+#define CHANGES 5000
+
+static void make_address(sockaddr_t *sa, int i) {
+	memset(sa, 0, sizeof(*sa));
+
+	// Few distinct addresses, so that several nodes share one
+	if(i % 2) {
+		sa->in.sin_family = AF_INET;
+		sa->in.sin_addr.s_addr = htonl(0x0a000000 | (uint32_t)(i % 37));
+		sa->in.sin_port = htons(655);
+	} else {
+		sa->in6.sin6_family = AF_INET6;
+		sa->in6.sin6_addr.s6_addr[15] = (uint8_t)(i % 41);
+		sa->in6.sin6_port = htons(655);
+	}
+}
+
+static bool has_address(node_t **nodes, bool *udp, const sockaddr_t *sa) {
+	for(int i = 0; i < NODES; i++) {
+		if(nodes[i] && udp[i] && !sockaddrcmp(&nodes[i]->address, sa)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void test_lookup_matches_linear_search(void **state) {
+	(void)state;
+
+	node_t *nodes[NODES] = {NULL};
+	bool udp[NODES] = {false};
+
+	srand(1);
+
+	for(int change = 0; change < CHANGES; change++) {
+		int i = rand() % NODES;
+
+		if(!nodes[i]) {
+			char name[16];
+			snprintf(name, sizeof(name), "node%d", i);
+			nodes[i] = new_node(name);
+			node_add(nodes[i]);
+		} else if(rand() % 4) {
+			sockaddr_t sa;
+			make_address(&sa, rand());
+			update_node_udp(nodes[i], &sa);
+			udp[i] = true;
+		} else if(rand() % 2) {
+			update_node_udp(nodes[i], NULL);
+			udp[i] = false;
+		} else {
+			node_del(nodes[i]);
+			nodes[i] = NULL;
+			udp[i] = false;
+		}
+
+		for(int j = 0; j < NODES; j++) {
+			if(!nodes[j]) {
+				continue;
+			}
+
+			assert_ptr_equal(nodes[j], lookup_node_id(&nodes[j]->id));
+
+			if(udp[j]) {
+				node_t *found = lookup_node_udp(&nodes[j]->address);
+				assert_non_null(found);
+				assert_int_equal(0, sockaddrcmp(&found->address, &nodes[j]->address));
+			}
+		}
+
+		sockaddr_t sa;
+		make_address(&sa, rand());
+		node_t *found = lookup_node_udp(&sa);
+		assert_true(has_address(nodes, udp, &sa) == (found != NULL));
+	}
+
+	for(int i = 0; i < NODES; i++) {
+		if(nodes[i]) {
+			node_id_t id = nodes[i]->id;
+			node_del(nodes[i]);
+			assert_null(lookup_node_id(&id));
+		}
+	}
+
+	exit_nodes();
+}
+
+int main(void) {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_lookup_matches_linear_search),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
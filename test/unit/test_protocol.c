@@ -1,5 +1,20 @@
 #include "unittest.h"
+#include "../../src/connection.h"
+#include "../../src/graph.h"
+#include "../../src/node.h"
 #include "../../src/protocol.h"
+#include "../../src/xalloc.h"
+
+static connection_t *terminated;
+
+void __wrap_terminate_connection(connection_t *c, bool report);
+
+void __wrap_terminate_connection(connection_t *c, bool report) {
+	(void)report;
+
+	terminated = c;
+	end_receiving_snapshot(c);
+}
 
 static void test_get_invalid_request(void **state) {
 	(void)state;
@@ -18,10 +33,83 @@ static void test_get_valid_request_returns_nonnull(void **state) {
 	}
 }
 
+static connection_t *make_connection(void) {
+	connection_t *c = new_connection();
+	c->name = xstrdup("peer");
+	c->hostname = xstrdup("peer");
+	c->allow_request = ALL;
+	return c;
+}
+
+// A snapshot record with no requests that is not the last one
+static const uint8_t first_record[] = {0};
+
+static void test_snapshot_without_last_record_times_out(void **state) {
+	(void)state;
+
+	connection_t *c = make_connection();
+	assert_true(receive_meta_snapshot(c, first_record, sizeof(first_record)));
+	assert_true(c->status.snapshot);
+	assert_non_null(c->snapshot_timeout.cb);
+
+	uint64_t runs = graph_runs;
+	graph_schedule();
+	graph_flush();
+	assert_int_equal(runs, graph_runs);
+
+	c->snapshot_timeout.cb(c->snapshot_timeout.data);
+
+	assert_ptr_equal(c, terminated);
+	assert_false(c->status.snapshot);
+	assert_null(c->snapshot_timeout.cb);
+	assert_int_equal(runs + 1, graph_runs);
+
+	free_connection(c);
+}
+
+static void test_snapshot_ended_by_other_request(void **state) {
+	(void)state;
+
+	connection_t *c = make_connection();
+	assert_true(receive_meta_snapshot(c, first_record, sizeof(first_record)));
+	graph_schedule();
+
+	uint64_t runs = graph_runs;
+	char pong[16];
+	snprintf(pong, sizeof(pong), "%d", PONG);
+	assert_true(receive_request(c, pong));
+
+	assert_false(c->status.snapshot);
+	assert_null(c->snapshot_timeout.cb);
+	assert_int_equal(runs + 1, graph_runs);
+	assert_null(terminated);
+
+	free_connection(c);
+}
+
+static int setup(void **state) {
+	(void)state;
+	myself = new_node("myself");
+	pingtimeout = 5;
+	terminated = NULL;
+	return 0;
+}
+
+static int teardown(void **state) {
+	(void)state;
+	exit_graph();
+	free_node(myself);
+	exit_nodes();
+	exit_edges();
+	return 0;
+}
+
 int main(void) {
 	const struct CMUnitTest tests[] = {
 		cmocka_unit_test(test_get_invalid_request),
 		cmocka_unit_test(test_get_valid_request_returns_nonnull),
+		cmocka_unit_test_setup_teardown(test_snapshot_without_last_record_times_out, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_snapshot_ended_by_other_request, setup, teardown),
 	};
 	return cmocka_run_group_tests(tests, NULL, NULL);
 }
@@ -1,4 +1,6 @@
 #include "unittest.h"
+#include "../../src/connection.h"
+#include "../../src/node.h"
 #include "../../src/subnet.h"
 
 typedef struct net_str_testcase {
@@ -513,6 +515,279 @@ static void test_maskcheck_invalid_ipv6(void **state) {
 	}
 }
 
+// The linear search that lookup_subnet_ipv4() and lookup_subnet_ipv6() used before the trie.
+static subnet_t *linear_lookup(subnet_type_t type, const void *address) {
+	subnet_t *r = NULL;
+
+	for splay_each(subnet_t, p, &subnet_tree) {
+		if(p->type != type) {
+			continue;
+		}
+
+		bool match = type == SUBNET_IPV4
+		             ? !maskcmp(address, &p->net.ipv4.address, p->net.ipv4.prefixlength)
+		             : !maskcmp(address, &p->net.ipv6.address, p->net.ipv6.prefixlength);
+
+		if(match) {
+			r = p;
+
+			if(!p->owner || p->owner->status.reachable) {
+				break;
+			}
+		}
+	}
+
+	return r;
+}
+
+#define TRIE_OWNERS 4
+#define TRIE_SUBNETS 300
+#define TRIE_LOOKUPS 2000
+
+static node_t *trie_owners[TRIE_OWNERS];
+static subnet_t *trie_subnets[TRIE_SUBNETS];
+
+// Random addresses drawn from a few short common prefixes, so that subnets overlap a lot.
+static void random_address(uint8_t *address, size_t len) {
+	address[0] = 10;
+	address[1] = (uint8_t)(rand() % 3);
+
+	for(size_t i = 2; i < len; i++) {
+		address[i] = (uint8_t)(rand() % 4);
+	}
+
+	if(rand() % 8 == 0) {
+		address[len - 1] = (uint8_t)rand();
+	}
+}
+
+static subnet_t *random_subnet(subnet_type_t type) {
+	subnet_t *subnet = new_subnet();
+	subnet->type = type;
+	subnet->weight = rand() % 3;
+
+	if(type == SUBNET_IPV4) {
+		subnet->net.ipv4.prefixlength = rand() % 33;
+		random_address(subnet->net.ipv4.address.x, sizeof(ipv4_t));
+		mask(&subnet->net.ipv4.address, subnet->net.ipv4.prefixlength, sizeof(ipv4_t));
+	} else {
+		subnet->net.ipv6.prefixlength = rand() % 129;
+		random_address((uint8_t *)subnet->net.ipv6.address.x, sizeof(ipv6_t));
+		mask(&subnet->net.ipv6.address, subnet->net.ipv6.prefixlength, sizeof(ipv6_t));
+	}
+
+	return subnet;
+}
+
+static void assert_lookups_match(subnet_type_t type) {
+	subnet_cache_flush_tables();
+
+	for(int i = 0; i < TRIE_LOOKUPS; i++) {
+		ipv6_t address = {0};
+		size_t len = type == SUBNET_IPV4 ? sizeof(ipv4_t) : sizeof(ipv6_t);
+		random_address((uint8_t *)&address, len);
+
+		subnet_t *expected = linear_lookup(type, &address);
+		subnet_t *found = type == SUBNET_IPV4
+		                  ? lookup_subnet_ipv4((ipv4_t *)&address)
+		                  : lookup_subnet_ipv6(&address);
+
+		assert_ptr_equal(expected, found);
+	}
+}
+
+static void test_lookup_matches_linear_search(subnet_type_t type) {
+	static const char *names[TRIE_OWNERS] = {"alpha", "bravo", "charlie", "delta"};
+
+	srand(1);
+
+	for(int i = 0; i < TRIE_OWNERS; i++) {
+		trie_owners[i] = new_node(names[i]);
+		trie_owners[i]->status.reachable = i % 2;
+	}
+
+	for(int i = 0; i < TRIE_SUBNETS; i++) {
+		// Duplicates of existing subnets are possible, subnet_tree would not accept them
+		subnet_t *subnet = random_subnet(type);
+		node_t *owner = rand() % 8 ? trie_owners[rand() % TRIE_OWNERS] : NULL;
+		subnet->owner = owner;
+
+		if(splay_search(&subnet_tree, subnet)) {
+			free_subnet(subnet);
+			continue;
+		}
+
+		trie_subnets[i] = subnet;
+		subnet_add(owner, subnet);
+	}
+
+	assert_lookups_match(type);
+
+	// Reachability changes without the trie being updated
+
+	for(int i = 0; i < TRIE_OWNERS; i++) {
+		trie_owners[i]->status.reachable = !trie_owners[i]->status.reachable;
+	}
+
+	assert_lookups_match(type);
+
+	for(int i = 0; i < TRIE_OWNERS; i++) {
+		trie_owners[i]->status.reachable = false;
+	}
+
+	assert_lookups_match(type);
+
+	// Remove subnets in random order, checking in between
+
+	trie_owners[0]->status.reachable = true;
+	trie_owners[2]->status.reachable = true;
+
+	for(int round = 0; round < 3; round++) {
+		for(int i = 0; i < TRIE_SUBNETS; i++) {
+			if(trie_subnets[i] && rand() % 2) {
+				subnet_del(trie_subnets[i]->owner, trie_subnets[i]);
+				trie_subnets[i] = NULL;
+			}
+		}
+
+		assert_lookups_match(type);
+	}
+
+	for(int i = 0; i < TRIE_SUBNETS; i++) {
+		if(trie_subnets[i]) {
+			subnet_del(trie_subnets[i]->owner, trie_subnets[i]);
+			trie_subnets[i] = NULL;
+		}
+	}
+
+	assert_lookups_match(type);
+	assert_int_equal(0, subnet_tree.count);
+
+	for(int i = 0; i < TRIE_OWNERS; i++) {
+		free_node(trie_owners[i]);
+	}
+}
+
+static void test_lookup_ipv4_matches_linear_search(void **state) {
+	(void)state;
+	test_lookup_matches_linear_search(SUBNET_IPV4);
+}
+
+static void test_lookup_ipv6_matches_linear_search(void **state) {
+	(void)state;
+	test_lookup_matches_linear_search(SUBNET_IPV6);
+}
+
+static void test_lookup_ipv4_longest_prefix(void **state) {
+	(void)state;
+
+	node_t *owner = new_node("owner");
+	node_t *other = new_node("other");
+	owner->status.reachable = true;
+	other->status.reachable = true;
+
+	subnet_t *wide = new_subnet();
+	subnet_t *narrow = new_subnet();
+	subnet_t *host = new_subnet();
+	assert_true(str2net(wide, "10.0.0.0/8"));
+	assert_true(str2net(narrow, "10.1.0.0/16#5"));
+	assert_true(str2net(host, "10.1.2.3"));
+
+	subnet_add(owner, wide);
+	subnet_add(other, narrow);
+	subnet_add(owner, host);
+	subnet_cache_flush_tables();
+
+	const ipv4_t a = {{10, 1, 2, 3}};
+	const ipv4_t b = {{10, 1, 2, 4}};
+	const ipv4_t c = {{10, 2, 2, 3}};
+	const ipv4_t d = {{11, 1, 2, 3}};
+
+	assert_ptr_equal(host, lookup_subnet_ipv4(&a));
+	assert_ptr_equal(narrow, lookup_subnet_ipv4(&b));
+	assert_ptr_equal(wide, lookup_subnet_ipv4(&c));
+	assert_null(lookup_subnet_ipv4(&d));
+
+	// An unreachable owner makes the lookup fall back to a shorter prefix
+	other->status.reachable = false;
+	subnet_cache_flush_tables();
+	assert_ptr_equal(wide, lookup_subnet_ipv4(&b));
+
+	subnet_del(owner, host);
+	subnet_cache_flush_tables();
+	assert_ptr_equal(wide, lookup_subnet_ipv4(&a));
+
+	subnet_del(owner, wide);
+	subnet_cache_flush_tables();
+	assert_ptr_equal(narrow, lookup_subnet_ipv4(&a));
+
+	subnet_del(other, narrow);
+	subnet_cache_flush_tables();
+	assert_null(lookup_subnet_ipv4(&a));
+
+	free_node(owner);
+	free_node(other);
+}
+
+static void test_lookup_cache(void **state) {
+	(void)state;
+
+	hash_stats_t before, after;
+	const ipv4_t address = {{192, 168, 1, 1}};
+
+	// Misses are cached too
+
+	subnet_cache_flush_tables();
+	subnet_cache_stats(&before);
+	assert_null(lookup_subnet_ipv4(&address));
+	assert_null(lookup_subnet_ipv4(&address));
+	subnet_cache_stats(&after);
+	assert_int_equal(before.misses + 1, after.misses);
+	assert_int_equal(before.hits + 1, after.hits);
+
+	// Adding a host subnet invalidates just that entry
+
+	node_t *owner = new_node("owner");
+	owner->status.reachable = true;
+
+	subnet_t *host = new_subnet();
+	assert_true(str2net(host, "192.168.1.1"));
+	subnet_add(owner, host);
+	assert_ptr_equal(host, lookup_subnet_ipv4(&address));
+
+	// Adding any other subnet starts a new generation
+
+	subnet_t *net = new_subnet();
+	assert_true(str2net(net, "192.168.0.0/16"));
+	subnet_add(owner, net);
+
+	subnet_cache_stats(&before);
+	assert_ptr_equal(host, lookup_subnet_ipv4(&address));
+	subnet_cache_stats(&after);
+	assert_int_equal(before.misses + 1, after.misses);
+	assert_int_equal(before.flushes, after.flushes);
+	assert_int_equal(1, after.entries - before.entries);
+
+	// The cache grows instead of evicting entries
+
+	subnet_cache_flush_tables();
+
+	for(int i = 0; i < 2048; i++) {
+		const ipv4_t a = {{192, 168, (uint8_t)(i >> 8), (uint8_t)i}};
+		assert_non_null(lookup_subnet_ipv4(&a));
+	}
+
+	subnet_cache_stats(&after);
+	assert_int_equal(2048, after.entries);
+	assert_true(after.size >= 2048);
+	assert_true(after.resizes > before.resizes);
+	assert_int_equal(before.evictions, after.evictions);
+
+	subnet_del(owner, host);
+	subnet_del(owner, net);
+	free_node(owner);
+}
+
 int main(void) {
 	const struct CMUnitTest tests[] = {
 		cmocka_unit_test(test_maskcmp),
@@ -546,6 +821,11 @@ int main(void) {
 		cmocka_unit_test(test_maskcheck_valid_ipv6),
 		cmocka_unit_test(test_maskcheck_invalid_ipv4),
 		cmocka_unit_test(test_maskcheck_invalid_ipv6),
+
+		cmocka_unit_test(test_lookup_ipv4_longest_prefix),
+		cmocka_unit_test(test_lookup_ipv4_matches_linear_search),
+		cmocka_unit_test(test_lookup_ipv6_matches_linear_search),
+		cmocka_unit_test(test_lookup_cache),
 	};
 	return cmocka_run_group_tests(tests, NULL, NULL);
 }
@@ -0,0 +1,285 @@
+#include "unittest.h"
+#include "../../src/event.h"
+#include "../../src/splay_tree.h"
+#include "../../src/timer_wheel.h"
+#include "../../src/xalloc.h"
+
+// The splay tree ordering that timeouts used before the timing wheel
+
+typedef struct test_timer_t {
+	wheel_node_t node;
+	int id;
+} test_timer_t;
+
+static int timer_compare(const test_timer_t *a, const test_timer_t *b) {
+	if(a->node.expires != b->node.expires) {
+		return a->node.expires < b->node.expires ? -1 : 1;
+	}
+
+	return a->id - b->id;
+}
+
+static uint32_t seed;
+
+static uint32_t next_random(void) {
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+// Distances up to beyond the range covered by the slots
+static uint64_t random_delay(void) {
+	switch(next_random() % 4) {
+	case 0:
+		return 1 + next_random() % 64;
+
+	case 1:
+		return 1 + next_random() % 100000;
+
+	case 2:
+		return 1 + (uint64_t)next_random() * 64;
+
+	default:
+		return 1 + ((uint64_t)next_random() << 12);
+	}
+}
+
+static int reset(void **state) {
+	(void)state;
+	seed = 1;
+	return 0;
+}
+
+// Pop all expired timers, and check that they are exactly the ones the splay tree says are due, in the same order
+static size_t expire_and_compare(timer_wheel_t *wheel, splay_tree_t *tree, uint64_t now) {
+	wheel_advance(wheel, now);
+
+	wheel_node_t *node;
+	uint64_t last = 0;
+	size_t expired = 0;
+
+	while((node = wheel_pop_expired(wheel))) {
+		test_timer_t *timer = (test_timer_t *)node;
+		assert_true(node->expires <= now);
+		assert_true(node->expires >= last);
+		last = node->expires;
+
+		test_timer_t *first = tree->head->data;
+		assert_true(first->node.expires == node->expires);
+		splay_delete(tree, timer);
+		expired++;
+	}
+
+	if(tree->head) {
+		test_timer_t *first = tree->head->data;
+		assert_true(first->node.expires > now);
+
+		uint64_t expires;
+		assert_true(wheel_next_expiry(wheel, &expires));
+		assert_true(expires == first->node.expires);
+	} else {
+		uint64_t expires;
+		assert_false(wheel_next_expiry(wheel, &expires));
+	}
+
+	return expired;
+}
+
+static void test_wheel_matches_splay_tree(void **state) {
+	(void)state;
+
+	enum { TIMERS = 2000 };
+	timer_wheel_t wheel = {.now = 1000};
+	splay_tree_t tree = {.compare = (splay_compare_t)timer_compare};
+	test_timer_t *timers = xzalloc(TIMERS * sizeof(*timers));
+	uint64_t now = wheel.now;
+	size_t count = 0;
+
+	for(int round = 0; round < 200000; round++) {
+		test_timer_t *timer = &timers[next_random() % TIMERS];
+		timer->id = (int)(timer - timers);
+
+		switch(next_random() % 8) {
+		case 0:
+		case 1:
+		case 2:
+			// Add or reschedule
+			if(wheel_contains(&timer->node)) {
+				wheel_del(&wheel, &timer->node);
+				splay_delete(&tree, timer);
+				count--;
+			}
+
+			wheel_add(&wheel, &timer->node, now + random_delay());
+			splay_insert(&tree, timer);
+			count++;
+			break;
+
+		case 3:
+			if(wheel_contains(&timer->node)) {
+				wheel_del(&wheel, &timer->node);
+				splay_delete(&tree, timer);
+				count--;
+			}
+
+			break;
+
+		default:
+			if(next_random() % 1000 == 0) {
+				now += (uint64_t)next_random() << 10;
+			} else {
+				now += next_random() % 2000;
+			}
+
+			count -= expire_and_compare(&wheel, &tree, now);
+			break;
+		}
+
+		assert_int_equal(wheel.count, count);
+	}
+
+	// Run everything that is left
+	expire_and_compare(&wheel, &tree, UINT64_MAX / 2);
+	assert_int_equal(0, wheel.count);
+
+	free(timers);
+}
+
+static void test_wheel_immediate_expiry(void **state) {
+	(void)state;
+
+	timer_wheel_t wheel = {.now = 100};
+	wheel_node_t past, present, future;
+
+	wheel_add(&wheel, &past, 50);
+	wheel_add(&wheel, &present, 100);
+	wheel_add(&wheel, &future, 101);
+
+	// Timers that are already due fire without advancing
+	assert_ptr_equal(&past, wheel_pop_expired(&wheel));
+	assert_ptr_equal(&present, wheel_pop_expired(&wheel));
+	assert_null(wheel_pop_expired(&wheel));
+
+	uint64_t expires;
+	assert_true(wheel_next_expiry(&wheel, &expires));
+	assert_true(expires == 101);
+
+	wheel_advance(&wheel, 101);
+	assert_ptr_equal(&future, wheel_pop_expired(&wheel));
+	assert_int_equal(0, wheel.count);
+}
+
+static void test_wheel_delete_expired(void **state) {
+	(void)state;
+
+	timer_wheel_t wheel = {0};
+	wheel_node_t a, b, c;
+
+	wheel_add(&wheel, &a, 0);
+	wheel_add(&wheel, &b, 0);
+	wheel_add(&wheel, &c, 0);
+
+	// Removing the last expired timer must keep appending working
+	wheel_del(&wheel, &c);
+	wheel_add(&wheel, &c, 0);
+	wheel_del(&wheel, &a);
+
+	assert_ptr_equal(&b, wheel_pop_expired(&wheel));
+	assert_ptr_equal(&c, wheel_pop_expired(&wheel));
+	assert_null(wheel_pop_expired(&wheel));
+	assert_false(wheel_contains(&a));
+}
+
+static void test_wheel_clock_backwards(void **state) {
+	(void)state;
+
+	timer_wheel_t wheel = {.now = 100000};
+	wheel_node_t early, due, late;
+
+	wheel_add(&wheel, &due, 99000);
+	wheel_add(&wheel, &late, 200000);
+
+	// The clock jumps back, timers keep their expiry time and new ones are not held up by them
+	wheel_advance(&wheel, 1000);
+	wheel_add(&wheel, &early, 1100);
+	assert_null(wheel_pop_expired(&wheel));
+
+	uint64_t expires;
+	assert_true(wheel_next_expiry(&wheel, &expires));
+	assert_true(expires == 1100);
+
+	wheel_advance(&wheel, 1100);
+	assert_ptr_equal(&early, wheel_pop_expired(&wheel));
+	assert_null(wheel_pop_expired(&wheel));
+
+	wheel_advance(&wheel, 98999);
+	assert_null(wheel_pop_expired(&wheel));
+	wheel_advance(&wheel, 99000);
+	assert_ptr_equal(&due, wheel_pop_expired(&wheel));
+
+	wheel_advance(&wheel, 199999);
+	assert_null(wheel_pop_expired(&wheel));
+	wheel_advance(&wheel, 200000);
+	assert_ptr_equal(&late, wheel_pop_expired(&wheel));
+	assert_int_equal(0, wheel.count);
+}
+
+static int fired[4];
+static int fire_count;
+static timeout_t timeouts[4];
+
+static void timeout_handler(void *data) {
+	fired[fire_count++] = (int)(intptr_t)data;
+
+	// The second timeout re-arms itself once
+	if((intptr_t)data == 1 && fire_count < 3) {
+		timeout_set(&timeouts[1], &(struct timeval) {
+			0, 1000
+		});
+	}
+}
+
+static void test_timeout_api(void **state) {
+	(void)state;
+
+	for(intptr_t i = 0; i < 4; i++) {
+		timeout_add(&timeouts[i], timeout_handler, (void *)i, &(struct timeval) {
+			0, (suseconds_t)(i + 1) * 1000
+		});
+	}
+
+	timeout_del(&timeouts[2]);
+	assert_null(timeouts[2].cb);
+
+	struct timeval diff;
+	assert_non_null(timeout_execute(&diff));
+	assert_int_equal(0, fire_count);
+
+	// Wait until all of them are due, then run them in order
+	usleep(10000);
+	assert_non_null(timeout_execute(&diff));
+
+	assert_int_equal(3, fire_count);
+	assert_int_equal(0, fired[0]);
+	assert_int_equal(1, fired[1]);
+	assert_int_equal(3, fired[2]);
+	assert_null(timeouts[0].cb);
+	assert_non_null(timeouts[1].cb);
+	assert_null(timeouts[3].cb);
+
+	usleep(10000);
+	assert_null(timeout_execute(&diff));
+	assert_int_equal(4, fire_count);
+	assert_int_equal(1, fired[3]);
+	assert_null(timeouts[1].cb);
+}
+
+int main(void) {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup(test_wheel_matches_splay_tree, reset),
+		cmocka_unit_test(test_wheel_immediate_expiry),
+		cmocka_unit_test(test_wheel_delete_expired),
+		cmocka_unit_test(test_wheel_clock_backwards),
+		cmocka_unit_test(test_timeout_api),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}